@@ -1 +1,2 @@
-gcc src/main.c src/vec3.c -o pt.exe -O3
\ No newline at end of file
+gcc src/main.c src/vec3.c -o pt.exe -O3 -fopenmp -lpsapi
+gcc src/bench.c src/vec3.c -o bench.exe -O3 -fopenmp -lpsapi
\ No newline at end of file
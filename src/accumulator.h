@@ -0,0 +1,283 @@
+#ifndef ACCUMULATOR_H
+#define ACCUMULATOR_H
+
+#include <assert.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "color.h"
+#include "platform.h"
+#include "util.h"
+
+// Radiance of some samples of a pixel, the squared radiance estimates the variance
+typedef struct SampleSum {
+    Color3f radiance;
+    Color3f radiance_sq;
+} SampleSum;
+
+void addSample(SampleSum* sum, Color3f radiance) {
+    sum->radiance = addColor3f(sum->radiance, radiance);
+    sum->radiance_sq = addColor3f(sum->radiance_sq, multColor3f(radiance, radiance));
+}
+
+// Sums of all samples taken for a pixel so far
+typedef struct AccumulatorPixel {
+    double r, g, b;
+    double r_sq, g_sq, b_sq;
+    uint32_t samples;
+    uint32_t padding;
+} AccumulatorPixel;
+
+typedef struct Accumulator {
+    AccumulatorPixel* pixels;
+    // smoothed error estimate of each pixel, see updateAccumulatorErrors
+    float* errors;
+    unsigned int width, height;
+} Accumulator;
+
+Accumulator createAccumulator(unsigned int width, unsigned int height) {
+    Accumulator accumulator = {
+        .pixels = calloc((size_t)width * height, sizeof(AccumulatorPixel)),
+        .errors = calloc((size_t)width * height, sizeof(float)),
+        .width = width,
+        .height = height
+    };
+    assert(accumulator.pixels && accumulator.errors);
+    return accumulator;
+}
+
+void freeAccumulator(Accumulator* accumulator) {
+    free(accumulator->pixels);
+    free(accumulator->errors);
+    accumulator->pixels = NULL;
+    accumulator->errors = NULL;
+}
+
+AccumulatorPixel* getAccumulatorPixel(Accumulator* accumulator, unsigned int x, unsigned int y) {
+    return &accumulator->pixels[x + y * accumulator->width];
+}
+
+void addAccumulatorSamples(AccumulatorPixel* pixel, SampleSum sum, unsigned int samples) {
+    pixel->r += sum.radiance.r;
+    pixel->g += sum.radiance.g;
+    pixel->b += sum.radiance.b;
+    pixel->r_sq += sum.radiance_sq.r;
+    pixel->g_sq += sum.radiance_sq.g;
+    pixel->b_sq += sum.radiance_sq.b;
+    pixel->samples += samples;
+}
+
+// Standard error of the pixel mean in display units, averaged over the color channels.
+// Channels which are certainly above 1 are clamped in the image and count as converged.
+double getPixelError(const AccumulatorPixel* pixel) {
+    if(pixel->samples < 2) {
+        return INFINITY;
+    }
+    const double samples = (double)pixel->samples;
+    const double sums[3] = {pixel->r, pixel->g, pixel->b};
+    const double sums_sq[3] = {pixel->r_sq, pixel->g_sq, pixel->b_sq};
+    double mean_variance = 0.0;
+    for(unsigned int c = 0; c < 3; c++) {
+        const double mean = sums[c] / samples;
+        const double variance = fmax(0.0, (sums_sq[c] / samples - mean * mean) * samples / (samples - 1.0)) / samples;
+        if(mean - 2.0 * sqrt(variance) <= 1.0) {
+            mean_variance += variance / 3.0;
+        }
+    }
+    return sqrt(mean_variance);
+}
+
+// Estimates of single pixels with few samples are noisy. A pixel which missed a rare bright
+// path looks converged and stopping it there darkens the image, so the error of a pixel is the
+// RMS error of its 3x3 neighbourhood.
+void updateAccumulatorErrors(Accumulator* accumulator) {
+    const int width = (int)accumulator->width;
+    const int height = (int)accumulator->height;
+    #pragma omp parallel for
+    for(int y = 0; y < height; y++) {
+        for(int x = 0; x < width; x++) {
+            double error_sq_sum = 0.0;
+            unsigned int count = 0;
+            for(int ny = y - 1; ny <= y + 1; ny++) {
+                for(int nx = x - 1; nx <= x + 1; nx++) {
+                    if(nx < 0 || ny < 0 || nx >= width || ny >= height) {
+                        continue;
+                    }
+                    const double error = getPixelError(&accumulator->pixels[nx + ny * width]);
+                    error_sq_sum += error * error;
+                    count++;
+                }
+            }
+            accumulator->errors[x + y * width] = (float)sqrt(error_sq_sum / (double)count);
+        }
+    }
+}
+
+// Which pixels a progressive pass samples
+typedef struct PassTarget {
+    // every pixel gets up to this many samples
+    unsigned int samples;
+    // with adaptive sampling, pixels with at least min_samples stop at the target error
+    int adaptive;
+    unsigned int min_samples;
+    double target_error;
+} PassTarget;
+
+// Samples the pixel gets in the pass, 0 if it has enough or converged
+unsigned int getPassSamples(const Accumulator* accumulator, unsigned int x, unsigned int y, const PassTarget* pass) {
+    const unsigned int index = x + y * accumulator->width;
+    const unsigned int samples = accumulator->pixels[index].samples;
+    if(samples >= pass->samples || (pass->adaptive && samples >= pass->min_samples && accumulator->errors[index] <= pass->target_error)) {
+        return 0;
+    }
+    return pass->samples - samples;
+}
+
+// Mean radiance of the samples of a pixel, black without samples
+Color3f getAccumulatorPixelMean(const AccumulatorPixel* pixel) {
+    const double factor = pixel->samples > 0 ? 1.0 / (double)pixel->samples : 0.0;
+    return (Color3f) {
+        .r = (float)(pixel->r * factor),
+        .g = (float)(pixel->g * factor),
+        .b = (float)(pixel->b * factor)
+    };
+}
+
+void getAccumulatorRowMeans(const Accumulator* accumulator, unsigned int y, Color3f* means) {
+    const AccumulatorPixel* row = accumulator->pixels + (size_t)y * accumulator->width;
+    for(unsigned int x = 0; x < accumulator->width; x++) {
+        means[x] = getAccumulatorPixelMean(&row[x]);
+    }
+}
+
+// Averages and clamps the accumulated radiance into 8 bit RGB
+void resolveAccumulator(const Accumulator* accumulator, unsigned char* data) {
+    const size_t pixel_count = (size_t)accumulator->width * accumulator->height;
+    for(size_t i = 0; i < pixel_count; i++) {
+        const Color3f mean = getAccumulatorPixelMean(&accumulator->pixels[i]);
+        data[i * 3 + 0] = (unsigned char)(clamp(mean.r, 0.0f, 1.0f) * 255.0f);
+        data[i * 3 + 1] = (unsigned char)(clamp(mean.g, 0.0f, 1.0f) * 255.0f);
+        data[i * 3 + 2] = (unsigned char)(clamp(mean.b, 0.0f, 1.0f) * 255.0f);
+    }
+}
+
+// Writes the samples per pixel as grayscale, white is max_samples
+void resolveSampleCounts(const Accumulator* accumulator, unsigned int max_samples, unsigned char* data) {
+    const size_t pixel_count = (size_t)accumulator->width * accumulator->height;
+    for(size_t i = 0; i < pixel_count; i++) {
+        const unsigned char value = (unsigned char)(clamp((float)accumulator->pixels[i].samples / (float)max_samples, 0.0f, 1.0f) * 255.0f);
+        data[i * 3 + 0] = value;
+        data[i * 3 + 1] = value;
+        data[i * 3 + 2] = value;
+    }
+}
+
+#define CHECKPOINT_MAGIC 0x4b435450u // "PTCK"
+#define CHECKPOINT_VERSION 4
+
+// The file holds the header and two accumulator slots. A checkpoint is written into the
+// inactive slot and only then made active, so a killed process always leaves one complete slot.
+typedef struct CheckpointHeader {
+    uint32_t magic;
+    uint32_t version;
+    // size of the whole image and origin of the rendered crop window
+    uint32_t image_width, image_height;
+    uint32_t crop_x, crop_y;
+    // size of the accumulator, which is the crop window
+    uint32_t width, height;
+    uint64_t seed;
+    // hash of the camera, scene and path settings, see hashRender
+    uint64_t render_hash;
+    uint32_t active_slot;
+    // samples per pixel every pixel got or converged before, for each slot
+    uint32_t slot_samples[2];
+    uint32_t padding;
+} CheckpointHeader;
+
+typedef struct Checkpoint {
+    MappedFile file;
+    CheckpointHeader* header;
+    AccumulatorPixel* slots[2];
+    size_t slot_size;
+} Checkpoint;
+
+// Maps or creates the checkpoint file. An existing checkpoint is loaded into the accumulator
+// and samples_done is set to its sample count. Returns 0 if the file doesn't match the render.
+// The accumulator covers the crop window at crop_x, crop_y of an image_width * image_height image.
+int openCheckpoint(Checkpoint* checkpoint, const char* path, uint64_t seed, uint64_t render_hash, unsigned int image_width, unsigned int image_height,
+    unsigned int crop_x, unsigned int crop_y, Accumulator* accumulator, unsigned int* samples_done) {
+    checkpoint->slot_size = sizeof(AccumulatorPixel) * accumulator->width * accumulator->height;
+    const size_t file_size = sizeof(CheckpointHeader) + checkpoint->slot_size * 2;
+    int created = 0;
+    if(!mapFileWritable(path, file_size, &checkpoint->file, &created)) {
+        fprintf(stderr, "Couldn't map checkpoint '%s'\n", path);
+        return 0;
+    }
+    checkpoint->header = (CheckpointHeader*)checkpoint->file.writable_data;
+    checkpoint->slots[0] = (AccumulatorPixel*)(checkpoint->file.writable_data + sizeof(CheckpointHeader));
+    checkpoint->slots[1] = (AccumulatorPixel*)(checkpoint->file.writable_data + sizeof(CheckpointHeader) + checkpoint->slot_size);
+    CheckpointHeader* header = checkpoint->header;
+    if(created) {
+        *header = (CheckpointHeader) {
+            .magic = CHECKPOINT_MAGIC,
+            .version = CHECKPOINT_VERSION,
+            .image_width = image_width,
+            .image_height = image_height,
+            .crop_x = crop_x,
+            .crop_y = crop_y,
+            .width = accumulator->width,
+            .height = accumulator->height,
+            .seed = seed,
+            .render_hash = render_hash,
+            .active_slot = 0,
+            .slot_samples = {0, 0}
+        };
+        *samples_done = 0;
+        return 1;
+    }
+    if(checkpoint->file.size != file_size || header->magic != CHECKPOINT_MAGIC || header->version != CHECKPOINT_VERSION
+        || header->image_width != image_width || header->image_height != image_height || header->crop_x != crop_x || header->crop_y != crop_y
+        || header->width != accumulator->width || header->height != accumulator->height || header->active_slot > 1) {
+        fprintf(stderr, "Checkpoint '%s' doesn't match the image\n", path);
+        unmapFile(&checkpoint->file);
+        return 0;
+    }
+    if(header->seed != seed) {
+        fprintf(stderr, "Checkpoint '%s' was rendered with seed %llu\n", path, (unsigned long long)header->seed);
+        unmapFile(&checkpoint->file);
+        return 0;
+    }
+    if(header->render_hash != render_hash) {
+        fprintf(stderr, "Checkpoint '%s' was rendered with another scene, camera or path settings\n", path);
+        unmapFile(&checkpoint->file);
+        return 0;
+    }
+    memcpy(accumulator->pixels, checkpoint->slots[header->active_slot], checkpoint->slot_size);
+    *samples_done = header->slot_samples[header->active_slot];
+    return 1;
+}
+
+// Returns 0 if the checkpoint couldn't be synced to disk
+int writeCheckpoint(Checkpoint* checkpoint, const Accumulator* accumulator, unsigned int samples_done) {
+    CheckpointHeader* header = checkpoint->header;
+    const uint32_t slot = 1 - header->active_slot;
+    memcpy(checkpoint->slots[slot], accumulator->pixels, checkpoint->slot_size);
+    header->slot_samples[slot] = samples_done;
+    const size_t slot_offset = sizeof(CheckpointHeader) + checkpoint->slot_size * slot;
+    if(!syncMappedFile(&checkpoint->file, slot_offset, checkpoint->slot_size) || !syncMappedFile(&checkpoint->file, 0, sizeof(CheckpointHeader))) {
+        return 0;
+    }
+    // switching the slot is a single aligned store, so the header never points at a partial slot
+    header->active_slot = slot;
+    return syncMappedFile(&checkpoint->file, 0, sizeof(CheckpointHeader));
+}
+
+void closeCheckpoint(Checkpoint* checkpoint) {
+    unmapFile(&checkpoint->file);
+    checkpoint->header = NULL;
+}
+
+#endif // ACCUMULATOR_H
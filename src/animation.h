@@ -0,0 +1,239 @@
+#ifndef ANIMATION_H
+#define ANIMATION_H
+
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <omp.h>
+
+#include "accumulator.h"
+#include "image_writer.h"
+#include "options.h"
+#include "platform.h"
+#include "sampler.h"
+#include "scene.h"
+#include "single_pass.h"
+#include "stats.h"
+#include "transform.h"
+
+// Frame sequences in one process: instances spin around their up axis, their meshes sway and the
+// camera orbits its target. Geometry moves by changing transforms and vertices in place and refitting
+// the BVHs instead of rebuilding them. Refits keep the leaf order, so the rest pose is kept per triangle
+// and every frame is posed from it, errors don't add up over the sequence. While a frame renders, a
+// writer thread encodes the previous one from the other of two accumulators.
+
+typedef struct Animation {
+    unsigned int frame_count;
+    // radians per frame
+    float spin;
+    float orbit;
+    // sideways offset of the top of the unit cube meshes at the peak of the swing
+    float sway;
+    // rest pose
+    TriangleVertices** mesh_vertices;
+    unsigned int mesh_count;
+    Transform* instance_transforms;
+    unsigned int instance_count;
+    Vec3 camera_position;
+} Animation;
+
+// An image written on its own thread while the next frame renders
+typedef struct FrameWriter {
+    Thread thread;
+    Accumulator accumulator;
+    char path[256];
+    ImageFormat format;
+    int busy;
+    int valid;
+    double busy_time;
+} FrameWriter;
+
+// Keeps the rest pose of a prepared scene
+Animation createAnimation(const Scene* scene, const Options* options) {
+    Animation animation = {
+        .frame_count = options->frames,
+        .spin = options->spin * (float)M_PI / 180.0f,
+        .orbit = options->orbit * (float)M_PI / 180.0f,
+        .sway = options->sway,
+        .mesh_vertices = malloc(sizeof(TriangleVertices*) * (scene->mesh_count > 0 ? scene->mesh_count : 1)),
+        .mesh_count = scene->mesh_count,
+        .instance_transforms = malloc(sizeof(Transform) * (scene->instance_count > 0 ? scene->instance_count : 1)),
+        .instance_count = scene->instance_count,
+        .camera_position = options->camera_position
+    };
+    assert(animation.mesh_vertices && animation.instance_transforms);
+    for(unsigned int i = 0; i < scene->mesh_count; i++) {
+        const Scene* mesh = &scene->meshes[i];
+        animation.mesh_vertices[i] = malloc(sizeof(TriangleVertices) * (mesh->triangle_count > 0 ? mesh->triangle_count : 1));
+        assert(animation.mesh_vertices[i]);
+        memcpy(animation.mesh_vertices[i], mesh->triangle_vertices, sizeof(TriangleVertices) * mesh->triangle_count);
+    }
+    for(unsigned int i = 0; i < scene->instance_count; i++) {
+        animation.instance_transforms[i] = scene->instances[i].to_world;
+    }
+    return animation;
+}
+
+void freeAnimation(Animation* animation) {
+    for(unsigned int i = 0; i < animation->mesh_count; i++) {
+        free(animation->mesh_vertices[i]);
+    }
+    free(animation->mesh_vertices);
+    free(animation->instance_transforms);
+    animation->mesh_vertices = NULL;
+    animation->instance_transforms = NULL;
+}
+
+// Poses the scene for a frame and moves the camera of the frame options
+void setAnimationFrame(const Animation* animation, Scene* scene, unsigned int frame, Options* frame_options) {
+    if(animation->sway != 0.0f) {
+        // one full swing over the sequence, so it loops
+        const float offset = animation->sway * sinf(2.0f * (float)M_PI * (float)frame / (float)animation->frame_count);
+        for(unsigned int i = 0; i < animation->mesh_count; i++) {
+            Scene* mesh = &scene->meshes[i];
+            for(unsigned int k = 0; k < mesh->triangle_count; k++) {
+                TriangleVertices vertices = animation->mesh_vertices[i][k];
+                for(unsigned int v = 0; v < 3; v++) {
+                    // meshes stand on their origin and are at most one unit high, the base stays in place
+                    vertices.v[v].x += offset * vertices.v[v].y * vertices.v[v].y;
+                }
+                mesh->triangle_vertices[k] = vertices;
+            }
+            refitSceneMesh(mesh);
+        }
+    }
+    if(animation->spin != 0.0f) {
+        const Transform rotation = rotationYTransform(animation->spin * (float)frame);
+        for(unsigned int i = 0; i < animation->instance_count; i++) {
+            Instance* instance = &scene->instances[i];
+            instance->to_world = multTransform(&animation->instance_transforms[i], &rotation);
+            instance->to_object = invertTransform(&instance->to_world);
+        }
+    }
+    if(animation->sway != 0.0f || animation->spin != 0.0f) {
+        refitInstanceBvh(scene);
+    }
+    const Transform orbit = rotationYTransform(animation->orbit * (float)frame);
+    const Vec3 offset = subVec3(animation->camera_position, frame_options->camera_target);
+    frame_options->camera_position = addVec3(frame_options->camera_target, transformDir(&orbit, offset));
+}
+
+// Inserts the frame number in front of the extension, "out/anim.ppm" becomes "out/anim_0007.ppm"
+void getFramePath(const char* path, unsigned int frame, char* frame_path, size_t size) {
+    const char* dot = strrchr(path, '.');
+    const char* slash = strrchr(path, '/');
+    if(!dot || (slash && dot < slash)) {
+        dot = path + strlen(path);
+    }
+    snprintf(frame_path, size, "%.*s_%04u%s", (int)(dot - path), path, frame, dot);
+}
+
+void runFrameWriter(void* argument) {
+    FrameWriter* writer = argument;
+    const double start = getWallTime();
+    writer->valid = writeImage(writer->path, writer->format, &writer->accumulator);
+    writer->busy_time += getWallTime() - start;
+}
+
+// Renders all frames of the options, path is numbered per frame. Returns 0 if an image couldn't be written.
+int renderFrameSequence(Scene* scene, const Options* options, const char* path) {
+    Animation animation = createAnimation(scene, options);
+    FrameWriter writers[2];
+    for(unsigned int i = 0; i < 2; i++) {
+        writers[i] = (FrameWriter) {
+            .accumulator = createAccumulator(options->crop_width, options->crop_height),
+            .format = options->output_format,
+            .busy = 0,
+            .valid = 1,
+            .busy_time = 0.0
+        };
+    }
+    initThreadStats(omp_get_max_threads());
+    if(options->sampler == SAMPLER_BLUE_NOISE) {
+        initBlueNoise(options->seed);
+    }
+    printf("Rendering %u frames\n", options->frames);
+
+    int valid = 1;
+    double update_time = 0.0;
+    double render_time = 0.0;
+    double wait_time = 0.0;
+    const double start = getWallTime();
+    for(unsigned int frame = 0; frame < options->frames && valid; frame++) {
+        FrameWriter* writer = &writers[frame % 2];
+        const double update_start = getWallTime();
+        Options frame_options = *options;
+        setAnimationFrame(&animation, scene, frame, &frame_options);
+        const double render_start = getWallTime();
+        update_time += render_start - update_start;
+        // the writer of the frame before the previous one still has this accumulator
+        if(writer->busy) {
+            joinThread(&writer->thread);
+            writer->busy = 0;
+            valid = writer->valid;
+            wait_time += getWallTime() - render_start;
+            if(!valid) {
+                fprintf(stderr, "Couldn't write image '%s'\n", writer->path);
+                break;
+            }
+        }
+        freeAccumulator(&writer->accumulator);
+        writer->accumulator = createAccumulator(options->crop_width, options->crop_height);
+        const double pass_start = getWallTime();
+        renderSinglePass(scene, &frame_options, &writer->accumulator);
+        render_time += getWallTime() - pass_start;
+
+        getFramePath(path, frame, writer->path, sizeof(writer->path));
+        if(startThread(&writer->thread, runFrameWriter, writer)) {
+            writer->busy = 1;
+        }
+        else {
+            runFrameWriter(writer);
+        }
+    }
+    for(unsigned int i = 0; i < 2; i++) {
+        if(writers[i].busy) {
+            const double wait_start = getWallTime();
+            joinThread(&writers[i].thread);
+            wait_time += getWallTime() - wait_start;
+            if(!writers[i].valid) {
+                fprintf(stderr, "Couldn't write image '%s'\n", writers[i].path);
+                valid = 0;
+            }
+        }
+    }
+    const double time_used = getWallTime() - start;
+    if(valid) {
+        char first_path[256];
+        getFramePath(path, 0, first_path, sizeof(first_path));
+        printf("Wrote %u frames starting with '%s'\n", options->frames, first_path);
+    }
+
+    #if STATS
+    const uint64_t ray_count = mergeThreadStats().ray_count;
+    #else
+    const uint64_t ray_count = 0;
+    #endif
+    printf("Statistics\n");
+    printf("==========\n");
+    printf("ANIMATION\n");
+    printStatTotal("Frames", options->frames);
+    printStatTime("Total time", time_used);
+    printStatFactor("Frames per hour", time_used > 0.0 ? (double)options->frames * 3600.0 / time_used : 0.0);
+    printStatTime("Avg frame render time", render_time / (double)options->frames);
+    printStatTime("Avg frame update time (pose and refit)", update_time / (double)options->frames);
+    printStatTime("Waiting for the writer", wait_time);
+    printStatTime("Writer busy time", writers[0].busy_time + writers[1].busy_time);
+    printStatFactor("Rays per second while rendering", render_time > 0.0 ? (double)ray_count / render_time : 0.0);
+
+    for(unsigned int i = 0; i < 2; i++) {
+        freeAccumulator(&writers[i].accumulator);
+    }
+    freeAnimation(&animation);
+    freeThreadStats();
+    return valid;
+}
+
+#endif // ANIMATION_H
@@ -0,0 +1,367 @@
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <omp.h>
+
+#include "vec3.h"
+#include "ray.h"
+#include "triangle.h"
+#include "material.h"
+#include "scene.h"
+#include "rng.h"
+#include "simd.h"
+#include "platform.h"
+#define STATS 1
+#include "stats.h"
+#include "render.h"
+
+// Ray throughput on generated scenes of growing size, with fixed seeds so runs of
+// different versions can be compared. See the README for the options.
+
+#define BENCH_MAX_THREAD_COUNTS 16
+
+typedef enum BenchWorkload {
+    BENCH_PRIMARY,
+    BENCH_PATH,
+    BENCH_OCCLUSION,
+    BENCH_PACKET,
+    BENCH_WORKLOAD_COUNT
+} BenchWorkload;
+
+const char* bench_workload_names[BENCH_WORKLOAD_COUNT] = {"primary", "path", "occlusion", "packet"};
+
+typedef struct BenchOptions {
+    unsigned int min_triangles;
+    unsigned int max_triangles;
+    unsigned int ray_count;
+    uint64_t seed;
+    unsigned int thread_counts[BENCH_MAX_THREAD_COUNTS];
+    unsigned int thread_count_count;
+    int workloads[BENCH_WORKLOAD_COUNT];
+    SimdLevel simd;
+    const char* json_path;
+} BenchOptions;
+
+typedef struct BenchResult {
+    uint64_t rays;
+    uint64_t hits;
+    double seconds;
+} BenchResult;
+
+void printBenchUsage(const char* program) {
+    printf("Usage: %s [options]\n", program);
+    printf("Options:\n");
+    printf("  --min-triangles <n>     smallest generated scene (default: 100)\n");
+    printf("  --max-triangles <n>     largest generated scene, sizes grow by 10x (default: 1000000)\n");
+    printf("  --rays <n>              rays per primary and occlusion run, paths use n / 8 samples (default: 1048576)\n");
+    printf("  --seed <n>              seed of the scenes and rays (default: 0)\n");
+    printf("  --threads <a,b,...>     thread counts to sweep (default: powers of two up to all cores)\n");
+    printf("  --workloads <a,b,...>   any of primary, path, occlusion and packet (default: all)\n");
+    printf("  --simd <level>          auto, scalar, sse, avx2 or avx512 intersection kernel (default: auto)\n");
+    printf("  --json <file>           write all results as JSON\n");
+}
+
+// Returns 0 if the arguments couldn't be parsed
+int parseBenchOptions(int argc, const char** argv, BenchOptions* options) {
+    *options = (BenchOptions) {
+        .min_triangles = 100,
+        .max_triangles = 1000000,
+        .ray_count = 1u << 20,
+        .seed = 0,
+        .thread_count_count = 0,
+        .workloads = {1, 1, 1, 1},
+        .simd = SIMD_AUTO,
+        .json_path = NULL
+    };
+    for(int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        const char* value = i + 1 < argc ? argv[i + 1] : NULL;
+        if(strcmp(arg, "--min-triangles") == 0 && value) {
+            options->min_triangles = atoi(value);
+            i++;
+        }
+        else if(strcmp(arg, "--max-triangles") == 0 && value) {
+            options->max_triangles = atoi(value);
+            i++;
+        }
+        else if(strcmp(arg, "--rays") == 0 && value) {
+            options->ray_count = atoi(value);
+            i++;
+        }
+        else if(strcmp(arg, "--seed") == 0 && value) {
+            options->seed = strtoull(value, NULL, 10);
+            i++;
+        }
+        else if(strcmp(arg, "--threads") == 0 && value) {
+            const char* list = value;
+            while(*list && options->thread_count_count < BENCH_MAX_THREAD_COUNTS) {
+                char* end;
+                const unsigned long threads = strtoul(list, &end, 10);
+                if(end == list || threads == 0) {
+                    fprintf(stderr, "Invalid thread count list '%s'\n", value);
+                    return 0;
+                }
+                options->thread_counts[options->thread_count_count++] = (unsigned int)threads;
+                list = *end == ',' ? end + 1 : end;
+            }
+            i++;
+        }
+        else if(strcmp(arg, "--workloads") == 0 && value) {
+            memset(options->workloads, 0, sizeof(options->workloads));
+            const char* list = value;
+            while(*list) {
+                const size_t length = strcspn(list, ",");
+                unsigned int workload = 0;
+                while(workload < BENCH_WORKLOAD_COUNT && (strlen(bench_workload_names[workload]) != length || strncmp(list, bench_workload_names[workload], length) != 0)) {
+                    workload++;
+                }
+                if(workload == BENCH_WORKLOAD_COUNT) {
+                    fprintf(stderr, "Unknown workload in '%s'\n", value);
+                    return 0;
+                }
+                options->workloads[workload] = 1;
+                list += length + (list[length] == ',');
+            }
+            i++;
+        }
+        else if(strcmp(arg, "--simd") == 0 && value) {
+            const char* levels[] = {"auto", "scalar", "sse", "avx2", "avx512"};
+            const SimdLevel level_values[] = {SIMD_AUTO, SIMD_SCALAR, SIMD_SSE, SIMD_AVX2, SIMD_AVX512};
+            unsigned int level = 0;
+            while(level < 5 && strcmp(value, levels[level]) != 0) {
+                level++;
+            }
+            if(level == 5) {
+                fprintf(stderr, "Unknown SIMD level '%s'\n", value);
+                return 0;
+            }
+            options->simd = level_values[level];
+            i++;
+        }
+        else if(strcmp(arg, "--json") == 0 && value) {
+            options->json_path = value;
+            i++;
+        }
+        else {
+            fprintf(stderr, "Unknown option '%s'\n", arg);
+            return 0;
+        }
+    }
+    if(options->min_triangles < 10 || options->max_triangles < options->min_triangles || options->ray_count < 8) {
+        fprintf(stderr, "Need at least 10 triangles, max triangles >= min triangles and 8 rays\n");
+        return 0;
+    }
+    if(options->thread_count_count == 0) {
+        const unsigned int max_threads = (unsigned int)omp_get_max_threads();
+        for(unsigned int threads = 1; threads < max_threads && options->thread_count_count < BENCH_MAX_THREAD_COUNTS - 1; threads *= 2) {
+            options->thread_counts[options->thread_count_count++] = threads;
+        }
+        options->thread_counts[options->thread_count_count++] = max_threads;
+    }
+    return 1;
+}
+
+void addBenchQuad(Scene* scene, Vec3 a, Vec3 b, Vec3 c, Vec3 d, MaterialHandle material) {
+    addTriangle(scene, (TriangleVertices){{a, b, c}}, material);
+    addTriangle(scene, (TriangleVertices){{c, d, a}}, material);
+}
+
+// A floor, an emissive ceiling and tessellated spheres on a jittered grid in between,
+// so larger scenes get both more and smaller triangles like real meshes
+void generateBenchScene(Scene* scene, unsigned int triangle_count, uint64_t seed) {
+    addBenchQuad(scene, (Vec3){{-1.0f, -0.5f, 0.0f}}, (Vec3){{-1.0f, -0.5f, 2.0f}}, (Vec3){{1.0f, -0.5f, 2.0f}}, (Vec3){{1.0f, -0.5f, 0.0f}}, 1);
+    addBenchQuad(scene, (Vec3){{-0.3f, 0.6f, 0.7f}}, (Vec3){{0.3f, 0.6f, 0.7f}}, (Vec3){{0.3f, 0.6f, 1.3f}}, (Vec3){{-0.3f, 0.6f, 1.3f}}, 4);
+    const unsigned int sphere_triangles_total = triangle_count > 4 ? triangle_count - 4 : 0;
+    const unsigned int sphere_count = (unsigned int)fmax(1.0, round(sqrt((double)sphere_triangles_total) / 16.0));
+    const unsigned int grid = (unsigned int)ceil(cbrt((double)sphere_count));
+    const float cell = 1.0f / (float)grid;
+    // segments * rings * 2 triangles per sphere with rings = segments / 2
+    const unsigned int segments = (unsigned int)fmax(4.0, round(sqrt((double)sphere_triangles_total / sphere_count)));
+    const unsigned int rings = segments / 2;
+    reserveTriangles(scene, 4 + sphere_count * segments * rings * 2);
+    Rng rng = createRng(seed, 0, 0, 0);
+    for(unsigned int sphere = 0; sphere < sphere_count; sphere++) {
+        const Vec3 center = {{
+            -0.5f + ((float)(sphere % grid) + 0.25f + 0.5f * randFloat(&rng)) * cell,
+            -0.5f + ((float)(sphere / grid % grid) + 0.25f + 0.5f * randFloat(&rng)) * cell,
+            0.5f + ((float)(sphere / grid / grid) + 0.25f + 0.5f * randFloat(&rng)) * cell
+        }};
+        const float radius = cell * (0.2f + 0.2f * randFloat(&rng));
+        for(unsigned int ring = 0; ring < rings; ring++) {
+            const float theta0 = (float)M_PI * (float)ring / (float)rings;
+            const float theta1 = (float)M_PI * (float)(ring + 1) / (float)rings;
+            for(unsigned int segment = 0; segment < segments; segment++) {
+                const float phi0 = 2.0f * (float)M_PI * (float)segment / (float)segments;
+                const float phi1 = 2.0f * (float)M_PI * (float)(segment + 1) / (float)segments;
+                Vec3 corners[4];
+                const float thetas[4] = {theta0, theta1, theta1, theta0};
+                const float phis[4] = {phi0, phi0, phi1, phi1};
+                for(unsigned int k = 0; k < 4; k++) {
+                    corners[k] = addVec3(center, multVec3Scalar((Vec3){{sinf(thetas[k]) * cosf(phis[k]), cosf(thetas[k]), sinf(thetas[k]) * sinf(phis[k])}}, radius));
+                }
+                addBenchQuad(scene, corners[0], corners[1], corners[2], corners[3], 1 + sphere % 3);
+            }
+        }
+    }
+}
+
+BenchResult runBenchWorkload(Scene* scene, BenchWorkload workload, unsigned int ray_count, uint64_t seed, unsigned int threads) {
+    omp_set_num_threads((int)threads);
+    memset(thread_stats, 0, sizeof(PaddedThreadStats) * thread_stats_count);
+    const unsigned int path_size = (unsigned int)sqrt((double)(ray_count / 8));
+    // the default camera of the renderer
+    const Vec3 camera_position = {{0.0f, 0.0f, -0.5f}};
+    const Vec3 camera_target = {{0.0f, 0.0f, 0.5f}};
+    const RenderSettings settings = {
+        .width = path_size,
+        .height = path_size,
+        .camera = createCamera(camera_position, camera_target, 90.0f, path_size, path_size),
+        .seed = seed,
+        .max_depth = 64,
+        .roulette_depth = 3,
+        .next_event_estimation = 1,
+        .sampler = SAMPLER_SOBOL,
+        .sample_count = 1
+    };
+    const unsigned int primary_size = (unsigned int)sqrt((double)ray_count);
+    const Camera primary_camera = createCamera(camera_position, camera_target, 90.0f, primary_size, primary_size);
+    const RenderSettings packet_settings = {
+        .width = primary_size,
+        .height = primary_size,
+        .camera = primary_camera,
+        .primary_packets = 1
+    };
+    const unsigned int packet_columns = (primary_size + PACKET_WIDTH - 1) / PACKET_WIDTH;
+    const int count = workload == BENCH_PATH ? (int)(settings.width * settings.height) :
+        workload == BENCH_PACKET ? (int)(packet_columns * packet_columns) : (int)(primary_size * primary_size);
+    const Vec3 bounds_min = {{-0.6f, -0.5f, 0.3f}};
+    const Vec3 bounds_size = {{1.2f, 1.1f, 1.4f}};
+    uint64_t hits = 0;
+    const double start = getWallTime();
+    #pragma omp parallel for schedule(dynamic, 256) reduction(+:hits)
+    for(int i = 0; i < count; i++) {
+        if(workload == BENCH_PRIMARY) {
+            hits += traceRay(scene, getCameraRay(&primary_camera, (unsigned int)i % primary_size, (unsigned int)i / primary_size, primary_size, primary_size)).handle != 0;
+        }
+        else if(workload == BENCH_PACKET) {
+            // the same camera rays as primary, traced in blocks of 8x8 pixels
+            const unsigned int block_x = (unsigned int)i % packet_columns * PACKET_WIDTH;
+            const unsigned int block_y = (unsigned int)i / packet_columns * PACKET_WIDTH;
+            PixelSamples pixels[PACKET_MAX_RAYS];
+            unsigned int pixel_count = 0;
+            for(unsigned int y = block_y; y < block_y + PACKET_WIDTH && y < primary_size; y++) {
+                for(unsigned int x = block_x; x < block_x + PACKET_WIDTH && x < primary_size; x++) {
+                    pixels[pixel_count++] = (PixelSamples){x, y, 0, 1};
+                }
+            }
+            Ray rays[PACKET_MAX_RAYS];
+            TriangleHit packet_hits[PACKET_MAX_RAYS];
+            tracePrimaryRays(scene, &packet_settings, pixels, pixel_count, rays, packet_hits);
+            for(unsigned int k = 0; k < pixel_count; k++) {
+                hits += packet_hits[k].handle != 0;
+            }
+        }
+        else if(workload == BENCH_OCCLUSION) {
+            // segment between two random points in the scene
+            Rng rng = createRng(seed, (uint32_t)i, 0, 1);
+            Vec3 points[2];
+            for(unsigned int k = 0; k < 2; k++) {
+                points[k] = (Vec3){{
+                    bounds_min.x + bounds_size.x * randFloat(&rng),
+                    bounds_min.y + bounds_size.y * randFloat(&rng),
+                    bounds_min.z + bounds_size.z * randFloat(&rng)
+                }};
+            }
+            const Vec3 segment = subVec3(points[1], points[0]);
+            const float distance = length(segment);
+            hits += traceShadowRay(scene, (Ray){ .origin = points[0], .dir = multVec3Scalar(segment, 1.0f / distance) }, distance);
+        }
+        else {
+            const SampleSum sum = samplePixelColor(scene, &settings, (unsigned int)i % settings.width, (unsigned int)i / settings.width, 0, 1);
+            hits += sum.radiance.r + sum.radiance.g + sum.radiance.b > 0.0f;
+        }
+    }
+    const double seconds = getWallTime() - start;
+    return (BenchResult) {
+        .rays = mergeThreadStats().ray_count,
+        .hits = hits,
+        .seconds = seconds
+    };
+}
+
+int main(int argc, const char** argv) {
+    BenchOptions options;
+    if(!parseBenchOptions(argc, argv, &options)) {
+        printBenchUsage(argv[0]);
+        return 1;
+    }
+    const SimdLevel simd_level = selectSimdLevel(options.simd);
+    unsigned int max_threads = 0;
+    for(unsigned int i = 0; i < options.thread_count_count; i++) {
+        max_threads = options.thread_counts[i] > max_threads ? options.thread_counts[i] : max_threads;
+    }
+    initThreadStats(max_threads);
+
+    FILE* json = NULL;
+    if(options.json_path) {
+        json = fopen(options.json_path, "w");
+        if(!json) {
+            fprintf(stderr, "Couldn't open '%s'\n", options.json_path);
+            return 1;
+        }
+        fprintf(json, "{\n  \"simd\": \"%s\",\n  \"seed\": %llu,\n  \"rays\": %u,\n  \"timestamp\": %lld,\n  \"scenes\": [",
+            getSimdLevelName(simd_level), (unsigned long long)options.seed, options.ray_count, (long long)time(NULL));
+    }
+    printf("Using %s intersection kernel\n", getSimdLevelName(simd_level));
+    printf("%12s %10s %8s %10s %10s %8s\n", "triangles", "workload", "threads", "Mrays/s", "ns/ray", "hits");
+
+    int first_scene = 1;
+    for(double size = options.min_triangles; size <= options.max_triangles * 1.0001; size *= 10.0) {
+        Scene scene = createScene();
+        generateBenchScene(&scene, (unsigned int)size, options.seed);
+        const double build_start = getWallTime();
+        prepareScene(&scene, materials, sizeof(materials) / sizeof(materials[0]), 1);
+        const double build_time = getWallTime() - build_start;
+        const size_t scene_memory = getSceneMemory(&scene);
+        const size_t peak_rss = getPeakRss();
+        printf("Scene with %u triangles: build %.3fs, %u BVH nodes, %.1f MiB, peak RSS %.1f MiB\n", scene.triangle_count, build_time,
+            scene.bvh.node_count, (double)scene_memory / (1024.0 * 1024.0), (double)peak_rss / (1024.0 * 1024.0));
+        if(json) {
+            fprintf(json, "%s\n    {\n      \"triangles\": %u,\n      \"bvh_nodes\": %u,\n      \"build_seconds\": %.6f,\n      \"scene_bytes\": %zu,\n      \"peak_rss_bytes\": %zu,\n      \"runs\": [",
+                first_scene ? "" : ",", scene.triangle_count, scene.bvh.node_count, build_time, scene_memory, peak_rss);
+        }
+        int first_run = 1;
+        for(unsigned int workload = 0; workload < BENCH_WORKLOAD_COUNT; workload++) {
+            if(!options.workloads[workload]) {
+                continue;
+            }
+            for(unsigned int t = 0; t < options.thread_count_count; t++) {
+                const unsigned int threads = options.thread_counts[t];
+                const BenchResult result = runBenchWorkload(&scene, (BenchWorkload)workload, options.ray_count, options.seed, threads);
+                const double mrays = (double)result.rays / result.seconds * 1e-6;
+                const double ns_per_ray = result.seconds * 1e9 / (double)result.rays;
+                printf("%12u %10s %8u %10.2f %10.2f %8llu\n", scene.triangle_count, bench_workload_names[workload], threads, mrays, ns_per_ray, (unsigned long long)result.hits);
+                if(json) {
+                    fprintf(json, "%s\n        {\"workload\": \"%s\", \"threads\": %u, \"rays\": %llu, \"hits\": %llu, \"seconds\": %.6f, \"mrays_per_second\": %.4f, \"ns_per_ray\": %.4f}",
+                        first_run ? "" : ",", bench_workload_names[workload], threads, (unsigned long long)result.rays, (unsigned long long)result.hits, result.seconds, mrays, ns_per_ray);
+                }
+                first_run = 0;
+            }
+        }
+        if(json) {
+            fprintf(json, "\n      ]\n    }");
+        }
+        first_scene = 0;
+        freeScene(&scene);
+    }
+    if(json) {
+        fprintf(json, "\n  ]\n}\n");
+        fclose(json);
+        printf("Wrote results to '%s'\n", options.json_path);
+    }
+    freeThreadStats();
+    return 0;
+}
@@ -0,0 +1,121 @@
+#ifndef BSDF_H
+#define BSDF_H
+
+#include <math.h>
+
+#include "vec3.h"
+#include "color.h"
+#include "material.h"
+#include "sampler.h"
+
+// Roughness 1 is a lambertian surface, anything below is a GGX reflector with
+// alpha = roughness^2 tinted by the diffuse color. Alpha is clamped, so a roughness
+// of 0 is a very sharp mirror and still has a finite pdf for MIS.
+#define GGX_MIN_ALPHA 0.001f
+
+// All directions point away from the surface, out is towards the viewer
+typedef struct BsdfSample {
+    Norm3 dir;
+    // bsdf * cos / pdf, black if the sample is absorbed
+    Color3f weight;
+    float pdf;
+} BsdfSample;
+
+int isDiffuseMaterial(const Material* material) {
+    return material->roughness >= 1.0f;
+}
+
+float getGgxAlpha(const Material* material) {
+    return fmaxf(material->roughness * material->roughness, GGX_MIN_ALPHA);
+}
+
+float getGgxDistribution(float cos_half, float alpha) {
+    const float alpha_sq = alpha * alpha;
+    const float denominator = cos_half * cos_half * (alpha_sq - 1.0f) + 1.0f;
+    return alpha_sq / ((float)M_PI * denominator * denominator);
+}
+
+// Smith masking of a single direction
+float getGgxMasking(float cos_dir, float alpha) {
+    const float cos_sq = cos_dir * cos_dir;
+    const float tan_sq = (1.0f - cos_sq) / cos_sq;
+    return 2.0f / (1.0f + sqrtf(1.0f + alpha * alpha * tan_sq));
+}
+
+Color3f getSchlickFresnel(Color3f f0, float cos_dir) {
+    const float m = fminf(fmaxf(1.0f - cos_dir, 0.0f), 1.0f);
+    const float m5 = m * m * m * m * m;
+    return (Color3f) {
+        .r = f0.r + (1.0f - f0.r) * m5,
+        .g = f0.g + (1.0f - f0.g) * m5,
+        .b = f0.b + (1.0f - f0.b) * m5
+    };
+}
+
+// bsdf * cos of the light arriving from in and leaving towards out
+Color3f evalBsdf(const Material* material, const Frame* frame, Norm3 out, Norm3 in) {
+    const Color3f black = {0.0f, 0.0f, 0.0f};
+    const Vec3 local_out = frameToLocal(frame, out);
+    const Vec3 local_in = frameToLocal(frame, in);
+    if(local_out.z <= 0.0f || local_in.z <= 0.0f) {
+        return black;
+    }
+    if(isDiffuseMaterial(material)) {
+        return multColor3fScalar(material->diffuse, local_in.z * (float)M_1_PI);
+    }
+    const float alpha = getGgxAlpha(material);
+    const Norm3 half = normalizeVec3(addVec3(local_out, local_in));
+    const float cos_out_half = dot(local_out, half);
+    const float factor = getGgxDistribution(half.z, alpha) * getGgxMasking(local_out.z, alpha) * getGgxMasking(local_in.z, alpha) / (4.0f * local_out.z);
+    return multColor3fScalar(getSchlickFresnel(material->diffuse, cos_out_half), factor);
+}
+
+// Solid angle density of sampleBsdf returning in
+float getBsdfPdf(const Material* material, const Frame* frame, Norm3 out, Norm3 in) {
+    const Vec3 local_out = frameToLocal(frame, out);
+    const Vec3 local_in = frameToLocal(frame, in);
+    if(local_out.z <= 0.0f || local_in.z <= 0.0f) {
+        return 0.0f;
+    }
+    if(isDiffuseMaterial(material)) {
+        return local_in.z * (float)M_1_PI;
+    }
+    const float alpha = getGgxAlpha(material);
+    const Norm3 half = normalizeVec3(addVec3(local_out, local_in));
+    return getGgxDistribution(half.z, alpha) * half.z / (4.0f * dot(local_out, half));
+}
+
+// Cosine weighted for diffuse surfaces, GGX normal distribution for glossy ones
+BsdfSample sampleBsdf(const Material* material, const Frame* frame, Norm3 out, Sampler* sampler) {
+    float u1, u2;
+    getSample2D(sampler, &u1, &u2);
+    const float angle = 2.0f * (float)M_PI * u2;
+    if(isDiffuseMaterial(material)) {
+        // uniform point on the unit disk projected up onto the hemisphere
+        const float radius = sqrtf(u1);
+        const Vec3 local_in = {{radius * cosf(angle), radius * sinf(angle), sqrtf(fmaxf(0.0f, 1.0f - u1))}};
+        return (BsdfSample) {
+            .dir = frameToWorld(frame, local_in),
+            .weight = material->diffuse,
+            .pdf = local_in.z * (float)M_1_PI
+        };
+    }
+    const float alpha = getGgxAlpha(material);
+    const Vec3 local_out = frameToLocal(frame, out);
+    const float cos_half = sqrtf((1.0f - u1) / (1.0f + (alpha * alpha - 1.0f) * u1));
+    const float sin_half = sqrtf(fmaxf(0.0f, 1.0f - cos_half * cos_half));
+    const Norm3 half = {{sin_half * cosf(angle), sin_half * sinf(angle), cos_half}};
+    const float cos_out_half = dot(local_out, half);
+    const Vec3 local_in = subVec3(multVec3Scalar(half, 2.0f * cos_out_half), local_out);
+    if(local_out.z <= 0.0f || local_in.z <= 0.0f || cos_out_half <= 0.0f) {
+        return (BsdfSample) { .dir = frame->normal, .weight = {{0.0f, 0.0f, 0.0f}}, .pdf = 0.0f };
+    }
+    const float factor = getGgxMasking(local_out.z, alpha) * getGgxMasking(local_in.z, alpha) * cos_out_half / (local_out.z * cos_half);
+    return (BsdfSample) {
+        .dir = frameToWorld(frame, local_in),
+        .weight = multColor3fScalar(getSchlickFresnel(material->diffuse, cos_out_half), factor),
+        .pdf = getGgxDistribution(cos_half, alpha) * cos_half / (4.0f * cos_out_half)
+    };
+}
+
+#endif // BSDF_H
@@ -0,0 +1,431 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include <assert.h>
+#include <float.h>
+#include <stdlib.h>
+
+#include "vec3.h"
+#include "triangle.h"
+#include "ray.h"
+#include "simd.h"
+
+#define BVH_SAH_BINS 16
+#define BVH_MAX_DEPTH 64
+#define BVH_MAX_LEAF_SIZE 8
+#define BVH_TRAVERSAL_COST 1.0f
+#define BVH_INTERSECTION_COST 1.0f
+#define BVH_MISS FLT_MAX
+
+typedef struct Aabb {
+    Vec3 min;
+    Vec3 max;
+} Aabb;
+
+typedef struct BvhNode {
+    Aabb bounds;
+    // Inner node: index of the left child, the right child directly follows it
+    // Leaf: index of the first triangle
+    unsigned int first;
+    // Number of triangles for leaves, 0 for inner nodes
+    unsigned int count;
+} BvhNode;
+
+typedef struct Bvh {
+    BvhNode* nodes;
+    unsigned int node_count;
+} Bvh;
+
+Aabb emptyAabb() {
+    return (Aabb) {
+        .min = { FLT_MAX,  FLT_MAX,  FLT_MAX},
+        .max = {-FLT_MAX, -FLT_MAX, -FLT_MAX}
+    };
+}
+
+Aabb growAabb(Aabb box, Vec3 point) {
+    for(unsigned int i = 0; i < 3; i++) {
+        box.min.v[i] = point.v[i] < box.min.v[i] ? point.v[i] : box.min.v[i];
+        box.max.v[i] = point.v[i] > box.max.v[i] ? point.v[i] : box.max.v[i];
+    }
+    return box;
+}
+
+Aabb mergeAabb(Aabb a, Aabb b) {
+    for(unsigned int i = 0; i < 3; i++) {
+        a.min.v[i] = b.min.v[i] < a.min.v[i] ? b.min.v[i] : a.min.v[i];
+        a.max.v[i] = b.max.v[i] > a.max.v[i] ? b.max.v[i] : a.max.v[i];
+    }
+    return a;
+}
+
+float aabbSurfaceArea(Aabb box) {
+    if(box.min.x > box.max.x) {
+        return 0.0f;
+    }
+    const Vec3 extent = subVec3(box.max, box.min);
+    return 2.0f * (extent.x * extent.y + extent.y * extent.z + extent.z * extent.x);
+}
+
+Aabb triangleAabb(TriangleVertices vertices) {
+    return growAabb(growAabb(growAabb(emptyAabb(), vertices.v1), vertices.v2), vertices.v3);
+}
+
+// Returns the distance at which the ray enters the box or BVH_MISS
+float intersectAabb(const Aabb* box, Vec3 origin, Vec3 inv_dir, float max_distance) {
+    float t_near = 0.0f;
+    float t_far = max_distance;
+    for(unsigned int i = 0; i < 3; i++) {
+        float t1 = (box->min.v[i] - origin.v[i]) * inv_dir.v[i];
+        float t2 = (box->max.v[i] - origin.v[i]) * inv_dir.v[i];
+        if(t1 > t2) {
+            const float temp = t1;
+            t1 = t2;
+            t2 = temp;
+        }
+        t_near = t1 > t_near ? t1 : t_near;
+        t_far = t2 < t_far ? t2 : t_far;
+    }
+    return t_near <= t_far ? t_near : BVH_MISS;
+}
+
+typedef struct BvhBuilder {
+    unsigned int leaf_width;
+    BvhNode* nodes;
+    unsigned int node_count;
+    unsigned int* order;
+    const Vec3* centroids;
+    const Aabb* triangle_bounds;
+} BvhBuilder;
+
+typedef struct BvhBin {
+    Aabb bounds;
+    unsigned int count;
+} BvhBin;
+
+// Cost of a leaf is counted in kernel calls, each tests leaf_width triangles at once
+float getBvhLeafCost(const BvhBuilder* builder, unsigned int count) {
+    return (float)((count + builder->leaf_width - 1) / builder->leaf_width);
+}
+
+unsigned int getBvhBinIndex(float centroid, float min, float scale) {
+    const int bin = (int)((centroid - min) * scale);
+    return bin < 0 ? 0 : (bin >= BVH_SAH_BINS ? BVH_SAH_BINS - 1 : (unsigned int)bin);
+}
+
+void subdivideBvhNode(BvhBuilder* builder, unsigned int node_index, unsigned int depth) {
+    BvhNode* node = &builder->nodes[node_index];
+    const unsigned int first = node->first;
+    const unsigned int count = node->count;
+
+    Aabb centroid_bounds = emptyAabb();
+    for(unsigned int i = first; i < first + count; i++) {
+        centroid_bounds = growAabb(centroid_bounds, builder->centroids[builder->order[i]]);
+    }
+
+    // Find the cheapest binned SAH split over all axes
+    float best_cost = FLT_MAX;
+    int best_axis = -1;
+    unsigned int best_split = 0;
+    for(unsigned int axis = 0; axis < 3; axis++) {
+        const float min = centroid_bounds.min.v[axis];
+        const float extent = centroid_bounds.max.v[axis] - min;
+        if(extent <= 0.0f) {
+            continue;
+        }
+        const float scale = (float)BVH_SAH_BINS / extent;
+        BvhBin bins[BVH_SAH_BINS];
+        for(unsigned int b = 0; b < BVH_SAH_BINS; b++) {
+            bins[b].bounds = emptyAabb();
+            bins[b].count = 0;
+        }
+        for(unsigned int i = first; i < first + count; i++) {
+            const unsigned int triangle = builder->order[i];
+            BvhBin* bin = &bins[getBvhBinIndex(builder->centroids[triangle].v[axis], min, scale)];
+            bin->bounds = mergeAabb(bin->bounds, builder->triangle_bounds[triangle]);
+            bin->count++;
+        }
+
+        float right_area[BVH_SAH_BINS];
+        unsigned int right_count[BVH_SAH_BINS];
+        Aabb right_bounds = emptyAabb();
+        unsigned int right_sum = 0;
+        for(unsigned int b = BVH_SAH_BINS - 1; b > 0; b--) {
+            right_bounds = mergeAabb(right_bounds, bins[b].bounds);
+            right_sum += bins[b].count;
+            right_area[b] = aabbSurfaceArea(right_bounds);
+            right_count[b] = right_sum;
+        }
+
+        Aabb left_bounds = emptyAabb();
+        unsigned int left_sum = 0;
+        for(unsigned int split = 1; split < BVH_SAH_BINS; split++) {
+            left_bounds = mergeAabb(left_bounds, bins[split - 1].bounds);
+            left_sum += bins[split - 1].count;
+            if(left_sum == 0 || right_count[split] == 0) {
+                continue;
+            }
+            const float cost = getBvhLeafCost(builder, left_sum) * aabbSurfaceArea(left_bounds)
+                             + getBvhLeafCost(builder, right_count[split]) * right_area[split];
+            if(cost < best_cost) {
+                best_cost = cost;
+                best_axis = (int)axis;
+                best_split = split;
+            }
+        }
+    }
+
+    const float node_area = aabbSurfaceArea(node->bounds);
+    const float leaf_cost = BVH_INTERSECTION_COST * getBvhLeafCost(builder, count);
+    const unsigned int max_leaf_size = builder->leaf_width > BVH_MAX_LEAF_SIZE ? builder->leaf_width : BVH_MAX_LEAF_SIZE;
+    const float split_cost = node_area > 0.0f
+        ? BVH_TRAVERSAL_COST + BVH_INTERSECTION_COST * best_cost / node_area
+        : FLT_MAX;
+    if(best_axis < 0 || depth + 1 >= BVH_MAX_DEPTH
+        || (split_cost >= leaf_cost && count <= max_leaf_size)) {
+        return;
+    }
+
+    // Partition the triangle range by the chosen split plane
+    const float min = centroid_bounds.min.v[best_axis];
+    const float scale = (float)BVH_SAH_BINS / (centroid_bounds.max.v[best_axis] - min);
+    unsigned int i = first;
+    unsigned int j = first + count;
+    while(i < j) {
+        const unsigned int triangle = builder->order[i];
+        if(getBvhBinIndex(builder->centroids[triangle].v[best_axis], min, scale) < best_split) {
+            i++;
+        }
+        else {
+            j--;
+            builder->order[i] = builder->order[j];
+            builder->order[j] = triangle;
+        }
+    }
+    const unsigned int left_count = i - first;
+    if(left_count == 0 || left_count == count) {
+        return;
+    }
+
+    const unsigned int left_index = builder->node_count;
+    builder->node_count += 2;
+    BvhNode* left = &builder->nodes[left_index];
+    BvhNode* right = &builder->nodes[left_index + 1];
+    left->first = first;
+    left->count = left_count;
+    right->first = first + left_count;
+    right->count = count - left_count;
+    left->bounds = emptyAabb();
+    for(unsigned int k = left->first; k < left->first + left->count; k++) {
+        left->bounds = mergeAabb(left->bounds, builder->triangle_bounds[builder->order[k]]);
+    }
+    right->bounds = emptyAabb();
+    for(unsigned int k = right->first; k < right->first + right->count; k++) {
+        right->bounds = mergeAabb(right->bounds, builder->triangle_bounds[builder->order[k]]);
+    }
+    node->first = left_index;
+    node->count = 0;
+
+    subdivideBvhNode(builder, left_index, depth + 1);
+    subdivideBvhNode(builder, left_index + 1, depth + 1);
+}
+
+// Builds a BVH with binned SAH over primitives with the given bounds, leaf_width is the number of
+// primitives a leaf tests at once.
+// order receives the leaf order of the primitives: order[i] is the original index
+// of the primitive which has to be stored at index i for the leaf ranges to be valid.
+void buildBvhFromBounds(Bvh* bvh, const Aabb* triangle_bounds, unsigned int triangle_count, unsigned int leaf_width, unsigned int* order) {
+    bvh->nodes = NULL;
+    bvh->node_count = 0;
+    if(triangle_count == 0) {
+        return;
+    }
+
+    Vec3* centroids = malloc(sizeof(Vec3) * triangle_count);
+    assert(centroids);
+    Aabb root_bounds = emptyAabb();
+    for(unsigned int i = 0; i < triangle_count; i++) {
+        centroids[i] = multVec3Scalar(addVec3(triangle_bounds[i].min, triangle_bounds[i].max), 0.5f);
+        root_bounds = mergeAabb(root_bounds, triangle_bounds[i]);
+        order[i] = i;
+    }
+
+    BvhBuilder builder = {
+        .leaf_width = leaf_width > 0 ? leaf_width : 1,
+        .nodes = malloc(sizeof(BvhNode) * (2 * triangle_count - 1)),
+        .node_count = 1,
+        .order = order,
+        .centroids = centroids,
+        .triangle_bounds = triangle_bounds
+    };
+    assert(builder.nodes);
+    builder.nodes[0] = (BvhNode) {
+        .bounds = root_bounds,
+        .first = 0,
+        .count = triangle_count
+    };
+    subdivideBvhNode(&builder, 0, 0);
+
+    free(centroids);
+    bvh->nodes = builder.nodes;
+    bvh->node_count = builder.node_count;
+}
+
+// Builds a BVH over triangles, leaf_width is the number of triangles the intersection kernel
+// tests at once. order is as for buildBvhFromBounds.
+void buildBvh(Bvh* bvh, const TriangleVertices* vertices, unsigned int triangle_count, unsigned int leaf_width, unsigned int* order) {
+    Aabb* triangle_bounds = malloc(sizeof(Aabb) * (triangle_count > 0 ? triangle_count : 1));
+    assert(triangle_bounds);
+    for(unsigned int i = 0; i < triangle_count; i++) {
+        triangle_bounds[i] = triangleAabb(vertices[i]);
+    }
+    buildBvhFromBounds(bvh, triangle_bounds, triangle_count, leaf_width, order);
+    free(triangle_bounds);
+}
+
+// Recomputes the bounds of every node after the primitives moved, keeping the tree and the leaf order.
+// bounds is indexed like the primitives in leaf order. Children always follow their parent, so one
+// backwards sweep sees them before the parent. Much cheaper than a rebuild, but the tree gets worse
+// the further primitives move away from where it was built.
+void refitBvhFromBounds(Bvh* bvh, const Aabb* bounds) {
+    for(unsigned int i = bvh->node_count; i-- > 0;) {
+        BvhNode* node = &bvh->nodes[i];
+        if(node->count > 0) {
+            node->bounds = emptyAabb();
+            for(unsigned int k = node->first; k < node->first + node->count; k++) {
+                node->bounds = mergeAabb(node->bounds, bounds[k]);
+            }
+        }
+        else {
+            node->bounds = mergeAabb(bvh->nodes[node->first].bounds, bvh->nodes[node->first + 1].bounds);
+        }
+    }
+}
+
+// Refits a BVH over triangles stored in its leaf order
+void refitBvh(Bvh* bvh, const TriangleVertices* vertices, unsigned int triangle_count) {
+    Aabb* triangle_bounds = malloc(sizeof(Aabb) * (triangle_count > 0 ? triangle_count : 1));
+    assert(triangle_bounds);
+    for(unsigned int i = 0; i < triangle_count; i++) {
+        triangle_bounds[i] = triangleAabb(vertices[i]);
+    }
+    refitBvhFromBounds(bvh, triangle_bounds);
+    free(triangle_bounds);
+}
+
+void freeBvh(Bvh* bvh) {
+    free(bvh->nodes);
+    bvh->nodes = NULL;
+    bvh->node_count = 0;
+}
+
+typedef struct BvhStackEntry {
+    unsigned int node;
+    float distance;
+} BvhStackEntry;
+
+// Closest hit traversal, visiting children front to back and skipping every
+// node which is entered behind the closest hit found so far.
+// Triangles have to be stored in the leaf order returned by buildBvh.
+void intersectBvh(const Bvh* bvh, const TrianglePrecomputed* triangles, Ray ray, TriangleHit* best_hit) {
+    const Vec3 inv_dir = {
+        .x = 1.0f / ray.dir.x,
+        .y = 1.0f / ray.dir.y,
+        .z = 1.0f / ray.dir.z
+    };
+    if(intersectAabb(&bvh->nodes[0].bounds, ray.origin, inv_dir, best_hit->intersection.distance) == BVH_MISS) {
+        return;
+    }
+
+    BvhStackEntry stack[BVH_MAX_DEPTH];
+    unsigned int stack_size = 0;
+    unsigned int node_index = 0;
+    while(1) {
+        const BvhNode* node = &bvh->nodes[node_index];
+        if(node->count > 0) {
+            const unsigned int hit = intersectTriangles(triangles, node->first, node->count, &ray, best_hit->intersection.distance, &best_hit->intersection);
+            if(hit) {
+                best_hit->handle = hit;
+            }
+        }
+        else {
+            unsigned int near = node->first;
+            unsigned int far = node->first + 1;
+            float near_distance = intersectAabb(&bvh->nodes[near].bounds, ray.origin, inv_dir, best_hit->intersection.distance);
+            float far_distance = intersectAabb(&bvh->nodes[far].bounds, ray.origin, inv_dir, best_hit->intersection.distance);
+            if(far_distance < near_distance) {
+                const unsigned int temp_index = near;
+                near = far;
+                far = temp_index;
+                const float temp_distance = near_distance;
+                near_distance = far_distance;
+                far_distance = temp_distance;
+            }
+            if(near_distance != BVH_MISS) {
+                if(far_distance != BVH_MISS) {
+                    stack[stack_size++] = (BvhStackEntry){ .node = far, .distance = far_distance };
+                }
+                node_index = near;
+                continue;
+            }
+        }
+
+        // Pop the next node which can still contain a closer hit
+        do {
+            if(stack_size == 0) {
+                return;
+            }
+            stack_size--;
+        } while(stack[stack_size].distance >= best_hit->intersection.distance);
+        node_index = stack[stack_size].node;
+    }
+}
+
+// Any-hit query for shadow rays, returns 1 as soon as some triangle is closer than max_distance
+int occludedBvh(const Bvh* bvh, const TrianglePrecomputed* triangles, Ray ray, float max_distance) {
+    const Vec3 inv_dir = {
+        .x = 1.0f / ray.dir.x,
+        .y = 1.0f / ray.dir.y,
+        .z = 1.0f / ray.dir.z
+    };
+    if(intersectAabb(&bvh->nodes[0].bounds, ray.origin, inv_dir, max_distance) == BVH_MISS) {
+        return 0;
+    }
+
+    // no closest hit to sort by, so the stack only needs node indices
+    unsigned int stack[BVH_MAX_DEPTH];
+    unsigned int stack_size = 0;
+    unsigned int node_index = 0;
+    while(1) {
+        const BvhNode* node = &bvh->nodes[node_index];
+        if(node->count > 0) {
+            TriangleIntersection intersection;
+            if(intersectTriangles(triangles, node->first, node->count, &ray, max_distance, &intersection)) {
+                return 1;
+            }
+        }
+        else {
+            const unsigned int left = node->first;
+            const unsigned int right = node->first + 1;
+            const int hit_left = intersectAabb(&bvh->nodes[left].bounds, ray.origin, inv_dir, max_distance) != BVH_MISS;
+            const int hit_right = intersectAabb(&bvh->nodes[right].bounds, ray.origin, inv_dir, max_distance) != BVH_MISS;
+            if(hit_left) {
+                if(hit_right) {
+                    stack[stack_size++] = right;
+                }
+                node_index = left;
+                continue;
+            }
+            if(hit_right) {
+                node_index = right;
+                continue;
+            }
+        }
+        if(stack_size == 0) {
+            return 0;
+        }
+        node_index = stack[--stack_size];
+    }
+}
+
+#endif // BVH_H
@@ -0,0 +1,49 @@
+#ifndef CAMERA_H
+#define CAMERA_H
+
+#include <math.h>
+
+#include "vec3.h"
+#include "ray.h"
+
+// Pinhole camera, the image plane is one unit in front of the position
+typedef struct Camera {
+    Vec3 position;
+    Norm3 right;
+    Norm3 up;
+    Norm3 forward;
+    // half extent of the image plane
+    float half_width, half_height;
+} Camera;
+
+// vertical_fov is in degrees, the horizontal one follows from the aspect ratio of the image
+Camera createCamera(Vec3 position, Vec3 target, float vertical_fov, unsigned int width, unsigned int height) {
+    const Norm3 forward = normalizeVec3(subVec3(target, position));
+    Vec3 right = cross(AXIS.up, forward);
+    if(squaredLength(right) == 0.0f) {
+        // looking straight up or down
+        right = cross(AXIS.back, forward);
+    }
+    right = normalizeVec3(right);
+    const float half_height = tanf(vertical_fov * (float)M_PI / 360.0f);
+    return (Camera) {
+        .position = position,
+        .right = right,
+        .up = cross(forward, right),
+        .forward = forward,
+        .half_width = half_height * (float)width / (float)height,
+        .half_height = half_height
+    };
+}
+
+// Ray through the top left corner of pixel x, y of an image with width * height pixels
+Ray getCameraRay(const Camera* camera, unsigned int x, unsigned int y, unsigned int width, unsigned int height) {
+    const float plane_x = (-1.0f + (float)(x) / (float)(width) * 2.0f) * camera->half_width;
+    const float plane_y = (1.0f - (float)(y) / (float)(height) * 2.0f) * camera->half_height;
+    return (Ray) {
+        .origin = camera->position,
+        .dir = normalizeVec3(addVec3(camera->forward, addVec3(multVec3Scalar(camera->right, plane_x), multVec3Scalar(camera->up, plane_y))))
+    };
+}
+
+#endif // CAMERA_H
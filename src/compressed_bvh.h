@@ -0,0 +1,438 @@
+#ifndef COMPRESSED_BVH_H
+#define COMPRESSED_BVH_H
+
+#include <assert.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vec3.h"
+#include "triangle.h"
+#include "ray.h"
+#include "simd.h"
+#include "bvh.h"
+#include "platform.h"
+
+// Compact storage for scenes which don't fit into memory with TriangleVertices, TrianglePrecomputed
+// and a binary BVH of 32 byte nodes. Triangles index shared vertices, and the BVH is collapsed to
+// 4 children per node whose boxes are stored as 8 bit offsets from the node origin in steps of a
+// power of two per axis, so a node fills exactly one cache line. Quantized boxes are rounded
+// outwards and only ever grow, traversal can't miss a triangle because of them.
+// Leaves are decompressed into a small buffer on the stack and tested with the SIMD kernel.
+
+#define COMPRESSED_BVH_WIDTH 4
+#define COMPRESSED_BVH_NODE_ALIGNMENT 64
+// every level pushes at most all but one of its children
+#define COMPRESSED_BVH_STACK_SIZE (BVH_MAX_DEPTH * (COMPRESSED_BVH_WIDTH - 1))
+// triangles decompressed per kernel call
+#define COMPRESSED_BVH_LEAF_BATCH 32
+
+// Triangles as three indices into shared vertices, in the leaf order of the BVH they came with
+typedef struct IndexedTriangles {
+    Vec3* vertices;
+    unsigned int vertex_count;
+    uint32_t* indices;
+    unsigned int triangle_count;
+} IndexedTriangles;
+
+typedef struct CompressedBvhNode {
+    // lower corner of the node, child boxes are origin + q * 2^exponent
+    float origin[3];
+    int8_t exponent[3];
+    uint8_t child_count;
+    uint8_t min_x[COMPRESSED_BVH_WIDTH];
+    uint8_t min_y[COMPRESSED_BVH_WIDTH];
+    uint8_t min_z[COMPRESSED_BVH_WIDTH];
+    uint8_t max_x[COMPRESSED_BVH_WIDTH];
+    uint8_t max_y[COMPRESSED_BVH_WIDTH];
+    uint8_t max_z[COMPRESSED_BVH_WIDTH];
+    // Inner child: index of its node
+    // Leaf child: index of its first triangle
+    uint32_t child[COMPRESSED_BVH_WIDTH];
+    // Number of triangles for leaf children, 0 for inner children
+    uint16_t leaf_count[COMPRESSED_BVH_WIDTH];
+} CompressedBvhNode;
+
+typedef struct CompressedBvh {
+    CompressedBvhNode* nodes;
+    unsigned int node_count;
+    // bounds of the root node, which aren't quantized
+    Aabb bounds;
+} CompressedBvh;
+
+typedef struct CompressedBvhStackEntry {
+    unsigned int child;
+    // triangles of a leaf, 0 for a node
+    unsigned int leaf_count;
+    float distance;
+} CompressedBvhStackEntry;
+
+IndexedTriangles createIndexedTriangles() {
+    return (IndexedTriangles) {
+        .vertices = NULL,
+        .vertex_count = 0,
+        .indices = NULL,
+        .triangle_count = 0
+    };
+}
+
+void freeIndexedTriangles(IndexedTriangles* triangles) {
+    free(triangles->vertices);
+    free(triangles->indices);
+    *triangles = createIndexedTriangles();
+}
+
+uint32_t hashVertex(Vec3 vertex) {
+    uint32_t bits[3];
+    memcpy(bits, &vertex, sizeof(bits));
+    uint32_t hash = 2166136261u;
+    for(unsigned int i = 0; i < 3; i++) {
+        hash = (hash ^ bits[i]) * 16777619u;
+    }
+    return hash ^ (hash >> 15);
+}
+
+// Merges vertices with identical coordinates, meshes share every vertex between about six triangles
+void buildIndexedTriangles(IndexedTriangles* triangles, const TriangleVertices* vertices, unsigned int triangle_count) {
+    *triangles = createIndexedTriangles();
+    if(triangle_count == 0) {
+        return;
+    }
+    const size_t corner_count = (size_t)triangle_count * 3;
+    size_t table_size = 1;
+    while(table_size < corner_count * 2) {
+        table_size *= 2;
+    }
+    // vertex index + 1, 0 for empty slots
+    uint32_t* table = calloc(table_size, sizeof(uint32_t));
+    Vec3* unique = malloc(sizeof(Vec3) * corner_count);
+    triangles->indices = malloc(sizeof(uint32_t) * corner_count);
+    assert(table && unique && triangles->indices);
+
+    unsigned int vertex_count = 0;
+    for(size_t i = 0; i < corner_count; i++) {
+        const Vec3 vertex = vertices[i / 3].v[i % 3];
+        size_t slot = hashVertex(vertex) & (table_size - 1);
+        while(table[slot] != 0 && memcmp(&unique[table[slot] - 1], &vertex, sizeof(Vec3)) != 0) {
+            slot = (slot + 1) & (table_size - 1);
+        }
+        if(table[slot] == 0) {
+            unique[vertex_count++] = vertex;
+            table[slot] = vertex_count;
+        }
+        triangles->indices[i] = table[slot] - 1;
+    }
+    free(table);
+    triangles->vertices = realloc(unique, sizeof(Vec3) * vertex_count);
+    assert(triangles->vertices);
+    triangles->vertex_count = vertex_count;
+    triangles->triangle_count = triangle_count;
+}
+
+// Shading frame of an indexed triangle, the same as precomputeTriangles derives
+Frame getIndexedTriangleFrame(const IndexedTriangles* triangles, unsigned int index) {
+    const uint32_t* indices = &triangles->indices[(size_t)index * 3];
+    const Vec3 v1 = triangles->vertices[indices[0]];
+    const Vec3 normal = cross(subVec3(triangles->vertices[indices[1]], v1), subVec3(triangles->vertices[indices[2]], v1));
+    return createFrame(squaredLength(normal) > 0.0f ? normalizeVec3(normal) : AXIS.forward);
+}
+
+// 2^exponent, built from the bits so traversal doesn't call ldexpf
+static inline float getCompressedScale(int8_t exponent) {
+    const uint32_t bits = (uint32_t)(exponent + 127) << 23;
+    float scale;
+    memcpy(&scale, &bits, sizeof(float));
+    return scale;
+}
+
+static inline float decodeCompressedCoordinate(float origin, float scale, uint8_t q) {
+    return origin + (float)q * scale;
+}
+
+// Smallest step so that 255 steps from origin reach max
+int8_t getCompressedExponent(float origin, float max) {
+    int exponent = -126;
+    if(max > origin) {
+        frexpf((max - origin) / 255.0f, &exponent);
+        exponent = exponent < -126 ? -126 : exponent;
+    }
+    while(exponent < 127 && decodeCompressedCoordinate(origin, getCompressedScale((int8_t)exponent), 255) < max) {
+        exponent++;
+    }
+    return (int8_t)exponent;
+}
+
+// Steps of the quantized child bounds, rounded outwards until the decoded box contains the child
+void quantizeChildBounds(float origin, int8_t exponent, float min, float max, uint8_t* q_min, uint8_t* q_max) {
+    const float scale = getCompressedScale(exponent);
+    float low = floorf((min - origin) / scale);
+    float high = ceilf((max - origin) / scale);
+    int qmin = low < 0.0f ? 0 : low > 255.0f ? 255 : (int)low;
+    int qmax = high < 0.0f ? 0 : high > 255.0f ? 255 : (int)high;
+    while(qmin > 0 && decodeCompressedCoordinate(origin, scale, (uint8_t)qmin) > min) {
+        qmin--;
+    }
+    while(qmax < 255 && decodeCompressedCoordinate(origin, scale, (uint8_t)qmax) < max) {
+        qmax++;
+    }
+    *q_min = (uint8_t)qmin;
+    *q_max = (uint8_t)qmax;
+}
+
+// Fills node node_index from the subtree of the binary node, collapsing it to up to 4 children
+// by repeatedly opening the inner child with the largest surface area
+void collapseBvhNode(CompressedBvh* compressed, const Bvh* bvh, unsigned int binary_index, unsigned int node_index) {
+    const BvhNode* binary = bvh->nodes;
+    unsigned int children[COMPRESSED_BVH_WIDTH];
+    unsigned int child_count = 0;
+    if(binary[binary_index].count > 0) {
+        children[child_count++] = binary_index;
+    }
+    else {
+        children[child_count++] = binary[binary_index].first;
+        children[child_count++] = binary[binary_index].first + 1;
+    }
+    while(child_count < COMPRESSED_BVH_WIDTH) {
+        int largest = -1;
+        float largest_area = -1.0f;
+        for(unsigned int i = 0; i < child_count; i++) {
+            const float area = aabbSurfaceArea(binary[children[i]].bounds);
+            if(binary[children[i]].count == 0 && area > largest_area) {
+                largest = (int)i;
+                largest_area = area;
+            }
+        }
+        if(largest < 0) {
+            break;
+        }
+        const unsigned int opened = children[largest];
+        children[largest] = binary[opened].first;
+        children[child_count++] = binary[opened].first + 1;
+    }
+
+    Aabb bounds = emptyAabb();
+    for(unsigned int i = 0; i < child_count; i++) {
+        bounds = mergeAabb(bounds, binary[children[i]].bounds);
+    }
+    CompressedBvhNode node;
+    memset(&node, 0, sizeof(node));
+    node.child_count = (uint8_t)child_count;
+    uint8_t* q_min[3] = {node.min_x, node.min_y, node.min_z};
+    uint8_t* q_max[3] = {node.max_x, node.max_y, node.max_z};
+    for(unsigned int axis = 0; axis < 3; axis++) {
+        node.origin[axis] = bounds.min.v[axis];
+        node.exponent[axis] = getCompressedExponent(bounds.min.v[axis], bounds.max.v[axis]);
+        for(unsigned int i = 0; i < child_count; i++) {
+            const Aabb* child_bounds = &binary[children[i]].bounds;
+            quantizeChildBounds(node.origin[axis], node.exponent[axis], child_bounds->min.v[axis], child_bounds->max.v[axis], &q_min[axis][i], &q_max[axis][i]);
+        }
+    }
+    // children get their node indices before recursing, so every subtree is contiguous
+    for(unsigned int i = 0; i < child_count; i++) {
+        const BvhNode* child = &binary[children[i]];
+        if(child->count > 0) {
+            assert(child->count <= UINT16_MAX);
+            node.child[i] = child->first;
+            node.leaf_count[i] = (uint16_t)child->count;
+        }
+        else {
+            node.child[i] = compressed->node_count++;
+        }
+    }
+    compressed->nodes[node_index] = node;
+    for(unsigned int i = 0; i < child_count; i++) {
+        if(node.leaf_count[i] == 0) {
+            collapseBvhNode(compressed, bvh, children[i], node.child[i]);
+        }
+    }
+}
+
+void freeCompressedBvh(CompressedBvh* bvh) {
+    alignedFree(bvh->nodes);
+    bvh->nodes = NULL;
+    bvh->node_count = 0;
+}
+
+// Builds a compressed BVH with the same leaves as the given binary BVH, so the triangles keep their order
+void buildCompressedBvh(CompressedBvh* compressed, const Bvh* bvh) {
+    compressed->nodes = NULL;
+    compressed->node_count = 0;
+    compressed->bounds = emptyAabb();
+    if(bvh->node_count == 0) {
+        return;
+    }
+    // every compressed node consumes at least one binary node
+    compressed->nodes = alignedAlloc(sizeof(CompressedBvhNode) * bvh->node_count, COMPRESSED_BVH_NODE_ALIGNMENT);
+    assert(compressed->nodes);
+    compressed->node_count = 1;
+    compressed->bounds = bvh->nodes[0].bounds;
+    collapseBvhNode(compressed, bvh, 0, 0);
+}
+
+// Enter distances of the children of a node, BVH_MISS for children which aren't hit
+static inline void intersectCompressedChildren(const CompressedBvhNode* node, Vec3 origin, Vec3 inv_dir, float max_distance, float* distances) {
+    const uint8_t* q_min[3] = {node->min_x, node->min_y, node->min_z};
+    const uint8_t* q_max[3] = {node->max_x, node->max_y, node->max_z};
+    float t_near[COMPRESSED_BVH_WIDTH];
+    float t_far[COMPRESSED_BVH_WIDTH];
+    for(unsigned int i = 0; i < COMPRESSED_BVH_WIDTH; i++) {
+        t_near[i] = 0.0f;
+        t_far[i] = max_distance;
+    }
+    for(unsigned int axis = 0; axis < 3; axis++) {
+        const float scale = getCompressedScale(node->exponent[axis]);
+        for(unsigned int i = 0; i < COMPRESSED_BVH_WIDTH; i++) {
+            float t1 = (decodeCompressedCoordinate(node->origin[axis], scale, q_min[axis][i]) - origin.v[axis]) * inv_dir.v[axis];
+            float t2 = (decodeCompressedCoordinate(node->origin[axis], scale, q_max[axis][i]) - origin.v[axis]) * inv_dir.v[axis];
+            const float low = t1 < t2 ? t1 : t2;
+            const float high = t1 < t2 ? t2 : t1;
+            t_near[i] = low > t_near[i] ? low : t_near[i];
+            t_far[i] = high < t_far[i] ? high : t_far[i];
+        }
+    }
+    for(unsigned int i = 0; i < COMPRESSED_BVH_WIDTH; i++) {
+        distances[i] = i < node->child_count && t_near[i] <= t_far[i] ? t_near[i] : BVH_MISS;
+    }
+}
+
+// Decompresses the triangles [first, first + count) in batches and tests them with the SIMD kernel,
+// returns the index of the closest hit triangle + 1 or 0 like the kernel.
+// Not inlined, the traversal loops get about 10% slower with the buffer in their frame.
+__attribute__((noinline))
+unsigned int intersectIndexedTriangles(const IndexedTriangles* triangles, unsigned int first, unsigned int count,
+    const Ray* ray, float best_distance, TriangleIntersection* result) {
+    float data[9][COMPRESSED_BVH_LEAF_BATCH + SIMD_MAX_WIDTH];
+    const TrianglePrecomputed batch = {
+        .v1 = {data[0], data[1], data[2]},
+        .edge12 = {data[3], data[4], data[5]},
+        .edge13 = {data[6], data[7], data[8]}
+    };
+    unsigned int hit = 0;
+    for(unsigned int start = first; start < first + count; start += COMPRESSED_BVH_LEAF_BATCH) {
+        const unsigned int batch_count = first + count - start < COMPRESSED_BVH_LEAF_BATCH ? first + count - start : COMPRESSED_BVH_LEAF_BATCH;
+        for(unsigned int i = 0; i < batch_count; i++) {
+            const uint32_t* indices = &triangles->indices[(size_t)(start + i) * 3];
+            const Vec3 v1 = triangles->vertices[indices[0]];
+            // the same operations as precomputeTriangles, so hits match the uncompressed scene
+            const Vec3 edge12 = subVec3(triangles->vertices[indices[1]], v1);
+            const Vec3 edge13 = subVec3(triangles->vertices[indices[2]], v1);
+            for(unsigned int axis = 0; axis < 3; axis++) {
+                data[axis][i] = v1.v[axis];
+                data[3 + axis][i] = edge12.v[axis];
+                data[6 + axis][i] = edge13.v[axis];
+            }
+        }
+        // kernels read full batches, the padding is zeroed like in precomputeTriangles
+        const unsigned int padded = (batch_count + SIMD_MAX_WIDTH - 1) / SIMD_MAX_WIDTH * SIMD_MAX_WIDTH;
+        for(unsigned int k = 0; k < 9; k++) {
+            for(unsigned int i = batch_count; i < padded; i++) {
+                data[k][i] = 0.0f;
+            }
+        }
+        const unsigned int batch_hit = intersectTriangles(&batch, 0, batch_count, ray, best_distance, result);
+        if(batch_hit) {
+            hit = start + batch_hit;
+            best_distance = result->distance;
+        }
+    }
+    return hit;
+}
+
+// Closest hit traversal like intersectBvh, children are visited front to back
+void intersectCompressedBvh(const CompressedBvh* bvh, const IndexedTriangles* triangles, Ray ray, TriangleHit* best_hit) {
+    const Vec3 inv_dir = {
+        .x = 1.0f / ray.dir.x,
+        .y = 1.0f / ray.dir.y,
+        .z = 1.0f / ray.dir.z
+    };
+    if(intersectAabb(&bvh->bounds, ray.origin, inv_dir, best_hit->intersection.distance) == BVH_MISS) {
+        return;
+    }
+
+    CompressedBvhStackEntry stack[COMPRESSED_BVH_STACK_SIZE];
+    unsigned int stack_size = 0;
+    CompressedBvhStackEntry entry = { .child = 0, .leaf_count = 0, .distance = 0.0f };
+    while(1) {
+        if(entry.leaf_count > 0) {
+            const unsigned int hit = intersectIndexedTriangles(triangles, entry.child, entry.leaf_count, &ray, best_hit->intersection.distance, &best_hit->intersection);
+            if(hit) {
+                best_hit->handle = hit;
+            }
+        }
+        else {
+            const CompressedBvhNode* node = &bvh->nodes[entry.child];
+            float distances[COMPRESSED_BVH_WIDTH];
+            intersectCompressedChildren(node, ray.origin, inv_dir, best_hit->intersection.distance, distances);
+            // hit children sorted far to near, the nearest is visited next and the others pushed
+            CompressedBvhStackEntry hits[COMPRESSED_BVH_WIDTH];
+            unsigned int hit_count = 0;
+            for(unsigned int i = 0; i < node->child_count; i++) {
+                if(distances[i] == BVH_MISS) {
+                    continue;
+                }
+                unsigned int k = hit_count++;
+                while(k > 0 && hits[k - 1].distance < distances[i]) {
+                    hits[k] = hits[k - 1];
+                    k--;
+                }
+                hits[k] = (CompressedBvhStackEntry){ .child = node->child[i], .leaf_count = node->leaf_count[i], .distance = distances[i] };
+            }
+            if(hit_count > 0) {
+                for(unsigned int i = 0; i + 1 < hit_count; i++) {
+                    stack[stack_size++] = hits[i];
+                }
+                entry = hits[hit_count - 1];
+                continue;
+            }
+        }
+
+        do {
+            if(stack_size == 0) {
+                return;
+            }
+            stack_size--;
+        } while(stack[stack_size].distance >= best_hit->intersection.distance);
+        entry = stack[stack_size];
+    }
+}
+
+// Any-hit query like occludedBvh, returns 1 as soon as some triangle is closer than max_distance
+int occludedCompressedBvh(const CompressedBvh* bvh, const IndexedTriangles* triangles, Ray ray, float max_distance) {
+    const Vec3 inv_dir = {
+        .x = 1.0f / ray.dir.x,
+        .y = 1.0f / ray.dir.y,
+        .z = 1.0f / ray.dir.z
+    };
+    if(intersectAabb(&bvh->bounds, ray.origin, inv_dir, max_distance) == BVH_MISS) {
+        return 0;
+    }
+
+    CompressedBvhStackEntry stack[COMPRESSED_BVH_STACK_SIZE];
+    unsigned int stack_size = 0;
+    CompressedBvhStackEntry entry = { .child = 0, .leaf_count = 0, .distance = 0.0f };
+    while(1) {
+        if(entry.leaf_count > 0) {
+            TriangleIntersection intersection;
+            if(intersectIndexedTriangles(triangles, entry.child, entry.leaf_count, &ray, max_distance, &intersection)) {
+                return 1;
+            }
+        }
+        else {
+            const CompressedBvhNode* node = &bvh->nodes[entry.child];
+            float distances[COMPRESSED_BVH_WIDTH];
+            intersectCompressedChildren(node, ray.origin, inv_dir, max_distance, distances);
+            for(unsigned int i = 0; i < node->child_count; i++) {
+                if(distances[i] != BVH_MISS) {
+                    stack[stack_size++] = (CompressedBvhStackEntry){ .child = node->child[i], .leaf_count = node->leaf_count[i], .distance = distances[i] };
+                }
+            }
+        }
+        if(stack_size == 0) {
+            return 0;
+        }
+        entry = stack[--stack_size];
+    }
+}
+
+#endif // COMPRESSED_BVH_H
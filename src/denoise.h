@@ -0,0 +1,276 @@
+#ifndef DENOISE_H
+#define DENOISE_H
+
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+
+#include "vec3.h"
+#include "ray.h"
+#include "color.h"
+#include "scene.h"
+#include "accumulator.h"
+#include "image_writer.h"
+#include "render.h"
+#include "stats.h"
+
+// Edge-avoiding a-trous wavelet filter (Dammertz et al. 2010) on the mean radiance of the
+// accumulator. Every iteration is a 5x5 B3 spline kernel whose taps are spread 2^i pixels
+// apart, so a few iterations cover a large footprint. Taps only count as much as they agree
+// with the center pixel in
+// - normal of the first hit,
+// - distance from the plane of the first hit, which is reconstructed from depth and
+//   doesn't change along slanted surfaces,
+// - luminance, relative to its standard error, which is filtered along (as in SVGF).
+// Radiance is divided by the first hit albedo before filtering and multiplied after it,
+// so the filter doesn't blur material edges.
+
+#define DENOISE_NORMAL_POWER 64.0f
+// tolerated distance from the plane of the center hit, relative to its depth
+#define DENOISE_PLANE_SIGMA 0.02f
+// tolerated luminance difference in standard errors
+#define DENOISE_LUMINANCE_SIGMA 4.0f
+#define DENOISE_MIN_ALBEDO 0.01f
+
+// First hit of the camera ray through each pixel
+typedef struct FeatureBuffers {
+    unsigned int width, height;
+    // diffuse color, the background color for misses
+    Color3f* albedo;
+    // shading normal facing the camera, zero for misses
+    Vec3* normal;
+    // distance along the camera ray, zero for misses
+    float* depth;
+    Vec3* position;
+} FeatureBuffers;
+
+FeatureBuffers createFeatureBuffers(unsigned int width, unsigned int height) {
+    const size_t count = (size_t)width * height;
+    FeatureBuffers features = {
+        .width = width,
+        .height = height,
+        .albedo = malloc(sizeof(Color3f) * count),
+        .normal = malloc(sizeof(Vec3) * count),
+        .depth = malloc(sizeof(float) * count),
+        .position = malloc(sizeof(Vec3) * count)
+    };
+    assert(features.albedo && features.normal && features.depth && features.position);
+    return features;
+}
+
+void freeFeatureBuffers(FeatureBuffers* features) {
+    free(features->albedo);
+    free(features->normal);
+    free(features->depth);
+    free(features->position);
+    features->albedo = NULL;
+    features->normal = NULL;
+    features->depth = NULL;
+    features->position = NULL;
+}
+
+// Traces the camera rays of all pixels, whose top left one is origin_x, origin_y of the image
+void renderFeatures(Scene* scene, const RenderSettings* settings, FeatureBuffers* features, unsigned int origin_x, unsigned int origin_y) {
+    const unsigned int columns = (features->width + PACKET_WIDTH - 1) / PACKET_WIDTH;
+    const unsigned int rows = (features->height + PACKET_WIDTH - 1) / PACKET_WIDTH;
+    #pragma omp parallel for schedule(dynamic, 4)
+    for(int block = 0; block < (int)(columns * rows); block++) {
+        const unsigned int block_x = (unsigned int)block % columns * PACKET_WIDTH;
+        const unsigned int block_y = (unsigned int)block / columns * PACKET_WIDTH;
+        PixelSamples pixels[PACKET_MAX_RAYS];
+        unsigned int count = 0;
+        for(unsigned int y = block_y; y < block_y + PACKET_WIDTH && y < features->height; y++) {
+            for(unsigned int x = block_x; x < block_x + PACKET_WIDTH && x < features->width; x++) {
+                pixels[count++] = (PixelSamples){origin_x + x, origin_y + y, 0, 1};
+            }
+        }
+        Ray rays[PACKET_MAX_RAYS];
+        TriangleHit hits[PACKET_MAX_RAYS];
+        tracePrimaryRays(scene, settings, pixels, count, rays, hits);
+        unsigned int hit_count = 0;
+        for(unsigned int i = 0; i < count; i++) {
+            const size_t index = (pixels[i].x - origin_x) + (size_t)(pixels[i].y - origin_y) * features->width;
+            if(hits[i].handle == 0) {
+                features->albedo[index] = BACKGROUND_COLOR;
+                features->normal[index] = (Vec3){{0.0f, 0.0f, 0.0f}};
+                features->depth[index] = 0.0f;
+                features->position[index] = (Vec3){{0.0f, 0.0f, 0.0f}};
+                continue;
+            }
+            hit_count++;
+            features->albedo[index] = getMaterialPointer(scene, getHitMaterialHandle(scene, hits[i].instance, hits[i].handle))->diffuse;
+            features->normal[index] = hits[i].frame.normal;
+            features->depth[index] = hits[i].intersection.distance;
+            features->position[index] = hits[i].intersection.world_pos;
+        }
+        #if STATS
+        ThreadStats* local_stats = getThreadStats();
+        local_stats->stats.feature_rays.count += count;
+        local_stats->stats.feature_rays.hits += hit_count;
+        #endif
+    }
+}
+
+float getLuminance(Color3f color) {
+    return 0.2126f * color.r + 0.7152f * color.g + 0.0722f * color.b;
+}
+
+// Variance of the luminance of the pixel mean, channels are taken as independent
+float getPixelLuminanceVariance(const AccumulatorPixel* pixel) {
+    if(pixel->samples < 2) {
+        return 0.0f;
+    }
+    const double samples = (double)pixel->samples;
+    const double sums[3] = {pixel->r, pixel->g, pixel->b};
+    const double sums_sq[3] = {pixel->r_sq, pixel->g_sq, pixel->b_sq};
+    const double weights[3] = {0.2126, 0.7152, 0.0722};
+    double variance = 0.0;
+    for(unsigned int c = 0; c < 3; c++) {
+        const double mean = sums[c] / samples;
+        const double channel_variance = fmax(0.0, (sums_sq[c] / samples - mean * mean) * samples / (samples - 1.0)) / samples;
+        variance += weights[c] * weights[c] * channel_variance;
+    }
+    return (float)variance;
+}
+
+// One a-trous iteration with taps step pixels apart, from colors and variances into the out buffers
+void filterAtrous(const FeatureBuffers* features, const Color3f* colors, const float* variances, unsigned int step,
+    Color3f* out_colors, float* out_variances) {
+    const float kernel[5] = {1.0f / 16.0f, 1.0f / 4.0f, 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f};
+    const int width = (int)features->width;
+    const int height = (int)features->height;
+    #pragma omp parallel for schedule(dynamic, 4)
+    for(int y = 0; y < height; y++) {
+        for(int x = 0; x < width; x++) {
+            const size_t index = (size_t)x + (size_t)y * (size_t)width;
+            const Vec3 normal = features->normal[index];
+            if(features->depth[index] == 0.0f) {
+                // the background is noise free
+                out_colors[index] = colors[index];
+                out_variances[index] = variances[index];
+                continue;
+            }
+            // the variance of a single pixel is too noisy to steer the filter, so it is blurred by a 3x3 gaussian
+            float variance = 0.0f;
+            float variance_weight = 0.0f;
+            for(int dy = -1; dy <= 1; dy++) {
+                for(int dx = -1; dx <= 1; dx++) {
+                    const int nx = x + dx, ny = y + dy;
+                    if(nx < 0 || ny < 0 || nx >= width || ny >= height) {
+                        continue;
+                    }
+                    const float weight = (dx == 0 ? 0.5f : 0.25f) * (dy == 0 ? 0.5f : 0.25f);
+                    variance += weight * variances[(size_t)nx + (size_t)ny * (size_t)width];
+                    variance_weight += weight;
+                }
+            }
+            const float luminance_scale = 1.0f / (DENOISE_LUMINANCE_SIGMA * sqrtf(variance / variance_weight) + 1e-6f);
+            const float luminance = getLuminance(colors[index]);
+            const Vec3 position = features->position[index];
+            const float plane_scale = 1.0f / (DENOISE_PLANE_SIGMA * features->depth[index]);
+
+            Color3f color_sum = {0.0f, 0.0f, 0.0f};
+            float variance_sum = 0.0f;
+            float weight_sum = 0.0f;
+            for(int ky = 0; ky < 5; ky++) {
+                const int ny = y + (ky - 2) * (int)step;
+                if(ny < 0 || ny >= height) {
+                    continue;
+                }
+                for(int kx = 0; kx < 5; kx++) {
+                    const int nx = x + (kx - 2) * (int)step;
+                    if(nx < 0 || nx >= width) {
+                        continue;
+                    }
+                    const size_t neighbour = (size_t)nx + (size_t)ny * (size_t)width;
+                    const float cos_normal = dot(normal, features->normal[neighbour]);
+                    if(features->depth[neighbour] == 0.0f || cos_normal <= 0.0f) {
+                        continue;
+                    }
+                    const float plane_distance = fabsf(dot(normal, subVec3(features->position[neighbour], position)));
+                    const float luminance_distance = fabsf(getLuminance(colors[neighbour]) - luminance);
+                    const float weight = kernel[kx] * kernel[ky] * powf(cos_normal, DENOISE_NORMAL_POWER)
+                        * expf(-plane_distance * plane_scale - luminance_distance * luminance_scale);
+                    color_sum = addColor3f(color_sum, multColor3fScalar(colors[neighbour], weight));
+                    variance_sum += weight * weight * variances[neighbour];
+                    weight_sum += weight;
+                }
+            }
+            // the center tap always has a weight
+            out_colors[index] = multColor3fScalar(color_sum, 1.0f / weight_sum);
+            out_variances[index] = variance_sum / (weight_sum * weight_sum);
+        }
+    }
+}
+
+// Filters the mean radiance of the accumulator with the given number of a-trous iterations into out
+void denoiseImage(const Accumulator* accumulator, const FeatureBuffers* features, unsigned int iterations, Color3f* out) {
+    assert(accumulator->width == features->width && accumulator->height == features->height);
+    const size_t count = (size_t)features->width * features->height;
+    Color3f* colors[2] = {out, malloc(sizeof(Color3f) * count)};
+    float* variances[2] = {malloc(sizeof(float) * count), malloc(sizeof(float) * count)};
+    assert(colors[1] && variances[0] && variances[1]);
+
+    // filter the illumination without the albedo
+    #pragma omp parallel for
+    for(long long i = 0; i < (long long)count; i++) {
+        const AccumulatorPixel* pixel = &accumulator->pixels[i];
+        Color3f color = getAccumulatorPixelMean(pixel);
+        float variance = getPixelLuminanceVariance(pixel);
+        if(features->depth[i] > 0.0f) {
+            const Color3f albedo = features->albedo[i];
+            color.r /= fmaxf(albedo.r, DENOISE_MIN_ALBEDO);
+            color.g /= fmaxf(albedo.g, DENOISE_MIN_ALBEDO);
+            color.b /= fmaxf(albedo.b, DENOISE_MIN_ALBEDO);
+            const float albedo_luminance = fmaxf(getLuminance(albedo), DENOISE_MIN_ALBEDO);
+            variance /= albedo_luminance * albedo_luminance;
+        }
+        colors[0][i] = color;
+        variances[0][i] = variance;
+    }
+
+    unsigned int current = 0;
+    for(unsigned int i = 0; i < iterations; i++) {
+        filterAtrous(features, colors[current], variances[current], 1u << i, colors[1 - current], variances[1 - current]);
+        current = 1 - current;
+    }
+
+    #pragma omp parallel for
+    for(long long i = 0; i < (long long)count; i++) {
+        Color3f color = colors[current][i];
+        if(features->depth[i] > 0.0f) {
+            const Color3f albedo = features->albedo[i];
+            color.r *= fmaxf(albedo.r, DENOISE_MIN_ALBEDO);
+            color.g *= fmaxf(albedo.g, DENOISE_MIN_ALBEDO);
+            color.b *= fmaxf(albedo.b, DENOISE_MIN_ALBEDO);
+        }
+        out[i] = color;
+    }
+    free(colors[1]);
+    free(variances[0]);
+    free(variances[1]);
+}
+
+// Writes albedo, normal and depth as <prefix>_albedo.pfm, <prefix>_normal.pfm and <prefix>_depth.pfm
+int writeFeatureImages(const FeatureBuffers* features, const char* prefix) {
+    const size_t count = (size_t)features->width * features->height;
+    Color3f* colors = calloc(count, sizeof(Color3f));
+    assert(colors);
+    char path[1024];
+    snprintf(path, sizeof(path), "%s_albedo.pfm", prefix);
+    int valid = writeColorImage(path, IMAGE_FORMAT_PFM, features->albedo, features->width, features->height);
+    for(size_t i = 0; i < count; i++) {
+        colors[i] = (Color3f){{features->normal[i].x, features->normal[i].y, features->normal[i].z}};
+    }
+    snprintf(path, sizeof(path), "%s_normal.pfm", prefix);
+    valid &= writeColorImage(path, IMAGE_FORMAT_PFM, colors, features->width, features->height);
+    for(size_t i = 0; i < count; i++) {
+        colors[i] = (Color3f){{features->depth[i], features->depth[i], features->depth[i]}};
+    }
+    snprintf(path, sizeof(path), "%s_depth.pfm", prefix);
+    valid &= writeColorImage(path, IMAGE_FORMAT_PFM, colors, features->width, features->height);
+    free(colors);
+    return valid;
+}
+
+#endif // DENOISE_H
@@ -0,0 +1,471 @@
+#ifndef DISTRIBUTED_H
+#define DISTRIBUTED_H
+
+#include <assert.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <omp.h>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#include "accumulator.h"
+#include "image_writer.h"
+#include "platform.h"
+#include "render.h"
+#include "stats.h"
+#include "tiles.h"
+#include "wavefront.h"
+
+// The coordinator forks worker processes after the scene is built, so every worker has the
+// scene without loading it again. Each worker is connected by a socket pair and renders one
+// tile at a time with its own OpenMP threads. The coordinator merges the sums into the
+// accumulator, so the image is the same as rendered by a single process. Tiles of a worker
+// which dies or exceeds the timeout are handed to the remaining workers again.
+
+// tile index of the message which makes a worker send its statistics and exit
+#define DISTRIBUTED_QUIT UINT32_MAX
+
+// Sent to a worker, followed by a PixelJob for every pixel of the tile
+typedef struct TileJobHeader {
+    uint32_t tile_index;
+    uint32_t x, y;
+    uint32_t width, height;
+} TileJobHeader;
+
+typedef struct PixelJob {
+    uint32_t first_sample;
+    // 0 if the pixel isn't sampled in this pass
+    uint32_t sample_count;
+} PixelJob;
+
+// Sent back, followed by a SampleSum for every pixel of the tile
+typedef struct TileResultHeader {
+    uint32_t tile_index;
+    uint32_t padding;
+    double render_time;
+} TileResultHeader;
+
+typedef struct WorkerProcess {
+#ifndef _WIN32
+    pid_t pid;
+#endif
+    int socket;
+    int alive;
+    // tile the worker is rendering, -1 if idle
+    int64_t tile_index;
+    double job_start;
+    unsigned int tiles_done;
+    // seconds spent rendering tiles as reported by the worker
+    double busy_time;
+} WorkerProcess;
+
+typedef struct Cluster {
+    WorkerProcess* workers;
+    unsigned int worker_count;
+    unsigned int alive_count;
+    // seconds after which a tile counts as lost, 0 waits forever. It bounds a whole tile job,
+    // whose work grows with the samples of the pass, so it is off by default.
+    double timeout;
+    // tiles of the current pass which still have to be handed out
+    unsigned int* queue;
+    unsigned int queue_count;
+    PixelJob* jobs;
+    SampleSum* sums;
+    unsigned int tiles_retried;
+    // wall time of all distributed passes
+    double pass_time;
+} Cluster;
+
+#ifndef _WIN32
+// Returns 0 if the other side closed the socket or on errors
+int writeAll(int socket, const void* data, size_t size) {
+    const char* bytes = data;
+    while(size > 0) {
+        const ssize_t written = send(socket, bytes, size, MSG_NOSIGNAL);
+        if(written < 0 && errno == EINTR) {
+            continue;
+        }
+        if(written <= 0) {
+            return 0;
+        }
+        bytes += written;
+        size -= (size_t)written;
+    }
+    return 1;
+}
+
+int readAll(int socket, void* data, size_t size) {
+    char* bytes = data;
+    while(size > 0) {
+        const ssize_t received = recv(socket, bytes, size, 0);
+        if(received < 0 && errno == EINTR) {
+            continue;
+        }
+        if(received <= 0) {
+            return 0;
+        }
+        bytes += received;
+        size -= (size_t)received;
+    }
+    return 1;
+}
+
+// Main loop of a worker process, renders tiles until it is told to quit
+void runWorker(int socket, Scene* scene, const RenderSettings* settings, unsigned int max_tile_pixels, int wavefront) {
+    PixelJob* jobs = malloc(sizeof(PixelJob) * max_tile_pixels);
+    SampleSum* sums = malloc(sizeof(SampleSum) * max_tile_pixels);
+    PixelSamples* pixels = malloc(sizeof(PixelSamples) * max_tile_pixels);
+    unsigned int* pixel_indices = malloc(sizeof(unsigned int) * max_tile_pixels);
+    SampleSum* pixel_sums = malloc(sizeof(SampleSum) * max_tile_pixels);
+    assert(jobs && sums && pixels && pixel_indices && pixel_sums);
+    TileJobHeader header;
+    while(readAll(socket, &header, sizeof(header)) && header.tile_index != DISTRIBUTED_QUIT) {
+        const unsigned int pixel_count = header.width * header.height;
+        assert(pixel_count <= max_tile_pixels);
+        if(!readAll(socket, jobs, sizeof(PixelJob) * pixel_count)) {
+            break;
+        }
+        const double start = getWallTime();
+        // pixels without samples in this pass are left out and keep a zero sum
+        unsigned int sampled_count = 0;
+        for(unsigned int i = 0; i < pixel_count; i++) {
+            memset(&sums[i], 0, sizeof(SampleSum));
+            if(jobs[i].sample_count > 0) {
+                pixels[sampled_count] = (PixelSamples){header.x + i % header.width, header.y + i / header.width, jobs[i].first_sample, jobs[i].sample_count};
+                pixel_indices[sampled_count++] = i;
+            }
+        }
+        // threads take packets of neighbouring pixels, the wavefront mode traces each as one batch
+        const int packet_count = (int)((sampled_count + PACKET_MAX_RAYS - 1) / PACKET_MAX_RAYS);
+        #pragma omp parallel
+        {
+            PathStates paths;
+            if(wavefront) {
+                paths = createPathStates(WAVEFRONT_MAX_PATHS);
+            }
+            #pragma omp for schedule(dynamic, 1)
+            for(int packet = 0; packet < packet_count; packet++) {
+                const unsigned int first = (unsigned int)packet * PACKET_MAX_RAYS;
+                const unsigned int count = sampled_count - first < PACKET_MAX_RAYS ? sampled_count - first : PACKET_MAX_RAYS;
+                if(wavefront) {
+                    samplePixelsWavefront(scene, settings, &paths, pixels + first, count, pixel_sums + first);
+                }
+                else {
+                    samplePixels(scene, settings, pixels + first, count, pixel_sums + first);
+                }
+            }
+            if(wavefront) {
+                freePathStates(&paths);
+            }
+        }
+        for(unsigned int i = 0; i < sampled_count; i++) {
+            sums[pixel_indices[i]] = pixel_sums[i];
+        }
+        const TileResultHeader result = {
+            .tile_index = header.tile_index,
+            .render_time = getWallTime() - start
+        };
+        if(!writeAll(socket, &result, sizeof(result)) || !writeAll(socket, sums, sizeof(SampleSum) * pixel_count)) {
+            break;
+        }
+    }
+#if STATS
+    if(header.tile_index == DISTRIBUTED_QUIT) {
+        const Stats stats = mergeThreadStats();
+        writeAll(socket, &stats, sizeof(stats));
+    }
+#endif
+    free(jobs);
+    free(sums);
+    free(pixels);
+    free(pixel_indices);
+    free(pixel_sums);
+}
+#endif
+
+// Forks the workers, each uses threads_per_worker OpenMP threads and the wavefront mode if set. Returns 0 on failure.
+int startCluster(Cluster* cluster, unsigned int worker_count, unsigned int threads_per_worker, double timeout,
+    Scene* scene, const RenderSettings* settings, const TileSchedule* schedule, int wavefront) {
+#ifdef _WIN32
+    (void)cluster; (void)worker_count; (void)threads_per_worker; (void)timeout;
+    (void)scene; (void)settings; (void)schedule; (void)wavefront;
+    fprintf(stderr, "Worker processes are only supported on POSIX systems\n");
+    return 0;
+#else
+    const unsigned int max_tile_pixels = getMaxTilePixels(schedule);
+    *cluster = (Cluster) {
+        .workers = calloc(worker_count, sizeof(WorkerProcess)),
+        .worker_count = worker_count,
+        .alive_count = 0,
+        .timeout = timeout,
+        .queue = malloc(sizeof(unsigned int) * schedule->tile_count),
+        .queue_count = 0,
+        .jobs = malloc(sizeof(PixelJob) * max_tile_pixels),
+        .sums = malloc(sizeof(SampleSum) * max_tile_pixels),
+        .tiles_retried = 0,
+        .pass_time = 0.0
+    };
+    assert(cluster->workers && cluster->queue && cluster->jobs && cluster->sums);
+    // a dying worker must not kill the coordinator by SIGPIPE
+    signal(SIGPIPE, SIG_IGN);
+    // buffered output would be printed by every child again
+    fflush(stdout);
+    fflush(stderr);
+    for(unsigned int i = 0; i < worker_count; i++) {
+        int sockets[2];
+        if(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) != 0) {
+            fprintf(stderr, "Couldn't create a socket pair for worker %u\n", i);
+            return 0;
+        }
+        const pid_t pid = fork();
+        if(pid < 0) {
+            fprintf(stderr, "Couldn't fork worker %u\n", i);
+            close(sockets[0]);
+            close(sockets[1]);
+            return 0;
+        }
+        if(pid == 0) {
+            close(sockets[0]);
+            for(unsigned int k = 0; k < i; k++) {
+                close(cluster->workers[k].socket);
+            }
+            omp_set_num_threads((int)threads_per_worker);
+            // the inherited stats are sized for the threads of the coordinator
+            freeThreadStats();
+            initThreadStats(threads_per_worker);
+            runWorker(sockets[1], scene, settings, max_tile_pixels, wavefront);
+            close(sockets[1]);
+            // skip atexit handlers and buffers inherited from the coordinator
+            _exit(0);
+        }
+        close(sockets[1]);
+        cluster->workers[i] = (WorkerProcess) {
+            .pid = pid,
+            .socket = sockets[0],
+            .alive = 1,
+            .tile_index = -1
+        };
+        cluster->alive_count++;
+    }
+    return 1;
+#endif
+}
+
+#ifndef _WIN32
+// Kills the worker if needed and puts its tile back into the queue
+void loseWorker(Cluster* cluster, WorkerProcess* worker, const char* reason) {
+    fprintf(stderr, "Lost worker %d: %s\n", (int)worker->pid, reason);
+    kill(worker->pid, SIGKILL);
+    waitpid(worker->pid, NULL, 0);
+    close(worker->socket);
+    worker->alive = 0;
+    cluster->alive_count--;
+    if(worker->tile_index >= 0) {
+        cluster->queue[cluster->queue_count++] = (unsigned int)worker->tile_index;
+        cluster->tiles_retried++;
+        worker->tile_index = -1;
+    }
+}
+
+int sendTileJob(Cluster* cluster, WorkerProcess* worker, const TileSchedule* schedule, unsigned int tile_index,
+    const Accumulator* accumulator, unsigned int origin_x, unsigned int origin_y, const PassTarget* pass) {
+    const Tile tile = schedule->tiles[tile_index];
+    const TileJobHeader header = {
+        .tile_index = tile_index,
+        .x = tile.x,
+        .y = tile.y,
+        .width = tile.width,
+        .height = tile.height
+    };
+    for(unsigned int i = 0; i < tile.width * tile.height; i++) {
+        const unsigned int x = tile.x - origin_x + i % tile.width;
+        const unsigned int y = tile.y - origin_y + i / tile.width;
+        cluster->jobs[i] = (PixelJob) {
+            .first_sample = accumulator->pixels[x + y * accumulator->width].samples,
+            .sample_count = getPassSamples(accumulator, x, y, pass)
+        };
+    }
+    worker->tile_index = tile_index;
+    worker->job_start = getWallTime();
+    return writeAll(worker->socket, &header, sizeof(header)) && writeAll(worker->socket, cluster->jobs, sizeof(PixelJob) * tile.width * tile.height);
+}
+
+// Reads the result of the worker's tile into the accumulator, returns the pixel samples
+// or -1 if the worker is gone
+int64_t receiveTileResult(Cluster* cluster, WorkerProcess* worker, TileSchedule* schedule,
+    Accumulator* accumulator, unsigned int origin_x, unsigned int origin_y, const PassTarget* pass) {
+    TileResultHeader result;
+    const Tile tile = schedule->tiles[worker->tile_index];
+    if(!readAll(worker->socket, &result, sizeof(result)) || result.tile_index != worker->tile_index
+        || !readAll(worker->socket, cluster->sums, sizeof(SampleSum) * tile.width * tile.height)) {
+        return -1;
+    }
+    uint64_t pixel_samples = 0;
+    for(unsigned int i = 0; i < tile.width * tile.height; i++) {
+        const unsigned int x = tile.x - origin_x + i % tile.width;
+        const unsigned int y = tile.y - origin_y + i / tile.width;
+        const unsigned int samples = getPassSamples(accumulator, x, y, pass);
+        if(samples > 0) {
+            addAccumulatorSamples(getAccumulatorPixel(accumulator, x, y), cluster->sums[i], samples);
+            pixel_samples += samples;
+        }
+    }
+    schedule->tile_times[worker->tile_index] += result.render_time;
+    schedule->tile_threads[worker->tile_index] = (unsigned int)(worker - cluster->workers);
+    worker->busy_time += result.render_time;
+    worker->tiles_done++;
+    worker->tile_index = -1;
+    return (int64_t)pixel_samples;
+}
+#endif
+
+// Renders one pass of every tile of the schedule on the workers. Tiles are handed to the
+// writer once merged if it isn't NULL. Returns 0 if all workers were lost.
+int runDistributedPass(Cluster* cluster, TileSchedule* schedule, Accumulator* accumulator, unsigned int origin_x, unsigned int origin_y,
+    const PassTarget* pass, ImageWriter* writer, uint64_t* pass_pixel_samples, double start, uint64_t pixel_samples_total) {
+#ifdef _WIN32
+    (void)cluster; (void)schedule; (void)accumulator; (void)origin_x; (void)origin_y;
+    (void)pass; (void)writer; (void)pass_pixel_samples; (void)start; (void)pixel_samples_total;
+    return 0;
+#else
+    const double pass_start = getWallTime();
+    double report_timer_start = pass_start;
+    // the queue is taken from the back, so the tiles go out in schedule order
+    cluster->queue_count = schedule->tile_count;
+    for(unsigned int i = 0; i < schedule->tile_count; i++) {
+        cluster->queue[i] = schedule->tile_count - 1 - i;
+    }
+    unsigned int tiles_left = schedule->tile_count;
+    struct pollfd* polls = malloc(sizeof(struct pollfd) * cluster->worker_count);
+    unsigned int* poll_workers = malloc(sizeof(unsigned int) * cluster->worker_count);
+    assert(polls && poll_workers);
+    while(tiles_left > 0) {
+        for(unsigned int i = 0; i < cluster->worker_count; i++) {
+            WorkerProcess* worker = &cluster->workers[i];
+            if(worker->alive && worker->tile_index < 0 && cluster->queue_count > 0) {
+                const unsigned int tile_index = cluster->queue[--cluster->queue_count];
+                if(!sendTileJob(cluster, worker, schedule, tile_index, accumulator, origin_x, origin_y, pass)) {
+                    loseWorker(cluster, worker, "couldn't send tile");
+                }
+            }
+        }
+        if(cluster->alive_count == 0) {
+            fprintf(stderr, "All workers were lost\n");
+            free(polls);
+            free(poll_workers);
+            return 0;
+        }
+        nfds_t poll_count = 0;
+        // wake up at least every second for the report, and at the first deadline
+        double wait_time = 1.0;
+        const double poll_start = getWallTime();
+        for(unsigned int i = 0; i < cluster->worker_count; i++) {
+            if(cluster->workers[i].alive && cluster->workers[i].tile_index >= 0) {
+                polls[poll_count] = (struct pollfd) { .fd = cluster->workers[i].socket, .events = POLLIN };
+                poll_workers[poll_count++] = i;
+                if(cluster->timeout > 0.0) {
+                    const double deadline_wait = cluster->workers[i].job_start + cluster->timeout - poll_start;
+                    wait_time = deadline_wait < wait_time ? deadline_wait : wait_time;
+                }
+            }
+        }
+        const int wait_ms = wait_time > 0.0 ? (int)ceil(wait_time * 1000.0) : 0;
+        if(poll(polls, poll_count, wait_ms) < 0 && errno != EINTR) {
+            fprintf(stderr, "Waiting for the workers failed\n");
+            free(polls);
+            free(poll_workers);
+            return 0;
+        }
+        const double now = getWallTime();
+        for(nfds_t p = 0; p < poll_count; p++) {
+            WorkerProcess* worker = &cluster->workers[poll_workers[p]];
+            if(polls[p].revents & (POLLIN | POLLHUP | POLLERR)) {
+                const unsigned int tile_index = (unsigned int)worker->tile_index;
+                const int64_t pixel_samples = receiveTileResult(cluster, worker, schedule, accumulator, origin_x, origin_y, pass);
+                if(pixel_samples < 0) {
+                    loseWorker(cluster, worker, "connection closed");
+                    continue;
+                }
+                *pass_pixel_samples += (uint64_t)pixel_samples;
+                addPixelSamplesDone(&thread_stats[0].data, (uint64_t)pixel_samples);
+                if(writer) {
+                    finishImageTile(writer, &schedule->tiles[tile_index]);
+                }
+                tiles_left--;
+            }
+        }
+        // every busy worker, results of others keep poll from ever timing out
+        for(unsigned int i = 0; i < cluster->worker_count && cluster->timeout > 0.0; i++) {
+            WorkerProcess* worker = &cluster->workers[i];
+            if(worker->alive && worker->tile_index >= 0 && now - worker->job_start > cluster->timeout) {
+                loseWorker(cluster, worker, "tile timed out");
+            }
+        }
+        if(now - report_timer_start > 1.0) {
+            printProgress(now - start, pixel_samples_total);
+            report_timer_start = now;
+        }
+    }
+    free(polls);
+    free(poll_workers);
+    cluster->pass_time += getWallTime() - pass_start;
+    return 1;
+#endif
+}
+
+// Lets the workers exit and adds their statistics to the first thread, the per worker
+// numbers stay until freeCluster
+void stopCluster(Cluster* cluster) {
+#ifndef _WIN32
+    const TileJobHeader quit = { .tile_index = DISTRIBUTED_QUIT };
+    for(unsigned int i = 0; i < cluster->worker_count; i++) {
+        WorkerProcess* worker = &cluster->workers[i];
+        if(!worker->alive) {
+            continue;
+        }
+        if(writeAll(worker->socket, &quit, sizeof(quit))) {
+#if STATS
+            Stats stats;
+            if(readAll(worker->socket, &stats, sizeof(stats))) {
+                uint64_t* counters = (uint64_t*)&thread_stats[0].data.stats;
+                const uint64_t* worker_counters = (const uint64_t*)&stats;
+                for(unsigned int k = 0; k < sizeof(Stats) / sizeof(uint64_t); k++) {
+                    counters[k] += worker_counters[k];
+                }
+            }
+#endif
+        }
+        close(worker->socket);
+        waitpid(worker->pid, NULL, 0);
+    }
+#endif
+}
+
+void freeCluster(Cluster* cluster) {
+    free(cluster->workers);
+    free(cluster->queue);
+    free(cluster->jobs);
+    free(cluster->sums);
+}
+
+// Sum of the worker busy times relative to the wall time of the passes times the workers
+double getClusterEfficiency(const Cluster* cluster) {
+    double busy_time = 0.0;
+    for(unsigned int i = 0; i < cluster->worker_count; i++) {
+        busy_time += cluster->workers[i].busy_time;
+    }
+    return cluster->pass_time > 0.0 ? busy_time / (cluster->pass_time * (double)cluster->worker_count) : 0.0;
+}
+
+#endif // DISTRIBUTED_H
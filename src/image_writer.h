@@ -0,0 +1,392 @@
+#ifndef IMAGE_WRITER_H
+#define IMAGE_WRITER_H
+
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "accumulator.h"
+#include "color.h"
+#include "platform.h"
+#include "tiles.h"
+
+typedef enum ImageFormat {
+    // 8 bit RGB clamped to [0, 1]
+    IMAGE_FORMAT_PPM,
+    // 32 bit float RGB, rows from bottom to top
+    IMAGE_FORMAT_PFM,
+    // Radiance RGBE with run length encoded scanlines
+    IMAGE_FORMAT_HDR
+} ImageFormat;
+
+const char* getImageFormatExtension(ImageFormat format) {
+    const char* extensions[] = {"ppm", "pfm", "hdr"};
+    return extensions[format];
+}
+
+// Returns 0 if the name isn't a known format
+int parseImageFormat(const char* name, ImageFormat* format) {
+    for(unsigned int i = 0; i < 3; i++) {
+        if(strcmp(name, getImageFormatExtension((ImageFormat)i)) == 0) {
+            *format = (ImageFormat)i;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int writeImageHeader(FILE* file, ImageFormat format, unsigned int width, unsigned int height) {
+    if(format == IMAGE_FORMAT_PPM) {
+        return fprintf(file, "P6\n%u %u\n255\n", width, height) > 0;
+    }
+    if(format == IMAGE_FORMAT_PFM) {
+        // the sign of the scale tells the byte order of the floats
+        const uint16_t byte_order = 1;
+        const int little_endian = *(const unsigned char*)&byte_order == 1;
+        return fprintf(file, "PF\n%u %u\n%s\n", width, height, little_endian ? "-1.0" : "1.0") > 0;
+    }
+    return fprintf(file, "#?RADIANCE\nFORMAT=32-bit_rle_rgbe\n\n-Y %u +X %u\n", height, width) > 0;
+}
+
+// Upper bound of the encoded size of one row
+size_t getImageRowCapacity(ImageFormat format, unsigned int width) {
+    if(format == IMAGE_FORMAT_PPM) {
+        return (size_t)width * 3;
+    }
+    if(format == IMAGE_FORMAT_PFM) {
+        return (size_t)width * 3 * sizeof(float);
+    }
+    // scanline header and a count byte for each 128 literal bytes of the four channels
+    return 4 + 4 * ((size_t)width + width / 128 + 1);
+}
+
+// Run length encodes one channel of a scanline the way Radiance does, returns the byte count.
+// Runs of at least 4 equal bytes get a count above 128, everything else is copied in chunks of 128.
+size_t encodeHdrChannel(const unsigned char* values, unsigned int width, unsigned char* out) {
+    size_t size = 0;
+    unsigned int i = 0;
+    while(i < width) {
+        unsigned int run_start = i;
+        unsigned int run_count = 0;
+        unsigned int previous_run_count = 0;
+        while(run_count < 4 && run_start < width) {
+            run_start += run_count;
+            previous_run_count = run_count;
+            run_count = 1;
+            while(run_start + run_count < width && run_count < 127 && values[run_start] == values[run_start + run_count]) {
+                run_count++;
+            }
+        }
+        // a short run right before the long one is cheaper as run than as literals
+        if(previous_run_count > 1 && previous_run_count == run_start - i) {
+            out[size++] = (unsigned char)(128 + previous_run_count);
+            out[size++] = values[i];
+            i = run_start;
+        }
+        while(i < run_start) {
+            const unsigned int literal_count = run_start - i > 128 ? 128 : run_start - i;
+            out[size++] = (unsigned char)literal_count;
+            memcpy(out + size, values + i, literal_count);
+            size += literal_count;
+            i += literal_count;
+        }
+        if(run_count >= 4) {
+            out[size++] = (unsigned char)(128 + run_count);
+            out[size++] = values[run_start];
+            i += run_count;
+        }
+    }
+    return size;
+}
+
+// Shared exponent of the largest channel, the mantissas are 8 bit
+void getRgbe(Color3f color, unsigned char* rgbe) {
+    const float max_value = fmaxf(color.r, fmaxf(color.g, color.b));
+    if(!(max_value >= 1e-32f)) {
+        rgbe[0] = rgbe[1] = rgbe[2] = rgbe[3] = 0;
+        return;
+    }
+    int exponent;
+    const float scale = frexpf(max_value, &exponent) * 256.0f / max_value;
+    rgbe[0] = (unsigned char)(fmaxf(color.r, 0.0f) * scale);
+    rgbe[1] = (unsigned char)(fmaxf(color.g, 0.0f) * scale);
+    rgbe[2] = (unsigned char)(fmaxf(color.b, 0.0f) * scale);
+    rgbe[3] = (unsigned char)(exponent + 128);
+}
+
+// Encodes a row of radiance values into out, returns the byte count.
+// scratch needs 4 bytes per pixel for HDR rows.
+size_t encodeImageRow(ImageFormat format, const Color3f* colors, unsigned int width, unsigned char* out, unsigned char* scratch) {
+    if(format == IMAGE_FORMAT_PPM) {
+        for(unsigned int x = 0; x < width; x++) {
+            out[x * 3 + 0] = (unsigned char)(clamp(colors[x].r, 0.0f, 1.0f) * 255.0f);
+            out[x * 3 + 1] = (unsigned char)(clamp(colors[x].g, 0.0f, 1.0f) * 255.0f);
+            out[x * 3 + 2] = (unsigned char)(clamp(colors[x].b, 0.0f, 1.0f) * 255.0f);
+        }
+        return (size_t)width * 3;
+    }
+    if(format == IMAGE_FORMAT_PFM) {
+        float* values = (float*)out;
+        for(unsigned int x = 0; x < width; x++) {
+            values[x * 3 + 0] = colors[x].r;
+            values[x * 3 + 1] = colors[x].g;
+            values[x * 3 + 2] = colors[x].b;
+        }
+        return (size_t)width * 3 * sizeof(float);
+    }
+    // scanlines are only run length encoded between 8 and 32767 pixels
+    if(width < 8 || width > 0x7fff) {
+        for(unsigned int x = 0; x < width; x++) {
+            getRgbe(colors[x], out + x * 4);
+        }
+        return (size_t)width * 4;
+    }
+    // the channels are stored one after the other
+    for(unsigned int x = 0; x < width; x++) {
+        unsigned char rgbe[4];
+        getRgbe(colors[x], rgbe);
+        for(unsigned int c = 0; c < 4; c++) {
+            scratch[c * width + x] = rgbe[c];
+        }
+    }
+    const unsigned char header[4] = {2, 2, (unsigned char)(width >> 8), (unsigned char)(width & 0xff)};
+    memcpy(out, header, 4);
+    size_t size = 4;
+    for(unsigned int c = 0; c < 4; c++) {
+        size += encodeHdrChannel(scratch + c * width, width, out + size);
+    }
+    return size;
+}
+
+// Writes the whole accumulator to an open file, returns 0 on failure
+int writeImageToFile(FILE* file, ImageFormat format, const Accumulator* accumulator) {
+    Color3f* means = malloc(sizeof(Color3f) * accumulator->width);
+    unsigned char* row = malloc(getImageRowCapacity(format, accumulator->width));
+    unsigned char* scratch = malloc((size_t)accumulator->width * 4);
+    assert(means && row && scratch);
+    int valid = writeImageHeader(file, format, accumulator->width, accumulator->height);
+    for(unsigned int i = 0; i < accumulator->height && valid; i++) {
+        const unsigned int y = format == IMAGE_FORMAT_PFM ? accumulator->height - 1 - i : i;
+        getAccumulatorRowMeans(accumulator, y, means);
+        const size_t size = encodeImageRow(format, means, accumulator->width, row, scratch);
+        valid = fwrite(row, 1, size, file) == size;
+    }
+    free(means);
+    free(row);
+    free(scratch);
+    return valid;
+}
+
+// Writes the whole accumulator at once, returns 0 on failure
+int writeImage(const char* path, ImageFormat format, const Accumulator* accumulator) {
+    FILE* file = fopen(path, "wb");
+    if(!file) {
+        return 0;
+    }
+    const int valid = writeImageToFile(file, format, accumulator);
+    return fclose(file) == 0 && valid;
+}
+
+// Writes an image of width * height radiance values, e.g. after denoising. Returns 0 on failure.
+int writeColorImage(const char* path, ImageFormat format, const Color3f* colors, unsigned int width, unsigned int height) {
+    FILE* file = fopen(path, "wb");
+    if(!file) {
+        return 0;
+    }
+    unsigned char* row = malloc(getImageRowCapacity(format, width));
+    unsigned char* scratch = malloc((size_t)width * 4);
+    assert(row && scratch);
+    int valid = writeImageHeader(file, format, width, height);
+    for(unsigned int i = 0; i < height && valid; i++) {
+        const unsigned int y = format == IMAGE_FORMAT_PFM ? height - 1 - i : i;
+        const size_t size = encodeImageRow(format, colors + (size_t)y * width, width, row, scratch);
+        valid = fwrite(row, 1, size, file) == size;
+    }
+    free(row);
+    free(scratch);
+    return fclose(file) == 0 && valid;
+}
+
+// Clamps radiance values into 8 bit RGB like resolveAccumulator
+void resolveColors(const Color3f* colors, size_t count, unsigned char* data) {
+    for(size_t i = 0; i < count; i++) {
+        data[i * 3 + 0] = (unsigned char)(clamp(colors[i].r, 0.0f, 1.0f) * 255.0f);
+        data[i * 3 + 1] = (unsigned char)(clamp(colors[i].g, 0.0f, 1.0f) * 255.0f);
+        data[i * 3 + 2] = (unsigned char)(clamp(colors[i].b, 0.0f, 1.0f) * 255.0f);
+    }
+}
+
+// Streams the image to disk on a background thread while it is rendered. The image is
+// split into bands of tile rows, once every tile of a band is final the writer encodes it
+// straight from the accumulator. Only one encoded row is buffered, so memory stays bounded
+// for any image size. PPM and PFM rows have a fixed size and bands are written at their
+// offset as they finish, HDR rows are compressed and written in order.
+typedef struct ImageWriter {
+    FILE* file;
+    ImageFormat format;
+    const Accumulator* accumulator;
+    long data_offset;
+    unsigned int origin_y;
+    unsigned int band_height;
+    unsigned int band_count;
+    // tiles of each band which aren't final yet
+    unsigned int* band_tiles_left;
+    // finished bands in the order they were handed over, guarded by the mutex
+    unsigned int* finished_bands;
+    unsigned int finished_count;
+    Mutex mutex;
+    Condition condition;
+    Thread thread;
+    // only touched by the writer thread
+    Color3f* means;
+    unsigned char* row;
+    unsigned char* scratch;
+    unsigned char* band_written;
+    unsigned int next_band;
+    int failed;
+    // seconds the writer thread spent encoding and writing
+    double busy_time;
+} ImageWriter;
+
+int writeImageBand(ImageWriter* writer, unsigned int band) {
+    const Accumulator* accumulator = writer->accumulator;
+    const unsigned int y_end = (band + 1) * writer->band_height < accumulator->height ? (band + 1) * writer->band_height : accumulator->height;
+    const size_t row_size = getImageRowCapacity(writer->format, accumulator->width);
+    for(unsigned int y = band * writer->band_height; y < y_end; y++) {
+        getAccumulatorRowMeans(accumulator, y, writer->means);
+        const size_t size = encodeImageRow(writer->format, writer->means, accumulator->width, writer->row, writer->scratch);
+        if(writer->format != IMAGE_FORMAT_HDR) {
+            const unsigned int file_row = writer->format == IMAGE_FORMAT_PFM ? accumulator->height - 1 - y : y;
+            if(fseek(writer->file, writer->data_offset + (long)((size_t)file_row * row_size), SEEK_SET) != 0) {
+                return 0;
+            }
+        }
+        if(fwrite(writer->row, 1, size, writer->file) != size) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void runImageWriter(void* argument) {
+    ImageWriter* writer = argument;
+    unsigned int bands_taken = 0;
+    while(bands_taken < writer->band_count) {
+        lockMutex(&writer->mutex);
+        while(bands_taken == writer->finished_count) {
+            waitCondition(&writer->condition, &writer->mutex);
+        }
+        const unsigned int band = writer->finished_bands[bands_taken++];
+        unlockMutex(&writer->mutex);
+
+        const double start = getWallTime();
+        writer->band_written[band] = 1;
+        if(writer->format == IMAGE_FORMAT_HDR) {
+            // compressed rows can only be appended
+            while(writer->next_band < writer->band_count && writer->band_written[writer->next_band]) {
+                writer->failed |= !writeImageBand(writer, writer->next_band++);
+            }
+        }
+        else {
+            writer->failed |= !writeImageBand(writer, band);
+        }
+        writer->busy_time += getWallTime() - start;
+    }
+}
+
+void freeImageWriterBuffers(ImageWriter* writer) {
+    free(writer->band_tiles_left);
+    free(writer->finished_bands);
+    free(writer->means);
+    free(writer->row);
+    free(writer->scratch);
+    free(writer->band_written);
+}
+
+// Creates the file and starts the writer thread for an accumulator rendered with the tiles
+// of schedule, whose rows start at origin_y. Returns 0 if the file couldn't be created or the
+// thread couldn't be started, the image then has to be written after rendering.
+int startImageWriter(ImageWriter* writer, const char* path, ImageFormat format, const Accumulator* accumulator, const TileSchedule* schedule, unsigned int origin_y, unsigned int tile_size) {
+    FILE* file = fopen(path, "wb");
+    if(!file) {
+        return 0;
+    }
+    if(!writeImageHeader(file, format, accumulator->width, accumulator->height)) {
+        fclose(file);
+        return 0;
+    }
+    const unsigned int band_count = (accumulator->height + tile_size - 1) / tile_size;
+    *writer = (ImageWriter) {
+        .file = file,
+        .format = format,
+        .accumulator = accumulator,
+        .data_offset = ftell(file),
+        .origin_y = origin_y,
+        .band_height = tile_size,
+        .band_count = band_count,
+        .band_tiles_left = calloc(band_count, sizeof(unsigned int)),
+        .finished_bands = malloc(sizeof(unsigned int) * band_count),
+        .finished_count = 0,
+        .means = malloc(sizeof(Color3f) * accumulator->width),
+        .row = malloc(getImageRowCapacity(format, accumulator->width)),
+        .scratch = malloc((size_t)accumulator->width * 4),
+        .band_written = calloc(band_count, 1),
+        .next_band = 0,
+        .failed = 0,
+        .busy_time = 0.0
+    };
+    assert(writer->band_tiles_left && writer->finished_bands && writer->means && writer->row && writer->scratch && writer->band_written);
+    for(unsigned int i = 0; i < schedule->tile_count; i++) {
+        writer->band_tiles_left[(schedule->tiles[i].y - origin_y) / tile_size]++;
+    }
+    initMutex(&writer->mutex);
+    initCondition(&writer->condition);
+    if(!startThread(&writer->thread, runImageWriter, writer)) {
+        fprintf(stderr, "Couldn't start the image writer thread\n");
+        destroyCondition(&writer->condition);
+        destroyMutex(&writer->mutex);
+        fclose(file);
+        freeImageWriterBuffers(writer);
+        return 0;
+    }
+    return 1;
+}
+
+void finishImageBand(ImageWriter* writer, unsigned int band) {
+    lockMutex(&writer->mutex);
+    writer->finished_bands[writer->finished_count++] = band;
+    signalCondition(&writer->condition);
+    unlockMutex(&writer->mutex);
+}
+
+// Called by the render threads once a tile won't get any more samples
+void finishImageTile(ImageWriter* writer, const Tile* tile) {
+    const unsigned int band = (tile->y - writer->origin_y) / writer->band_height;
+    // acquire and release, so the thread finishing a band has seen the samples of all its tiles
+    // before the writer reads them
+    const unsigned int tiles_left = __atomic_sub_fetch(&writer->band_tiles_left[band], 1, __ATOMIC_ACQ_REL);
+    if(tiles_left == 0) {
+        finishImageBand(writer, band);
+    }
+}
+
+// Hands over the bands which didn't finish yet, waits for the writer and closes the file.
+// Returns 0 if anything couldn't be written.
+int finishImageWriter(ImageWriter* writer) {
+    for(unsigned int band = 0; band < writer->band_count; band++) {
+        if(writer->band_tiles_left[band] > 0) {
+            writer->band_tiles_left[band] = 0;
+            finishImageBand(writer, band);
+        }
+    }
+    joinThread(&writer->thread);
+    destroyCondition(&writer->condition);
+    destroyMutex(&writer->mutex);
+    const int closed = fclose(writer->file) == 0;
+    freeImageWriterBuffers(writer);
+    return closed && !writer->failed;
+}
+
+#endif // IMAGE_WRITER_H
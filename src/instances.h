@@ -0,0 +1,151 @@
+#ifndef INSTANCES_H
+#define INSTANCES_H
+
+#include "vec3.h"
+#include "ray.h"
+#include "bvh.h"
+#include "scene.h"
+#include "transform.h"
+
+// Traversal of the two-level acceleration structure. The BVH over the instances is walked like
+// a triangle BVH, at its leaves the ray is moved into object space and traced through the BVH of
+// the instance mesh. The direction isn't normalized after the transform, so distances along the
+// ray stay the same in both spaces and hits of different instances compare directly.
+
+Ray getObjectRay(const Instance* instance, Ray ray) {
+    return (Ray) {
+        .origin = transformPoint(&instance->to_object, ray.origin),
+        .dir = transformDir(&instance->to_object, ray.dir)
+    };
+}
+
+// Updates best_hit if the mesh of the instance is hit closer
+void intersectInstance(const Scene* scene, unsigned int index, Ray ray, TriangleHit* best_hit) {
+    const Instance* instance = &scene->instances[index];
+    const Scene* mesh = &scene->meshes[instance->mesh];
+    if(mesh->bvh.node_count == 0) {
+        return;
+    }
+    TriangleHit hit = *best_hit;
+    hit.handle = 0;
+    intersectBvh(&mesh->bvh, &mesh->triangle_precomputed, getObjectRay(instance, ray), &hit);
+    if(hit.handle != 0) {
+        best_hit->intersection = hit.intersection;
+        best_hit->handle = hit.handle;
+        best_hit->instance = index + 1;
+    }
+}
+
+// Closest hit traversal like intersectBvh, updates best_hit if an instance is hit closer
+void intersectInstances(const Scene* scene, Ray ray, TriangleHit* best_hit) {
+    const Bvh* bvh = &scene->instance_bvh;
+    const Vec3 inv_dir = {
+        .x = 1.0f / ray.dir.x,
+        .y = 1.0f / ray.dir.y,
+        .z = 1.0f / ray.dir.z
+    };
+    if(bvh->node_count == 0 || intersectAabb(&bvh->nodes[0].bounds, ray.origin, inv_dir, best_hit->intersection.distance) == BVH_MISS) {
+        return;
+    }
+
+    BvhStackEntry stack[BVH_MAX_DEPTH];
+    unsigned int stack_size = 0;
+    unsigned int node_index = 0;
+    while(1) {
+        const BvhNode* node = &bvh->nodes[node_index];
+        if(node->count > 0) {
+            for(unsigned int i = node->first; i < node->first + node->count; i++) {
+                intersectInstance(scene, i, ray, best_hit);
+            }
+        }
+        else {
+            unsigned int near = node->first;
+            unsigned int far = node->first + 1;
+            float near_distance = intersectAabb(&bvh->nodes[near].bounds, ray.origin, inv_dir, best_hit->intersection.distance);
+            float far_distance = intersectAabb(&bvh->nodes[far].bounds, ray.origin, inv_dir, best_hit->intersection.distance);
+            if(far_distance < near_distance) {
+                const unsigned int temp_index = near;
+                near = far;
+                far = temp_index;
+                const float temp_distance = near_distance;
+                near_distance = far_distance;
+                far_distance = temp_distance;
+            }
+            if(near_distance != BVH_MISS) {
+                if(far_distance != BVH_MISS) {
+                    stack[stack_size++] = (BvhStackEntry){ .node = far, .distance = far_distance };
+                }
+                node_index = near;
+                continue;
+            }
+        }
+
+        do {
+            if(stack_size == 0) {
+                return;
+            }
+            stack_size--;
+        } while(stack[stack_size].distance >= best_hit->intersection.distance);
+        node_index = stack[stack_size].node;
+    }
+}
+
+// Any-hit query like occludedBvh, returns 1 as soon as some instance is hit closer than max_distance
+int occludedInstances(const Scene* scene, Ray ray, float max_distance) {
+    const Bvh* bvh = &scene->instance_bvh;
+    const Vec3 inv_dir = {
+        .x = 1.0f / ray.dir.x,
+        .y = 1.0f / ray.dir.y,
+        .z = 1.0f / ray.dir.z
+    };
+    if(bvh->node_count == 0 || intersectAabb(&bvh->nodes[0].bounds, ray.origin, inv_dir, max_distance) == BVH_MISS) {
+        return 0;
+    }
+
+    unsigned int stack[BVH_MAX_DEPTH];
+    unsigned int stack_size = 0;
+    unsigned int node_index = 0;
+    while(1) {
+        const BvhNode* node = &bvh->nodes[node_index];
+        if(node->count > 0) {
+            for(unsigned int i = node->first; i < node->first + node->count; i++) {
+                const Instance* instance = &scene->instances[i];
+                const Scene* mesh = &scene->meshes[instance->mesh];
+                if(mesh->bvh.node_count > 0 && occludedBvh(&mesh->bvh, &mesh->triangle_precomputed, getObjectRay(instance, ray), max_distance)) {
+                    return 1;
+                }
+            }
+        }
+        else {
+            const unsigned int left = node->first;
+            const unsigned int right = node->first + 1;
+            const int hit_left = intersectAabb(&bvh->nodes[left].bounds, ray.origin, inv_dir, max_distance) != BVH_MISS;
+            const int hit_right = intersectAabb(&bvh->nodes[right].bounds, ray.origin, inv_dir, max_distance) != BVH_MISS;
+            if(hit_left) {
+                if(hit_right) {
+                    stack[stack_size++] = right;
+                }
+                node_index = left;
+                continue;
+            }
+            if(hit_right) {
+                node_index = right;
+                continue;
+            }
+        }
+        if(stack_size == 0) {
+            return 0;
+        }
+        node_index = stack[--stack_size];
+    }
+}
+
+// Shading frame in world space around the transformed normal of a mesh triangle, not yet facing the ray
+Frame getInstanceFrame(const Scene* scene, unsigned int instance, TriangleHandle handle) {
+    const Instance* hit_instance = &scene->instances[instance - 1];
+    const Scene* mesh = &scene->meshes[hit_instance->mesh];
+    const Vec3 normal = transformNormal(&hit_instance->to_object, getVec3ArrayElement(&mesh->triangle_precomputed.normal, handle - 1));
+    return createFrame(normalizeVec3(normal));
+}
+
+#endif // INSTANCES_H
@@ -0,0 +1,144 @@
+#ifndef LIGHTS_H
+#define LIGHTS_H
+
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+
+#include "vec3.h"
+#include "triangle.h"
+#include "material.h"
+#include "sampler.h"
+
+// Corner, edges and normal of an emissive triangle
+typedef struct LightTriangle {
+    Vec3 v1;
+    Vec3 edge12;
+    Vec3 edge13;
+    Norm3 normal;
+} LightTriangle;
+
+// Emissive triangles of a scene, picked proportional to area times emitted radiance
+typedef struct Lights {
+    unsigned int* triangles;
+    // copied, so sampling works with any storage of the scene triangles
+    LightTriangle* geometry;
+    // cumulative selection probability, the last entry is 1
+    float* cdf;
+    unsigned int count;
+    // selection probability divided by area for every scene triangle, 0 for non emissive ones
+    float* area_pdf;
+} Lights;
+
+typedef struct LightSample {
+    Vec3 position;
+    Norm3 normal;
+    TriangleHandle handle;
+    // probability density of the position per area
+    float area_pdf;
+} LightSample;
+
+Lights createLights() {
+    return (Lights) {
+        .triangles = NULL,
+        .geometry = NULL,
+        .cdf = NULL,
+        .count = 0,
+        .area_pdf = NULL
+    };
+}
+
+void freeLights(Lights* lights) {
+    free(lights->triangles);
+    free(lights->geometry);
+    free(lights->cdf);
+    free(lights->area_pdf);
+    *lights = createLights();
+}
+
+float getTriangleArea(const TrianglePrecomputed* triangles, unsigned int index) {
+    return length(cross(getVec3ArrayElement(&triangles->edge12, index), getVec3ArrayElement(&triangles->edge13, index))) * 0.5f;
+}
+
+// Collects the emissive triangles, materials is indexed by handle - 1
+void buildLights(Lights* lights, const TrianglePrecomputed* triangles, const MaterialHandle* material_handles, unsigned int triangle_count, const Material* materials) {
+    freeLights(lights);
+    lights->area_pdf = calloc(triangle_count + 1, sizeof(float));
+    assert(lights->area_pdf);
+    double total_power = 0.0;
+    for(unsigned int i = 0; i < triangle_count; i++) {
+        const Material* material = &materials[material_handles[i] - 1];
+        if(material->emission > 0.0f && getTriangleArea(triangles, i) > 0.0f) {
+            lights->count++;
+        }
+    }
+    if(lights->count == 0) {
+        return;
+    }
+    lights->triangles = malloc(sizeof(unsigned int) * lights->count);
+    lights->geometry = malloc(sizeof(LightTriangle) * lights->count);
+    lights->cdf = malloc(sizeof(float) * lights->count);
+    assert(lights->triangles && lights->geometry && lights->cdf);
+
+    unsigned int light = 0;
+    for(unsigned int i = 0; i < triangle_count; i++) {
+        const Material* material = &materials[material_handles[i] - 1];
+        const float area = getTriangleArea(triangles, i);
+        if(material->emission > 0.0f && area > 0.0f) {
+            const Color3f radiance = material->diffuse;
+            const double power = (double)area * material->emission * (radiance.r + radiance.g + radiance.b) / 3.0;
+            lights->triangles[light] = i;
+            lights->geometry[light] = (LightTriangle) {
+                .v1 = getVec3ArrayElement(&triangles->v1, i),
+                .edge12 = getVec3ArrayElement(&triangles->edge12, i),
+                .edge13 = getVec3ArrayElement(&triangles->edge13, i),
+                .normal = getVec3ArrayElement(&triangles->normal, i)
+            };
+            lights->area_pdf[i] = (float)(power / area);
+            total_power += power;
+            lights->cdf[light] = (float)total_power;
+            light++;
+        }
+    }
+    for(unsigned int i = 0; i < lights->count; i++) {
+        lights->cdf[i] = (float)(lights->cdf[i] / total_power);
+        lights->area_pdf[lights->triangles[i]] = (float)(lights->area_pdf[lights->triangles[i]] / total_power);
+    }
+    lights->cdf[lights->count - 1] = 1.0f;
+}
+
+// Picks a light proportional to its power and a uniform point on it. The number which picked the light
+// is stretched over the light's cdf interval and reused for the point, so one 2D sample is enough.
+LightSample sampleLights(const Lights* lights, Sampler* sampler) {
+    assert(lights->count > 0);
+    float select, v;
+    getSample2D(sampler, &select, &v);
+    unsigned int low = 0;
+    unsigned int high = lights->count - 1;
+    while(low < high) {
+        const unsigned int middle = (low + high) / 2;
+        if(lights->cdf[middle] <= select) {
+            low = middle + 1;
+        }
+        else {
+            high = middle;
+        }
+    }
+    const float cdf_start = low > 0 ? lights->cdf[low - 1] : 0.0f;
+    const float u = fminf((select - cdf_start) / (lights->cdf[low] - cdf_start), 0x1.fffffep-1f);
+    const unsigned int index = lights->triangles[low];
+    const LightTriangle* triangle = &lights->geometry[low];
+    const float root = sqrtf(u);
+    const Vec3 position = addVec3(triangle->v1, addVec3(
+        multVec3Scalar(triangle->edge12, root * (1.0f - v)),
+        multVec3Scalar(triangle->edge13, root * v)
+    ));
+    return (LightSample) {
+        .position = position,
+        .normal = triangle->normal,
+        .handle = index + 1,
+        .area_pdf = lights->area_pdf[index]
+    };
+}
+
+#endif // LIGHTS_H
@@ -8,359 +8,527 @@
 
 #include "ppm.h"
 #include "vec3.h"
+#include "ray.h"
 #include "color.h"
 #include "triangle.h"
 #include "material.h"
 #include "scene.h"
+#include "mesh.h"
 #include "util.h"
+#include "rng.h"
+#include "sampler.h"
+#include "options.h"
+#include "accumulator.h"
 #define STATS 1
 #include "stats.h"
-
-Stats global_stats = {};
-
-#define IMAGE_SIZE_X 512
-#define IMAGE_SIZE_Y 512
-#define MAX_STEPS 16
-#define MAX_DISTANCE 100.0f
+#include "render.h"
+#include "wavefront.h"
+#include "distributed.h"
+#include "denoise.h"
+#include "scene_cache.h"
+#include "server.h"
+#include "animation.h"
 
 #define PLANE(a, b, c, d) (TriangleVertices){a, b, c}, (TriangleVertices){c, d, a}
 
-typedef struct Ray {
-    Vec3 origin;
-    Norm3 dir;
-} Ray;
-
-const Color3f BACKGROUND_COLOR = {1.0f, 1.0f, 1.0f};
-
-const Material materials[] = {
-    {.roughness = 1.0f, .emission = 0.0f, .diffuse = { 1.0f, 1.0f, 1.0f}},
-    {.roughness = 1.0f, .emission = 0.0f, .diffuse = { 1.0f, 0.05f, 0.05f}},
-    {.roughness = 0.0f, .emission = 0.0f, .diffuse = { 0.0f, 1.0f, 0.5f}},
-    {.roughness = 1.0f, .emission = 2.0f, .diffuse = { 1.0f, 0.05f, 0.01f}},
-    {.roughness = 1.0f, .emission = 4.0f, .diffuse = { 0.1f, 0.02f, 1.0f}},
-    {.roughness = 1.0f, .emission = 0.0f, .diffuse = { 0.05f, 0.05f, 1.0f}},
-};
-
-Material getMaterial(MaterialHandle handle) {
-    return materials[handle - 1];
-}
-
-Norm3 reflectVec3InHemisphere(Norm3 dirIn, Norm3 normal, float roughness) {
-    Vec3 tangent_base = cross(normal, AXIS.up);
-    if(squaredLength(tangent_base) < 0.1f) {
-        tangent_base = cross(normal, AXIS.forward);
-    }
-    assert(squaredLength(tangent_base) > 0.01f);
-    const Norm3 tangent = normalizeVec3(tangent_base);
-    const Norm3 bitangent = cross(normal, tangent);
-
-    const Vec3 rand_vec = {
-        .x = ((randFloat() * 2.0f) - 1.0f),
-        .y = ((randFloat() * 2.0f) - 1.0f),
-        .z = randFloat()
+int main(int argc, const char** argv) {
+    const Vec3 box[8] = {
+        {{-0.5f, -0.5f, 0.0f}}, // LBF 0
+        {{-0.5f, -0.5f, 1.0f}}, // LBB 1
+        {{-0.5f,  0.5f, 0.0f}}, // LTF 2
+        {{-0.5f,  0.5f, 1.0f}}, // LTB 3
+        {{ 0.5f, -0.5f, 0.0f}}, // RBF 4
+        {{ 0.5f, -0.5f, 1.0f}}, // RBB 5
+        {{ 0.5f,  0.5f, 0.0f}}, // RTF 6
+        {{ 0.5f,  0.5f, 1.0f}}, // RTB 7
     };
-    const Norm3 rand_vec_norm = normalizeVec3(rand_vec);
-
-    const Norm3 dirOut = normalizeVec3(addVec3(
-                multVec3Scalar(normal, rand_vec_norm.z), 
-        addVec3(multVec3Scalar(tangent, rand_vec_norm.x),
-                multVec3Scalar(bitangent, rand_vec_norm.y)
-        )
-    ));
-
-    return dirOut;
-}
 
-typedef struct TriangleIntersection {
-    float u, v;
-    float distance;
-    Vec3 world_pos;
-} TriangleIntersection;
-
-typedef struct TriangleHit {
-    TriangleIntersection intersection;
-    TriangleHandle handle;
-    Norm3 normal;
-} TriangleHit;
-
-TriangleIntersection intersectTriangle(TriangleVertices vertices, Ray ray) {
-    TriangleIntersection result = {
-        .distance = MAX_DISTANCE,
-        .u = -1.0f,
-        .v = -1.0f,
-        .world_pos = {0.0f, 0.0f, 0.0f}
+    const TriangleVertices box_triangles[] = {
+        // Back plane
+        PLANE(box[1], box[3], box[7], box[5]),
+        // Ground plane
+        PLANE(box[1], box[5], box[4], box[0]),
+        // Left plane
+        PLANE(box[0], box[2], box[3], box[1]),
+        // Right plane
+        PLANE(box[5], box[7], box[6], box[4]),
+        // Top plane
+        PLANE(box[3], box[2], box[6], box[7]),
+        // Lighting plane top
+        {.v1 = {-0.1f, 0.499f, 0.6f}, .v2 = {-0.1f, 0.499f, 0.4f}, .v3 = {0.1f, 0.499f, 0.4f}},
+        {.v1 = {-0.1f, 0.499f, 0.6f}, .v2 = {0.1f, 0.499f, 0.4f}, .v3 = {0.1f, 0.499f, 0.6f}},
+        // Lighting plane left
+        {.v1 = {-0.499f, 0.2f, 0.2f}, .v2 = {-0.499f, 0.25f, 0.2f}, .v3 = {-0.499f, 0.25f, 0.8f}},
+        {.v1 = {-0.499f, 0.25f, 0.8f}, .v2 = {-0.499f, 0.2f, 0.8f}, .v3 = {-0.499f, 0.2f, 0.2f}},
+        // Right shadow caster plane
+        {(Vec3){0.25f, -0.45f, 1.0f}, (Vec3){0.25f, 0.45f, 1.0f}, (Vec3){0.25f, 0.45f, 0.3f}},
+        {(Vec3){0.25f, 0.45f, 0.3f}, (Vec3){0.25f, -0.45f, 0.3f}, (Vec3){0.25f, -0.45f, 1.0f}},
+        // Center shadow caster plane
+        {(Vec3){0.15f, 0.05f, 0.7f}, (Vec3){0.15f, 0.15f, 0.7f}, (Vec3){0.15f, 0.15f, 0.5f}},
+        {(Vec3){0.15f, 0.15f, 0.5f}, (Vec3){0.15f, 0.05f, 0.5f}, (Vec3){0.15f, 0.05f, 0.7f}},
+        // Center shadow caster plane 2
+        {(Vec3){0.1f, -0.15f, 0.7f}, (Vec3){0.1f, 0.1f, 0.7f}, (Vec3){0.1f, 0.1f, 0.5f}},
+        {(Vec3){0.1f, 0.1f, 0.5f}, (Vec3){0.1f, -0.15f, 0.5f}, (Vec3){0.1f, -0.15f, 0.7f}},
     };
-    const Vec3 v12 = subVec3(vertices.v2, vertices.v1);
-    const Vec3 v13 = subVec3(vertices.v3, vertices.v1);
-    const Vec3 plane_normal = cross(v12, v13);
-    const Vec3 plane_to_ray = subVec3(ray.origin, vertices.v1);
-    const float a = -dot(plane_normal, plane_to_ray);
-    const float b = dot(plane_normal, ray.dir);
-    const float r = a / b;
-    result.distance = r;
-    if (r < 0.0f) {
-        // ray goes away from triangle
-        return result;
-    }
-    const Vec3 hitPoint = addVec3(ray.origin, multVec3Scalar(ray.dir, r));
-    result.world_pos = hitPoint;
-    const float uu = dot(v12, v12);
-    const float uv = dot(v12, v13);
-    const float vv = dot(v13, v13);
-    const Vec3 w = subVec3(hitPoint, vertices.v1);
-    const float wu = dot(w, v12);
-    const float wv = dot(w, v13);
-    const float D = uv * uv - uu * vv;
-
-    // get parametric coords
-    result.u = (uv * wv - vv * wu) / D;
-    result.v = (uv * wu - uu * wv) / D;
-
-    return result;
-}
-
-TriangleHit traceRay(Scene* scene, const Ray ray) {
-    TriangleHit best_hit = {
-        .handle = 0,
-        .intersection = {
-            .distance = MAX_DISTANCE,
-            .u = -1.0f,
-            .v = -1.0f,
-            .world_pos = {0.0f, 0.0f, 0.0f}
-        },
-        .normal = {0.0f, 0.0f, 1.0f}
+    const MaterialHandle box_material_handles[] = {
+        1, 1,
+        1, 1,
+        2, 2,
+        3, 3,
+        1, 1,
+        4, 4,
+        5, 5,
+        1, 1,
+        6, 6,
+        3, 3,
     };
-    #if STATS
-    global_stats.ray_count++;
-    #endif
 
-    for(unsigned int i = 1; i <= scene->triangle_count; i++) {
-        TriangleIntersection result = intersectTriangle(getTriangleVertices(scene, i), ray);
-        if(result.u >= 0.0f && result.v >= 0.0f && result.u + result.v <= 1.0f) {
-            if(result.distance > 0.0f && result.distance < best_hit.intersection.distance) {
-                best_hit.intersection = result;
-                best_hit.handle = i;
+    Options options;
+    if(!parseOptions(argc, argv, &options)) {
+        printUsage(argv[0]);
+        return 1;
+    }
+    const unsigned int spp = options.spp;
+
+    const SimdLevel simd_level = selectSimdLevel(options.simd);
+    if(options.serve) {
+        // responses go to stdout, so only the server writes there until the input ends
+        return runRenderServer(&options, stdin, stdout) ? 0 : 1;
+    }
+    printf("Using %s intersection kernel\n", getSimdLevelName(simd_level));
+    Scene scene = createScene();
+    if(options.scene_path) {
+        const double load_start = getWallTime();
+        if(!loadSceneCache(&scene, options.scene_path)) {
+            return 1;
+        }
+        printf("Mapped scene cache '%s' with %u triangles and %u BVH nodes in %.3fs\n",
+            options.scene_path, scene.triangle_count, scene.bvh.node_count, getWallTime() - load_start);
+        if(scene.bvh.node_count > 0 && getSceneCacheLeafWidth(&scene) != getSimdWidth(simd_level)) {
+            printf("The BVH leaves were built for %u wide kernels, a fitting cache renders faster\n", getSceneCacheLeafWidth(&scene));
+        }
+        if(options.accel == ACCEL_LINEAR) {
+            scene.bvh.node_count = 0;
+        }
+    }
+    else {
+        for(unsigned int i = 0; i < sizeof(box_triangles) / sizeof(box_triangles[0]); i++) {
+            addTriangle(&scene, box_triangles[i], box_material_handles[i]);
+        }
+        const unsigned int material_count = sizeof(materials) / sizeof(materials[0]);
+        if(options.mesh_material < 1 || options.mesh_material > material_count) {
+            fprintf(stderr, "Mesh material has to be between 1 and %u\n", material_count);
+            return 1;
+        }
+        const Aabb mesh_target = {
+            .min = {-0.2f, -0.5f, 0.35f},
+            .max = { 0.2f,  0.1f, 0.75f}
+        };
+        // instanced meshes stand in the unit cube on their origin
+        const Aabb instance_mesh_target = {
+            .min = {-0.5f, 0.0f, -0.5f},
+            .max = { 0.5f, 1.0f,  0.5f}
+        };
+        for(unsigned int i = 0; i < options.mesh_count; i++) {
+            Scene mesh = createScene();
+            Scene* target = options.instances > 0 ? &mesh : &scene;
+            const unsigned int first = target->triangle_count;
+            MeshLoadInfo info;
+            if(!loadMesh(target, options.mesh_paths[i], options.mesh_material, material_count, &info)) {
+                return 1;
+            }
+            fitTriangles(target, first, target->triangle_count - first, options.instances > 0 ? instance_mesh_target : mesh_target);
+            printf("Loaded '%s': %u vertices, %u triangles in %.3fs, peak RSS %.1f MiB\n",
+                options.mesh_paths[i], info.vertex_count, info.triangle_count, info.load_time, (double)info.peak_rss / (1024.0 * 1024.0));
+            if(options.instances > 0) {
+                prepareSceneMesh(&mesh);
+                addSceneMesh(&scene, &mesh);
+            }
+        }
+        if(options.instances > 0) {
+            // instances cycle through these, 0 keeps the mesh materials
+            const MaterialHandle instance_materials[] = {0, 2, 6, 3};
+            const Aabb instance_target = {
+                .min = {-0.45f, -0.5f, 0.1f},
+                .max = { 0.45f,  0.0f, 0.95f}
+            };
+            addInstanceGrid(&scene, options.instances, instance_target, instance_materials, sizeof(instance_materials) / sizeof(instance_materials[0]));
+            if(options.flatten_instances) {
+                flattenInstances(&scene);
+            }
+        }
+        const double prepare_start = getWallTime();
+        prepareScene(&scene, materials, material_count, options.accel != ACCEL_LINEAR);
+        const double prepare_time = getWallTime() - prepare_start;
+        if(options.accel == ACCEL_BVH) {
+            printf("Built BVH with %u nodes over %u triangles in %.3fs\n", scene.bvh.node_count, scene.triangle_count, prepare_time);
+        }
+        if(options.accel == ACCEL_COMPRESSED) {
+            const size_t uncompressed_memory = getSceneMemory(&scene);
+            const double compress_start = getWallTime();
+            compressScene(&scene);
+            const size_t compressed_memory = getSceneMemory(&scene);
+            printf("Built compressed BVH with %u nodes over %u triangles and %u vertices in %.3fs\n",
+                scene.compressed_bvh.node_count, scene.triangle_count, scene.indexed_triangles.vertex_count, prepare_time + getWallTime() - compress_start);
+            // the meshes of instances stay uncompressed, so only scenes without them give a meaningful size per triangle
+            if(scene.mesh_count == 0 && scene.triangle_count > 0) {
+                printf("Scene memory %.1f instead of %.1f bytes per triangle\n",
+                    (double)compressed_memory / scene.triangle_count, (double)uncompressed_memory / scene.triangle_count);
             }
         }
+        if(scene.instance_count > 0) {
+            printf("Placed %u instances of %u meshes, scene memory %.1f MiB\n", scene.instance_count, scene.mesh_count, (double)getSceneMemory(&scene) / (1024.0 * 1024.0));
+        }
+        else if(options.instances > 0) {
+            printf("Flattened %u instances, scene memory %.1f MiB\n", options.instances, (double)getSceneMemory(&scene) / (1024.0 * 1024.0));
+        }
     }
-
-    if(best_hit.handle != 0) {
-        TriangleVertices vertices = getTriangleVertices(scene, best_hit.handle);
-        Vec3 v12 = subVec3(vertices.v2, vertices.v1);
-        Vec3 v13 = subVec3(vertices.v3, vertices.v1);
-        best_hit.normal = normalizeVec3(cross(v12, v13));
-        #if STATS
-        global_stats.ray_hits++;
-        #endif
+    if(options.compile_scene_path) {
+        const int written = writeSceneCache(&scene, options.compile_scene_path);
+        if(written) {
+            printf("Wrote scene cache '%s'\n", options.compile_scene_path);
+        }
+        else {
+            fprintf(stderr, "Couldn't write scene cache '%s'\n", options.compile_scene_path);
+        }
+        freeScene(&scene);
+        return written ? 0 : 1;
+    }
+    if(options.check_simd) {
+        const unsigned int check_rays = 1000000;
+        const unsigned int mismatches = checkSimdKernel(&scene.triangle_precomputed, scene.triangle_count, check_rays);
+        printf("SIMD check: %u of %u rays disagree with the scalar kernel\n", mismatches, check_rays);
+        freeScene(&scene);
+        return mismatches == 0 ? 0 : 1;
     }
+    const double report_timer_interval_s = 1.0;
 
-    return best_hit;
-}
+    // only the crop window is rendered and written, it is the whole image by default
+    const unsigned int image_width = options.crop_width;
+    const unsigned int image_height = options.crop_height;
+    const int cropped = image_width != options.width || image_height != options.height;
+    const unsigned int pixel_count = image_width * image_height;
+    const size_t image_data_size = (size_t)pixel_count * 3;
 
-Color3f sampleBounceRay(Scene* scene, Ray ray, const unsigned int max_depth) {
-    Color3f result = {1.0f, 1.0f, 1.0f};
-    for(unsigned int i = 0; i < max_depth; i++) {
-        const TriangleHit hit = traceRay(scene, ray);
-        if(hit.handle == 0) {
-            return multColor3f(BACKGROUND_COLOR, result);;
+    char filename[256];
+    if(options.output_path) {
+        snprintf(filename, sizeof(filename), "%s", options.output_path);
+    }
+    else {
+        if(!createDirectory("out")) {
+            fprintf(stderr, "Couldn't create the output directory 'out'\n");
+            return 1;
         }
+        char crop_suffix[64] = "";
+        if(cropped) {
+            // crops of one image can be stitched by the position in their name
+            snprintf(crop_suffix, sizeof(crop_suffix), "_%u_%u_%u_%u", options.crop_x, options.crop_y, image_width, image_height);
+        }
+        snprintf(filename, sizeof(filename), "out/render_%lld_%u%s.%s", (long long)time(NULL), spp, crop_suffix, getImageFormatExtension(options.output_format));
+    }
 
-        const Material material = getMaterial(getMaterialHandle(scene, hit.handle));
-        result = multColor3f(material.diffuse, result);
-
-        if(material.emission > 0.0f) {
-            #if STATS
-            global_stats.bounce_rays.hit_emissive++;
-            #endif
-            return multColor3fScalar(result, material.emission);
-        }
-        ray.origin = addVec3(hit.intersection.world_pos, multVec3Scalar(hit.normal, 0.001f));
-        ray.dir = reflectVec3InHemisphere(ray.dir, hit.normal, material.roughness);
+    if(options.frames > 0) {
+        const int rendered = renderFrameSequence(&scene, &options, filename);
+        freeScene(&scene);
+        return rendered ? 0 : 1;
     }
-    #if STATS
-    global_stats.bounce_rays.reached_max_depth++;
-    #endif
-    return (Color3f){0.0f, 0.0f, 0.0f};
-}
 
-Color3f samplePixelColor(Scene* scene, const unsigned int x, const unsigned int y, const unsigned int spp) {
-    const Norm3 origin_to_image_plane_point = normalizeVec3((Vec3){ 
-        .x = (-1.0f + (float)(x) / (float)(IMAGE_SIZE_X) * 2.0f),
-        .y = (1.0f - (float)(y) / (float)(IMAGE_SIZE_Y) * 2.0f),
-        .z = 1.0f
-    });
-    const Ray primary_ray = {
-        .origin = { 0.0f, 0.0f, -0.5f },
-        .dir = origin_to_image_plane_point
+    const RenderSettings settings = {
+        .width = options.width,
+        .height = options.height,
+        .camera = createCamera(options.camera_position, options.camera_target, options.camera_fov, options.width, options.height),
+        .seed = options.seed,
+        .max_depth = options.max_depth,
+        .roulette_depth = options.roulette_depth,
+        .sampler = options.sampler,
+        .sample_count = spp,
+        .next_event_estimation = options.next_event_estimation,
+        .primary_packets = options.primary_packets
     };
-
-    const TriangleHit primary_hit = traceRay(scene, primary_ray);
-    #if STATS
-    global_stats.primary_rays.count++;
-    #endif
-    
-    if(primary_hit.handle != 0) {
-        #if STATS
-        global_stats.primary_rays.hits++;
-        #endif
-        const MaterialHandle material_handle = getMaterialHandle(scene, primary_hit.handle);
-        const Material primary_hit_material = getMaterial(material_handle);
-        if(primary_hit_material.emission > 0.0f) {
-            #if STATS
-            global_stats.primary_rays.hit_emissive++;
-            #endif
-            return multColor3fScalar(primary_hit_material.diffuse, primary_hit_material.emission);
-        }
-        const Vec3 ray_origin = addVec3(primary_hit.intersection.world_pos, multVec3Scalar(primary_hit.normal, 0.001f));
-        Color3f pixel_color_sum = {0.0f, 0.0f, 0.0f};
-
-        for(unsigned int samples = 0; samples < spp; samples++) {
-            const Ray ray = {
-                .origin = ray_origin,
-                .dir = reflectVec3InHemisphere(primary_ray.dir, primary_hit.normal, primary_hit_material.roughness)
-            };
-            const Color3f bounce_ray_color = sampleBounceRay(scene, ray, MAX_STEPS);
-            pixel_color_sum = addColor3f(pixel_color_sum, multColor3f(primary_hit_material.diffuse, bounce_ray_color));
+    Accumulator accumulator = createAccumulator(image_width, image_height);
+    unsigned int samples_done = 0;
+    Checkpoint checkpoint;
+    if(options.checkpoint_path) {
+        if(!openCheckpoint(&checkpoint, options.checkpoint_path, options.seed, hashRender(&settings, &scene), options.width, options.height,
+            options.crop_x, options.crop_y, &accumulator, &samples_done)) {
+            return 1;
+        }
+        if(samples_done > 0) {
+            printf("Resuming from checkpoint '%s' with %u spp\n", options.checkpoint_path, samples_done);
         }
-        const float color_factor = 1.0f / (float) spp;
-        return multColor3fScalar(pixel_color_sum, color_factor);
     }
-    return BACKGROUND_COLOR;
-}
-
-int main(int argc, const char** argv) {
-    srand((unsigned)time(NULL));
-
-    const Vec3 box[8] = {
-        {{-0.5f, -0.5f, 0.0f}}, // LBF 0
-        {{-0.5f, -0.5f, 1.0f}}, // LBB 1
-        {{-0.5f,  0.5f, 0.0f}}, // LTF 2
-        {{-0.5f,  0.5f, 1.0f}}, // LTB 3
-        {{ 0.5f, -0.5f, 0.0f}}, // RBF 4
-        {{ 0.5f, -0.5f, 1.0f}}, // RBB 5
-        {{ 0.5f,  0.5f, 0.0f}}, // RTF 6
-        {{ 0.5f,  0.5f, 1.0f}}, // RTB 7
-    };
-
-    Scene scene = {
-        .triangle_vertices = {
-            // Back plane
-            PLANE(box[1], box[3], box[7], box[5]),
-            // Ground plane
-            PLANE(box[1], box[5], box[4], box[0]),
-            // Left plane
-            PLANE(box[0], box[2], box[3], box[1]),
-            // Right plane
-            PLANE(box[5], box[7], box[6], box[4]),
-            // Top plane
-            PLANE(box[3], box[2], box[6], box[7]),
-            // Lighting plane top
-            {.v1 = {-0.1f, 0.499f, 0.6f}, .v2 = {-0.1f, 0.499f, 0.4f}, .v3 = {0.1f, 0.499f, 0.4f}},
-            {.v1 = {-0.1f, 0.499f, 0.6f}, .v2 = {0.1f, 0.499f, 0.4f}, .v3 = {0.1f, 0.499f, 0.6f}},
-            // Lighting plane left
-            {.v1 = {-0.499f, 0.2f, 0.2f}, .v2 = {-0.499f, 0.25f, 0.2f}, .v3 = {-0.499f, 0.25f, 0.8f}},
-            {.v1 = {-0.499f, 0.25f, 0.8f}, .v2 = {-0.499f, 0.2f, 0.8f}, .v3 = {-0.499f, 0.2f, 0.2f}},
-            // Right shadow caster plane
-            {(Vec3){0.25f, -0.45f, 1.0f}, (Vec3){0.25f, 0.45f, 1.0f}, (Vec3){0.25f, 0.45f, 0.3f}},
-            {(Vec3){0.25f, 0.45f, 0.3f}, (Vec3){0.25f, -0.45f, 0.3f}, (Vec3){0.25f, -0.45f, 1.0f}},
-            // Center shadow caster plane
-            {(Vec3){0.15f, 0.05f, 0.7f}, (Vec3){0.15f, 0.15f, 0.7f}, (Vec3){0.15f, 0.15f, 0.5f}},
-            {(Vec3){0.15f, 0.15f, 0.5f}, (Vec3){0.15f, 0.05f, 0.5f}, (Vec3){0.15f, 0.05f, 0.7f}},
-            // Center shadow caster plane 2
-            {(Vec3){0.1f, -0.15f, 0.7f}, (Vec3){0.1f, 0.1f, 0.7f}, (Vec3){0.1f, 0.1f, 0.5f}},
-            {(Vec3){0.1f, 0.1f, 0.5f}, (Vec3){0.1f, -0.15f, 0.5f}, (Vec3){0.1f, -0.15f, 0.7f}},
-        },
-        .triangle_material_handles = {
-            1, 1,
-            1, 1,
-            2, 2,
-            3, 3,
-            1, 1,
-            4, 4,
-            5, 5,
-            1, 1,
-            6, 6,
-            3, 3,
-        },
-        .triangle_count = 20
-    };
-    unsigned int spp_input = 32;
-    if(argc > 1) {
-        spp_input = atoi(argv[1]);
+    // adaptive sampling starts with min_spp everywhere and then refines noisy pixels in small passes
+    // without it the first pass is just a pass of pass_spp
+    const unsigned int min_spp = options.adaptive ? (options.min_spp < spp ? options.min_spp : spp)
+        : (options.pass_spp > 0 && options.pass_spp < spp ? options.pass_spp : spp);
+    const unsigned int pass_spp = options.pass_spp > 0 ? options.pass_spp : min_spp;
+    // with adaptive sampling this is an upper bound
+    const uint64_t pixel_samples_total = (uint64_t)pixel_count * (spp > samples_done ? spp - samples_done : 0);
+    unsigned int pass_count = 0;
+
+    TileSchedule schedule = createTileSchedule(options.crop_x, options.crop_y, image_width, image_height, options.tile_size, options.tile_order);
+    const unsigned int max_tile_pixels = getMaxTilePixels(&schedule);
+    if(settings.sampler == SAMPLER_BLUE_NOISE) {
+        initBlueNoise(options.seed);
+    }
+    initThreadStats(omp_get_max_threads());
+    // workers are forked with everything set up for rendering
+    Cluster cluster;
+    if(options.workers > 0) {
+        const unsigned int cores = (unsigned int)omp_get_num_procs();
+        const unsigned int worker_threads = options.worker_threads > 0 ? options.worker_threads
+            : (cores > options.workers ? cores / options.workers : 1);
+        if(!startCluster(&cluster, options.workers, worker_threads, options.worker_timeout, &scene, &settings, &schedule, options.wavefront)) {
+            return 1;
+        }
+        printf("Started %u worker processes with %u threads each\n", options.workers, worker_threads);
     }
-    const unsigned int spp = spp_input;
-    const double report_timer_interval_s = 1.0;
-
-    const unsigned int IMAGE_DATA_SIZE = IMAGE_SIZE_X * IMAGE_SIZE_Y * 3;
-    unsigned char data[IMAGE_DATA_SIZE];
-
     printf("Begin sampling\n");
-    const clock_t start = clock();
-    clock_t report_timer_start = clock();
-    unsigned int data_filled = 0;
-    const unsigned int data_report_interval = 1000000 / spp;
+    const double start = getWallTime();
+    double report_timer_start = start;
+    double checkpoint_timer_start = start;
+    // the image is streamed to disk during the last pass, when tiles become final,
+    // unless it still gets denoised
+    ImageWriter writer;
+    int writer_started = 0;
+    int writer_failed = 0;
+
+    while(samples_done < spp) {
+        // every pixel gets up to pass_target samples, unless it already converged
+        const unsigned int pass_target = samples_done < min_spp ? min_spp
+            : (spp - samples_done < pass_spp ? spp : samples_done + pass_spp);
+        uint64_t pass_pixel_samples = 0;
+        resetTileSchedule(&schedule);
+        if(options.adaptive && samples_done >= min_spp) {
+            updateAccumulatorErrors(&accumulator);
+        }
+        const PassTarget pass = {
+            .samples = pass_target,
+            .adaptive = options.adaptive,
+            .min_samples = min_spp,
+            .target_error = options.target_error
+        };
+        const int final_pass = pass_target == spp && !options.denoise;
+        if(final_pass && !writer_started && !writer_failed) {
+            writer_started = startImageWriter(&writer, filename, options.output_format, &accumulator, &schedule, options.crop_y, options.tile_size);
+            // the image is written after rendering instead
+            writer_failed = !writer_started;
+        }
+        const int stream_tiles = final_pass && writer_started;
 
-    #pragma omp parallel for
-    for(unsigned int y = 0; y < IMAGE_SIZE_Y; y++) {
-        for(unsigned int x = 0; x < IMAGE_SIZE_X; x++) {
-            const unsigned int data_index = (x+y*IMAGE_SIZE_X)*3;
-            
-            const Color3f pixel_color = samplePixelColor(&scene, x, y, spp);
-            data[data_index + 0] = (char)(clamp(pixel_color.r, 0.0f, 1.0f) * 255.0f);
-            data[data_index + 1] = (char)(clamp(pixel_color.g, 0.0f, 1.0f) * 255.0f);
-            data[data_index + 2] = (char)(clamp(pixel_color.b, 0.0f, 1.0f) * 255.0f);
-            const unsigned int progress = ++data_filled; 
-            if(progress % data_report_interval == data_report_interval - 1) {
-                const double work_done = ((double)(progress * 3) / (double)(IMAGE_DATA_SIZE));
-                const clock_t end = clock();
-                const double cpu_time_used = ((double) (end - start)) / CLOCKS_PER_SEC;
-                const double approx_total_time = cpu_time_used / work_done;
-                printf("Finished %4.1f%%, %02d:%02d / ~%02d:%02d\n", work_done * 100.0, (unsigned int)(cpu_time_used)/60, (unsigned int)(cpu_time_used)%60, (unsigned int)(approx_total_time)/60, (unsigned int)(approx_total_time)%60);
+        if(options.workers > 0) {
+            if(!runDistributedPass(&cluster, &schedule, &accumulator, options.crop_x, options.crop_y, &pass,
+                stream_tiles ? &writer : NULL, &pass_pixel_samples, start, pixel_samples_total)) {
+                return 1;
+            }
+        }
+        else
+        #pragma omp parallel reduction(+:pass_pixel_samples)
+        {
+            ThreadStats* local_stats = getThreadStats();
+            PathStates paths;
+            if(options.wavefront) {
+                paths = createPathStates(WAVEFRONT_MAX_PATHS);
             }
-            
-            /*
-            const clock_t report_timer_end = clock();
-            const double timer_s = ((double) (report_timer_end - report_timer_start)) / CLOCKS_PER_SEC;
+            PixelSamples* tile_pixels = malloc(sizeof(PixelSamples) * max_tile_pixels);
+            SampleSum* tile_sums = malloc(sizeof(SampleSum) * max_tile_pixels);
+            assert(tile_pixels && tile_sums);
+            unsigned int tile_index;
+            while(acquireTile(&schedule, &tile_index)) {
+                const Tile tile = schedule.tiles[tile_index];
+                const double tile_start = getWallTime();
+                uint64_t tile_pixel_samples = 0;
+                unsigned int tile_pixel_count = 0;
+                for(unsigned int y = tile.y; y < tile.y + tile.height; y++) {
+                    for(unsigned int x = tile.x; x < tile.x + tile.width; x++) {
+                        // the accumulator only covers the crop window
+                        const unsigned int local_x = x - options.crop_x;
+                        const unsigned int local_y = y - options.crop_y;
+                        const unsigned int pixel_samples = getPassSamples(&accumulator, local_x, local_y, &pass);
+                        if(pixel_samples == 0) {
+                            continue;
+                        }
+                        const AccumulatorPixel* pixel = getAccumulatorPixel(&accumulator, local_x, local_y);
+                        tile_pixels[tile_pixel_count++] = (PixelSamples){x, y, pixel->samples, pixel_samples};
+                    }
+                }
+                if(options.wavefront) {
+                    // the whole tile goes through the stages as one batch
+                    samplePixelsWavefront(&scene, &settings, &paths, tile_pixels, tile_pixel_count, tile_sums);
+                }
+                else {
+                    samplePixels(&scene, &settings, tile_pixels, tile_pixel_count, tile_sums);
+                }
+                for(unsigned int i = 0; i < tile_pixel_count; i++) {
+                    const PixelSamples* tile_pixel = &tile_pixels[i];
+                    AccumulatorPixel* pixel = getAccumulatorPixel(&accumulator, tile_pixel->x - options.crop_x, tile_pixel->y - options.crop_y);
+                    addAccumulatorSamples(pixel, tile_sums[i], tile_pixel->sample_count);
+                    tile_pixel_samples += tile_pixel->sample_count;
+                }
+                const double tile_end = getWallTime();
+                schedule.tile_times[tile_index] += tile_end - tile_start;
+                schedule.tile_threads[tile_index] = omp_get_thread_num();
+                local_stats->busy_time += tile_end - tile_start;
+                if(stream_tiles) {
+                    finishImageTile(&writer, &tile);
+                }
+                addPixelSamplesDone(local_stats, tile_pixel_samples);
+                pass_pixel_samples += tile_pixel_samples;
+
+                // only the first thread reports, so the report timer isn't shared
+                if(omp_get_thread_num() == 0 && tile_end - report_timer_start > report_timer_interval_s) {
+                    printProgress(tile_end - start, pixel_samples_total);
+                    report_timer_start = tile_end;
+                }
+            }
+            if(options.wavefront) {
+                freePathStates(&paths);
+            }
+            free(tile_pixels);
+            free(tile_sums);
+        }
+        samples_done = pass_target;
+        pass_count++;
+        if(pass_pixel_samples == 0 && samples_done >= min_spp) {
+            // every pixel converged
+            samples_done = spp;
+        }
 
-            if(timer_s > report_timer_interval_s) {
-                const double work_done = ((double)(data_index) / (double)(IMAGE_DATA_SIZE));
-                const clock_t end = clock();
-                const double cpu_time_used = ((double) (end - start)) / CLOCKS_PER_SEC;
-                const double approx_total_time = cpu_time_used / work_done;
-                printf("Finished %4.1f%%, %02d:%02d / ~%02d:%02d\n", work_done * 100.0, (unsigned int)(cpu_time_used)/60, (unsigned int)(cpu_time_used)%60, (unsigned int)(approx_total_time)/60, (unsigned int)(approx_total_time)%60);
-                // reset timer
-                report_timer_start = clock();
+        const double now = getWallTime();
+        if(options.checkpoint_path && (samples_done == spp || now - checkpoint_timer_start > options.checkpoint_interval)) {
+            if(!writeCheckpoint(&checkpoint, &accumulator, samples_done)) {
+                fprintf(stderr, "Couldn't write checkpoint '%s'\n", options.checkpoint_path);
             }
-            */
+            // the intermediate image can be looked at while rendering goes on,
+            // the final one is written by the image writer
+            if(samples_done < spp && !writeImage(filename, options.output_format, &accumulator)) {
+                fprintf(stderr, "Couldn't write image '%s'\n", filename);
+            }
+            printf("Checkpoint at %u spp\n", samples_done);
+            checkpoint_timer_start = now;
         }
     }
-    const clock_t end = clock();
-    const double cpu_time_used = ((double) (end - start)) / CLOCKS_PER_SEC;
+    const double time_used = getWallTime() - start;
     printf("Finished sampling\n");
+    if(options.workers > 0) {
+        stopCluster(&cluster);
+    }
 
-    char filename[256] = ".\\out\\render_";
-    char temp_convert[32];
-    snprintf(temp_convert, 32,"%d", time(NULL));
-    strcat(filename, temp_convert);
-    strcat(filename, "_");
-    snprintf(temp_convert, 32,"%d", spp);
-    strcat(filename, temp_convert);
-    strcat(filename, ".ppm");
-
-    write_ppm(filename, IMAGE_SIZE_X, IMAGE_SIZE_Y, data);
-    printf("Wrote image to '%s'\n", filename);
-
-    const Stats gs = global_stats;
-    const unsigned int bounce_rays_count = gs.ray_count - gs.primary_rays.count;
-    const unsigned int bounce_rays_hits = gs.ray_hits - gs.primary_rays.hits;
+    Color3f* denoised = NULL;
+    double denoise_time = 0.0;
+    if(options.denoise || options.features_prefix) {
+        const double denoise_start = getWallTime();
+        FeatureBuffers features = createFeatureBuffers(image_width, image_height);
+        renderFeatures(&scene, &settings, &features, options.crop_x, options.crop_y);
+        if(options.denoise) {
+            denoised = malloc(sizeof(Color3f) * pixel_count);
+            assert(denoised);
+            denoiseImage(&accumulator, &features, options.denoise_iterations, denoised);
+            denoise_time = getWallTime() - denoise_start;
+            printf("Denoised in %.3fs\n", denoise_time);
+        }
+        if(options.features_prefix) {
+            if(writeFeatureImages(&features, options.features_prefix)) {
+                printf("Wrote features to '%s_*.pfm'\n", options.features_prefix);
+            }
+            else {
+                fprintf(stderr, "Couldn't write features to '%s_*.pfm'\n", options.features_prefix);
+            }
+        }
+        freeFeatureBuffers(&features);
+    }
+    if(options.denoise) {
+        if(!writeColorImage(filename, options.output_format, denoised, image_width, image_height)) {
+            fprintf(stderr, "Couldn't write image '%s'\n", filename);
+            return 1;
+        }
+        printf("Wrote denoised image to '%s'\n", filename);
+    }
+    else if(writer_started) {
+        if(!finishImageWriter(&writer)) {
+            fprintf(stderr, "Couldn't write image '%s'\n", filename);
+            return 1;
+        }
+        const double write_wait_time = getWallTime() - start - time_used;
+        printf("Wrote image to '%s', waited %.3fs for the writer which was busy for %.3fs\n", filename, write_wait_time, writer.busy_time);
+    }
+    else {
+        // converged or resumed renders may never get to the final pass
+        if(!writeImage(filename, options.output_format, &accumulator)) {
+            fprintf(stderr, "Couldn't write image '%s'\n", filename);
+            return 1;
+        }
+        printf("Wrote image to '%s'\n", filename);
+    }
+    unsigned char* data = NULL;
+    if(options.reference_path || options.spp_map_path) {
+        data = malloc(image_data_size);
+        assert(data);
+    }
+    if(options.reference_path) {
+        if(denoised) {
+            resolveColors(denoised, pixel_count, data);
+        }
+        else {
+            resolveAccumulator(&accumulator, data);
+        }
+        unsigned char* reference = malloc(image_data_size);
+        assert(reference);
+        if(read_ppm(options.reference_path, image_width, image_height, reference)) {
+            printf("RMSE against '%s': %.3f\n", options.reference_path, image_rmse(data, reference, image_data_size));
+        }
+        else {
+            fprintf(stderr, "Couldn't read reference '%s' with %ux%u pixels\n", options.reference_path, image_width, image_height);
+        }
+        free(reference);
+    }
+    if(options.spp_map_path) {
+        resolveSampleCounts(&accumulator, spp, data);
+        if(write_ppm(options.spp_map_path, image_width, image_height, data)) {
+            printf("Wrote samples per pixel to '%s'\n", options.spp_map_path);
+        }
+        else {
+            fprintf(stderr, "Couldn't write samples per pixel to '%s'\n", options.spp_map_path);
+        }
+    }
+    if(options.tile_times_path) {
+        if(writeTileTimes(&schedule, options.tile_times_path)) {
+            printf("Wrote tile times to '%s'\n", options.tile_times_path);
+        }
+        else {
+            fprintf(stderr, "Couldn't write tile times to '%s'\n", options.tile_times_path);
+        }
+    }
+    if(options.checkpoint_path) {
+        closeCheckpoint(&checkpoint);
+    }
+    unsigned int converged_pixels = 0;
+    for(unsigned int i = 0; i < pixel_count; i++) {
+        converged_pixels += accumulator.pixels[i].samples < spp;
+    }
+    const unsigned int light_count = scene.lights.count;
+    freeAccumulator(&accumulator);
+    freeScene(&scene);
+    free(data);
+    free(denoised);
 
     #if STATS
+    const Stats gs = mergeThreadStats();
+    // feature rays are traced after sampling
+    const uint64_t sample_rays_count = gs.ray_count - gs.feature_rays.count;
+    const uint64_t bounce_rays_count = sample_rays_count - gs.primary_rays.count - gs.shadow_rays.count;
+    const uint64_t bounce_rays_hits = gs.ray_hits - gs.feature_rays.hits - gs.primary_rays.hits;
+
     printf("Statistics\n");
     printf("==========\n");
     printf("GENERAL\n");
-    printStatTime("Total time", (unsigned int)(cpu_time_used));
-    printStatTotal("Total rays", gs.ray_count);
-    printStatFactor("Rays per second", (double)(gs.ray_count) / cpu_time_used);
+    printStatTime("Total time", time_used);
+    printStatTotal("Total rays", sample_rays_count);
+    printStatTotal("Threads", thread_stats_count);
+    printStatFactor("Rays per second", (double)(sample_rays_count) / time_used);
+    printStatTotal("Passes", pass_count);
+    printStatFactor("Avg samples per pixel rendered", (double)sumPixelSamplesDone() / (double)pixel_count);
+    printStatTotalPercent("Pixels converged before max spp", converged_pixels, pixel_count);
     printf("PRIMARY RAYS\n");
     printStatTotal("Total primary rays", gs.primary_rays.count);
     printStatTotalPercent("Primary ray hits", gs.primary_rays.hits, gs.primary_rays.count);
@@ -369,9 +537,54 @@ int main(int argc, const char** argv) {
     printStatTotal("Total bounce rays", bounce_rays_count);
     printStatTotalPercent("Bounce ray hits", bounce_rays_hits, bounce_rays_count);
     printStatTotalPercent("Bounce rays to light source", gs.bounce_rays.hit_emissive, bounce_rays_count);
-    printStatTotalPercent("Bounce rays with max depth", gs.bounce_rays.reached_max_depth, bounce_rays_count);
-    printStatFactor("Avg bounce ray depth", ((double)(bounce_rays_count)/ (double)(spp)) / ((double)(gs.primary_rays.hits)));
+    printStatTotalPercent("Paths reaching max depth", gs.bounce_rays.reached_max_depth, gs.bounce_rays.paths);
+    printStatTotalPercent("Paths ended by Russian roulette", gs.bounce_rays.roulette_terminated, gs.bounce_rays.paths);
+    printStatFactor("Avg bounce ray depth", (double)(bounce_rays_count) / (double)(gs.bounce_rays.paths));
+    printStatFactor("Avg rays per pixel sample", (double)sample_rays_count / (double)sumPixelSamplesDone());
+    printf("PATH DEPTHS\n");
+    for(unsigned int depth = 1; depth < STATS_PATH_DEPTH_BINS; depth++) {
+        char text[32];
+        snprintf(text, sizeof(text), depth + 1 < STATS_PATH_DEPTH_BINS ? "%u bounces" : "%u+ bounces", depth);
+        printStatTotalPercent(text, gs.bounce_rays.path_depths[depth], gs.bounce_rays.paths);
+    }
+    printf("SHADOW RAYS\n");
+    printStatTotal("Emissive triangles", light_count);
+    printStatTotal("Total shadow rays", gs.shadow_rays.count);
+    printStatTotalPercent("Shadow rays occluded", gs.shadow_rays.occluded, gs.shadow_rays.count);
+    if(options.denoise || options.features_prefix) {
+        printf("DENOISER\n");
+        printStatTime("Denoise time (features and filter)", denoise_time);
+        printStatTotal("Filter iterations", options.denoise ? options.denoise_iterations : 0);
+        printStatTotal("Feature rays", gs.feature_rays.count);
+        printStatTotalPercent("Feature ray hits", gs.feature_rays.hits, gs.feature_rays.count);
+    }
+    printf("TILES\n");
+    printStatTotal("Total tiles", schedule.tile_count);
+    const TileTimeStats tile_stats = getTileTimeStats(&schedule);
+    printStatTime("Min tile time", tile_stats.min_tile_time);
+    printStatTime("Avg tile time", tile_stats.avg_tile_time);
+    printStatTime("Max tile time", tile_stats.max_tile_time);
+    printStatTime("Max thread busy time", getMaxBusyTime());
+    printStatFactor("Thread imbalance (max / avg busy)", getBusyImbalance());
+    if(options.workers > 0) {
+        printf("WORKERS\n");
+        printStatTotal("Workers", cluster.worker_count);
+        printStatTotal("Workers lost", cluster.worker_count - cluster.alive_count);
+        printStatTotal("Tiles retried", cluster.tiles_retried);
+        for(unsigned int i = 0; i < cluster.worker_count; i++) {
+            char text[48];
+            snprintf(text, sizeof(text), "Worker %u tiles / busy time", i);
+            printf("  %-40s%8u %7.3fs\n", text, cluster.workers[i].tiles_done, cluster.workers[i].busy_time);
+        }
+        printStatTime("Distributed pass time", cluster.pass_time);
+        printStatFactor("Scaling efficiency (busy / workers)", getClusterEfficiency(&cluster));
+    }
     #endif
+    freeTileSchedule(&schedule);
+    if(options.workers > 0) {
+        freeCluster(&cluster);
+    }
+    freeThreadStats();
     
     return 0;
 }
\ No newline at end of file
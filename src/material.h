@@ -1,6 +1,8 @@
 #ifndef MATERIAL_H
 #define MATERIAL_H
 
+#include "color.h"
+
 typedef struct Material {
     float roughness;
     float emission;
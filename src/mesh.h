@@ -0,0 +1,537 @@
+#ifndef MESH_H
+#define MESH_H
+
+#include <assert.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vec3.h"
+#include "triangle.h"
+#include "material.h"
+#include "scene.h"
+#include "platform.h"
+
+#define PLY_MAX_ELEMENTS 8
+#define PLY_MAX_PROPERTIES 16
+#define MESH_MAX_NAME 64
+
+typedef struct MeshLoadInfo {
+    unsigned int vertex_count;
+    unsigned int triangle_count;
+    double load_time;
+    size_t peak_rss;
+} MeshLoadInfo;
+
+// Cursor over the mapped file, nothing is copied out of the mapping
+typedef struct MeshReader {
+    const char* cursor;
+    const char* end;
+} MeshReader;
+
+typedef struct MeshVertices {
+    Vec3* positions;
+    unsigned int count;
+    unsigned int capacity;
+} MeshVertices;
+
+void addMeshVertex(MeshVertices* vertices, Vec3 position) {
+    if(vertices->count == vertices->capacity) {
+        vertices->capacity = vertices->capacity < 1024 ? 1024 : vertices->capacity * 2;
+        vertices->positions = realloc(vertices->positions, sizeof(Vec3) * vertices->capacity);
+        assert(vertices->positions);
+    }
+    vertices->positions[vertices->count++] = position;
+}
+
+void skipMeshSpaces(MeshReader* reader) {
+    while(reader->cursor < reader->end && (*reader->cursor == ' ' || *reader->cursor == '\t' || *reader->cursor == '\r')) {
+        reader->cursor++;
+    }
+}
+
+void skipMeshLine(MeshReader* reader) {
+    const char* newline = memchr(reader->cursor, '\n', (size_t)(reader->end - reader->cursor));
+    reader->cursor = newline ? newline + 1 : reader->end;
+}
+
+int isMeshLineEnd(MeshReader* reader) {
+    skipMeshSpaces(reader);
+    return reader->cursor >= reader->end || *reader->cursor == '\n' || *reader->cursor == '#';
+}
+
+// Reads the next whitespace separated token, returns its length
+size_t readMeshToken(MeshReader* reader, const char** token) {
+    skipMeshSpaces(reader);
+    *token = reader->cursor;
+    while(reader->cursor < reader->end && *reader->cursor != ' ' && *reader->cursor != '\t'
+        && *reader->cursor != '\r' && *reader->cursor != '\n') {
+        reader->cursor++;
+    }
+    return (size_t)(reader->cursor - *token);
+}
+
+int isMeshToken(const char* token, size_t length, const char* keyword) {
+    return strlen(keyword) == length && memcmp(token, keyword, length) == 0;
+}
+
+int parseMeshInt(MeshReader* reader, long* value) {
+    skipMeshSpaces(reader);
+    const char* p = reader->cursor;
+    int negative = 0;
+    if(p < reader->end && (*p == '-' || *p == '+')) {
+        negative = *p == '-';
+        p++;
+    }
+    if(p >= reader->end || *p < '0' || *p > '9') {
+        return 0;
+    }
+    long result = 0;
+    while(p < reader->end && *p >= '0' && *p <= '9') {
+        result = result * 10 + (*p - '0');
+        p++;
+    }
+    *value = negative ? -result : result;
+    reader->cursor = p;
+    return 1;
+}
+
+// Bounded replacement for strtod, the mapping isn't null terminated
+int parseMeshNumber(MeshReader* reader, double* value) {
+    skipMeshSpaces(reader);
+    const char* p = reader->cursor;
+    int negative = 0;
+    if(p < reader->end && (*p == '-' || *p == '+')) {
+        negative = *p == '-';
+        p++;
+    }
+    uint64_t mantissa = 0;
+    int exponent = 0;
+    int digits = 0;
+    while(p < reader->end && *p >= '0' && *p <= '9') {
+        if(mantissa < 1000000000000000000ull) {
+            mantissa = mantissa * 10 + (uint64_t)(*p - '0');
+        }
+        else {
+            exponent++;
+        }
+        digits++;
+        p++;
+    }
+    if(p < reader->end && *p == '.') {
+        p++;
+        while(p < reader->end && *p >= '0' && *p <= '9') {
+            if(mantissa < 1000000000000000000ull) {
+                mantissa = mantissa * 10 + (uint64_t)(*p - '0');
+                exponent--;
+            }
+            digits++;
+            p++;
+        }
+    }
+    if(digits == 0) {
+        return 0;
+    }
+    if(p < reader->end && (*p == 'e' || *p == 'E')) {
+        MeshReader exponent_reader = { .cursor = p + 1, .end = reader->end };
+        long exponent_value;
+        if(parseMeshInt(&exponent_reader, &exponent_value)) {
+            exponent += (int)exponent_value;
+            p = exponent_reader.cursor;
+        }
+    }
+    const double result = exponent == 0 ? (double)mantissa : (double)mantissa * pow(10.0, exponent);
+    *value = negative ? -result : result;
+    reader->cursor = p;
+    return 1;
+}
+
+int parseMeshVec3(MeshReader* reader, Vec3* vec) {
+    for(unsigned int i = 0; i < 3; i++) {
+        double value;
+        if(!parseMeshNumber(reader, &value)) {
+            return 0;
+        }
+        vec->v[i] = (float)value;
+    }
+    return 1;
+}
+
+// Adds the polygon as a triangle fan, returns the number of added triangles
+unsigned int addMeshPolygon(Scene* scene, const MeshVertices* vertices, const long* indices, unsigned int count, MaterialHandle material) {
+    unsigned int added = 0;
+    for(unsigned int i = 2; i < count; i++) {
+        const TriangleVertices triangle = {
+            .v1 = vertices->positions[indices[0]],
+            .v2 = vertices->positions[indices[i - 1]],
+            .v3 = vertices->positions[indices[i]]
+        };
+        addTriangle(scene, triangle, material);
+        added++;
+    }
+    return added;
+}
+
+// OBJ: v and f statements are used, usemtl selects a material by its handle number
+int loadObj(Scene* scene, MeshReader* reader, MaterialHandle default_material, unsigned int material_count, MeshLoadInfo* info) {
+    MeshVertices vertices = {0};
+    MaterialHandle material = default_material;
+    long* polygon = NULL;
+    unsigned int polygon_capacity = 0;
+    int success = 1;
+
+    while(reader->cursor < reader->end) {
+        const char* keyword;
+        const size_t keyword_length = readMeshToken(reader, &keyword);
+        if(isMeshToken(keyword, keyword_length, "v")) {
+            Vec3 position;
+            if(!parseMeshVec3(reader, &position)) {
+                success = 0;
+                break;
+            }
+            addMeshVertex(&vertices, position);
+        }
+        else if(isMeshToken(keyword, keyword_length, "f")) {
+            unsigned int count = 0;
+            while(!isMeshLineEnd(reader)) {
+                long index;
+                if(!parseMeshInt(reader, &index)) {
+                    success = 0;
+                    break;
+                }
+                // skip texture coordinate and normal indices
+                if(reader->cursor < reader->end && *reader->cursor == '/') {
+                    const char* rest;
+                    readMeshToken(reader, &rest);
+                }
+                index = index < 0 ? (long)vertices.count + index : index - 1;
+                if(index < 0 || index >= (long)vertices.count) {
+                    success = 0;
+                    break;
+                }
+                if(count == polygon_capacity) {
+                    polygon_capacity = polygon_capacity < 16 ? 16 : polygon_capacity * 2;
+                    polygon = realloc(polygon, sizeof(long) * polygon_capacity);
+                    assert(polygon);
+                }
+                polygon[count++] = index;
+            }
+            if(!success) {
+                break;
+            }
+            info->triangle_count += addMeshPolygon(scene, &vertices, polygon, count, material);
+        }
+        else if(isMeshToken(keyword, keyword_length, "usemtl")) {
+            MeshReader name_reader = *reader;
+            long handle;
+            material = default_material;
+            if(parseMeshInt(&name_reader, &handle) && isMeshLineEnd(&name_reader)
+                && handle >= 1 && handle <= (long)material_count) {
+                material = (MaterialHandle)handle;
+            }
+        }
+        skipMeshLine(reader);
+    }
+
+    info->vertex_count = vertices.count;
+    free(vertices.positions);
+    free(polygon);
+    return success;
+}
+
+typedef enum PlyType {
+    PLY_INVALID,
+    PLY_INT8,
+    PLY_UINT8,
+    PLY_INT16,
+    PLY_UINT16,
+    PLY_INT32,
+    PLY_UINT32,
+    PLY_FLOAT32,
+    PLY_FLOAT64
+} PlyType;
+
+typedef enum PlyFormat {
+    PLY_ASCII,
+    PLY_BINARY_LITTLE_ENDIAN,
+    PLY_BINARY_BIG_ENDIAN
+} PlyFormat;
+
+typedef struct PlyProperty {
+    PlyType type;
+    PlyType count_type; // only set for list properties
+    char name[MESH_MAX_NAME];
+} PlyProperty;
+
+typedef struct PlyElement {
+    char name[MESH_MAX_NAME];
+    unsigned int count;
+    PlyProperty properties[PLY_MAX_PROPERTIES];
+    unsigned int property_count;
+} PlyElement;
+
+PlyType parsePlyType(const char* token, size_t length) {
+    static const struct {
+        const char* name;
+        PlyType type;
+    } types[] = {
+        {"char", PLY_INT8}, {"int8", PLY_INT8},
+        {"uchar", PLY_UINT8}, {"uint8", PLY_UINT8},
+        {"short", PLY_INT16}, {"int16", PLY_INT16},
+        {"ushort", PLY_UINT16}, {"uint16", PLY_UINT16},
+        {"int", PLY_INT32}, {"int32", PLY_INT32},
+        {"uint", PLY_UINT32}, {"uint32", PLY_UINT32},
+        {"float", PLY_FLOAT32}, {"float32", PLY_FLOAT32},
+        {"double", PLY_FLOAT64}, {"float64", PLY_FLOAT64},
+    };
+    for(unsigned int i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+        if(isMeshToken(token, length, types[i].name)) {
+            return types[i].type;
+        }
+    }
+    return PLY_INVALID;
+}
+
+size_t getPlyTypeSize(PlyType type) {
+    switch(type) {
+        case PLY_INT8: case PLY_UINT8: return 1;
+        case PLY_INT16: case PLY_UINT16: return 2;
+        case PLY_INT32: case PLY_UINT32: case PLY_FLOAT32: return 4;
+        case PLY_FLOAT64: return 8;
+        default: return 0;
+    }
+}
+
+int readPlyValue(MeshReader* reader, PlyFormat format, PlyType type, double* value) {
+    if(format == PLY_ASCII) {
+        return parseMeshNumber(reader, value);
+    }
+    const size_t size = getPlyTypeSize(type);
+    if((size_t)(reader->end - reader->cursor) < size) {
+        return 0;
+    }
+    unsigned char bytes[8];
+    for(size_t i = 0; i < size; i++) {
+        bytes[i] = (unsigned char)reader->cursor[format == PLY_BINARY_BIG_ENDIAN ? size - 1 - i : i];
+    }
+    reader->cursor += size;
+    // bytes are little endian now, assemble them independent of the host byte order
+    uint64_t bits = 0;
+    for(size_t i = 0; i < size; i++) {
+        bits |= (uint64_t)bytes[i] << (8 * i);
+    }
+    switch(type) {
+        case PLY_INT8: *value = (double)(int8_t)bits; break;
+        case PLY_UINT8: *value = (double)(uint8_t)bits; break;
+        case PLY_INT16: *value = (double)(int16_t)bits; break;
+        case PLY_UINT16: *value = (double)(uint16_t)bits; break;
+        case PLY_INT32: *value = (double)(int32_t)bits; break;
+        case PLY_UINT32: *value = (double)(uint32_t)bits; break;
+        case PLY_FLOAT32: {
+            const uint32_t bits32 = (uint32_t)bits;
+            float result;
+            memcpy(&result, &bits32, sizeof(result));
+            *value = result;
+            break;
+        }
+        case PLY_FLOAT64: {
+            double result;
+            memcpy(&result, &bits, sizeof(result));
+            *value = result;
+            break;
+        }
+        default: return 0;
+    }
+    return 1;
+}
+
+int parsePlyHeader(MeshReader* reader, PlyFormat* format, PlyElement* elements, unsigned int* element_count) {
+    const char* token;
+    size_t length = readMeshToken(reader, &token);
+    if(!isMeshToken(token, length, "ply")) {
+        return 0;
+    }
+    skipMeshLine(reader);
+    *element_count = 0;
+    while(reader->cursor < reader->end) {
+        length = readMeshToken(reader, &token);
+        if(isMeshToken(token, length, "format")) {
+            length = readMeshToken(reader, &token);
+            if(isMeshToken(token, length, "ascii")) {
+                *format = PLY_ASCII;
+            }
+            else if(isMeshToken(token, length, "binary_little_endian")) {
+                *format = PLY_BINARY_LITTLE_ENDIAN;
+            }
+            else if(isMeshToken(token, length, "binary_big_endian")) {
+                *format = PLY_BINARY_BIG_ENDIAN;
+            }
+            else {
+                return 0;
+            }
+        }
+        else if(isMeshToken(token, length, "element")) {
+            if(*element_count == PLY_MAX_ELEMENTS) {
+                return 0;
+            }
+            PlyElement* element = &elements[(*element_count)++];
+            length = readMeshToken(reader, &token);
+            if(length >= MESH_MAX_NAME) {
+                return 0;
+            }
+            memcpy(element->name, token, length);
+            element->name[length] = '\0';
+            long count;
+            if(!parseMeshInt(reader, &count) || count < 0) {
+                return 0;
+            }
+            element->count = (unsigned int)count;
+            element->property_count = 0;
+        }
+        else if(isMeshToken(token, length, "property")) {
+            if(*element_count == 0 || elements[*element_count - 1].property_count == PLY_MAX_PROPERTIES) {
+                return 0;
+            }
+            PlyElement* element = &elements[*element_count - 1];
+            PlyProperty* property = &element->properties[element->property_count++];
+            property->count_type = PLY_INVALID;
+            length = readMeshToken(reader, &token);
+            if(isMeshToken(token, length, "list")) {
+                length = readMeshToken(reader, &token);
+                property->count_type = parsePlyType(token, length);
+                if(property->count_type == PLY_INVALID) {
+                    return 0;
+                }
+                length = readMeshToken(reader, &token);
+            }
+            property->type = parsePlyType(token, length);
+            length = readMeshToken(reader, &token);
+            if(property->type == PLY_INVALID || length >= MESH_MAX_NAME) {
+                return 0;
+            }
+            memcpy(property->name, token, length);
+            property->name[length] = '\0';
+        }
+        else if(isMeshToken(token, length, "end_header")) {
+            skipMeshLine(reader);
+            return 1;
+        }
+        skipMeshLine(reader);
+    }
+    return 0;
+}
+
+// PLY: ascii and binary, vertex x/y/z and face vertex_indices (or vertex_index) are used
+int loadPly(Scene* scene, MeshReader* reader, MaterialHandle material, MeshLoadInfo* info) {
+    PlyFormat format = PLY_ASCII;
+    PlyElement elements[PLY_MAX_ELEMENTS];
+    unsigned int element_count;
+    if(!parsePlyHeader(reader, &format, elements, &element_count)) {
+        return 0;
+    }
+
+    MeshVertices vertices = {0};
+    long* polygon = NULL;
+    unsigned int polygon_capacity = 0;
+    int success = 1;
+
+    for(unsigned int e = 0; e < element_count && success; e++) {
+        const PlyElement* element = &elements[e];
+        const int is_vertex = strcmp(element->name, "vertex") == 0;
+        const int is_face = strcmp(element->name, "face") == 0;
+        if(is_vertex) {
+            vertices.capacity = element->count;
+            vertices.positions = malloc(sizeof(Vec3) * (element->count ? element->count : 1));
+            assert(vertices.positions);
+        }
+        else if(is_face) {
+            reserveTriangles(scene, scene->triangle_count + element->count);
+        }
+
+        for(unsigned int i = 0; i < element->count && success; i++) {
+            Vec3 position = {0};
+            for(unsigned int p = 0; p < element->property_count && success; p++) {
+                const PlyProperty* property = &element->properties[p];
+                if(property->count_type == PLY_INVALID) {
+                    double value;
+                    success = readPlyValue(reader, format, property->type, &value);
+                    if(is_vertex) {
+                        if(strcmp(property->name, "x") == 0) position.x = (float)value;
+                        else if(strcmp(property->name, "y") == 0) position.y = (float)value;
+                        else if(strcmp(property->name, "z") == 0) position.z = (float)value;
+                    }
+                    continue;
+                }
+                double count_value;
+                success = readPlyValue(reader, format, property->count_type, &count_value) && count_value >= 0.0;
+                const unsigned int count = success ? (unsigned int)count_value : 0;
+                const int is_indices = is_face
+                    && (strcmp(property->name, "vertex_indices") == 0 || strcmp(property->name, "vertex_index") == 0);
+                if(count > polygon_capacity) {
+                    polygon_capacity = count;
+                    polygon = realloc(polygon, sizeof(long) * polygon_capacity);
+                    assert(polygon);
+                }
+                for(unsigned int k = 0; k < count && success; k++) {
+                    double index = 0.0;
+                    success = readPlyValue(reader, format, property->type, &index);
+                    polygon[k] = (long)index;
+                    if(is_indices && (polygon[k] < 0 || polygon[k] >= (long)vertices.count)) {
+                        success = 0;
+                    }
+                }
+                if(success && is_indices) {
+                    info->triangle_count += addMeshPolygon(scene, &vertices, polygon, count, material);
+                }
+            }
+            if(success && is_vertex) {
+                addMeshVertex(&vertices, position);
+            }
+            if(format == PLY_ASCII) {
+                skipMeshLine(reader);
+            }
+        }
+    }
+
+    info->vertex_count = vertices.count;
+    free(vertices.positions);
+    free(polygon);
+    return success;
+}
+
+// Streams an OBJ or PLY file from a read-only mapping and appends its triangles to the scene.
+// Returns 0 if the file couldn't be read, the triangles loaded up to the error stay in the scene.
+int loadMesh(Scene* scene, const char* path, MaterialHandle default_material, unsigned int material_count, MeshLoadInfo* info) {
+    const double start = getWallTime();
+    *info = (MeshLoadInfo) {0};
+
+    MappedFile file;
+    if(!mapFile(path, &file)) {
+        fprintf(stderr, "Couldn't open mesh '%s'\n", path);
+        return 0;
+    }
+    MeshReader reader = {
+        .cursor = file.data,
+        .end = file.data + file.size
+    };
+    const char* extension = strrchr(path, '.');
+    int success;
+    if(extension && (strcmp(extension, ".ply") == 0 || strcmp(extension, ".PLY") == 0)) {
+        success = loadPly(scene, &reader, default_material, info);
+    }
+    else {
+        success = loadObj(scene, &reader, default_material, material_count, info);
+    }
+    unmapFile(&file);
+    if(!success) {
+        fprintf(stderr, "Couldn't parse mesh '%s'\n", path);
+    }
+
+    info->load_time = getWallTime() - start;
+    info->peak_rss = getPeakRss();
+    return success;
+}
+
+#endif // MESH_H
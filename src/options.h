@@ -0,0 +1,561 @@
+#ifndef OPTIONS_H
+#define OPTIONS_H
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "image_writer.h"
+#include "sampler.h"
+#include "simd.h"
+#include "tiles.h"
+#include "vec3.h"
+
+typedef enum AccelType {
+    ACCEL_LINEAR,
+    ACCEL_BVH,
+    // BVH with quantized 4-wide nodes over indexed triangles, see compressed_bvh.h
+    ACCEL_COMPRESSED
+} AccelType;
+
+#define OPTIONS_MAX_MESHES 8
+#define OPTIONS_MAX_WORKERS 256
+#define OPTIONS_MAX_SPP (1u << 24)
+#define OPTIONS_MAX_INSTANCES (1u << 20)
+#define OPTIONS_MAX_SCENE_CACHE_SIZE 1024
+#define OPTIONS_MAX_FRAMES 100000
+
+typedef struct Options {
+    unsigned int spp;
+    AccelType accel;
+    const char* mesh_paths[OPTIONS_MAX_MESHES];
+    unsigned int mesh_count;
+    unsigned int mesh_material;
+    // instances of the meshes placed in a grid, 0 adds each mesh once as scene triangles
+    unsigned int instances;
+    int flatten_instances;
+    SimdLevel simd;
+    int check_simd;
+    uint64_t seed;
+    unsigned int tile_size;
+    TileOrder tile_order;
+    const char* tile_times_path;
+    unsigned int pass_spp;
+    const char* checkpoint_path;
+    double checkpoint_interval;
+    int adaptive;
+    unsigned int min_spp;
+    double target_error;
+    const char* spp_map_path;
+    int next_event_estimation;
+    unsigned int max_depth;
+    unsigned int roulette_depth;
+    SamplerType sampler;
+    const char* reference_path;
+    unsigned int width, height;
+    // pixel rectangle which is rendered, the whole image by default
+    unsigned int crop_x, crop_y, crop_width, crop_height;
+    Vec3 camera_position;
+    Vec3 camera_target;
+    float camera_fov;
+    // NULL for a name from time and spp in the out directory
+    const char* output_path;
+    ImageFormat output_format;
+    // worker processes rendering the tiles, 0 renders in this process
+    unsigned int workers;
+    // OpenMP threads of each worker, 0 splits the cores between them
+    unsigned int worker_threads;
+    double worker_timeout;
+    int wavefront;
+    int primary_packets;
+    int denoise;
+    unsigned int denoise_iterations;
+    // NULL for no feature images
+    const char* features_prefix;
+    // load the prepared scene from this cache instead of building it, NULL to build
+    const char* scene_path;
+    // write the prepared scene to this cache and exit
+    const char* compile_scene_path;
+    // read render jobs from stdin instead of rendering once, see server.h
+    int serve;
+    // scene caches the server keeps mapped
+    unsigned int scene_cache_size;
+    // frames of an animation, 0 renders a single image, see animation.h
+    unsigned int frames;
+    // degrees per frame
+    float spin;
+    float orbit;
+    float sway;
+} Options;
+
+void printUsage(const char* program) {
+    printf("Usage: %s [spp] [options]\n", program);
+    printf("Options:\n");
+    printf("  --accel <type>          linear, bvh or cbvh (compressed bvh) ray intersection (default: bvh)\n");
+    printf("  --mesh <file.obj|ply>   load a mesh into the scene, can be given %d times\n", OPTIONS_MAX_MESHES);
+    printf("  --mesh-material <n>     material handle for meshes without usemtl (default: 1)\n");
+    printf("  --instances <n>         place n instances of the meshes in a grid on the floor\n");
+    printf("  --flatten-instances     copy the triangles of every instance into the scene instead\n");
+    printf("  --simd <level>          auto, scalar, sse, avx2 or avx512 intersection kernel (default: auto)\n");
+    printf("  --check-simd            compare the SIMD kernel against the scalar one and exit\n");
+    printf("  --seed <n>              random seed, equal seeds give identical images (default: 0)\n");
+    printf("  --tile-size <n>         edge length of the tiles threads render (default: 16)\n");
+    printf("  --tile-order <order>    scanline, morton or spiral tile order (default: morton)\n");
+    printf("  --tile-times <file>     write the render time of every tile as CSV\n");
+    printf("  --pass-spp <n>          samples per pixel of each progressive pass (default: spp)\n");
+    printf("  --checkpoint <file>     resume from and periodically save the accumulated samples\n");
+    printf("  --checkpoint-interval <s> seconds between checkpoints (default: 60)\n");
+    printf("  --adaptive              stop sampling converged pixels, spp becomes the maximum\n");
+    printf("  --min-spp <n>           samples per pixel before a pixel may converge (default: 8)\n");
+    printf("  --target-error <e>      standard error of a converged pixel (default: 0.05)\n");
+    printf("  --spp-map <file.ppm>    write the samples per pixel as grayscale image\n");
+    printf("  --no-nee                only find lights by bouncing, without sampling them directly\n");
+    printf("  --max-depth <n>         hard limit of bounces per path (default: 64)\n");
+    printf("  --rr-depth <n>          bounces before Russian roulette may end a path (default: 3)\n");
+    printf("  --sampler <type>        independent, stratified, sobol or bluenoise (default: sobol)\n");
+    printf("  --reference <file.ppm>  print the RMSE of the image against a reference render\n");
+    printf("  --size <w>x<h>          image resolution (default: 512x512)\n");
+    printf("  --crop <x>,<y>,<w>,<h>  only render and write this pixel rectangle of the image\n");
+    printf("  --camera-pos <x,y,z>    camera position (default: 0,0,-0.5)\n");
+    printf("  --camera-target <x,y,z> point the camera looks at (default: 0,0,0.5)\n");
+    printf("  --fov <degrees>         vertical field of view (default: 90)\n");
+    printf("  --output <file>         image file, the format follows from the extension\n");
+    printf("  --format <ppm|pfm|hdr>  image format of the default output file (default: ppm)\n");
+    printf("  --workers <n>           render tiles in n local worker processes (default: 0)\n");
+    printf("  --worker-threads <n>    threads of each worker (default: cores / workers)\n");
+    printf("  --worker-timeout <s>    seconds after which a tile is handed to another worker (default: 0, off)\n");
+    printf("  --wavefront             trace paths in batches one bounce at a time instead of depth first\n");
+    printf("  --no-packets            trace every camera ray on its own instead of in 8x8 packets\n");
+    printf("  --denoise               filter the image guided by albedo, normal and depth of the first hits\n");
+    printf("  --denoise-iterations <n> filter iterations, each doubles the radius (default: 5)\n");
+    printf("  --features <prefix>     write albedo, normal and depth as <prefix>_albedo.pfm etc.\n");
+    printf("  --scene <file>          map a scene cache instead of building the scene\n");
+    printf("  --compile-scene <file>  write the prepared scene with its BVH as scene cache and exit\n");
+    printf("  --serve                 render jobs from stdin, one line of these options each\n");
+    printf("  --scene-cache-size <n>  scene caches the server keeps mapped (default: 4)\n");
+    printf("  --frames <n>            render an animation of n frames, numbered in front of the extension\n");
+    printf("  --spin <degrees>        turn of every instance around its up axis per frame (default: 0)\n");
+    printf("  --sway <amount>         sideways bend of the instanced meshes, one swing per animation (default: 0)\n");
+    printf("  --orbit <degrees>       turn of the camera around its target per frame (default: 0)\n");
+}
+
+// Returns 0 if value isn't three comma separated numbers
+int parseVec3Option(const char* value, Vec3* vec) {
+    return sscanf(value, "%f,%f,%f", &vec->x, &vec->y, &vec->z) == 3;
+}
+
+// Returns 0 if value isn't a whole number between min and max
+int parseUnsignedOption(const char* value, unsigned int min, unsigned int max, unsigned int* result) {
+    char* end;
+    errno = 0;
+    const long long number = strtoll(value, &end, 10);
+    if(end == value || *end != '\0' || errno != 0 || number < (long long)min || number > (long long)max) {
+        return 0;
+    }
+    *result = (unsigned int)number;
+    return 1;
+}
+
+// Returns 0 if the arguments couldn't be parsed
+int parseOptions(int argc, const char** argv, Options* options) {
+    *options = (Options) {
+        .spp = 32,
+        .accel = ACCEL_BVH,
+        .mesh_count = 0,
+        .mesh_material = 1,
+        .instances = 0,
+        .flatten_instances = 0,
+        .simd = SIMD_AUTO,
+        .check_simd = 0,
+        .seed = 0,
+        .tile_size = 16,
+        .tile_order = TILE_ORDER_MORTON,
+        .tile_times_path = NULL,
+        .pass_spp = 0,
+        .checkpoint_path = NULL,
+        .checkpoint_interval = 60.0,
+        .adaptive = 0,
+        .min_spp = 8,
+        .target_error = 0.05,
+        .spp_map_path = NULL,
+        .next_event_estimation = 1,
+        .max_depth = 64,
+        .roulette_depth = 3,
+        .sampler = SAMPLER_SOBOL,
+        .reference_path = NULL,
+        .width = 512,
+        .height = 512,
+        .crop_width = 0,
+        .camera_position = {{0.0f, 0.0f, -0.5f}},
+        .camera_target = {{0.0f, 0.0f, 0.5f}},
+        .camera_fov = 90.0f,
+        .output_path = NULL,
+        .output_format = IMAGE_FORMAT_PPM,
+        .workers = 0,
+        .worker_threads = 0,
+        .worker_timeout = 0.0,
+        .wavefront = 0,
+        .primary_packets = 1,
+        .denoise = 0,
+        .denoise_iterations = 5,
+        .features_prefix = NULL,
+        .scene_path = NULL,
+        .compile_scene_path = NULL,
+        .serve = 0,
+        .scene_cache_size = 4,
+        .frames = 0,
+        .spin = 0.0f,
+        .orbit = 0.0f,
+        .sway = 0.0f
+    };
+    for(int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        const char* value = i + 1 < argc ? argv[i + 1] : NULL;
+        if(strcmp(arg, "--accel") == 0 && value) {
+            if(strcmp(value, "linear") == 0) {
+                options->accel = ACCEL_LINEAR;
+            }
+            else if(strcmp(value, "bvh") == 0) {
+                options->accel = ACCEL_BVH;
+            }
+            else if(strcmp(value, "cbvh") == 0) {
+                options->accel = ACCEL_COMPRESSED;
+            }
+            else {
+                fprintf(stderr, "Unknown acceleration structure '%s'\n", value);
+                return 0;
+            }
+            i++;
+        }
+        else if(strcmp(arg, "--mesh") == 0 && value) {
+            if(options->mesh_count == OPTIONS_MAX_MESHES) {
+                fprintf(stderr, "Too many meshes\n");
+                return 0;
+            }
+            options->mesh_paths[options->mesh_count++] = value;
+            i++;
+        }
+        else if(strcmp(arg, "--mesh-material") == 0 && value) {
+            options->mesh_material = atoi(value);
+            i++;
+        }
+        else if(strcmp(arg, "--instances") == 0 && value) {
+            if(!parseUnsignedOption(value, 0, OPTIONS_MAX_INSTANCES, &options->instances)) {
+                fprintf(stderr, "Instances have to be between 0 and %u\n", OPTIONS_MAX_INSTANCES);
+                return 0;
+            }
+            i++;
+        }
+        else if(strcmp(arg, "--flatten-instances") == 0) {
+            options->flatten_instances = 1;
+        }
+        else if(strcmp(arg, "--simd") == 0 && value) {
+            const char* levels[] = {"auto", "scalar", "sse", "avx2", "avx512"};
+            const SimdLevel level_values[] = {SIMD_AUTO, SIMD_SCALAR, SIMD_SSE, SIMD_AVX2, SIMD_AVX512};
+            unsigned int level = 0;
+            while(level < 5 && strcmp(value, levels[level]) != 0) {
+                level++;
+            }
+            if(level == 5) {
+                fprintf(stderr, "Unknown SIMD level '%s'\n", value);
+                return 0;
+            }
+            options->simd = level_values[level];
+            i++;
+        }
+        else if(strcmp(arg, "--check-simd") == 0) {
+            options->check_simd = 1;
+        }
+        else if(strcmp(arg, "--seed") == 0 && value) {
+            options->seed = strtoull(value, NULL, 10);
+            i++;
+        }
+        else if(strcmp(arg, "--tile-size") == 0 && value) {
+            options->tile_size = atoi(value);
+            if(options->tile_size == 0) {
+                fprintf(stderr, "Tile size has to be at least 1\n");
+                return 0;
+            }
+            i++;
+        }
+        else if(strcmp(arg, "--tile-order") == 0 && value) {
+            if(strcmp(value, "scanline") == 0) {
+                options->tile_order = TILE_ORDER_SCANLINE;
+            }
+            else if(strcmp(value, "morton") == 0) {
+                options->tile_order = TILE_ORDER_MORTON;
+            }
+            else if(strcmp(value, "spiral") == 0) {
+                options->tile_order = TILE_ORDER_SPIRAL;
+            }
+            else {
+                fprintf(stderr, "Unknown tile order '%s'\n", value);
+                return 0;
+            }
+            i++;
+        }
+        else if(strcmp(arg, "--tile-times") == 0 && value) {
+            options->tile_times_path = value;
+            i++;
+        }
+        else if(strcmp(arg, "--pass-spp") == 0 && value) {
+            if(!parseUnsignedOption(value, 0, OPTIONS_MAX_SPP, &options->pass_spp)) {
+                fprintf(stderr, "Pass spp has to be between 0 and %u\n", OPTIONS_MAX_SPP);
+                return 0;
+            }
+            i++;
+        }
+        else if(strcmp(arg, "--checkpoint") == 0 && value) {
+            options->checkpoint_path = value;
+            i++;
+        }
+        else if(strcmp(arg, "--checkpoint-interval") == 0 && value) {
+            options->checkpoint_interval = atof(value);
+            i++;
+        }
+        else if(strcmp(arg, "--wavefront") == 0) {
+            options->wavefront = 1;
+        }
+        else if(strcmp(arg, "--no-packets") == 0) {
+            options->primary_packets = 0;
+        }
+        else if(strcmp(arg, "--denoise") == 0) {
+            options->denoise = 1;
+        }
+        else if(strcmp(arg, "--denoise-iterations") == 0 && value) {
+            options->denoise_iterations = atoi(value);
+            if(options->denoise_iterations == 0 || options->denoise_iterations > 10) {
+                fprintf(stderr, "Denoise iterations have to be between 1 and 10\n");
+                return 0;
+            }
+            i++;
+        }
+        else if(strcmp(arg, "--features") == 0 && value) {
+            options->features_prefix = value;
+            i++;
+        }
+        else if(strcmp(arg, "--scene") == 0 && value) {
+            options->scene_path = value;
+            i++;
+        }
+        else if(strcmp(arg, "--compile-scene") == 0 && value) {
+            options->compile_scene_path = value;
+            i++;
+        }
+        else if(strcmp(arg, "--serve") == 0) {
+            options->serve = 1;
+        }
+        else if(strcmp(arg, "--frames") == 0 && value) {
+            if(!parseUnsignedOption(value, 1, OPTIONS_MAX_FRAMES, &options->frames)) {
+                fprintf(stderr, "An animation has between 1 and %d frames\n", OPTIONS_MAX_FRAMES);
+                return 0;
+            }
+            i++;
+        }
+        else if(strcmp(arg, "--spin") == 0 && value) {
+            options->spin = atof(value);
+            i++;
+        }
+        else if(strcmp(arg, "--orbit") == 0 && value) {
+            options->orbit = atof(value);
+            i++;
+        }
+        else if(strcmp(arg, "--sway") == 0 && value) {
+            options->sway = atof(value);
+            i++;
+        }
+        else if(strcmp(arg, "--scene-cache-size") == 0 && value) {
+            if(!parseUnsignedOption(value, 1, OPTIONS_MAX_SCENE_CACHE_SIZE, &options->scene_cache_size)) {
+                fprintf(stderr, "The server keeps between 1 and %d scenes\n", OPTIONS_MAX_SCENE_CACHE_SIZE);
+                return 0;
+            }
+            i++;
+        }
+        else if(strcmp(arg, "--adaptive") == 0) {
+            options->adaptive = 1;
+        }
+        else if(strcmp(arg, "--min-spp") == 0 && value) {
+            options->min_spp = atoi(value);
+            if(options->min_spp < 2) {
+                fprintf(stderr, "Minimum spp has to be at least 2 to estimate the variance\n");
+                return 0;
+            }
+            i++;
+        }
+        else if(strcmp(arg, "--target-error") == 0 && value) {
+            options->target_error = atof(value);
+            i++;
+        }
+        else if(strcmp(arg, "--spp-map") == 0 && value) {
+            options->spp_map_path = value;
+            i++;
+        }
+        else if(strcmp(arg, "--no-nee") == 0) {
+            options->next_event_estimation = 0;
+        }
+        else if(strcmp(arg, "--max-depth") == 0 && value) {
+            options->max_depth = atoi(value);
+            if(options->max_depth == 0) {
+                fprintf(stderr, "Maximum depth has to be at least 1\n");
+                return 0;
+            }
+            i++;
+        }
+        else if(strcmp(arg, "--rr-depth") == 0 && value) {
+            options->roulette_depth = atoi(value);
+            i++;
+        }
+        else if(strcmp(arg, "--sampler") == 0 && value) {
+            const char* samplers[] = {"independent", "stratified", "sobol", "bluenoise"};
+            const SamplerType sampler_values[] = {SAMPLER_INDEPENDENT, SAMPLER_STRATIFIED, SAMPLER_SOBOL, SAMPLER_BLUE_NOISE};
+            unsigned int sampler = 0;
+            while(sampler < 4 && strcmp(value, samplers[sampler]) != 0) {
+                sampler++;
+            }
+            if(sampler == 4) {
+                fprintf(stderr, "Unknown sampler '%s'\n", value);
+                return 0;
+            }
+            options->sampler = sampler_values[sampler];
+            i++;
+        }
+        else if(strcmp(arg, "--reference") == 0 && value) {
+            options->reference_path = value;
+            i++;
+        }
+        else if(strcmp(arg, "--size") == 0 && value) {
+            if(sscanf(value, "%ux%u", &options->width, &options->height) != 2 || options->width == 0 || options->height == 0) {
+                fprintf(stderr, "Invalid image size '%s'\n", value);
+                return 0;
+            }
+            i++;
+        }
+        else if(strcmp(arg, "--crop") == 0 && value) {
+            if(sscanf(value, "%u,%u,%u,%u", &options->crop_x, &options->crop_y, &options->crop_width, &options->crop_height) != 4
+                || options->crop_width == 0 || options->crop_height == 0) {
+                fprintf(stderr, "Invalid crop window '%s'\n", value);
+                return 0;
+            }
+            i++;
+        }
+        else if(strcmp(arg, "--camera-pos") == 0 && value) {
+            if(!parseVec3Option(value, &options->camera_position)) {
+                fprintf(stderr, "Invalid camera position '%s'\n", value);
+                return 0;
+            }
+            i++;
+        }
+        else if(strcmp(arg, "--camera-target") == 0 && value) {
+            if(!parseVec3Option(value, &options->camera_target)) {
+                fprintf(stderr, "Invalid camera target '%s'\n", value);
+                return 0;
+            }
+            i++;
+        }
+        else if(strcmp(arg, "--fov") == 0 && value) {
+            options->camera_fov = atof(value);
+            if(options->camera_fov <= 0.0f || options->camera_fov >= 180.0f) {
+                fprintf(stderr, "Field of view has to be between 0 and 180 degrees\n");
+                return 0;
+            }
+            i++;
+        }
+        else if(strcmp(arg, "--output") == 0 && value) {
+            options->output_path = value;
+            const char* extension = strrchr(value, '.');
+            if(!extension || !parseImageFormat(extension + 1, &options->output_format)) {
+                fprintf(stderr, "Output '%s' has to end in .ppm, .pfm or .hdr\n", value);
+                return 0;
+            }
+            i++;
+        }
+        else if(strcmp(arg, "--format") == 0 && value) {
+            if(!parseImageFormat(value, &options->output_format)) {
+                fprintf(stderr, "Unknown image format '%s'\n", value);
+                return 0;
+            }
+            i++;
+        }
+        else if(strcmp(arg, "--workers") == 0 && value) {
+            options->workers = atoi(value);
+            if(options->workers > OPTIONS_MAX_WORKERS) {
+                fprintf(stderr, "At most %d workers are supported\n", OPTIONS_MAX_WORKERS);
+                return 0;
+            }
+            i++;
+        }
+        else if(strcmp(arg, "--worker-threads") == 0 && value) {
+            options->worker_threads = atoi(value);
+            i++;
+        }
+        else if(strcmp(arg, "--worker-timeout") == 0 && value) {
+            options->worker_timeout = atof(value);
+            i++;
+        }
+        else if(arg[0] != '-') {
+            if(!parseUnsignedOption(arg, 1, OPTIONS_MAX_SPP, &options->spp)) {
+                fprintf(stderr, "Samples per pixel have to be between 1 and %u\n", OPTIONS_MAX_SPP);
+                return 0;
+            }
+        }
+        else {
+            fprintf(stderr, "Unknown option '%s'\n", arg);
+            return 0;
+        }
+    }
+    if(options->crop_width == 0) {
+        options->crop_x = 0;
+        options->crop_y = 0;
+        options->crop_width = options->width;
+        options->crop_height = options->height;
+    }
+    if((uint64_t)options->crop_x + options->crop_width > options->width || (uint64_t)options->crop_y + options->crop_height > options->height) {
+        fprintf(stderr, "Crop window doesn't fit into the %ux%u image\n", options->width, options->height);
+        return 0;
+    }
+    // larger tiles give the same schedule, and tile sizes close to 2^32 would overflow
+    const unsigned int crop_extent = options->crop_width > options->crop_height ? options->crop_width : options->crop_height;
+    if(options->tile_size > crop_extent) {
+        options->tile_size = crop_extent;
+    }
+    const Vec3 camera_dir = subVec3(options->camera_target, options->camera_position);
+    if(squaredLength(camera_dir) == 0.0f) {
+        fprintf(stderr, "Camera position and target have to differ\n");
+        return 0;
+    }
+    if(options->instances > 0 && options->mesh_count == 0) {
+        fprintf(stderr, "Instances need at least one mesh\n");
+        return 0;
+    }
+    if(options->compile_scene_path && options->instances > 0 && !options->flatten_instances) {
+        fprintf(stderr, "Scene caches can't hold instances, flatten them\n");
+        return 0;
+    }
+    if(options->accel == ACCEL_COMPRESSED && (options->scene_path || options->compile_scene_path || options->check_simd)) {
+        fprintf(stderr, "Compressed scenes can't be used with scene caches or the SIMD check\n");
+        return 0;
+    }
+    if(options->frames > 0 && (options->workers > 0 || options->checkpoint_path || options->adaptive || options->pass_spp > 0
+        || options->denoise || options->features_prefix || options->reference_path || options->spp_map_path || options->tile_times_path
+        || options->compile_scene_path || options->check_simd || options->serve)) {
+        fprintf(stderr, "Animations render every frame in a single pass and only write the frames\n");
+        return 0;
+    }
+    if((options->spin != 0.0f || options->sway != 0.0f) && (options->frames == 0 || options->instances == 0 || options->flatten_instances)) {
+        fprintf(stderr, "Spin and sway move instances of an animation, they need --frames and --instances\n");
+        return 0;
+    }
+    if(options->orbit != 0.0f && options->frames == 0) {
+        fprintf(stderr, "Orbit moves the camera of an animation, it needs --frames\n");
+        return 0;
+    }
+    if(options->scene_path && options->mesh_count > 0) {
+        fprintf(stderr, "Meshes can't be added to a scene cache, compile them into it\n");
+        return 0;
+    }
+    return 1;
+}
+
+#endif // OPTIONS_H
@@ -0,0 +1,377 @@
+#ifndef PACKET_H
+#define PACKET_H
+
+#include <assert.h>
+#include <float.h>
+#include <math.h>
+
+#include "vec3.h"
+#include "triangle.h"
+#include "ray.h"
+#include "bvh.h"
+#include "simd.h"
+
+// Packet tracing of coherent rays from one origin, like the camera rays of a block of pixels.
+// The packet walks the BVH once for all of its rays: a node is skipped if it lies outside the
+// frustum spanned by the corner rays or behind the farthest hit found so far, and at the leaves
+// the rays are tested in SIMD lanes against one triangle after the other. The lane arithmetic is
+// the same as in the triangle kernel of the active SIMD level, so every ray gets the same hit.
+
+#define PACKET_WIDTH 8
+#define PACKET_MAX_RAYS (PACKET_WIDTH * PACKET_WIDTH)
+// Lanes of the widest packet kernel, the ray arrays are padded to a multiple of it
+#define PACKET_LANES 8
+// Rays are only inside the frustum of the corner rays up to rounding, so planes cull with this relative margin
+#define PACKET_FRUSTUM_EPSILON 1e-4f
+
+typedef struct RayPacket {
+    float dir_x[PACKET_MAX_RAYS] __attribute__((aligned(32)));
+    float dir_y[PACKET_MAX_RAYS] __attribute__((aligned(32)));
+    float dir_z[PACKET_MAX_RAYS] __attribute__((aligned(32)));
+    float inv_dir_x[PACKET_MAX_RAYS] __attribute__((aligned(32)));
+    float inv_dir_y[PACKET_MAX_RAYS] __attribute__((aligned(32)));
+    float inv_dir_z[PACKET_MAX_RAYS] __attribute__((aligned(32)));
+    // closest hit of each ray, handle 0 for a miss
+    float distance[PACKET_MAX_RAYS] __attribute__((aligned(32)));
+    float u[PACKET_MAX_RAYS] __attribute__((aligned(32)));
+    float v[PACKET_MAX_RAYS] __attribute__((aligned(32)));
+    TriangleHandle handle[PACKET_MAX_RAYS] __attribute__((aligned(32)));
+    Vec3 origin;
+    unsigned int count;
+    // count rounded up to PACKET_LANES, the padding lanes never hit anything
+    unsigned int lane_count;
+    // inward normals of the planes through the origin and two neighbouring corner rays
+    Vec3 planes[4];
+    // 1 or -1 if the directions of all rays have this sign on an axis, 0 otherwise
+    int dir_sign[3];
+    Vec3 inv_dir_min, inv_dir_max;
+} RayPacket;
+
+// Starts a packet of count rays, corners are the directions through the corners of
+// the screen rectangle around all rays, given in order around it
+void initRayPacket(RayPacket* packet, Vec3 origin, const Norm3* dirs, unsigned int count, const Norm3 corners[4]) {
+    assert(count > 0 && count <= PACKET_MAX_RAYS);
+    packet->origin = origin;
+    packet->count = count;
+    packet->lane_count = (count + PACKET_LANES - 1) / PACKET_LANES * PACKET_LANES;
+    for(unsigned int lane = 0; lane < packet->lane_count; lane++) {
+        const Norm3 dir = dirs[lane < count ? lane : 0];
+        packet->dir_x[lane] = dir.x;
+        packet->dir_y[lane] = dir.y;
+        packet->dir_z[lane] = dir.z;
+        // same inverse as intersectBvh
+        packet->inv_dir_x[lane] = 1.0f / dir.x;
+        packet->inv_dir_y[lane] = 1.0f / dir.y;
+        packet->inv_dir_z[lane] = 1.0f / dir.z;
+        // a hit has to be closer than 0 in the padding lanes
+        packet->distance[lane] = lane < count ? MAX_DISTANCE : 0.0f;
+        packet->u[lane] = -1.0f;
+        packet->v[lane] = -1.0f;
+        packet->handle[lane] = 0;
+    }
+
+    for(unsigned int axis = 0; axis < 3; axis++) {
+        const float* dir = axis == 0 ? packet->dir_x : axis == 1 ? packet->dir_y : packet->dir_z;
+        const float* inv_dir = axis == 0 ? packet->inv_dir_x : axis == 1 ? packet->inv_dir_y : packet->inv_dir_z;
+        unsigned int positive = 0, negative = 0;
+        float inv_dir_min = FLT_MAX, inv_dir_max = -FLT_MAX;
+        for(unsigned int lane = 0; lane < count; lane++) {
+            positive += dir[lane] > 0.0f;
+            negative += dir[lane] < 0.0f;
+            inv_dir_min = inv_dir[lane] < inv_dir_min ? inv_dir[lane] : inv_dir_min;
+            inv_dir_max = inv_dir[lane] > inv_dir_max ? inv_dir[lane] : inv_dir_max;
+        }
+        packet->inv_dir_min.v[axis] = inv_dir_min;
+        packet->inv_dir_max.v[axis] = inv_dir_max;
+        // tiny components have an infinite inverse, which the interval can't bound
+        const int finite = isfinite(inv_dir_min) && isfinite(inv_dir_max);
+        packet->dir_sign[axis] = !finite ? 0 : positive == count ? 1 : negative == count ? -1 : 0;
+    }
+
+    const Vec3 center = addVec3(addVec3(corners[0], corners[1]), addVec3(corners[2], corners[3]));
+    for(unsigned int i = 0; i < 4; i++) {
+        Vec3 normal = cross(corners[i], corners[(i + 1) % 4]);
+        // a single row or column of rays has no area, the zero normal never culls
+        if(squaredLength(normal) > 0.0f) {
+            normal = normalizeVec3(normal);
+            normal = dot(normal, center) < 0.0f ? multVec3Scalar(normal, -1.0f) : normal;
+        }
+        packet->planes[i] = normal;
+    }
+}
+
+// Returns a lower bound of the distance at which the rays enter the box, or BVH_MISS if no ray
+// can enter it closer than max_distance
+float intersectPacketAabb(const RayPacket* packet, const Aabb* box, float max_distance) {
+    for(unsigned int i = 0; i < 4; i++) {
+        const Vec3 normal = packet->planes[i];
+        // the box is outside if even its corner farthest along the normal is outside
+        const Vec3 corner = {{
+            normal.x >= 0.0f ? box->max.x : box->min.x,
+            normal.y >= 0.0f ? box->max.y : box->min.y,
+            normal.z >= 0.0f ? box->max.z : box->min.z
+        }};
+        const Vec3 offset = subVec3(corner, packet->origin);
+        if(dot(normal, offset) < -PACKET_FRUSTUM_EPSILON * (fabsf(offset.x) + fabsf(offset.y) + fabsf(offset.z))) {
+            return BVH_MISS;
+        }
+    }
+
+    // slab test of intersectAabb over the interval of inverse directions, axes on which
+    // the directions change sign don't bound the distance
+    float t_near = 0.0f;
+    float t_far = max_distance;
+    for(unsigned int i = 0; i < 3; i++) {
+        if(packet->dir_sign[i] == 0) {
+            continue;
+        }
+        const float near_offset = (packet->dir_sign[i] > 0 ? box->min.v[i] : box->max.v[i]) - packet->origin.v[i];
+        const float far_offset = (packet->dir_sign[i] > 0 ? box->max.v[i] : box->min.v[i]) - packet->origin.v[i];
+        const float near_min = near_offset * packet->inv_dir_min.v[i], near_max = near_offset * packet->inv_dir_max.v[i];
+        const float far_min = far_offset * packet->inv_dir_min.v[i], far_max = far_offset * packet->inv_dir_max.v[i];
+        const float t1 = near_min < near_max ? near_min : near_max;
+        const float t2 = far_min > far_max ? far_min : far_max;
+        t_near = t1 > t_near ? t1 : t_near;
+        t_far = t2 < t_far ? t2 : t_far;
+    }
+    return t_near <= t_far ? t_near : BVH_MISS;
+}
+
+// Tests every ray which enters box against the triangles [first, first + count)
+typedef void (*IntersectPacketLeafFunction)(RayPacket* packet, const TrianglePrecomputed* triangles, const Aabb* box,
+    unsigned int first, unsigned int count);
+
+void intersectPacketLeafScalar(RayPacket* packet, const TrianglePrecomputed* triangles, const Aabb* box,
+    unsigned int first, unsigned int count) {
+    for(unsigned int lane = 0; lane < packet->count; lane++) {
+        const Vec3 inv_dir = {{packet->inv_dir_x[lane], packet->inv_dir_y[lane], packet->inv_dir_z[lane]}};
+        if(intersectAabb(box, packet->origin, inv_dir, packet->distance[lane]) == BVH_MISS) {
+            continue;
+        }
+        const Ray ray = {
+            .origin = packet->origin,
+            .dir = {{packet->dir_x[lane], packet->dir_y[lane], packet->dir_z[lane]}}
+        };
+        TriangleIntersection intersection;
+        const unsigned int hit = intersectTrianglesScalar(triangles, first, count, &ray, packet->distance[lane], &intersection);
+        if(hit) {
+            packet->distance[lane] = intersection.distance;
+            packet->u[lane] = intersection.u;
+            packet->v[lane] = intersection.v;
+            packet->handle[lane] = hit;
+        }
+    }
+}
+
+#if SIMD_X86
+
+// Same operations as intersectTrianglesSse with rays instead of triangles in the lanes
+__attribute__((target("sse2")))
+void intersectPacketLeafSse(RayPacket* packet, const TrianglePrecomputed* triangles, const Aabb* box,
+    unsigned int first, unsigned int count) {
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 origin_x = _mm_set1_ps(packet->origin.x), origin_y = _mm_set1_ps(packet->origin.y), origin_z = _mm_set1_ps(packet->origin.z);
+    // box planes relative to the origin, as in intersectAabb
+    const __m128 min_x = _mm_set1_ps(box->min.x - packet->origin.x), max_x = _mm_set1_ps(box->max.x - packet->origin.x);
+    const __m128 min_y = _mm_set1_ps(box->min.y - packet->origin.y), max_y = _mm_set1_ps(box->max.y - packet->origin.y);
+    const __m128 min_z = _mm_set1_ps(box->min.z - packet->origin.z), max_z = _mm_set1_ps(box->max.z - packet->origin.z);
+    for(unsigned int lane = 0; lane < packet->lane_count; lane += 4) {
+        __m128 distance = _mm_load_ps(packet->distance + lane);
+        const __m128 tx1 = _mm_mul_ps(min_x, _mm_load_ps(packet->inv_dir_x + lane)), tx2 = _mm_mul_ps(max_x, _mm_load_ps(packet->inv_dir_x + lane));
+        const __m128 ty1 = _mm_mul_ps(min_y, _mm_load_ps(packet->inv_dir_y + lane)), ty2 = _mm_mul_ps(max_y, _mm_load_ps(packet->inv_dir_y + lane));
+        const __m128 tz1 = _mm_mul_ps(min_z, _mm_load_ps(packet->inv_dir_z + lane)), tz2 = _mm_mul_ps(max_z, _mm_load_ps(packet->inv_dir_z + lane));
+        __m128 t_near = _mm_max_ps(_mm_min_ps(tx2, tx1), zero);
+        __m128 t_far = _mm_min_ps(_mm_max_ps(tx1, tx2), distance);
+        t_near = _mm_max_ps(_mm_min_ps(ty2, ty1), t_near);
+        t_far = _mm_min_ps(_mm_max_ps(ty1, ty2), t_far);
+        t_near = _mm_max_ps(_mm_min_ps(tz2, tz1), t_near);
+        t_far = _mm_min_ps(_mm_max_ps(tz1, tz2), t_far);
+        const __m128 box_mask = _mm_cmple_ps(t_near, t_far);
+        if(!_mm_movemask_ps(box_mask)) {
+            continue;
+        }
+        const __m128 dir_x = _mm_load_ps(packet->dir_x + lane), dir_y = _mm_load_ps(packet->dir_y + lane), dir_z = _mm_load_ps(packet->dir_z + lane);
+        __m128 u = _mm_load_ps(packet->u + lane);
+        __m128 v = _mm_load_ps(packet->v + lane);
+        __m128i handle = _mm_load_si128((const __m128i*)(packet->handle + lane));
+        for(unsigned int i = first; i < first + count; i++) {
+            const __m128 e1x = _mm_set1_ps(triangles->edge12.x[i]), e1y = _mm_set1_ps(triangles->edge12.y[i]), e1z = _mm_set1_ps(triangles->edge12.z[i]);
+            const __m128 e2x = _mm_set1_ps(triangles->edge13.x[i]), e2y = _mm_set1_ps(triangles->edge13.y[i]), e2z = _mm_set1_ps(triangles->edge13.z[i]);
+            const __m128 px = _mm_sub_ps(_mm_mul_ps(dir_y, e2z), _mm_mul_ps(dir_z, e2y));
+            const __m128 py = _mm_sub_ps(_mm_mul_ps(dir_z, e2x), _mm_mul_ps(dir_x, e2z));
+            const __m128 pz = _mm_sub_ps(_mm_mul_ps(dir_x, e2y), _mm_mul_ps(dir_y, e2x));
+            const __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+            const __m128 inv_det = _mm_div_ps(one, det);
+            const __m128 tx = _mm_sub_ps(origin_x, _mm_set1_ps(triangles->v1.x[i]));
+            const __m128 ty = _mm_sub_ps(origin_y, _mm_set1_ps(triangles->v1.y[i]));
+            const __m128 tz = _mm_sub_ps(origin_z, _mm_set1_ps(triangles->v1.z[i]));
+            const __m128 uu = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)), _mm_mul_ps(tz, pz)), inv_det);
+            const __m128 qx = _mm_sub_ps(_mm_mul_ps(ty, e1z), _mm_mul_ps(tz, e1y));
+            const __m128 qy = _mm_sub_ps(_mm_mul_ps(tz, e1x), _mm_mul_ps(tx, e1z));
+            const __m128 qz = _mm_sub_ps(_mm_mul_ps(tx, e1y), _mm_mul_ps(ty, e1x));
+            const __m128 vv = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dir_x, qx), _mm_mul_ps(dir_y, qy)), _mm_mul_ps(dir_z, qz)), inv_det);
+            const __m128 tt = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), inv_det);
+            __m128 mask = _mm_and_ps(box_mask, _mm_cmpneq_ps(det, zero));
+            mask = _mm_and_ps(mask, _mm_cmpge_ps(uu, zero));
+            mask = _mm_and_ps(mask, _mm_cmpge_ps(vv, zero));
+            mask = _mm_and_ps(mask, _mm_cmple_ps(_mm_add_ps(uu, vv), one));
+            mask = _mm_and_ps(mask, _mm_cmpgt_ps(tt, zero));
+            mask = _mm_and_ps(mask, _mm_cmplt_ps(tt, distance));
+            if(!_mm_movemask_ps(mask)) {
+                continue;
+            }
+            distance = _mm_or_ps(_mm_and_ps(mask, tt), _mm_andnot_ps(mask, distance));
+            u = _mm_or_ps(_mm_and_ps(mask, uu), _mm_andnot_ps(mask, u));
+            v = _mm_or_ps(_mm_and_ps(mask, vv), _mm_andnot_ps(mask, v));
+            const __m128i hit_mask = _mm_castps_si128(mask);
+            handle = _mm_or_si128(_mm_and_si128(hit_mask, _mm_set1_epi32((int)(i + 1))), _mm_andnot_si128(hit_mask, handle));
+        }
+        _mm_store_ps(packet->distance + lane, distance);
+        _mm_store_ps(packet->u + lane, u);
+        _mm_store_ps(packet->v + lane, v);
+        _mm_store_si128((__m128i*)(packet->handle + lane), handle);
+    }
+}
+
+// Same operations as intersectTrianglesAvx2 and intersectTrianglesAvx512 with rays in the lanes
+__attribute__((target("avx2,fma")))
+void intersectPacketLeafAvx2(RayPacket* packet, const TrianglePrecomputed* triangles, const Aabb* box,
+    unsigned int first, unsigned int count) {
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 origin_x = _mm256_set1_ps(packet->origin.x), origin_y = _mm256_set1_ps(packet->origin.y), origin_z = _mm256_set1_ps(packet->origin.z);
+    const __m256 min_x = _mm256_set1_ps(box->min.x - packet->origin.x), max_x = _mm256_set1_ps(box->max.x - packet->origin.x);
+    const __m256 min_y = _mm256_set1_ps(box->min.y - packet->origin.y), max_y = _mm256_set1_ps(box->max.y - packet->origin.y);
+    const __m256 min_z = _mm256_set1_ps(box->min.z - packet->origin.z), max_z = _mm256_set1_ps(box->max.z - packet->origin.z);
+    for(unsigned int lane = 0; lane < packet->lane_count; lane += 8) {
+        __m256 distance = _mm256_load_ps(packet->distance + lane);
+        const __m256 tx1 = _mm256_mul_ps(min_x, _mm256_load_ps(packet->inv_dir_x + lane)), tx2 = _mm256_mul_ps(max_x, _mm256_load_ps(packet->inv_dir_x + lane));
+        const __m256 ty1 = _mm256_mul_ps(min_y, _mm256_load_ps(packet->inv_dir_y + lane)), ty2 = _mm256_mul_ps(max_y, _mm256_load_ps(packet->inv_dir_y + lane));
+        const __m256 tz1 = _mm256_mul_ps(min_z, _mm256_load_ps(packet->inv_dir_z + lane)), tz2 = _mm256_mul_ps(max_z, _mm256_load_ps(packet->inv_dir_z + lane));
+        __m256 t_near = _mm256_max_ps(_mm256_min_ps(tx2, tx1), zero);
+        __m256 t_far = _mm256_min_ps(_mm256_max_ps(tx1, tx2), distance);
+        t_near = _mm256_max_ps(_mm256_min_ps(ty2, ty1), t_near);
+        t_far = _mm256_min_ps(_mm256_max_ps(ty1, ty2), t_far);
+        t_near = _mm256_max_ps(_mm256_min_ps(tz2, tz1), t_near);
+        t_far = _mm256_min_ps(_mm256_max_ps(tz1, tz2), t_far);
+        const __m256 box_mask = _mm256_cmp_ps(t_near, t_far, _CMP_LE_OQ);
+        if(!_mm256_movemask_ps(box_mask)) {
+            continue;
+        }
+        const __m256 dir_x = _mm256_load_ps(packet->dir_x + lane), dir_y = _mm256_load_ps(packet->dir_y + lane), dir_z = _mm256_load_ps(packet->dir_z + lane);
+        __m256 u = _mm256_load_ps(packet->u + lane);
+        __m256 v = _mm256_load_ps(packet->v + lane);
+        __m256i handle = _mm256_load_si256((const __m256i*)(packet->handle + lane));
+        for(unsigned int i = first; i < first + count; i++) {
+            const __m256 e1x = _mm256_set1_ps(triangles->edge12.x[i]), e1y = _mm256_set1_ps(triangles->edge12.y[i]), e1z = _mm256_set1_ps(triangles->edge12.z[i]);
+            const __m256 e2x = _mm256_set1_ps(triangles->edge13.x[i]), e2y = _mm256_set1_ps(triangles->edge13.y[i]), e2z = _mm256_set1_ps(triangles->edge13.z[i]);
+            const __m256 px = _mm256_fmsub_ps(dir_y, e2z, _mm256_mul_ps(dir_z, e2y));
+            const __m256 py = _mm256_fmsub_ps(dir_z, e2x, _mm256_mul_ps(dir_x, e2z));
+            const __m256 pz = _mm256_fmsub_ps(dir_x, e2y, _mm256_mul_ps(dir_y, e2x));
+            const __m256 det = _mm256_fmadd_ps(e1z, pz, _mm256_fmadd_ps(e1y, py, _mm256_mul_ps(e1x, px)));
+            const __m256 inv_det = _mm256_div_ps(one, det);
+            const __m256 tx = _mm256_sub_ps(origin_x, _mm256_set1_ps(triangles->v1.x[i]));
+            const __m256 ty = _mm256_sub_ps(origin_y, _mm256_set1_ps(triangles->v1.y[i]));
+            const __m256 tz = _mm256_sub_ps(origin_z, _mm256_set1_ps(triangles->v1.z[i]));
+            const __m256 uu = _mm256_mul_ps(_mm256_fmadd_ps(tz, pz, _mm256_fmadd_ps(ty, py, _mm256_mul_ps(tx, px))), inv_det);
+            const __m256 qx = _mm256_fmsub_ps(ty, e1z, _mm256_mul_ps(tz, e1y));
+            const __m256 qy = _mm256_fmsub_ps(tz, e1x, _mm256_mul_ps(tx, e1z));
+            const __m256 qz = _mm256_fmsub_ps(tx, e1y, _mm256_mul_ps(ty, e1x));
+            const __m256 vv = _mm256_mul_ps(_mm256_fmadd_ps(dir_z, qz, _mm256_fmadd_ps(dir_y, qy, _mm256_mul_ps(dir_x, qx))), inv_det);
+            const __m256 tt = _mm256_mul_ps(_mm256_fmadd_ps(e2z, qz, _mm256_fmadd_ps(e2y, qy, _mm256_mul_ps(e2x, qx))), inv_det);
+            __m256 mask = _mm256_and_ps(box_mask, _mm256_cmp_ps(det, zero, _CMP_NEQ_UQ));
+            mask = _mm256_and_ps(mask, _mm256_cmp_ps(uu, zero, _CMP_GE_OQ));
+            mask = _mm256_and_ps(mask, _mm256_cmp_ps(vv, zero, _CMP_GE_OQ));
+            mask = _mm256_and_ps(mask, _mm256_cmp_ps(_mm256_add_ps(uu, vv), one, _CMP_LE_OQ));
+            mask = _mm256_and_ps(mask, _mm256_cmp_ps(tt, zero, _CMP_GT_OQ));
+            mask = _mm256_and_ps(mask, _mm256_cmp_ps(tt, distance, _CMP_LT_OQ));
+            if(!_mm256_movemask_ps(mask)) {
+                continue;
+            }
+            distance = _mm256_blendv_ps(distance, tt, mask);
+            u = _mm256_blendv_ps(u, uu, mask);
+            v = _mm256_blendv_ps(v, vv, mask);
+            handle = _mm256_blendv_epi8(handle, _mm256_set1_epi32((int)(i + 1)), _mm256_castps_si256(mask));
+        }
+        _mm256_store_ps(packet->distance + lane, distance);
+        _mm256_store_ps(packet->u + lane, u);
+        _mm256_store_ps(packet->v + lane, v);
+        _mm256_store_si256((__m256i*)(packet->handle + lane), handle);
+    }
+}
+
+#endif
+
+IntersectPacketLeafFunction getIntersectPacketLeafFunction(SimdLevel level) {
+#if SIMD_X86
+    switch(level) {
+        case SIMD_SSE: return intersectPacketLeafSse;
+        // the AVX-512 triangle kernel does the same FMA operations as the AVX2 one
+        case SIMD_AVX2: case SIMD_AVX512: return intersectPacketLeafAvx2;
+        default: break;
+    }
+#endif
+    return intersectPacketLeafScalar;
+}
+
+float getPacketMaxDistance(const RayPacket* packet) {
+    float max_distance = 0.0f;
+    for(unsigned int lane = 0; lane < packet->count; lane++) {
+        max_distance = packet->distance[lane] > max_distance ? packet->distance[lane] : max_distance;
+    }
+    return max_distance;
+}
+
+// Closest hit of every ray of the packet, front to back like intersectBvh.
+// Triangles have to be stored in the leaf order returned by buildBvh.
+void intersectPacketBvh(const Bvh* bvh, const TrianglePrecomputed* triangles, RayPacket* packet) {
+    const IntersectPacketLeafFunction intersectPacketLeaf = getIntersectPacketLeafFunction(active_simd_level);
+    float max_distance = getPacketMaxDistance(packet);
+    if(intersectPacketAabb(packet, &bvh->nodes[0].bounds, max_distance) == BVH_MISS) {
+        return;
+    }
+
+    BvhStackEntry stack[BVH_MAX_DEPTH];
+    unsigned int stack_size = 0;
+    unsigned int node_index = 0;
+    while(1) {
+        const BvhNode* node = &bvh->nodes[node_index];
+        if(node->count > 0) {
+            intersectPacketLeaf(packet, triangles, &node->bounds, node->first, node->count);
+            max_distance = getPacketMaxDistance(packet);
+        }
+        else {
+            unsigned int near = node->first;
+            unsigned int far = node->first + 1;
+            float near_distance = intersectPacketAabb(packet, &bvh->nodes[near].bounds, max_distance);
+            float far_distance = intersectPacketAabb(packet, &bvh->nodes[far].bounds, max_distance);
+            if(far_distance < near_distance) {
+                const unsigned int temp_index = near;
+                near = far;
+                far = temp_index;
+                const float temp_distance = near_distance;
+                near_distance = far_distance;
+                far_distance = temp_distance;
+            }
+            if(near_distance != BVH_MISS) {
+                if(far_distance != BVH_MISS) {
+                    stack[stack_size++] = (BvhStackEntry){ .node = far, .distance = far_distance };
+                }
+                node_index = near;
+                continue;
+            }
+        }
+
+        // Pop the next node which can still contain a closer hit for some ray
+        do {
+            if(stack_size == 0) {
+                return;
+            }
+            stack_size--;
+        } while(stack[stack_size].distance >= max_distance);
+        node_index = stack[stack_size].node;
+    }
+}
+
+#endif // PACKET_H
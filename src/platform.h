@@ -0,0 +1,357 @@
+#ifndef PLATFORM_H
+#define PLATFORM_H
+
+#include <stddef.h>
+#include <stdlib.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+// Monotonic wall clock time in seconds
+double getWallTime() {
+#ifdef _WIN32
+    LARGE_INTEGER frequency, counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (double)counter.QuadPart / (double)frequency.QuadPart;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec * 1e-9;
+#endif
+}
+
+// Peak resident set size of the process in bytes
+size_t getPeakRss() {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if(GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+        return (size_t)counters.PeakWorkingSetSize;
+    }
+    return 0;
+#else
+    struct rusage usage;
+    if(getrusage(RUSAGE_SELF, &usage) == 0) {
+        return (size_t)usage.ru_maxrss * 1024;
+    }
+    return 0;
+#endif
+}
+
+// Allocation aligned to alignment, which has to be a power of two multiple of sizeof(void*)
+void* alignedAlloc(size_t size, size_t alignment) {
+#ifdef _WIN32
+    return _aligned_malloc(size, alignment);
+#else
+    void* memory = NULL;
+    return posix_memalign(&memory, alignment, size) == 0 ? memory : NULL;
+#endif
+}
+
+void alignedFree(void* memory) {
+#ifdef _WIN32
+    _aligned_free(memory);
+#else
+    free(memory);
+#endif
+}
+
+typedef struct MappedFile {
+    const char* data;
+    // same memory as data for writable mappings, NULL otherwise
+    char* writable_data;
+    size_t size;
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#endif
+} MappedFile;
+
+// Maps a whole file read-only into memory, returns 0 on failure
+int mapFile(const char* path, MappedFile* mapped) {
+    mapped->data = NULL;
+    mapped->writable_data = NULL;
+    mapped->size = 0;
+#ifdef _WIN32
+    mapped->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if(mapped->file == INVALID_HANDLE_VALUE) {
+        return 0;
+    }
+    LARGE_INTEGER size;
+    if(!GetFileSizeEx(mapped->file, &size) || size.QuadPart == 0) {
+        CloseHandle(mapped->file);
+        return size.QuadPart == 0;
+    }
+    mapped->mapping = CreateFileMappingA(mapped->file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if(!mapped->mapping) {
+        CloseHandle(mapped->file);
+        return 0;
+    }
+    mapped->data = MapViewOfFile(mapped->mapping, FILE_MAP_READ, 0, 0, 0);
+    if(!mapped->data) {
+        CloseHandle(mapped->mapping);
+        CloseHandle(mapped->file);
+        return 0;
+    }
+    mapped->size = (size_t)size.QuadPart;
+    return 1;
+#else
+    const int fd = open(path, O_RDONLY);
+    if(fd < 0) {
+        return 0;
+    }
+    struct stat info;
+    if(fstat(fd, &info) != 0) {
+        close(fd);
+        return 0;
+    }
+    if(info.st_size == 0) {
+        close(fd);
+        return 1;
+    }
+    void* data = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED) {
+        return 0;
+    }
+    madvise(data, (size_t)info.st_size, MADV_SEQUENTIAL);
+    mapped->data = data;
+    mapped->size = (size_t)info.st_size;
+    return 1;
+#endif
+}
+
+// Maps a file read-write, an empty or missing file is created with the given size first.
+// Existing files keep their size, created tells whether the file was new. Returns 0 on failure.
+int mapFileWritable(const char* path, size_t size, MappedFile* mapped, int* created) {
+    mapped->data = NULL;
+    mapped->writable_data = NULL;
+    mapped->size = 0;
+#ifdef _WIN32
+    mapped->file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if(mapped->file == INVALID_HANDLE_VALUE) {
+        return 0;
+    }
+    LARGE_INTEGER existing_size;
+    if(!GetFileSizeEx(mapped->file, &existing_size)) {
+        CloseHandle(mapped->file);
+        return 0;
+    }
+    *created = existing_size.QuadPart == 0;
+    const unsigned long long map_size = *created ? (unsigned long long)size : (unsigned long long)existing_size.QuadPart;
+    // mapping past the end grows the file
+    mapped->mapping = CreateFileMappingA(mapped->file, NULL, PAGE_READWRITE, (DWORD)(map_size >> 32), (DWORD)map_size, NULL);
+    if(!mapped->mapping) {
+        CloseHandle(mapped->file);
+        return 0;
+    }
+    mapped->writable_data = MapViewOfFile(mapped->mapping, FILE_MAP_WRITE, 0, 0, 0);
+    if(!mapped->writable_data) {
+        CloseHandle(mapped->mapping);
+        CloseHandle(mapped->file);
+        return 0;
+    }
+    mapped->data = mapped->writable_data;
+    mapped->size = (size_t)map_size;
+    return 1;
+#else
+    const int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if(fd < 0) {
+        return 0;
+    }
+    struct stat info;
+    if(fstat(fd, &info) != 0) {
+        close(fd);
+        return 0;
+    }
+    *created = info.st_size == 0;
+    if(*created && ftruncate(fd, (off_t)size) != 0) {
+        close(fd);
+        return 0;
+    }
+    const size_t map_size = *created ? size : (size_t)info.st_size;
+    void* data = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED) {
+        return 0;
+    }
+    mapped->writable_data = data;
+    mapped->data = data;
+    mapped->size = map_size;
+    return 1;
+#endif
+}
+
+// Blocks until the given range of a writable mapping is on disk
+int syncMappedFile(MappedFile* mapped, size_t offset, size_t size) {
+#ifdef _WIN32
+    return FlushViewOfFile(mapped->writable_data + offset, size) && FlushFileBuffers(mapped->file);
+#else
+    // msync wants a page aligned start
+    const size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    const size_t aligned_offset = offset / page_size * page_size;
+    return msync(mapped->writable_data + aligned_offset, size + offset - aligned_offset, MS_SYNC) == 0;
+#endif
+}
+
+void unmapFile(MappedFile* mapped) {
+    if(!mapped->data) {
+        return;
+    }
+#ifdef _WIN32
+    UnmapViewOfFile(mapped->data);
+    CloseHandle(mapped->mapping);
+    CloseHandle(mapped->file);
+#else
+    munmap((void*)mapped->data, mapped->size);
+#endif
+    mapped->data = NULL;
+    mapped->writable_data = NULL;
+    mapped->size = 0;
+}
+
+// Creates a directory, returns 0 if it doesn't exist afterwards
+int createDirectory(const char* path) {
+#ifdef _WIN32
+    return CreateDirectoryA(path, NULL) || GetLastError() == ERROR_ALREADY_EXISTS;
+#else
+    return mkdir(path, 0755) == 0 || errno == EEXIST;
+#endif
+}
+
+// Plain threads for background work besides the OpenMP workers
+typedef struct Thread {
+    void (*function)(void*);
+    void* argument;
+#ifdef _WIN32
+    HANDLE handle;
+#else
+    pthread_t handle;
+#endif
+} Thread;
+
+#ifdef _WIN32
+DWORD WINAPI runThread(LPVOID thread) {
+    ((Thread*)thread)->function(((Thread*)thread)->argument);
+    return 0;
+}
+#else
+void* runThread(void* thread) {
+    ((Thread*)thread)->function(((Thread*)thread)->argument);
+    return NULL;
+}
+#endif
+
+// The thread struct has to stay in place until joinThread, returns 0 on failure
+int startThread(Thread* thread, void (*function)(void*), void* argument) {
+    thread->function = function;
+    thread->argument = argument;
+#ifdef _WIN32
+    thread->handle = CreateThread(NULL, 0, runThread, thread, 0, NULL);
+    return thread->handle != NULL;
+#else
+    return pthread_create(&thread->handle, NULL, runThread, thread) == 0;
+#endif
+}
+
+void joinThread(Thread* thread) {
+#ifdef _WIN32
+    WaitForSingleObject(thread->handle, INFINITE);
+    CloseHandle(thread->handle);
+#else
+    pthread_join(thread->handle, NULL);
+#endif
+}
+
+typedef struct Mutex {
+#ifdef _WIN32
+    CRITICAL_SECTION handle;
+#else
+    pthread_mutex_t handle;
+#endif
+} Mutex;
+
+typedef struct Condition {
+#ifdef _WIN32
+    CONDITION_VARIABLE handle;
+#else
+    pthread_cond_t handle;
+#endif
+} Condition;
+
+void initMutex(Mutex* mutex) {
+#ifdef _WIN32
+    InitializeCriticalSection(&mutex->handle);
+#else
+    pthread_mutex_init(&mutex->handle, NULL);
+#endif
+}
+
+void destroyMutex(Mutex* mutex) {
+#ifdef _WIN32
+    DeleteCriticalSection(&mutex->handle);
+#else
+    pthread_mutex_destroy(&mutex->handle);
+#endif
+}
+
+void lockMutex(Mutex* mutex) {
+#ifdef _WIN32
+    EnterCriticalSection(&mutex->handle);
+#else
+    pthread_mutex_lock(&mutex->handle);
+#endif
+}
+
+void unlockMutex(Mutex* mutex) {
+#ifdef _WIN32
+    LeaveCriticalSection(&mutex->handle);
+#else
+    pthread_mutex_unlock(&mutex->handle);
+#endif
+}
+
+void initCondition(Condition* condition) {
+#ifdef _WIN32
+    InitializeConditionVariable(&condition->handle);
+#else
+    pthread_cond_init(&condition->handle, NULL);
+#endif
+}
+
+void destroyCondition(Condition* condition) {
+#ifndef _WIN32
+    pthread_cond_destroy(&condition->handle);
+#endif
+}
+
+// Releases the locked mutex while waiting and locks it again before returning
+void waitCondition(Condition* condition, Mutex* mutex) {
+#ifdef _WIN32
+    SleepConditionVariableCS(&condition->handle, &mutex->handle, INFINITE);
+#else
+    pthread_cond_wait(&condition->handle, &mutex->handle);
+#endif
+}
+
+void signalCondition(Condition* condition) {
+#ifdef _WIN32
+    WakeConditionVariable(&condition->handle);
+#else
+    pthread_cond_signal(&condition->handle);
+#endif
+}
+
+#endif // PLATFORM_H
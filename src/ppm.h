@@ -1,16 +1,47 @@
 #ifndef PPM_H
 #define PPM_H
 
+#include <math.h>
 #include <stdio.h>
  
-void write_ppm(const char *filename, unsigned int dim_x, unsigned int dim_y, unsigned const char* data)
+/* returns 0 if the file couldn't be written */
+int write_ppm(const char *filename, unsigned int dim_x, unsigned int dim_y, unsigned const char* data)
 {
   FILE * fp = fopen(filename, "wb");
+  if (!fp) {
+    return 0;
+  }
   /* write header to the file */
-  fprintf(fp, "P6\n%d %d\n255\n", dim_x, dim_y);
+  fprintf(fp, "P6\n%u %u\n255\n", dim_x, dim_y);
   /* write image data bytes to the file */
-  fwrite(data, sizeof(char), dim_x * dim_y * 3, fp);
+  const int valid = fwrite(data, sizeof(char), (size_t)dim_x * dim_y * 3, fp) == (size_t)dim_x * dim_y * 3;
+  return fclose(fp) == 0 && valid;
+}
+
+/* reads a binary 8 bit ppm of the given size, returns 0 on failure */
+int read_ppm(const char *filename, unsigned int dim_x, unsigned int dim_y, unsigned char* data)
+{
+  FILE * fp = fopen(filename, "rb");
+  if (!fp) {
+    return 0;
+  }
+  unsigned int file_x, file_y, max_value;
+  const int header = fscanf(fp, "P6 %u %u %u", &file_x, &file_y, &max_value) == 3 && fgetc(fp) != EOF;
+  const int valid = header && file_x == dim_x && file_y == dim_y && max_value == 255
+    && fread(data, sizeof(char), dim_x * dim_y * 3, fp) == dim_x * dim_y * 3;
   fclose(fp);
+  return valid;
+}
+
+/* root mean square difference of two images in 8 bit units */
+double image_rmse(const unsigned char* a, const unsigned char* b, unsigned int size)
+{
+  double sum = 0.0;
+  for (unsigned int i = 0; i < size; i++) {
+    const double difference = (double)a[i] - (double)b[i];
+    sum += difference * difference;
+  }
+  return sqrt(sum / (double)size);
 }
 
 #endif // PPM_H
\ No newline at end of file
@@ -0,0 +1,67 @@
+#ifndef RAY_H
+#define RAY_H
+
+#include "vec3.h"
+#include "triangle.h"
+
+#define MAX_DISTANCE 100.0f
+
+typedef struct Ray {
+    Vec3 origin;
+    Norm3 dir;
+} Ray;
+
+typedef struct TriangleIntersection {
+    float u, v;
+    float distance;
+    Vec3 world_pos;
+} TriangleIntersection;
+
+typedef struct TriangleHit {
+    TriangleIntersection intersection;
+    TriangleHandle handle;
+    // index + 1 of the instance whose mesh the triangle belongs to, 0 for triangles of the scene itself
+    unsigned int instance;
+    // shading frame, its normal faces the side the ray came from
+    Frame frame;
+} TriangleHit;
+
+// Moeller-Trumbore test against a precomputed triangle.
+// Writes distance and parametric coords and returns 1 only for hits closer than best_distance.
+int intersectTriangle(const TrianglePrecomputed* triangles, unsigned int index, const Ray* ray, float best_distance, TriangleIntersection* result) {
+    const float e1x = triangles->edge12.x[index], e1y = triangles->edge12.y[index], e1z = triangles->edge12.z[index];
+    const float e2x = triangles->edge13.x[index], e2y = triangles->edge13.y[index], e2z = triangles->edge13.z[index];
+    const float px = ray->dir.y * e2z - ray->dir.z * e2y;
+    const float py = ray->dir.z * e2x - ray->dir.x * e2z;
+    const float pz = ray->dir.x * e2y - ray->dir.y * e2x;
+    const float det = e1x * px + e1y * py + e1z * pz;
+    if(det == 0.0f) {
+        // ray is parallel to the triangle plane
+        return 0;
+    }
+    const float inv_det = 1.0f / det;
+    const float tx = ray->origin.x - triangles->v1.x[index];
+    const float ty = ray->origin.y - triangles->v1.y[index];
+    const float tz = ray->origin.z - triangles->v1.z[index];
+    const float u = (tx * px + ty * py + tz * pz) * inv_det;
+    if(u < 0.0f || u > 1.0f) {
+        return 0;
+    }
+    const float qx = ty * e1z - tz * e1y;
+    const float qy = tz * e1x - tx * e1z;
+    const float qz = tx * e1y - ty * e1x;
+    const float v = (ray->dir.x * qx + ray->dir.y * qy + ray->dir.z * qz) * inv_det;
+    if(v < 0.0f || u + v > 1.0f) {
+        return 0;
+    }
+    const float distance = (e2x * qx + e2y * qy + e2z * qz) * inv_det;
+    if(distance <= 0.0f || distance >= best_distance) {
+        return 0;
+    }
+    result->u = u;
+    result->v = v;
+    result->distance = distance;
+    return 1;
+}
+
+#endif // RAY_H
@@ -0,0 +1,424 @@
+#ifndef RENDER_H
+#define RENDER_H
+
+#include <assert.h>
+#include <math.h>
+#include <stdint.h>
+
+#include "vec3.h"
+#include "ray.h"
+#include "color.h"
+#include "material.h"
+#include "scene.h"
+#include "instances.h"
+#include "sampler.h"
+#include "accumulator.h"
+#include "bsdf.h"
+#include "camera.h"
+#include "packet.h"
+#include "stats.h"
+
+const Color3f BACKGROUND_COLOR = {1.0f, 1.0f, 1.0f};
+
+const Material materials[] = {
+    {.roughness = 1.0f, .emission = 0.0f, .diffuse = { 1.0f, 1.0f, 1.0f}},
+    {.roughness = 1.0f, .emission = 0.0f, .diffuse = { 1.0f, 0.05f, 0.05f}},
+    {.roughness = 0.0f, .emission = 0.0f, .diffuse = { 0.0f, 1.0f, 0.5f}},
+    {.roughness = 1.0f, .emission = 2.0f, .diffuse = { 1.0f, 0.05f, 0.01f}},
+    {.roughness = 1.0f, .emission = 4.0f, .diffuse = { 0.1f, 0.02f, 1.0f}},
+    {.roughness = 1.0f, .emission = 0.0f, .diffuse = { 0.05f, 0.05f, 1.0f}},
+};
+
+// Settings which stay the same for every sample of a render
+typedef struct RenderSettings {
+    // size of the whole image, also when only a crop window of it is rendered
+    unsigned int width, height;
+    Camera camera;
+    uint64_t seed;
+    unsigned int max_depth;
+    // bounces before Russian roulette may end a path
+    unsigned int roulette_depth;
+    int next_event_estimation;
+    SamplerType sampler;
+    // samples per pixel of the whole render, the stratified sampler divides them into strata
+    unsigned int sample_count;
+    // trace the camera rays of neighbouring pixels as packets
+    int primary_packets;
+} RenderSettings;
+
+// A pixel and the samples it gets
+typedef struct PixelSamples {
+    unsigned int x, y;
+    unsigned int first_sample;
+    unsigned int sample_count;
+} PixelSamples;
+
+// Hash of the settings and scene which decide what the samples of a pixel are, so samples of
+// another image are never averaged in. Size and seed are checked on their own.
+uint64_t hashRender(const RenderSettings* settings, const Scene* scene) {
+    uint64_t hash = hashScene(0xcbf29ce484222325ull, scene);
+    hash = hashMemory(hash, &settings->camera, sizeof(settings->camera));
+    const uint32_t values[] = {
+        settings->max_depth,
+        settings->roulette_depth,
+        (uint32_t)settings->next_event_estimation,
+        (uint32_t)settings->sampler,
+        // only the strata depend on the total sample count, other samplers can resume with more samples
+        settings->sampler == SAMPLER_STRATIFIED ? settings->sample_count : 0
+    };
+    return hashMemory(hash, values, sizeof(values));
+}
+
+// Power heuristic weight of a sample drawn with pdf against one drawn with other_pdf
+float getMisWeight(float pdf, float other_pdf) {
+    const float pdf_sq = pdf * pdf;
+    return pdf_sq > 0.0f ? pdf_sq / (pdf_sq + other_pdf * other_pdf) : 0.0f;
+}
+
+// Closest hit along the ray without the shading frame, handle 0 for a miss
+TriangleHit intersectScene(Scene* scene, const Ray ray) {
+    TriangleHit best_hit = {
+        .handle = 0,
+        .intersection = {
+            .distance = MAX_DISTANCE,
+            .u = -1.0f,
+            .v = -1.0f,
+            .world_pos = {0.0f, 0.0f, 0.0f}
+        },
+        .frame = {{{1.0f, 0.0f, 0.0f}}, {{0.0f, 1.0f, 0.0f}}, {{0.0f, 0.0f, 1.0f}}}
+    };
+    #if STATS
+    getThreadStats()->stats.ray_count++;
+    #endif
+
+    if(scene->compressed_bvh.node_count > 0) {
+        intersectCompressedBvh(&scene->compressed_bvh, &scene->indexed_triangles, ray, &best_hit);
+    }
+    else if(scene->bvh.node_count > 0) {
+        intersectBvh(&scene->bvh, &scene->triangle_precomputed, ray, &best_hit);
+    }
+    else {
+        best_hit.handle = intersectTriangles(&scene->triangle_precomputed, 0, scene->triangle_count, &ray, best_hit.intersection.distance, &best_hit.intersection);
+    }
+    if(scene->instance_count > 0) {
+        intersectInstances(scene, ray, &best_hit);
+    }
+
+    if(best_hit.handle != 0) {
+        best_hit.intersection.world_pos = addVec3(ray.origin, multVec3Scalar(ray.dir, best_hit.intersection.distance));
+        #if STATS
+        getThreadStats()->stats.ray_hits++;
+        #endif
+    }
+    return best_hit;
+}
+
+// Shading frame of a triangle hit by a ray along dir, instance is as in TriangleHit
+Frame getHitFrame(const Scene* scene, unsigned int instance, TriangleHandle handle, Norm3 dir) {
+    const unsigned int index = handle - 1;
+    Frame frame;
+    if(instance != 0) {
+        frame = getInstanceFrame(scene, instance, handle);
+    }
+    else if(scene->compressed_bvh.node_count > 0) {
+        frame = getIndexedTriangleFrame(&scene->indexed_triangles, index);
+    }
+    else {
+        frame = (Frame) {
+            .tangent = getVec3ArrayElement(&scene->triangle_precomputed.tangent, index),
+            .bitangent = getVec3ArrayElement(&scene->triangle_precomputed.bitangent, index),
+            .normal = getVec3ArrayElement(&scene->triangle_precomputed.normal, index)
+        };
+    }
+    // triangles are two-sided, flipping normal and bitangent keeps the frame right-handed
+    if(dot(frame.normal, dir) > 0.0f) {
+        frame.normal = multVec3Scalar(frame.normal, -1.0f);
+        frame.bitangent = multVec3Scalar(frame.bitangent, -1.0f);
+    }
+    return frame;
+}
+
+TriangleHit traceRay(Scene* scene, const Ray ray) {
+    TriangleHit hit = intersectScene(scene, ray);
+    if(hit.handle != 0) {
+        hit.frame = getHitFrame(scene, hit.instance, hit.handle, ray.dir);
+    }
+    return hit;
+}
+
+// Returns 1 if anything is hit closer than max_distance
+int traceShadowRay(Scene* scene, const Ray ray, float max_distance) {
+    #if STATS
+    getThreadStats()->stats.ray_count++;
+    getThreadStats()->stats.shadow_rays.count++;
+    #endif
+    int occluded;
+    if(scene->compressed_bvh.node_count > 0) {
+        occluded = occludedCompressedBvh(&scene->compressed_bvh, &scene->indexed_triangles, ray, max_distance);
+    }
+    else if(scene->bvh.node_count > 0) {
+        occluded = occludedBvh(&scene->bvh, &scene->triangle_precomputed, ray, max_distance);
+    }
+    else {
+        TriangleIntersection intersection;
+        occluded = intersectTriangles(&scene->triangle_precomputed, 0, scene->triangle_count, &ray, max_distance, &intersection) != 0;
+    }
+    if(!occluded && scene->instance_count > 0) {
+        occluded = occludedInstances(scene, ray, max_distance);
+    }
+    #if STATS
+    getThreadStats()->stats.shadow_rays.occluded += occluded;
+    #endif
+    return occluded;
+}
+
+// Solid angle density of sampleDirectLight choosing the given point on an emissive triangle.
+// Only triangles of the scene itself are sampled as lights, emissive instances are found by bsdf sampling alone.
+float getLightPdf(Scene* scene, const TriangleHit* hit, Norm3 dir) {
+    if(hit->instance != 0) {
+        return 0.0f;
+    }
+    const float cos_light = fabsf(dot(hit->frame.normal, dir));
+    const float distance = hit->intersection.distance;
+    return cos_light > 0.0f ? scene->lights.area_pdf[hit->handle - 1] * distance * distance / cos_light : 0.0f;
+}
+
+// Shadow ray towards a random point on an emissive triangle and the light it carries if unoccluded
+typedef struct LightConnection {
+    Ray ray;
+    float distance;
+    Color3f radiance;
+    // 0 if nothing can arrive, no shadow ray has to be traced then
+    int valid;
+} LightConnection;
+
+// Samples a point on an emissive triangle for next event estimation. The radiance is reflected
+// towards out and weighted against finding the light by sampling the bsdf.
+LightConnection connectLight(Scene* scene, Vec3 origin, const Material* material, const Frame* frame, Norm3 out, Sampler* sampler) {
+    LightConnection connection = { .valid = 0 };
+    if(scene->lights.count == 0) {
+        return connection;
+    }
+    const LightSample light = sampleLights(&scene->lights, sampler);
+    const Vec3 to_light = subVec3(light.position, origin);
+    const float distance_sq = squaredLength(to_light);
+    const float distance = sqrtf(distance_sq);
+    const Norm3 dir = multVec3Scalar(to_light, 1.0f / distance);
+    const float cos_light = fabsf(dot(light.normal, dir));
+    if(dot(frame->normal, dir) <= 0.0f || cos_light <= 0.0f) {
+        return connection;
+    }
+    const Color3f reflected = evalBsdf(material, frame, out, dir);
+    if(reflected.r + reflected.g + reflected.b <= 0.0f) {
+        return connection;
+    }
+    const Material* light_material = getMaterialPointer(scene, getMaterialHandle(scene, light.handle));
+    const float light_pdf = light.area_pdf * distance_sq / cos_light;
+    const float bsdf_pdf = getBsdfPdf(material, frame, out, dir);
+    const Color3f emitted = multColor3fScalar(light_material->diffuse, light_material->emission);
+    connection.ray = (Ray){ .origin = origin, .dir = dir };
+    // stop short of the light, so it doesn't occlude itself
+    connection.distance = distance * 0.999f;
+    connection.radiance = multColor3f(emitted, multColor3fScalar(reflected, getMisWeight(light_pdf, bsdf_pdf) / light_pdf));
+    connection.valid = 1;
+    return connection;
+}
+
+// Light reflected towards out from a random point on an emissive triangle, weighted
+// against finding the light by sampling the bsdf
+Color3f sampleDirectLight(Scene* scene, Vec3 origin, const Material* material, const Frame* frame, Norm3 out, Sampler* sampler) {
+    const Color3f black = {0.0f, 0.0f, 0.0f};
+    const LightConnection connection = connectLight(scene, origin, material, frame, out, sampler);
+    if(!connection.valid || traceShadowRay(scene, connection.ray, connection.distance)) {
+        return black;
+    }
+    return connection.radiance;
+}
+
+// Radiance arriving along ray, which was sampled with ray_pdf from the bsdf of the last surface
+Color3f sampleBounceRay(Scene* scene, const RenderSettings* settings, Ray ray, float ray_pdf, Sampler* sampler) {
+    Color3f radiance = {0.0f, 0.0f, 0.0f};
+    Color3f throughput = {1.0f, 1.0f, 1.0f};
+    unsigned int depth = 0;
+    while(depth < settings->max_depth) {
+        const TriangleHit hit = traceRay(scene, ray);
+        depth++;
+        if(hit.handle == 0) {
+            radiance = addColor3f(radiance, multColor3f(BACKGROUND_COLOR, throughput));
+            break;
+        }
+
+        const Material material = getMaterial(scene, getHitMaterialHandle(scene, hit.instance, hit.handle));
+        if(material.emission > 0.0f) {
+            #if STATS
+            getThreadStats()->stats.bounce_rays.hit_emissive++;
+            #endif
+            // with next event estimation the light was already sampled at the last surface
+            const float weight = settings->next_event_estimation ? getMisWeight(ray_pdf, getLightPdf(scene, &hit, ray.dir)) : 1.0f;
+            radiance = addColor3f(radiance, multColor3f(throughput, multColor3fScalar(material.diffuse, material.emission * weight)));
+            break;
+        }
+        const Norm3 out = multVec3Scalar(ray.dir, -1.0f);
+        ray.origin = addVec3(hit.intersection.world_pos, multVec3Scalar(hit.frame.normal, 0.001f));
+        if(settings->next_event_estimation) {
+            radiance = addColor3f(radiance, multColor3f(throughput, sampleDirectLight(scene, ray.origin, &material, &hit.frame, out, sampler)));
+        }
+        const BsdfSample bsdf = sampleBsdf(&material, &hit.frame, out, sampler);
+        if(bsdf.pdf <= 0.0f) {
+            break;
+        }
+        throughput = multColor3f(throughput, bsdf.weight);
+        ray.dir = bsdf.dir;
+        ray_pdf = bsdf.pdf;
+        // Russian roulette: dark paths stop early, survivors are weighted up so the estimate stays unbiased.
+        // Survival is capped below 1, otherwise paths between white walls would never stop.
+        if(depth >= settings->roulette_depth) {
+            const float survival = fminf(fmaxf(throughput.r, fmaxf(throughput.g, throughput.b)), 0.95f);
+            if(getSample1D(sampler) >= survival) {
+                #if STATS
+                getThreadStats()->stats.bounce_rays.roulette_terminated++;
+                #endif
+                break;
+            }
+            throughput = multColor3fScalar(throughput, 1.0f / survival);
+        }
+    }
+    #if STATS
+    Stats* stats = &getThreadStats()->stats;
+    stats->bounce_rays.paths++;
+    stats->bounce_rays.reached_max_depth += depth == settings->max_depth;
+    stats->bounce_rays.path_depths[depth < STATS_PATH_DEPTH_BINS ? depth : STATS_PATH_DEPTH_BINS - 1]++;
+    #endif
+    return radiance;
+}
+
+// Camera rays of at most PACKET_MAX_RAYS pixels and their hits. With primary packets and a BVH
+// they are traced as one packet, which is only fast for pixels close to each other.
+void tracePrimaryRays(Scene* scene, const RenderSettings* settings, const PixelSamples* pixels, unsigned int count, Ray* rays, TriangleHit* hits) {
+    assert(count <= PACKET_MAX_RAYS);
+    unsigned int min_x = UINT32_MAX, min_y = UINT32_MAX, max_x = 0, max_y = 0;
+    for(unsigned int i = 0; i < count; i++) {
+        rays[i] = getCameraRay(&settings->camera, pixels[i].x, pixels[i].y, settings->width, settings->height);
+        min_x = pixels[i].x < min_x ? pixels[i].x : min_x;
+        min_y = pixels[i].y < min_y ? pixels[i].y : min_y;
+        max_x = pixels[i].x > max_x ? pixels[i].x : max_x;
+        max_y = pixels[i].y > max_y ? pixels[i].y : max_y;
+    }
+    if(!settings->primary_packets || scene->bvh.node_count == 0 || count == 0) {
+        for(unsigned int i = 0; i < count; i++) {
+            hits[i] = traceRay(scene, rays[i]);
+        }
+        return;
+    }
+
+    RayPacket packet;
+    Norm3 dirs[PACKET_MAX_RAYS];
+    for(unsigned int i = 0; i < count; i++) {
+        dirs[i] = rays[i].dir;
+    }
+    const Norm3 corners[4] = {
+        getCameraRay(&settings->camera, min_x, min_y, settings->width, settings->height).dir,
+        getCameraRay(&settings->camera, max_x, min_y, settings->width, settings->height).dir,
+        getCameraRay(&settings->camera, max_x, max_y, settings->width, settings->height).dir,
+        getCameraRay(&settings->camera, min_x, max_y, settings->width, settings->height).dir
+    };
+    initRayPacket(&packet, settings->camera.position, dirs, count, corners);
+    intersectPacketBvh(&scene->bvh, &scene->triangle_precomputed, &packet);
+    for(unsigned int i = 0; i < count; i++) {
+        hits[i] = (TriangleHit) {
+            .handle = packet.handle[i],
+            .intersection = {
+                .distance = packet.distance[i],
+                .u = packet.u[i],
+                .v = packet.v[i],
+                .world_pos = {0.0f, 0.0f, 0.0f}
+            },
+            .frame = {{{1.0f, 0.0f, 0.0f}}, {{0.0f, 1.0f, 0.0f}}, {{0.0f, 0.0f, 1.0f}}}
+        };
+        // instances are traced one ray at a time behind the packet hit
+        if(scene->instance_count > 0) {
+            intersectInstances(scene, rays[i], &hits[i]);
+        }
+        if(hits[i].handle != 0) {
+            // same as intersectScene and traceRay
+            hits[i].intersection.world_pos = addVec3(rays[i].origin, multVec3Scalar(rays[i].dir, hits[i].intersection.distance));
+            hits[i].frame = getHitFrame(scene, hits[i].instance, hits[i].handle, rays[i].dir);
+        }
+    }
+    #if STATS
+    Stats* stats = &getThreadStats()->stats;
+    stats->ray_count += count;
+    for(unsigned int i = 0; i < count; i++) {
+        stats->ray_hits += hits[i].handle != 0;
+    }
+    #endif
+}
+
+// Returns the sums of the samples [first_sample, first_sample + sample_count) of the pixel whose camera ray is primary_ray
+SampleSum samplePrimaryHit(Scene* scene, const RenderSettings* settings, const unsigned int x, const unsigned int y, const Ray primary_ray, const TriangleHit primary_hit,
+    const unsigned int first_sample, const unsigned int sample_count) {
+    #if STATS
+    getThreadStats()->stats.primary_rays.count++;
+    #endif
+    
+    if(primary_hit.handle != 0) {
+        #if STATS
+        getThreadStats()->stats.primary_rays.hits++;
+        #endif
+        const MaterialHandle material_handle = getHitMaterialHandle(scene, primary_hit.instance, primary_hit.handle);
+        const Material primary_hit_material = getMaterial(scene, material_handle);
+        if(primary_hit_material.emission > 0.0f) {
+            #if STATS
+            getThreadStats()->stats.primary_rays.hit_emissive++;
+            #endif
+            const Color3f emitted = multColor3fScalar(primary_hit_material.diffuse, primary_hit_material.emission);
+            return (SampleSum){multColor3fScalar(emitted, (float)sample_count), multColor3fScalar(multColor3f(emitted, emitted), (float)sample_count)};
+        }
+        const Vec3 ray_origin = addVec3(primary_hit.intersection.world_pos, multVec3Scalar(primary_hit.frame.normal, 0.001f));
+        const Norm3 out = multVec3Scalar(primary_ray.dir, -1.0f);
+        SampleSum pixel_color_sum = {{{0.0f, 0.0f, 0.0f}}, {{0.0f, 0.0f, 0.0f}}};
+
+        const unsigned int pixel_index = x + y * settings->width;
+        for(unsigned int samples = first_sample; samples < first_sample + sample_count; samples++) {
+            Sampler sampler = createSampler(settings->sampler, settings->seed, x, y, pixel_index, samples, settings->sample_count);
+            Color3f incoming = {0.0f, 0.0f, 0.0f};
+            if(settings->next_event_estimation) {
+                incoming = sampleDirectLight(scene, ray_origin, &primary_hit_material, &primary_hit.frame, out, &sampler);
+            }
+            const BsdfSample bsdf = sampleBsdf(&primary_hit_material, &primary_hit.frame, out, &sampler);
+            if(bsdf.pdf > 0.0f) {
+                const Ray ray = {
+                    .origin = ray_origin,
+                    .dir = bsdf.dir
+                };
+                incoming = addColor3f(incoming, multColor3f(bsdf.weight, sampleBounceRay(scene, settings, ray, bsdf.pdf, &sampler)));
+            }
+            addSample(&pixel_color_sum, incoming);
+        }
+        return pixel_color_sum;
+    }
+    return (SampleSum){multColor3fScalar(BACKGROUND_COLOR, (float)sample_count), multColor3fScalar(multColor3f(BACKGROUND_COLOR, BACKGROUND_COLOR), (float)sample_count)};
+}
+
+// Returns the sums of the samples [first_sample, first_sample + sample_count)
+SampleSum samplePixelColor(Scene* scene, const RenderSettings* settings, const unsigned int x, const unsigned int y, const unsigned int first_sample, const unsigned int sample_count) {
+    const Ray primary_ray = getCameraRay(&settings->camera, x, y, settings->width, settings->height);
+    return samplePrimaryHit(scene, settings, x, y, primary_ray, traceRay(scene, primary_ray), first_sample, sample_count);
+}
+
+// Sums the samples of each pixel into sums like samplePixelColor, camera rays are traced
+// in groups of PACKET_MAX_RAYS pixels, so pixels should be listed e.g. row by row of a tile
+void samplePixels(Scene* scene, const RenderSettings* settings, const PixelSamples* pixels, unsigned int pixel_count, SampleSum* sums) {
+    Ray rays[PACKET_MAX_RAYS];
+    TriangleHit hits[PACKET_MAX_RAYS];
+    for(unsigned int start = 0; start < pixel_count; start += PACKET_MAX_RAYS) {
+        const unsigned int count = pixel_count - start < PACKET_MAX_RAYS ? pixel_count - start : PACKET_MAX_RAYS;
+        tracePrimaryRays(scene, settings, pixels + start, count, rays, hits);
+        for(unsigned int i = 0; i < count; i++) {
+            const PixelSamples* pixel = &pixels[start + i];
+            sums[start + i] = samplePrimaryHit(scene, settings, pixel->x, pixel->y, rays[i], hits[i], pixel->first_sample, pixel->sample_count);
+        }
+    }
+}
+
+#endif // RENDER_H
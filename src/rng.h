@@ -0,0 +1,50 @@
+#ifndef RNG_H
+#define RNG_H
+
+#include <stdint.h>
+
+// PCG32 generator, every thread works on its own copy so there is no shared state
+typedef struct Rng {
+    uint64_t state;
+    uint64_t increment;
+} Rng;
+
+uint64_t mixRandomSeed(uint64_t value) {
+    // splitmix64 finalizer
+    value += 0x9E3779B97F4A7C15ull;
+    value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9ull;
+    value = (value ^ (value >> 27)) * 0x94D049BB133111EBull;
+    return value ^ (value >> 31);
+}
+
+uint32_t nextRandom(Rng* rng) {
+    const uint64_t old_state = rng->state;
+    rng->state = old_state * 6364136223846793005ull + rng->increment;
+    const uint32_t xorshifted = (uint32_t)(((old_state >> 18u) ^ old_state) >> 27u);
+    const uint32_t rotation = (uint32_t)(old_state >> 59u);
+    return (xorshifted >> rotation) | (xorshifted << ((-rotation) & 31));
+}
+
+// Seeds a generator deterministically, so the same seed, pixel, sample and
+// dimension always produce the same numbers independent of the thread
+Rng createRng(uint64_t seed, uint32_t pixel, uint32_t sample, uint32_t dimension) {
+    uint64_t hash = mixRandomSeed(seed);
+    hash = mixRandomSeed(hash ^ pixel);
+    hash = mixRandomSeed(hash ^ sample);
+    hash = mixRandomSeed(hash ^ dimension);
+    Rng rng = {
+        .state = 0,
+        .increment = (mixRandomSeed(hash) << 1u) | 1u
+    };
+    nextRandom(&rng);
+    rng.state += hash;
+    nextRandom(&rng);
+    return rng;
+}
+
+// Uniform float in [0, 1)
+float randFloat(Rng* rng) {
+    return (float)(nextRandom(rng) >> 8) * (1.0f / 16777216.0f);
+}
+
+#endif // RNG_H
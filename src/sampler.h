@@ -0,0 +1,306 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <assert.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rng.h"
+
+typedef enum SamplerType {
+    SAMPLER_INDEPENDENT,
+    SAMPLER_STRATIFIED,
+    SAMPLER_SOBOL,
+    SAMPLER_BLUE_NOISE
+} SamplerType;
+
+// Numbers of one sample of one pixel. Every call to getSample1D or getSample2D uses up the
+// next dimension, so a path asks for its numbers in the same order for every sample.
+typedef struct Sampler {
+    SamplerType type;
+    // scrambling seed of this pixel, the blue noise sampler uses the same one for all pixels
+    uint64_t seed;
+    uint32_t pixel_x, pixel_y;
+    uint32_t sample;
+    // samples per pixel the stratified sampler divides its strata into
+    uint32_t sample_count;
+    uint32_t dimension;
+    // only used by the independent sampler
+    Rng rng;
+} Sampler;
+
+#define BLUE_NOISE_SIZE 64
+
+// Ranks of a void-and-cluster pattern mapped to [0, 1), see initBlueNoise
+float blue_noise[BLUE_NOISE_SIZE * BLUE_NOISE_SIZE];
+
+float toUnitFloat(uint32_t value) {
+    return (float)(value >> 8) * (1.0f / 16777216.0f);
+}
+
+uint32_t reverseBits(uint32_t x) {
+    x = (x << 16) | (x >> 16);
+    x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+    x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+    x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+    x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+    return x;
+}
+
+// Owen scrambling by hashing from Burley, "Practical Hash-based Owen Scrambling". The input has its
+// bits reversed, so every bit is only flipped depending on the more significant ones. The result isn't reversed.
+uint32_t scrambleOwenReversed(uint32_t x, uint32_t seed) {
+    x ^= x * 0x3d20adeau;
+    x += seed;
+    x *= (seed >> 16) | 1u;
+    x ^= x * 0x05526c56u;
+    x ^= x * 0x53a22864u;
+    return reverseBits(x);
+}
+
+// The first Sobol dimension with reversed bits is the index itself. The second one has the Pascal matrix
+// mod 2 as generator, its element j, k is odd exactly when the bits of j are a subset of those of k,
+// so the product is a superset sum over the bit positions.
+uint32_t getSobol1Reversed(uint32_t index) {
+    index ^= (index >> 1) & 0x55555555u;
+    index ^= (index >> 2) & 0x33333333u;
+    index ^= (index >> 4) & 0x0f0f0f0fu;
+    index ^= (index >> 8) & 0x00ff00ffu;
+    index ^= (index >> 16) & 0x0000ffffu;
+    return index;
+}
+
+// Pseudo random permutation of [0, count) from Kensler, "Correlated Multi-Jittered Sampling"
+uint32_t permuteIndex(uint32_t index, uint32_t count, uint32_t seed) {
+    uint32_t mask = count - 1;
+    mask |= mask >> 1;
+    mask |= mask >> 2;
+    mask |= mask >> 4;
+    mask |= mask >> 8;
+    mask |= mask >> 16;
+    do {
+        index ^= seed;
+        index *= 0xe170893du;
+        index ^= seed >> 16;
+        index ^= (index & mask) >> 4;
+        index ^= seed >> 8;
+        index *= 0x0929eb3fu;
+        index ^= seed >> 23;
+        index ^= (index & mask) >> 1;
+        index *= 1u | seed >> 27;
+        index *= 0x6935fa69u;
+        index ^= (index & mask) >> 11;
+        index *= 0x74dcb303u;
+        index ^= (index & mask) >> 2;
+        index *= 0x9e501cc3u;
+        index ^= (index & mask) >> 2;
+        index *= 0xc860a3dfu;
+        index &= mask;
+        index ^= index >> 5;
+    } while(index >= count);
+    return (index + seed) % count;
+}
+
+// Offset inside a stratum of stratum_count, the result stays below 1
+float getStratumSample(uint32_t stratum, uint32_t stratum_count, uint32_t jitter_seed) {
+    return fminf(((float)stratum + toUnitFloat(jitter_seed)) / (float)stratum_count, 0x1.fffffep-1f);
+}
+
+float getBlueNoise(uint32_t x, uint32_t y, uint32_t seed) {
+    // every dimension reads the texture at its own toroidal offset
+    const uint32_t offset_x = seed & (BLUE_NOISE_SIZE - 1);
+    const uint32_t offset_y = (seed >> 16) & (BLUE_NOISE_SIZE - 1);
+    return blue_noise[((x + offset_x) & (BLUE_NOISE_SIZE - 1)) + ((y + offset_y) & (BLUE_NOISE_SIZE - 1)) * BLUE_NOISE_SIZE];
+}
+
+float wrapUnitFloat(float value) {
+    return value >= 1.0f ? value - 1.0f : value;
+}
+
+Sampler createSampler(SamplerType type, uint64_t seed, uint32_t pixel_x, uint32_t pixel_y, uint32_t pixel_index, uint32_t sample, uint32_t sample_count) {
+    const uint64_t sequence_seed = mixRandomSeed(seed);
+    return (Sampler) {
+        .type = type,
+        .seed = type == SAMPLER_BLUE_NOISE ? sequence_seed : mixRandomSeed(sequence_seed ^ pixel_index),
+        .pixel_x = pixel_x,
+        .pixel_y = pixel_y,
+        .sample = sample,
+        .sample_count = sample_count,
+        .dimension = 0,
+        .rng = type == SAMPLER_INDEPENDENT ? createRng(seed, pixel_index, sample, 0) : (Rng){0, 0}
+    };
+}
+
+// 64 random bits for the next dimension, callers take their seeds from different bits
+uint64_t nextSamplerDimension(Sampler* sampler) {
+    return mixRandomSeed(sampler->seed + sampler->dimension++);
+}
+
+void getSample2D(Sampler* sampler, float* u, float* v) {
+    switch(sampler->type) {
+        case SAMPLER_STRATIFIED: {
+            const uint64_t hash = nextSamplerDimension(sampler);
+            const uint64_t jitter = mixRandomSeed(hash ^ sampler->sample);
+            const uint32_t strata = (uint32_t)sqrtf((float)sampler->sample_count);
+            if(sampler->sample >= strata * strata) {
+                // samples beyond the square grid, e.g. when a checkpoint is topped up, are only jittered
+                *u = toUnitFloat((uint32_t)jitter);
+                *v = toUnitFloat((uint32_t)(jitter >> 32));
+                return;
+            }
+            const uint32_t stratum = permuteIndex(sampler->sample, strata * strata, (uint32_t)hash);
+            *u = getStratumSample(stratum % strata, strata, (uint32_t)jitter);
+            *v = getStratumSample(stratum / strata, strata, (uint32_t)(jitter >> 32));
+            return;
+        }
+        case SAMPLER_SOBOL:
+        case SAMPLER_BLUE_NOISE: {
+            const uint64_t hash = nextSamplerDimension(sampler);
+            const uint32_t index_seed = (uint32_t)hash;
+            const uint32_t u_seed = (uint32_t)(hash >> 32);
+            const uint32_t v_seed = index_seed * 0x9e3779b9u ^ u_seed;
+            // shuffling the sample index by scrambling it keeps the sequence stratified
+            const uint32_t index = scrambleOwenReversed(reverseBits(sampler->sample), index_seed);
+            *u = toUnitFloat(scrambleOwenReversed(index, u_seed));
+            *v = toUnitFloat(scrambleOwenReversed(getSobol1Reversed(index), v_seed));
+            if(sampler->type == SAMPLER_BLUE_NOISE) {
+                // the sequence is shared by all pixels and shifted per pixel, so the error of neighbours is anti-correlated
+                *u = wrapUnitFloat(*u + getBlueNoise(sampler->pixel_x, sampler->pixel_y, index_seed));
+                *v = wrapUnitFloat(*v + getBlueNoise(sampler->pixel_x, sampler->pixel_y, u_seed));
+            }
+            return;
+        }
+        default:
+            *u = randFloat(&sampler->rng);
+            *v = randFloat(&sampler->rng);
+            return;
+    }
+}
+
+float getSample1D(Sampler* sampler) {
+    switch(sampler->type) {
+        case SAMPLER_STRATIFIED: {
+            const uint64_t hash = nextSamplerDimension(sampler);
+            const uint32_t jitter = (uint32_t)mixRandomSeed(hash ^ sampler->sample);
+            if(sampler->sample >= sampler->sample_count) {
+                return toUnitFloat(jitter);
+            }
+            return getStratumSample(permuteIndex(sampler->sample, sampler->sample_count, (uint32_t)hash), sampler->sample_count, jitter);
+        }
+        case SAMPLER_SOBOL:
+        case SAMPLER_BLUE_NOISE: {
+            float u, v;
+            getSample2D(sampler, &u, &v);
+            return u;
+        }
+        default:
+            return randFloat(&sampler->rng);
+    }
+}
+
+// Toroidal gaussian energy of a pattern pixel at the distance dx, dy
+float getBlueNoiseKernel(int dx, int dy) {
+    dx = abs(dx) > BLUE_NOISE_SIZE / 2 ? BLUE_NOISE_SIZE - abs(dx) : abs(dx);
+    dy = abs(dy) > BLUE_NOISE_SIZE / 2 ? BLUE_NOISE_SIZE - abs(dy) : abs(dy);
+    return expf(-(float)(dx * dx + dy * dy) / (2.0f * 1.5f * 1.5f));
+}
+
+void updateBlueNoiseEnergy(float* energy, const float* kernel, unsigned int pixel, float sign) {
+    const unsigned int px = pixel % BLUE_NOISE_SIZE;
+    const unsigned int py = pixel / BLUE_NOISE_SIZE;
+    for(unsigned int y = 0; y < BLUE_NOISE_SIZE; y++) {
+        for(unsigned int x = 0; x < BLUE_NOISE_SIZE; x++) {
+            const unsigned int dx = (x - px) & (BLUE_NOISE_SIZE - 1);
+            const unsigned int dy = (y - py) & (BLUE_NOISE_SIZE - 1);
+            energy[x + y * BLUE_NOISE_SIZE] += sign * kernel[dx + dy * BLUE_NOISE_SIZE];
+        }
+    }
+}
+
+// Set pixel with the highest energy (tightest cluster) or unset pixel with the lowest (largest void)
+unsigned int findBlueNoiseExtreme(const float* energy, const unsigned char* pattern, int find_cluster) {
+    unsigned int best = 0;
+    float best_energy = find_cluster ? -INFINITY : INFINITY;
+    for(unsigned int i = 0; i < BLUE_NOISE_SIZE * BLUE_NOISE_SIZE; i++) {
+        if(pattern[i] != find_cluster) {
+            continue;
+        }
+        if(find_cluster ? energy[i] > best_energy : energy[i] < best_energy) {
+            best = i;
+            best_energy = energy[i];
+        }
+    }
+    return best;
+}
+
+// Builds the blue noise texture with Ulichney's void-and-cluster method, has to be called
+// once before the blue noise sampler is used
+void initBlueNoise(uint64_t seed) {
+    const unsigned int pixel_count = BLUE_NOISE_SIZE * BLUE_NOISE_SIZE;
+    float* kernel = malloc(sizeof(float) * pixel_count);
+    float* energy = calloc(pixel_count, sizeof(float));
+    float* initial_energy = malloc(sizeof(float) * pixel_count);
+    unsigned char* pattern = calloc(pixel_count, 1);
+    unsigned char* initial_pattern = malloc(pixel_count);
+    unsigned int* ranks = malloc(sizeof(unsigned int) * pixel_count);
+    assert(kernel && energy && initial_energy && pattern && initial_pattern && ranks);
+    for(unsigned int y = 0; y < BLUE_NOISE_SIZE; y++) {
+        for(unsigned int x = 0; x < BLUE_NOISE_SIZE; x++) {
+            kernel[x + y * BLUE_NOISE_SIZE] = getBlueNoiseKernel((int)x, (int)y);
+        }
+    }
+
+    // random initial pattern, relaxed by moving the tightest cluster into the largest void
+    Rng rng = createRng(seed, 0, 0, 0);
+    const unsigned int initial_count = pixel_count / 10;
+    for(unsigned int count = 0; count < initial_count;) {
+        const unsigned int pixel = nextRandom(&rng) % pixel_count;
+        if(!pattern[pixel]) {
+            pattern[pixel] = 1;
+            updateBlueNoiseEnergy(energy, kernel, pixel, 1.0f);
+            count++;
+        }
+    }
+    for(;;) {
+        const unsigned int cluster = findBlueNoiseExtreme(energy, pattern, 1);
+        pattern[cluster] = 0;
+        updateBlueNoiseEnergy(energy, kernel, cluster, -1.0f);
+        const unsigned int gap = findBlueNoiseExtreme(energy, pattern, 0);
+        pattern[gap] = 1;
+        updateBlueNoiseEnergy(energy, kernel, gap, 1.0f);
+        if(gap == cluster) {
+            break;
+        }
+    }
+    memcpy(initial_pattern, pattern, pixel_count);
+    memcpy(initial_energy, energy, sizeof(float) * pixel_count);
+
+    // the initial pixels are ranked by removing clusters, all others by filling voids
+    for(unsigned int rank = initial_count; rank > 0; rank--) {
+        const unsigned int cluster = findBlueNoiseExtreme(energy, pattern, 1);
+        pattern[cluster] = 0;
+        updateBlueNoiseEnergy(energy, kernel, cluster, -1.0f);
+        ranks[cluster] = rank - 1;
+    }
+    memcpy(pattern, initial_pattern, pixel_count);
+    memcpy(energy, initial_energy, sizeof(float) * pixel_count);
+    for(unsigned int rank = initial_count; rank < pixel_count; rank++) {
+        const unsigned int gap = findBlueNoiseExtreme(energy, pattern, 0);
+        pattern[gap] = 1;
+        updateBlueNoiseEnergy(energy, kernel, gap, 1.0f);
+        ranks[gap] = rank;
+    }
+    for(unsigned int i = 0; i < pixel_count; i++) {
+        blue_noise[i] = ((float)ranks[i] + 0.5f) / (float)pixel_count;
+    }
+    free(kernel);
+    free(energy);
+    free(initial_energy);
+    free(pattern);
+    free(initial_pattern);
+    free(ranks);
+}
+
+#endif // SAMPLER_H
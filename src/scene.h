@@ -1,17 +1,125 @@
 #ifndef SCENE_H
 #define SCENE_H
 
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
 #include "triangle.h"
 #include "material.h"
+#include "bvh.h"
+#include "compressed_bvh.h"
+#include "lights.h"
+#include "platform.h"
+#include "transform.h"
 
-#define MAX_TRIANGLES 100
+// A mesh shared by many instances, placed into the scene by a transform
+typedef struct Instance {
+    Transform to_world;
+    Transform to_object;
+    // index into the meshes of the scene
+    unsigned int mesh;
+    // replaces the materials of the mesh, 0 keeps them
+    MaterialHandle material;
+} Instance;
 
 typedef struct Scene {
-    TriangleVertices triangle_vertices[MAX_TRIANGLES];
-    MaterialHandle triangle_material_handles[MAX_TRIANGLES];
+    // triangles are in world space, or in object space for the meshes of instances
+    TriangleVertices* triangle_vertices;
+    MaterialHandle* triangle_material_handles;
     unsigned int triangle_count;
+    unsigned int triangle_capacity;
+    TrianglePrecomputed triangle_precomputed;
+    Bvh bvh;
+    // replace the vertices, precomputed data and BVH above after compressScene
+    IndexedTriangles indexed_triangles;
+    CompressedBvh compressed_bvh;
+    Lights lights;
+    // two-level acceleration structure: the BVH over the world bounds of the instances
+    // leads to the BVHs of their meshes, which are only stored once
+    struct Scene* meshes;
+    unsigned int mesh_count;
+    Instance* instances;
+    unsigned int instance_count;
+    Bvh instance_bvh;
+    // indexed by material handle - 1, not owned by the scene
+    const Material* materials;
+    unsigned int material_count;
+    // when the scene was loaded from a scene cache all arrays point into this read-only mapping
+    MappedFile cache;
 } Scene;
 
+void freeTrianglePrecomputed(TrianglePrecomputed* precomputed) {
+    // every array lives in the allocation of v1.x
+    free(precomputed->v1.x);
+    memset(precomputed, 0, sizeof(*precomputed));
+}
+
+Scene createScene() {
+    return (Scene) {
+        .triangle_vertices = NULL,
+        .triangle_material_handles = NULL,
+        .triangle_count = 0,
+        .triangle_capacity = 0,
+        .triangle_precomputed = {{0}},
+        .bvh = { .nodes = NULL, .node_count = 0 },
+        .indexed_triangles = createIndexedTriangles(),
+        .compressed_bvh = { .nodes = NULL, .node_count = 0 },
+        .lights = createLights(),
+        .meshes = NULL,
+        .mesh_count = 0,
+        .instances = NULL,
+        .instance_count = 0,
+        .instance_bvh = { .nodes = NULL, .node_count = 0 },
+        .materials = NULL,
+        .material_count = 0,
+        .cache = { .data = NULL }
+    };
+}
+
+void freeScene(Scene* scene) {
+    if(scene->cache.data) {
+        unmapFile(&scene->cache);
+        *scene = createScene();
+        return;
+    }
+    free(scene->triangle_vertices);
+    free(scene->triangle_material_handles);
+    freeTrianglePrecomputed(&scene->triangle_precomputed);
+    freeBvh(&scene->bvh);
+    freeIndexedTriangles(&scene->indexed_triangles);
+    freeCompressedBvh(&scene->compressed_bvh);
+    freeLights(&scene->lights);
+    for(unsigned int i = 0; i < scene->mesh_count; i++) {
+        freeScene(&scene->meshes[i]);
+    }
+    free(scene->meshes);
+    free(scene->instances);
+    freeBvh(&scene->instance_bvh);
+    *scene = createScene();
+}
+
+void reserveTriangles(Scene* scene, unsigned int capacity) {
+    if(capacity <= scene->triangle_capacity) {
+        return;
+    }
+    scene->triangle_vertices = realloc(scene->triangle_vertices, sizeof(TriangleVertices) * capacity);
+    scene->triangle_material_handles = realloc(scene->triangle_material_handles, sizeof(MaterialHandle) * capacity);
+    assert(scene->triangle_vertices && scene->triangle_material_handles);
+    scene->triangle_capacity = capacity;
+}
+
+TriangleHandle addTriangle(Scene* scene, TriangleVertices vertices, MaterialHandle material_handle) {
+    if(scene->triangle_count == scene->triangle_capacity) {
+        reserveTriangles(scene, scene->triangle_capacity < 64 ? 64 : scene->triangle_capacity * 2);
+    }
+    scene->triangle_vertices[scene->triangle_count] = vertices;
+    scene->triangle_material_handles[scene->triangle_count] = material_handle;
+    scene->triangle_count++;
+    return scene->triangle_count;
+}
+
 TriangleVertices getTriangleVertices(Scene* scene, TriangleHandle handle) {
     return scene->triangle_vertices[handle-1];
 }
@@ -20,4 +128,336 @@ MaterialHandle getMaterialHandle(Scene* scene, TriangleHandle handle) {
     return scene->triangle_material_handles[handle-1];
 }
 
-#endif // SCENE_H
\ No newline at end of file
+// Material handle of a hit triangle, instance is as in TriangleHit
+MaterialHandle getHitMaterialHandle(const Scene* scene, unsigned int instance, TriangleHandle handle) {
+    if(instance == 0) {
+        return scene->triangle_material_handles[handle - 1];
+    }
+    const Instance* hit_instance = &scene->instances[instance - 1];
+    return hit_instance->material != 0 ? hit_instance->material : scene->meshes[hit_instance->mesh].triangle_material_handles[handle - 1];
+}
+
+Material getMaterial(const Scene* scene, MaterialHandle handle) {
+    return scene->materials[handle - 1];
+}
+
+// Without copying, for loops over many hits
+const Material* getMaterialPointer(const Scene* scene, MaterialHandle handle) {
+    return &scene->materials[handle - 1];
+}
+
+// Uniformly scales and moves the given triangle range so it stands centered on the bottom of target
+void fitTriangles(Scene* scene, unsigned int first, unsigned int count, Aabb target) {
+    if(count == 0) {
+        return;
+    }
+    Aabb bounds = emptyAabb();
+    for(unsigned int i = first; i < first + count; i++) {
+        bounds = mergeAabb(bounds, triangleAabb(scene->triangle_vertices[i]));
+    }
+    const Vec3 extent = subVec3(bounds.max, bounds.min);
+    const Vec3 target_extent = subVec3(target.max, target.min);
+    float scale = FLT_MAX;
+    for(unsigned int axis = 0; axis < 3; axis++) {
+        if(extent.v[axis] > 0.0f && target_extent.v[axis] / extent.v[axis] < scale) {
+            scale = target_extent.v[axis] / extent.v[axis];
+        }
+    }
+    if(scale == FLT_MAX) {
+        scale = 1.0f;
+    }
+    const Vec3 offset = {
+        .x = (target.min.x + target.max.x) * 0.5f - (bounds.min.x + bounds.max.x) * 0.5f * scale,
+        .y = target.min.y - bounds.min.y * scale,
+        .z = (target.min.z + target.max.z) * 0.5f - (bounds.min.z + bounds.max.z) * 0.5f * scale
+    };
+    for(unsigned int i = first; i < first + count; i++) {
+        for(unsigned int k = 0; k < 3; k++) {
+            scene->triangle_vertices[i].v[k] = addVec3(multVec3Scalar(scene->triangle_vertices[i].v[k], scale), offset);
+        }
+    }
+}
+
+// Builds the BVH and reorders the triangles of the scene into its leaf order
+void buildSceneBvh(Scene* scene) {
+    const unsigned int count = scene->triangle_count;
+    if(count == 0) {
+        return;
+    }
+    unsigned int* order = malloc(sizeof(unsigned int) * count);
+    TriangleVertices* vertices = malloc(sizeof(TriangleVertices) * count);
+    MaterialHandle* material_handles = malloc(sizeof(MaterialHandle) * count);
+    assert(order && vertices && material_handles);
+
+    buildBvh(&scene->bvh, scene->triangle_vertices, count, getSimdWidth(active_simd_level), order);
+    for(unsigned int i = 0; i < count; i++) {
+        vertices[i] = scene->triangle_vertices[order[i]];
+        material_handles[i] = scene->triangle_material_handles[order[i]];
+    }
+    free(scene->triangle_vertices);
+    free(scene->triangle_material_handles);
+    scene->triangle_vertices = vertices;
+    scene->triangle_material_handles = material_handles;
+    scene->triangle_capacity = count;
+
+    free(order);
+}
+
+// Derives edges, normals and shading frames of all triangles, has to be redone whenever triangles change
+void precomputeTriangles(Scene* scene) {
+    const unsigned int count = scene->triangle_count;
+    TrianglePrecomputed* precomputed = &scene->triangle_precomputed;
+    freeTrianglePrecomputed(precomputed);
+    // SIMD kernels read full batches, so every array is padded with zeroed triangles
+    const unsigned int stride = count + SIMD_MAX_WIDTH;
+    float* data = calloc((size_t)stride * 18, sizeof(float));
+    assert(data);
+    Vec3Array* arrays[6] = {&precomputed->v1, &precomputed->edge12, &precomputed->edge13, &precomputed->normal, &precomputed->tangent, &precomputed->bitangent};
+    for(unsigned int i = 0; i < 6; i++) {
+        arrays[i]->x = data + (i * 3 + 0) * stride;
+        arrays[i]->y = data + (i * 3 + 1) * stride;
+        arrays[i]->z = data + (i * 3 + 2) * stride;
+    }
+    for(unsigned int i = 0; i < count; i++) {
+        const TriangleVertices vertices = scene->triangle_vertices[i];
+        const Vec3 edge12 = subVec3(vertices.v2, vertices.v1);
+        const Vec3 edge13 = subVec3(vertices.v3, vertices.v1);
+        const Vec3 normal = cross(edge12, edge13);
+        const Frame frame = createFrame(squaredLength(normal) > 0.0f ? normalizeVec3(normal) : AXIS.forward);
+        setVec3ArrayElement(&precomputed->v1, i, vertices.v1);
+        setVec3ArrayElement(&precomputed->edge12, i, edge12);
+        setVec3ArrayElement(&precomputed->edge13, i, edge13);
+        setVec3ArrayElement(&precomputed->normal, i, frame.normal);
+        setVec3ArrayElement(&precomputed->tangent, i, frame.tangent);
+        setVec3ArrayElement(&precomputed->bitangent, i, frame.bitangent);
+    }
+}
+
+// Bytes held by the triangles, precomputed data, BVH and lights of a prepared scene
+size_t getSceneMemory(const Scene* scene) {
+    const size_t count = scene->triangle_count;
+    size_t memory = count * sizeof(MaterialHandle)
+        + (scene->triangle_vertices ? count * sizeof(TriangleVertices) : 0)
+        + (scene->triangle_precomputed.v1.x ? (count + SIMD_MAX_WIDTH) * 18 * sizeof(float) : 0)
+        + (size_t)scene->bvh.node_count * sizeof(BvhNode)
+        + (size_t)scene->indexed_triangles.vertex_count * sizeof(Vec3)
+        + (size_t)scene->indexed_triangles.triangle_count * 3 * sizeof(uint32_t)
+        + (size_t)scene->compressed_bvh.node_count * sizeof(CompressedBvhNode)
+        + (size_t)scene->lights.count * (sizeof(unsigned int) + sizeof(LightTriangle) + sizeof(float))
+        + (scene->lights.area_pdf ? (count + 1) * sizeof(float) : 0)
+        + (size_t)scene->instance_count * sizeof(Instance)
+        + (size_t)scene->instance_bvh.node_count * sizeof(BvhNode);
+    for(unsigned int i = 0; i < scene->mesh_count; i++) {
+        memory += getSceneMemory(&scene->meshes[i]);
+    }
+    return memory;
+}
+
+// FNV-1a over 8 byte words and the remaining bytes
+uint64_t hashMemory(uint64_t hash, const void* data, size_t size) {
+    const unsigned char* bytes = data;
+    size_t i = 0;
+    for(; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, bytes + i, 8);
+        hash = (hash ^ word) * 0x100000001b3ull;
+    }
+    for(; i < size; i++) {
+        hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+    }
+    return hash;
+}
+
+// Hash of everything a prepared scene renders: triangles, materials, meshes and instances
+uint64_t hashScene(uint64_t hash, const Scene* scene) {
+    const size_t count = scene->triangle_count;
+    hash = hashMemory(hash, &scene->triangle_count, sizeof(scene->triangle_count));
+    if(scene->triangle_vertices) {
+        hash = hashMemory(hash, scene->triangle_vertices, count * sizeof(TriangleVertices));
+    }
+    hash = hashMemory(hash, scene->indexed_triangles.vertices, (size_t)scene->indexed_triangles.vertex_count * sizeof(Vec3));
+    hash = hashMemory(hash, scene->indexed_triangles.indices, (size_t)scene->indexed_triangles.triangle_count * 3 * sizeof(uint32_t));
+    hash = hashMemory(hash, scene->triangle_material_handles, count * sizeof(MaterialHandle));
+    hash = hashMemory(hash, scene->materials, (size_t)scene->material_count * sizeof(Material));
+    for(unsigned int i = 0; i < scene->mesh_count; i++) {
+        hash = hashScene(hash, &scene->meshes[i]);
+    }
+    return hashMemory(hash, scene->instances, (size_t)scene->instance_count * sizeof(Instance));
+}
+
+// Prepares the triangles of a mesh for instancing after the SIMD level was selected, they always get a BVH
+void prepareSceneMesh(Scene* mesh) {
+    buildSceneBvh(mesh);
+    precomputeTriangles(mesh);
+}
+
+// Moves a prepared mesh into the scene and returns its index for addInstance
+unsigned int addSceneMesh(Scene* scene, Scene* mesh) {
+    scene->meshes = realloc(scene->meshes, sizeof(Scene) * (scene->mesh_count + 1));
+    assert(scene->meshes);
+    scene->meshes[scene->mesh_count] = *mesh;
+    *mesh = createScene();
+    return scene->mesh_count++;
+}
+
+// Places a mesh of the scene with the given object to world transform, material 0 keeps the mesh materials
+void addInstance(Scene* scene, unsigned int mesh, Transform to_world, MaterialHandle material) {
+    assert(mesh < scene->mesh_count);
+    scene->instances = realloc(scene->instances, sizeof(Instance) * (scene->instance_count + 1));
+    assert(scene->instances);
+    scene->instances[scene->instance_count++] = (Instance) {
+        .to_world = to_world,
+        .to_object = invertTransform(&to_world),
+        .mesh = mesh,
+        .material = material
+    };
+}
+
+// Box around the transformed corners of box
+Aabb transformAabb(const Transform* transform, Aabb box) {
+    Aabb result = emptyAabb();
+    for(unsigned int corner = 0; corner < 8; corner++) {
+        const Vec3 point = {
+            .x = corner & 1 ? box.max.x : box.min.x,
+            .y = corner & 2 ? box.max.y : box.min.y,
+            .z = corner & 4 ? box.max.z : box.min.z
+        };
+        result = growAabb(result, transformPoint(transform, point));
+    }
+    return result;
+}
+
+// Places count instances in a grid on the bottom of target, cycling through the meshes of the scene
+// and the given material overrides. Each mesh has to fit into the unit cube standing on the origin.
+void addInstanceGrid(Scene* scene, unsigned int count, Aabb target, const MaterialHandle* materials, unsigned int material_count) {
+    if(scene->mesh_count == 0 || count == 0) {
+        return;
+    }
+    unsigned int columns = 1;
+    while(columns * columns < count) {
+        columns++;
+    }
+    const float cell_x = (target.max.x - target.min.x) / (float)columns;
+    const float cell_z = (target.max.z - target.min.z) / (float)columns;
+    const float scale = fminf(fminf(cell_x, cell_z), target.max.y - target.min.y) * 0.8f;
+    const Transform scaling = scaleTransform(scale);
+    for(unsigned int i = 0; i < count; i++) {
+        const Vec3 position = {
+            .x = target.min.x + ((float)(i % columns) + 0.5f) * cell_x,
+            .y = target.min.y,
+            .z = target.min.z + ((float)(i / columns) + 0.5f) * cell_z
+        };
+        // golden angle steps, so neighbours never face the same way
+        const Transform rotation = rotationYTransform((float)i * 2.39996323f);
+        const Transform translation = translationTransform(position);
+        const Transform rotated = multTransform(&rotation, &scaling);
+        addInstance(scene, i % scene->mesh_count, multTransform(&translation, &rotated), materials[i % material_count]);
+    }
+}
+
+// Replaces the instances by transformed copies of their triangles, e.g. to compare memory and speed
+void flattenInstances(Scene* scene) {
+    for(unsigned int i = 0; i < scene->instance_count; i++) {
+        const Instance* instance = &scene->instances[i];
+        const Scene* mesh = &scene->meshes[instance->mesh];
+        for(unsigned int k = 0; k < mesh->triangle_count; k++) {
+            TriangleVertices vertices = mesh->triangle_vertices[k];
+            for(unsigned int v = 0; v < 3; v++) {
+                vertices.v[v] = transformPoint(&instance->to_world, vertices.v[v]);
+            }
+            addTriangle(scene, vertices, instance->material != 0 ? instance->material : mesh->triangle_material_handles[k]);
+        }
+    }
+    for(unsigned int i = 0; i < scene->mesh_count; i++) {
+        freeScene(&scene->meshes[i]);
+    }
+    free(scene->meshes);
+    free(scene->instances);
+    scene->meshes = NULL;
+    scene->mesh_count = 0;
+    scene->instances = NULL;
+    scene->instance_count = 0;
+}
+
+// World space bounds of an instance, the BVH of its mesh has to be built
+Aabb getInstanceBounds(const Scene* scene, unsigned int index) {
+    const Instance* instance = &scene->instances[index];
+    const Scene* mesh = &scene->meshes[instance->mesh];
+    return mesh->bvh.node_count > 0 ? transformAabb(&instance->to_world, mesh->bvh.nodes[0].bounds) : emptyAabb();
+}
+
+// Builds the BVH over the instances and reorders them into its leaf order, the meshes have to be prepared
+void buildInstanceBvh(Scene* scene) {
+    const unsigned int count = scene->instance_count;
+    freeBvh(&scene->instance_bvh);
+    if(count == 0) {
+        return;
+    }
+    Aabb* bounds = malloc(sizeof(Aabb) * count);
+    unsigned int* order = malloc(sizeof(unsigned int) * count);
+    Instance* instances = malloc(sizeof(Instance) * count);
+    assert(bounds && order && instances);
+    for(unsigned int i = 0; i < count; i++) {
+        bounds[i] = getInstanceBounds(scene, i);
+    }
+    // instances are tested one at a time
+    buildBvhFromBounds(&scene->instance_bvh, bounds, count, 1, order);
+    for(unsigned int i = 0; i < count; i++) {
+        instances[i] = scene->instances[order[i]];
+    }
+    free(scene->instances);
+    scene->instances = instances;
+    free(bounds);
+    free(order);
+}
+
+// Updates the instance BVH after instances moved or their meshes changed, without reordering the instances
+void refitInstanceBvh(Scene* scene) {
+    if(scene->instance_bvh.node_count == 0) {
+        return;
+    }
+    Aabb* bounds = malloc(sizeof(Aabb) * scene->instance_count);
+    assert(bounds);
+    for(unsigned int i = 0; i < scene->instance_count; i++) {
+        bounds[i] = getInstanceBounds(scene, i);
+    }
+    refitBvhFromBounds(&scene->instance_bvh, bounds);
+    free(bounds);
+}
+
+// Updates BVH and precomputed data of a prepared mesh whose vertices moved in place, the triangles keep their order
+void refitSceneMesh(Scene* mesh) {
+    if(mesh->bvh.node_count > 0) {
+        refitBvh(&mesh->bvh, mesh->triangle_vertices, mesh->triangle_count);
+    }
+    precomputeTriangles(mesh);
+}
+
+// Prepares a scene for rendering after all triangles and instances were added and the SIMD level was selected.
+// materials is indexed by material handle - 1 and has to outlive the scene.
+void prepareScene(Scene* scene, const Material* materials, unsigned int material_count, int build_bvh) {
+    scene->materials = materials;
+    scene->material_count = material_count;
+    if(build_bvh) {
+        buildSceneBvh(scene);
+    }
+    precomputeTriangles(scene);
+    buildLights(&scene->lights, &scene->triangle_precomputed, scene->triangle_material_handles, scene->triangle_count, materials);
+    buildInstanceBvh(scene);
+}
+
+// Replaces the vertices, precomputed data and BVH of a prepared scene by indexed triangles and a
+// compressed BVH with the same leaves, see compressed_bvh.h. Lights keep their own copy of their triangles.
+void compressScene(Scene* scene) {
+    if(scene->bvh.node_count == 0) {
+        return;
+    }
+    buildIndexedTriangles(&scene->indexed_triangles, scene->triangle_vertices, scene->triangle_count);
+    buildCompressedBvh(&scene->compressed_bvh, &scene->bvh);
+    free(scene->triangle_vertices);
+    scene->triangle_vertices = NULL;
+    freeTrianglePrecomputed(&scene->triangle_precomputed);
+    freeBvh(&scene->bvh);
+}
+
+#endif // SCENE_H
@@ -0,0 +1,212 @@
+#ifndef SCENE_CACHE_H
+#define SCENE_CACHE_H
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "triangle.h"
+#include "material.h"
+#include "bvh.h"
+#include "lights.h"
+#include "scene.h"
+#include "simd.h"
+#include "platform.h"
+
+// A scene cache holds a prepared scene exactly as it lies in memory, so loading it is a single
+// mmap: the scene arrays point into the mapping and nothing is parsed, built or copied.
+// The file is the header followed by the sections in the order of SceneCacheSectionType,
+// each one starting at a multiple of SCENE_CACHE_ALIGNMENT.
+// It is only meant for the build and machine that wrote it, other struct layouts fail the size checks.
+
+#define SCENE_CACHE_MAGIC 0x43535450u // "PTSC"
+#define SCENE_CACHE_VERSION 2
+#define SCENE_CACHE_ALIGNMENT 64
+
+typedef enum SceneCacheSectionType {
+    SCENE_CACHE_VERTICES,
+    SCENE_CACHE_MATERIAL_HANDLES,
+    // all arrays of TrianglePrecomputed in one block, like precomputeTriangles allocates them
+    SCENE_CACHE_PRECOMPUTED,
+    SCENE_CACHE_BVH_NODES,
+    SCENE_CACHE_LIGHT_TRIANGLES,
+    SCENE_CACHE_LIGHT_GEOMETRY,
+    SCENE_CACHE_LIGHT_CDF,
+    SCENE_CACHE_LIGHT_AREA_PDF,
+    SCENE_CACHE_MATERIALS,
+    SCENE_CACHE_SECTION_COUNT
+} SceneCacheSectionType;
+
+typedef struct SceneCacheSection {
+    uint64_t offset;
+    uint64_t size;
+} SceneCacheSection;
+
+typedef struct SceneCacheHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t triangle_count;
+    uint32_t node_count;
+    uint32_t light_count;
+    uint32_t material_count;
+    // leaf width the BVH was built for, see getSimdWidth
+    uint32_t bvh_leaf_width;
+    uint32_t padding;
+    SceneCacheSection sections[SCENE_CACHE_SECTION_COUNT];
+    // of everything after the header
+    uint64_t checksum;
+} SceneCacheHeader;
+
+// FNV-1a over 64 bit words, size has to be a multiple of 8
+uint64_t hashSceneCache(const char* data, size_t size) {
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for(size_t i = 0; i < size; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        hash = (hash ^ word) * 0x100000001b3ull;
+    }
+    return hash;
+}
+
+size_t alignSceneCacheOffset(size_t offset) {
+    return (offset + SCENE_CACHE_ALIGNMENT - 1) / SCENE_CACHE_ALIGNMENT * SCENE_CACHE_ALIGNMENT;
+}
+
+// Expected byte size of every section
+void getSceneCacheSectionSizes(const SceneCacheHeader* header, size_t* sizes) {
+    const size_t triangle_count = header->triangle_count;
+    sizes[SCENE_CACHE_VERTICES] = triangle_count * sizeof(TriangleVertices);
+    sizes[SCENE_CACHE_MATERIAL_HANDLES] = triangle_count * sizeof(MaterialHandle);
+    sizes[SCENE_CACHE_PRECOMPUTED] = (triangle_count + SIMD_MAX_WIDTH) * 18 * sizeof(float);
+    sizes[SCENE_CACHE_BVH_NODES] = (size_t)header->node_count * sizeof(BvhNode);
+    sizes[SCENE_CACHE_LIGHT_TRIANGLES] = (size_t)header->light_count * sizeof(unsigned int);
+    sizes[SCENE_CACHE_LIGHT_GEOMETRY] = (size_t)header->light_count * sizeof(LightTriangle);
+    sizes[SCENE_CACHE_LIGHT_CDF] = (size_t)header->light_count * sizeof(float);
+    sizes[SCENE_CACHE_LIGHT_AREA_PDF] = (triangle_count + 1) * sizeof(float);
+    sizes[SCENE_CACHE_MATERIALS] = (size_t)header->material_count * sizeof(Material);
+}
+
+// Writes a prepared scene, returns 0 on failure
+int writeSceneCache(const Scene* scene, const char* path) {
+    SceneCacheHeader header = {
+        .magic = SCENE_CACHE_MAGIC,
+        .version = SCENE_CACHE_VERSION,
+        .triangle_count = scene->triangle_count,
+        .node_count = scene->bvh.node_count,
+        .light_count = scene->lights.count,
+        .material_count = scene->material_count,
+        .bvh_leaf_width = getSimdWidth(active_simd_level),
+        .padding = 0
+    };
+    const void* section_data[SCENE_CACHE_SECTION_COUNT] = {
+        scene->triangle_vertices,
+        scene->triangle_material_handles,
+        scene->triangle_precomputed.v1.x,
+        scene->bvh.nodes,
+        scene->lights.triangles,
+        scene->lights.geometry,
+        scene->lights.cdf,
+        scene->lights.area_pdf,
+        scene->materials
+    };
+    size_t sizes[SCENE_CACHE_SECTION_COUNT];
+    getSceneCacheSectionSizes(&header, sizes);
+    size_t offset = alignSceneCacheOffset(sizeof(SceneCacheHeader));
+    for(unsigned int i = 0; i < SCENE_CACHE_SECTION_COUNT; i++) {
+        header.sections[i] = (SceneCacheSection){offset, sizes[i]};
+        offset = alignSceneCacheOffset(offset + sizes[i]);
+    }
+    // the whole file is assembled in memory, so the checksum is known before writing
+    const size_t file_size = offset;
+    char* data = calloc(file_size, 1);
+    assert(data);
+    for(unsigned int i = 0; i < SCENE_CACHE_SECTION_COUNT; i++) {
+        if(sizes[i] > 0) {
+            memcpy(data + header.sections[i].offset, section_data[i], sizes[i]);
+        }
+    }
+    const size_t payload_offset = alignSceneCacheOffset(sizeof(SceneCacheHeader));
+    header.checksum = hashSceneCache(data + payload_offset, file_size - payload_offset);
+    memcpy(data, &header, sizeof(SceneCacheHeader));
+
+    FILE* file = fopen(path, "wb");
+    if(!file) {
+        free(data);
+        return 0;
+    }
+    const int valid = fwrite(data, 1, file_size, file) == file_size;
+    free(data);
+    return fclose(file) == 0 && valid;
+}
+
+// Maps a scene cache into an empty scene, which then owns the mapping. Returns 0 if the file
+// can't be read or doesn't match this build, the scene stays empty then.
+int loadSceneCache(Scene* scene, const char* path) {
+    MappedFile file;
+    if(!mapFile(path, &file)) {
+        fprintf(stderr, "Couldn't read scene cache '%s'\n", path);
+        return 0;
+    }
+    const size_t payload_offset = alignSceneCacheOffset(sizeof(SceneCacheHeader));
+    const SceneCacheHeader* header = (const SceneCacheHeader*)file.data;
+    if(file.size < payload_offset || header->magic != SCENE_CACHE_MAGIC || header->version != SCENE_CACHE_VERSION) {
+        fprintf(stderr, "'%s' isn't a scene cache of version %u\n", path, SCENE_CACHE_VERSION);
+        unmapFile(&file);
+        return 0;
+    }
+    size_t sizes[SCENE_CACHE_SECTION_COUNT];
+    getSceneCacheSectionSizes(header, sizes);
+    for(unsigned int i = 0; i < SCENE_CACHE_SECTION_COUNT; i++) {
+        const SceneCacheSection section = header->sections[i];
+        if(section.size != sizes[i] || section.offset % SCENE_CACHE_ALIGNMENT != 0 || section.offset < payload_offset
+            || section.offset > file.size || section.size > file.size - section.offset) {
+            fprintf(stderr, "Scene cache '%s' was written by a different build or is truncated\n", path);
+            unmapFile(&file);
+            return 0;
+        }
+    }
+    if((file.size - payload_offset) % 8 != 0 || hashSceneCache(file.data + payload_offset, file.size - payload_offset) != header->checksum) {
+        fprintf(stderr, "Scene cache '%s' is corrupted, its checksum doesn't match\n", path);
+        unmapFile(&file);
+        return 0;
+    }
+
+    // the mapping is read-only, so the scene must not be changed
+    char* const base = (char*)file.data;
+    const SceneCacheSection* sections = header->sections;
+    const unsigned int count = header->triangle_count;
+    *scene = createScene();
+    scene->triangle_vertices = (TriangleVertices*)(base + sections[SCENE_CACHE_VERTICES].offset);
+    scene->triangle_material_handles = (MaterialHandle*)(base + sections[SCENE_CACHE_MATERIAL_HANDLES].offset);
+    scene->triangle_count = count;
+    scene->triangle_capacity = count;
+    float* precomputed = (float*)(base + sections[SCENE_CACHE_PRECOMPUTED].offset);
+    const unsigned int stride = count + SIMD_MAX_WIDTH;
+    Vec3Array* arrays[6] = {&scene->triangle_precomputed.v1, &scene->triangle_precomputed.edge12, &scene->triangle_precomputed.edge13,
+        &scene->triangle_precomputed.normal, &scene->triangle_precomputed.tangent, &scene->triangle_precomputed.bitangent};
+    for(unsigned int i = 0; i < 6; i++) {
+        arrays[i]->x = precomputed + (i * 3 + 0) * (size_t)stride;
+        arrays[i]->y = precomputed + (i * 3 + 1) * (size_t)stride;
+        arrays[i]->z = precomputed + (i * 3 + 2) * (size_t)stride;
+    }
+    scene->bvh.nodes = (BvhNode*)(base + sections[SCENE_CACHE_BVH_NODES].offset);
+    scene->bvh.node_count = header->node_count;
+    scene->lights.triangles = (unsigned int*)(base + sections[SCENE_CACHE_LIGHT_TRIANGLES].offset);
+    scene->lights.geometry = (LightTriangle*)(base + sections[SCENE_CACHE_LIGHT_GEOMETRY].offset);
+    scene->lights.cdf = (float*)(base + sections[SCENE_CACHE_LIGHT_CDF].offset);
+    scene->lights.count = header->light_count;
+    scene->lights.area_pdf = (float*)(base + sections[SCENE_CACHE_LIGHT_AREA_PDF].offset);
+    scene->materials = (const Material*)(base + sections[SCENE_CACHE_MATERIALS].offset);
+    scene->material_count = header->material_count;
+    scene->cache = file;
+    return 1;
+}
+
+// Leaf width the BVH of a mapped scene cache was built for
+unsigned int getSceneCacheLeafWidth(const Scene* scene) {
+    return ((const SceneCacheHeader*)scene->cache.data)->bvh_leaf_width;
+}
+
+#endif // SCENE_CACHE_H
@@ -0,0 +1,322 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <omp.h>
+
+#include "accumulator.h"
+#include "image_writer.h"
+#include "options.h"
+#include "platform.h"
+#include "render.h"
+#include "sampler.h"
+#include "scene.h"
+#include "scene_cache.h"
+#include "single_pass.h"
+#include "stats.h"
+
+// Server mode renders many small jobs in one process. Every line of the input is a job with the
+// same arguments as the command line, e.g. "4 --scene box.psc --size 64x64 --output thumb.ppm".
+// The scene caches of recent jobs stay mapped and validated in an LRU cache, and the OpenMP
+// threads stay alive between jobs. Each job is answered by one line on the output:
+//   ok <job> latency_ms=<t> render_ms=<t> scene=<hit|miss> rays=<n> output=<path>
+//   error <job> <message>
+// Without --output the image is streamed back instead: output=- bytes=<n>, followed by the
+// n bytes of the image file. "quit" or the end of the input stops the server.
+
+#define SERVER_MAX_LINE 4096
+#define SERVER_MAX_ARGS 64
+
+// A mapped scene cache and when a job used it last
+typedef struct ServerScene {
+    char* path;
+    Scene scene;
+    uint64_t last_used;
+} ServerScene;
+
+typedef struct SceneLru {
+    ServerScene* entries;
+    unsigned int count;
+    unsigned int capacity;
+    // counts job lookups, for the least recently used entry
+    uint64_t clock;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    // caches which couldn't be loaded, they count as neither hit nor miss
+    uint64_t load_failures;
+} SceneLru;
+
+typedef struct ServerStats {
+    uint64_t jobs;
+    uint64_t failed_jobs;
+    double latency_sum;
+    double max_latency;
+    double render_time_sum;
+    uint64_t ray_count;
+} ServerStats;
+
+// Returns 0 if the entries couldn't be allocated
+int createSceneLru(SceneLru* lru, unsigned int capacity) {
+    *lru = (SceneLru) {
+        .entries = malloc(sizeof(ServerScene) * capacity),
+        .count = 0,
+        .capacity = capacity,
+        .clock = 0,
+        .hits = 0,
+        .misses = 0,
+        .evictions = 0,
+        .load_failures = 0
+    };
+    return lru->entries != NULL;
+}
+
+void freeSceneLru(SceneLru* lru) {
+    for(unsigned int i = 0; i < lru->count; i++) {
+        free(lru->entries[i].path);
+        freeScene(&lru->entries[i].scene);
+    }
+    free(lru->entries);
+    lru->entries = NULL;
+    lru->count = 0;
+}
+
+// Scene of the cache at path, mapped on a miss and evicting the least recently used one if full.
+// Returns NULL if the cache can't be loaded.
+Scene* getLruScene(SceneLru* lru, const char* path, int* hit) {
+    lru->clock++;
+    for(unsigned int i = 0; i < lru->count; i++) {
+        if(strcmp(lru->entries[i].path, path) == 0) {
+            lru->entries[i].last_used = lru->clock;
+            lru->hits++;
+            *hit = 1;
+            return &lru->entries[i].scene;
+        }
+    }
+    *hit = 0;
+    Scene scene;
+    if(!loadSceneCache(&scene, path)) {
+        lru->load_failures++;
+        return NULL;
+    }
+    lru->misses++;
+    unsigned int index = lru->count;
+    if(lru->count == lru->capacity) {
+        index = 0;
+        for(unsigned int i = 1; i < lru->count; i++) {
+            if(lru->entries[i].last_used < lru->entries[index].last_used) {
+                index = i;
+            }
+        }
+        free(lru->entries[index].path);
+        freeScene(&lru->entries[index].scene);
+        lru->evictions++;
+    }
+    else {
+        lru->count++;
+    }
+    lru->entries[index] = (ServerScene) {
+        .path = strdup(path),
+        .scene = scene,
+        .last_used = lru->clock
+    };
+    assert(lru->entries[index].path);
+    return &lru->entries[index].scene;
+}
+
+// Splits a job line at whitespace into argv, with a program name in front like the command line.
+// Returns the argument count, the line is modified.
+int splitJobArguments(char* line, const char** argv) {
+    int argc = 0;
+    argv[argc++] = "job";
+    char* token = strtok(line, " \t\r\n");
+    while(token && argc < SERVER_MAX_ARGS) {
+        argv[argc++] = token;
+        token = strtok(NULL, " \t\r\n");
+    }
+    return token ? -1 : argc;
+}
+
+// Everything a server renders itself, the rest of the options only works for single renders
+const char* getUnsupportedJobOption(const Options* options) {
+    if(!options->scene_path) {
+        return "jobs need a --scene cache";
+    }
+    if(options->mesh_count > 0 || options->instances > 0 || options->accel != ACCEL_BVH) {
+        return "jobs render scene caches as they are, without meshes, instances or another --accel";
+    }
+    if(options->workers > 0 || options->checkpoint_path || options->adaptive || options->pass_spp > 0) {
+        return "jobs can't use workers, checkpoints, adaptive sampling or passes";
+    }
+    if(options->frames > 0 || options->spin != 0.0f || options->sway != 0.0f || options->orbit != 0.0f) {
+        return "jobs render single images, not animations";
+    }
+    if(options->denoise || options->features_prefix || options->reference_path || options->spp_map_path
+        || options->tile_times_path || options->compile_scene_path || options->check_simd || options->serve) {
+        return "jobs can't denoise or write anything but the image";
+    }
+    return NULL;
+}
+
+// Writes the image of a job as "bytes=<n>" and the n bytes of the image file, returns 0 on failure
+int streamImage(FILE* output, ImageFormat format, const Accumulator* accumulator) {
+    // the size of run-length encoded formats is only known after encoding
+    FILE* image = tmpfile();
+    if(!image) {
+        return 0;
+    }
+    int valid = writeImageToFile(image, format, accumulator);
+    const long size = ftell(image);
+    valid = valid && size >= 0 && fseek(image, 0, SEEK_SET) == 0;
+    if(valid) {
+        fprintf(output, " bytes=%ld\n", size);
+        char buffer[65536];
+        size_t read;
+        while((read = fread(buffer, 1, sizeof(buffer), image)) > 0) {
+            valid = valid && fwrite(buffer, 1, read, output) == read;
+        }
+    }
+    fclose(image);
+    return valid;
+}
+
+uint64_t getServerRayCount() {
+    #if STATS
+    return mergeThreadStats().ray_count;
+    #else
+    return 0;
+    #endif
+}
+
+// Reads and answers jobs until the input ends, returns 0 if the server couldn't start or the output broke
+int runRenderServer(const Options* server_options, FILE* input, FILE* output) {
+    SceneLru lru;
+    if(!createSceneLru(&lru, server_options->scene_cache_size)) {
+        fprintf(stderr, "Couldn't allocate a scene cache for %u scenes\n", server_options->scene_cache_size);
+        return 0;
+    }
+    ServerStats stats;
+    memset(&stats, 0, sizeof(stats));
+    initThreadStats(omp_get_max_threads());
+    // the blue noise mask only depends on the seed, so it is kept for jobs with the same one
+    int blue_noise_ready = 0;
+    uint64_t blue_noise_seed = 0;
+    int output_valid = 1;
+    fprintf(stderr, "Serving jobs with %d threads and %s intersection kernel, keeping up to %u scenes\n",
+        omp_get_max_threads(), getSimdLevelName(active_simd_level), server_options->scene_cache_size);
+
+    char line[SERVER_MAX_LINE];
+    while(output_valid && fgets(line, sizeof(line), input)) {
+        const double job_start = getWallTime();
+        // the rest of a line which doesn't fit would otherwise be read as the next job
+        const int too_long = !strchr(line, '\n') && !feof(input);
+        if(too_long) {
+            int c;
+            while((c = fgetc(input)) != EOF && c != '\n') {
+            }
+        }
+        const char* argv[SERVER_MAX_ARGS];
+        const int argc = too_long ? -1 : splitJobArguments(line, argv);
+        if(argc == 1) {
+            continue;
+        }
+        if(argc == 2 && strcmp(argv[1], "quit") == 0) {
+            break;
+        }
+        const uint64_t job = ++stats.jobs;
+        Options options;
+        const char* error = NULL;
+        if(too_long) {
+            error = "line too long";
+        }
+        else if(argc < 0) {
+            error = "too many arguments";
+        }
+        else if(!parseOptions(argc, argv, &options)) {
+            error = "invalid options";
+        }
+        else {
+            error = getUnsupportedJobOption(&options);
+        }
+        int hit = 0;
+        Scene* scene = NULL;
+        if(!error) {
+            scene = getLruScene(&lru, options.scene_path, &hit);
+            if(!scene) {
+                error = "couldn't load the scene cache";
+            }
+        }
+        if(error) {
+            stats.failed_jobs++;
+            output_valid = fprintf(output, "error %llu %s\n", (unsigned long long)job, error) > 0 && fflush(output) == 0;
+            continue;
+        }
+
+        if(options.sampler == SAMPLER_BLUE_NOISE && (!blue_noise_ready || blue_noise_seed != options.seed)) {
+            initBlueNoise(options.seed);
+            blue_noise_ready = 1;
+            blue_noise_seed = options.seed;
+        }
+        const uint64_t rays_before = getServerRayCount();
+        const double render_start = getWallTime();
+        Accumulator accumulator = createAccumulator(options.crop_width, options.crop_height);
+        renderSinglePass(scene, &options, &accumulator);
+        const double render_time = getWallTime() - render_start;
+        const uint64_t rays = getServerRayCount() - rays_before;
+
+        int written = 1;
+        if(options.output_path) {
+            written = writeImage(options.output_path, options.output_format, &accumulator);
+        }
+        if(!written) {
+            stats.failed_jobs++;
+            output_valid = fprintf(output, "error %llu couldn't write image '%s'\n", (unsigned long long)job, options.output_path) > 0;
+        }
+        else {
+            // the latency covers everything up to the image, which is streamed last
+            const double latency = getWallTime() - job_start;
+            output_valid = fprintf(output, "ok %llu latency_ms=%.3f render_ms=%.3f scene=%s rays=%llu output=%s",
+                (unsigned long long)job, latency * 1000.0, render_time * 1000.0, hit ? "hit" : "miss",
+                (unsigned long long)rays, options.output_path ? options.output_path : "-") > 0;
+            if(options.output_path) {
+                output_valid = output_valid && fprintf(output, "\n") > 0;
+            }
+            else {
+                output_valid = output_valid && streamImage(output, options.output_format, &accumulator);
+            }
+            stats.latency_sum += latency;
+            stats.max_latency = latency > stats.max_latency ? latency : stats.max_latency;
+            stats.render_time_sum += render_time;
+            stats.ray_count += rays;
+        }
+        output_valid = output_valid && fflush(output) == 0;
+        freeAccumulator(&accumulator);
+    }
+
+    // stdout only carries the answers of the protocol
+    const uint64_t finished_jobs = stats.jobs - stats.failed_jobs;
+    stats_stream = stderr;
+    fprintf(stderr, "Statistics\n");
+    fprintf(stderr, "==========\n");
+    fprintf(stderr, "SERVER\n");
+    printStatTotal("Jobs", stats.jobs);
+    printStatTotalPercent("Failed jobs", stats.failed_jobs, stats.jobs);
+    printStatTime("Avg job latency", finished_jobs > 0 ? stats.latency_sum / (double)finished_jobs : 0.0);
+    printStatTime("Max job latency", stats.max_latency);
+    printStatTime("Avg job render time", finished_jobs > 0 ? stats.render_time_sum / (double)finished_jobs : 0.0);
+    printStatFactor("Rays per second while rendering", stats.render_time_sum > 0.0 ? (double)stats.ray_count / stats.render_time_sum : 0.0);
+    printStatTotalPercent("Scene cache hits", lru.hits, lru.hits + lru.misses);
+    printStatTotal("Scene cache misses", lru.misses);
+    printStatTotal("Scene cache evictions", lru.evictions);
+    printStatTotal("Scene cache load failures", lru.load_failures);
+    stats_stream = NULL;
+    freeSceneLru(&lru);
+    freeThreadStats();
+    return output_valid;
+}
+
+#endif // SERVER_H
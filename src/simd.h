@@ -0,0 +1,335 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <math.h>
+#include <stdio.h>
+
+#include "triangle.h"
+#include "ray.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SIMD_X86 1
+#include <immintrin.h>
+#else
+#define SIMD_X86 0
+#endif
+
+// Triangle arrays have to be readable this many elements past the last triangle
+#define SIMD_MAX_WIDTH 16
+
+// Small triangles far away from the ray origin lose precision in the distance, which
+// FMA kernels round differently, so results are only compared up to these tolerances
+#define SIMD_CHECK_DISTANCE_TOLERANCE 1e-3f
+#define SIMD_CHECK_EDGE_TOLERANCE 1e-3f
+#define SIMD_CHECK_GRAZING_COS 0.05f
+
+typedef enum SimdLevel {
+    SIMD_AUTO,
+    SIMD_SCALAR,
+    SIMD_SSE,
+    SIMD_AVX2,
+    SIMD_AVX512
+} SimdLevel;
+
+// Tests the triangles [first, first + count) against the ray, writes the closest
+// intersection nearer than best_distance and returns the index of its triangle + 1 or 0
+typedef unsigned int (*IntersectTrianglesFunction)(const TrianglePrecomputed* triangles, unsigned int first, unsigned int count,
+    const Ray* ray, float best_distance, TriangleIntersection* result);
+
+unsigned int intersectTrianglesScalar(const TrianglePrecomputed* triangles, unsigned int first, unsigned int count,
+    const Ray* ray, float best_distance, TriangleIntersection* result) {
+    unsigned int hit = 0;
+    for(unsigned int i = first; i < first + count; i++) {
+        if(intersectTriangle(triangles, i, ray, best_distance, result)) {
+            best_distance = result->distance;
+            hit = i + 1;
+        }
+    }
+    return hit;
+}
+
+// Picks the closest lane out of the hit mask of one batch
+static inline unsigned int selectClosestLane(unsigned int hits, const float* t, const float* u, const float* v,
+    unsigned int base, float* best_distance, TriangleIntersection* result) {
+    unsigned int hit = 0;
+    while(hits) {
+        const unsigned int lane = (unsigned int)__builtin_ctz(hits);
+        if(t[lane] < *best_distance) {
+            *best_distance = t[lane];
+            result->distance = t[lane];
+            result->u = u[lane];
+            result->v = v[lane];
+            hit = base + lane + 1;
+        }
+        hits &= hits - 1;
+    }
+    return hit;
+}
+
+#if SIMD_X86
+
+__attribute__((target("sse2")))
+unsigned int intersectTrianglesSse(const TrianglePrecomputed* triangles, unsigned int first, unsigned int count,
+    const Ray* ray, float best_distance, TriangleIntersection* result) {
+    const __m128 dir_x = _mm_set1_ps(ray->dir.x), dir_y = _mm_set1_ps(ray->dir.y), dir_z = _mm_set1_ps(ray->dir.z);
+    const __m128 origin_x = _mm_set1_ps(ray->origin.x), origin_y = _mm_set1_ps(ray->origin.y), origin_z = _mm_set1_ps(ray->origin.z);
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+    float t[4] __attribute__((aligned(16)));
+    float u[4] __attribute__((aligned(16)));
+    float v[4] __attribute__((aligned(16)));
+    unsigned int hit = 0;
+    for(unsigned int i = first; i < first + count; i += 4) {
+        const __m128 e1x = _mm_loadu_ps(triangles->edge12.x + i), e1y = _mm_loadu_ps(triangles->edge12.y + i), e1z = _mm_loadu_ps(triangles->edge12.z + i);
+        const __m128 e2x = _mm_loadu_ps(triangles->edge13.x + i), e2y = _mm_loadu_ps(triangles->edge13.y + i), e2z = _mm_loadu_ps(triangles->edge13.z + i);
+        const __m128 px = _mm_sub_ps(_mm_mul_ps(dir_y, e2z), _mm_mul_ps(dir_z, e2y));
+        const __m128 py = _mm_sub_ps(_mm_mul_ps(dir_z, e2x), _mm_mul_ps(dir_x, e2z));
+        const __m128 pz = _mm_sub_ps(_mm_mul_ps(dir_x, e2y), _mm_mul_ps(dir_y, e2x));
+        const __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+        const __m128 inv_det = _mm_div_ps(one, det);
+        const __m128 tx = _mm_sub_ps(origin_x, _mm_loadu_ps(triangles->v1.x + i));
+        const __m128 ty = _mm_sub_ps(origin_y, _mm_loadu_ps(triangles->v1.y + i));
+        const __m128 tz = _mm_sub_ps(origin_z, _mm_loadu_ps(triangles->v1.z + i));
+        const __m128 uu = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)), _mm_mul_ps(tz, pz)), inv_det);
+        const __m128 qx = _mm_sub_ps(_mm_mul_ps(ty, e1z), _mm_mul_ps(tz, e1y));
+        const __m128 qy = _mm_sub_ps(_mm_mul_ps(tz, e1x), _mm_mul_ps(tx, e1z));
+        const __m128 qz = _mm_sub_ps(_mm_mul_ps(tx, e1y), _mm_mul_ps(ty, e1x));
+        const __m128 vv = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dir_x, qx), _mm_mul_ps(dir_y, qy)), _mm_mul_ps(dir_z, qz)), inv_det);
+        const __m128 tt = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), inv_det);
+        __m128 mask = _mm_cmpneq_ps(det, zero);
+        mask = _mm_and_ps(mask, _mm_cmpge_ps(uu, zero));
+        mask = _mm_and_ps(mask, _mm_cmpge_ps(vv, zero));
+        mask = _mm_and_ps(mask, _mm_cmple_ps(_mm_add_ps(uu, vv), one));
+        mask = _mm_and_ps(mask, _mm_cmpgt_ps(tt, zero));
+        mask = _mm_and_ps(mask, _mm_cmplt_ps(tt, _mm_set1_ps(best_distance)));
+        unsigned int hits = (unsigned int)_mm_movemask_ps(mask);
+        const unsigned int remaining = first + count - i;
+        if(remaining < 4) {
+            hits &= (1u << remaining) - 1;
+        }
+        if(hits) {
+            _mm_store_ps(t, tt);
+            _mm_store_ps(u, uu);
+            _mm_store_ps(v, vv);
+            const unsigned int lane_hit = selectClosestLane(hits, t, u, v, i, &best_distance, result);
+            hit = lane_hit ? lane_hit : hit;
+        }
+    }
+    return hit;
+}
+
+__attribute__((target("avx2,fma")))
+unsigned int intersectTrianglesAvx2(const TrianglePrecomputed* triangles, unsigned int first, unsigned int count,
+    const Ray* ray, float best_distance, TriangleIntersection* result) {
+    const __m256 dir_x = _mm256_set1_ps(ray->dir.x), dir_y = _mm256_set1_ps(ray->dir.y), dir_z = _mm256_set1_ps(ray->dir.z);
+    const __m256 origin_x = _mm256_set1_ps(ray->origin.x), origin_y = _mm256_set1_ps(ray->origin.y), origin_z = _mm256_set1_ps(ray->origin.z);
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 one = _mm256_set1_ps(1.0f);
+    float t[8] __attribute__((aligned(32)));
+    float u[8] __attribute__((aligned(32)));
+    float v[8] __attribute__((aligned(32)));
+    unsigned int hit = 0;
+    for(unsigned int i = first; i < first + count; i += 8) {
+        const __m256 e1x = _mm256_loadu_ps(triangles->edge12.x + i), e1y = _mm256_loadu_ps(triangles->edge12.y + i), e1z = _mm256_loadu_ps(triangles->edge12.z + i);
+        const __m256 e2x = _mm256_loadu_ps(triangles->edge13.x + i), e2y = _mm256_loadu_ps(triangles->edge13.y + i), e2z = _mm256_loadu_ps(triangles->edge13.z + i);
+        const __m256 px = _mm256_fmsub_ps(dir_y, e2z, _mm256_mul_ps(dir_z, e2y));
+        const __m256 py = _mm256_fmsub_ps(dir_z, e2x, _mm256_mul_ps(dir_x, e2z));
+        const __m256 pz = _mm256_fmsub_ps(dir_x, e2y, _mm256_mul_ps(dir_y, e2x));
+        const __m256 det = _mm256_fmadd_ps(e1z, pz, _mm256_fmadd_ps(e1y, py, _mm256_mul_ps(e1x, px)));
+        const __m256 inv_det = _mm256_div_ps(one, det);
+        const __m256 tx = _mm256_sub_ps(origin_x, _mm256_loadu_ps(triangles->v1.x + i));
+        const __m256 ty = _mm256_sub_ps(origin_y, _mm256_loadu_ps(triangles->v1.y + i));
+        const __m256 tz = _mm256_sub_ps(origin_z, _mm256_loadu_ps(triangles->v1.z + i));
+        const __m256 uu = _mm256_mul_ps(_mm256_fmadd_ps(tz, pz, _mm256_fmadd_ps(ty, py, _mm256_mul_ps(tx, px))), inv_det);
+        const __m256 qx = _mm256_fmsub_ps(ty, e1z, _mm256_mul_ps(tz, e1y));
+        const __m256 qy = _mm256_fmsub_ps(tz, e1x, _mm256_mul_ps(tx, e1z));
+        const __m256 qz = _mm256_fmsub_ps(tx, e1y, _mm256_mul_ps(ty, e1x));
+        const __m256 vv = _mm256_mul_ps(_mm256_fmadd_ps(dir_z, qz, _mm256_fmadd_ps(dir_y, qy, _mm256_mul_ps(dir_x, qx))), inv_det);
+        const __m256 tt = _mm256_mul_ps(_mm256_fmadd_ps(e2z, qz, _mm256_fmadd_ps(e2y, qy, _mm256_mul_ps(e2x, qx))), inv_det);
+        __m256 mask = _mm256_cmp_ps(det, zero, _CMP_NEQ_UQ);
+        mask = _mm256_and_ps(mask, _mm256_cmp_ps(uu, zero, _CMP_GE_OQ));
+        mask = _mm256_and_ps(mask, _mm256_cmp_ps(vv, zero, _CMP_GE_OQ));
+        mask = _mm256_and_ps(mask, _mm256_cmp_ps(_mm256_add_ps(uu, vv), one, _CMP_LE_OQ));
+        mask = _mm256_and_ps(mask, _mm256_cmp_ps(tt, zero, _CMP_GT_OQ));
+        mask = _mm256_and_ps(mask, _mm256_cmp_ps(tt, _mm256_set1_ps(best_distance), _CMP_LT_OQ));
+        unsigned int hits = (unsigned int)_mm256_movemask_ps(mask);
+        const unsigned int remaining = first + count - i;
+        if(remaining < 8) {
+            hits &= (1u << remaining) - 1;
+        }
+        if(hits) {
+            _mm256_store_ps(t, tt);
+            _mm256_store_ps(u, uu);
+            _mm256_store_ps(v, vv);
+            const unsigned int lane_hit = selectClosestLane(hits, t, u, v, i, &best_distance, result);
+            hit = lane_hit ? lane_hit : hit;
+        }
+    }
+    return hit;
+}
+
+__attribute__((target("avx512f")))
+unsigned int intersectTrianglesAvx512(const TrianglePrecomputed* triangles, unsigned int first, unsigned int count,
+    const Ray* ray, float best_distance, TriangleIntersection* result) {
+    const __m512 dir_x = _mm512_set1_ps(ray->dir.x), dir_y = _mm512_set1_ps(ray->dir.y), dir_z = _mm512_set1_ps(ray->dir.z);
+    const __m512 origin_x = _mm512_set1_ps(ray->origin.x), origin_y = _mm512_set1_ps(ray->origin.y), origin_z = _mm512_set1_ps(ray->origin.z);
+    const __m512 zero = _mm512_setzero_ps();
+    const __m512 one = _mm512_set1_ps(1.0f);
+    float t[16] __attribute__((aligned(64)));
+    float u[16] __attribute__((aligned(64)));
+    float v[16] __attribute__((aligned(64)));
+    unsigned int hit = 0;
+    for(unsigned int i = first; i < first + count; i += 16) {
+        const unsigned int remaining = first + count - i;
+        __mmask16 mask = remaining < 16 ? (__mmask16)((1u << remaining) - 1) : (__mmask16)0xFFFF;
+        const __m512 e1x = _mm512_loadu_ps(triangles->edge12.x + i), e1y = _mm512_loadu_ps(triangles->edge12.y + i), e1z = _mm512_loadu_ps(triangles->edge12.z + i);
+        const __m512 e2x = _mm512_loadu_ps(triangles->edge13.x + i), e2y = _mm512_loadu_ps(triangles->edge13.y + i), e2z = _mm512_loadu_ps(triangles->edge13.z + i);
+        const __m512 px = _mm512_fmsub_ps(dir_y, e2z, _mm512_mul_ps(dir_z, e2y));
+        const __m512 py = _mm512_fmsub_ps(dir_z, e2x, _mm512_mul_ps(dir_x, e2z));
+        const __m512 pz = _mm512_fmsub_ps(dir_x, e2y, _mm512_mul_ps(dir_y, e2x));
+        const __m512 det = _mm512_fmadd_ps(e1z, pz, _mm512_fmadd_ps(e1y, py, _mm512_mul_ps(e1x, px)));
+        mask = _mm512_mask_cmp_ps_mask(mask, det, zero, _CMP_NEQ_UQ);
+        const __m512 inv_det = _mm512_div_ps(one, det);
+        const __m512 tx = _mm512_sub_ps(origin_x, _mm512_loadu_ps(triangles->v1.x + i));
+        const __m512 ty = _mm512_sub_ps(origin_y, _mm512_loadu_ps(triangles->v1.y + i));
+        const __m512 tz = _mm512_sub_ps(origin_z, _mm512_loadu_ps(triangles->v1.z + i));
+        const __m512 uu = _mm512_mul_ps(_mm512_fmadd_ps(tz, pz, _mm512_fmadd_ps(ty, py, _mm512_mul_ps(tx, px))), inv_det);
+        mask = _mm512_mask_cmp_ps_mask(mask, uu, zero, _CMP_GE_OQ);
+        const __m512 qx = _mm512_fmsub_ps(ty, e1z, _mm512_mul_ps(tz, e1y));
+        const __m512 qy = _mm512_fmsub_ps(tz, e1x, _mm512_mul_ps(tx, e1z));
+        const __m512 qz = _mm512_fmsub_ps(tx, e1y, _mm512_mul_ps(ty, e1x));
+        const __m512 vv = _mm512_mul_ps(_mm512_fmadd_ps(dir_z, qz, _mm512_fmadd_ps(dir_y, qy, _mm512_mul_ps(dir_x, qx))), inv_det);
+        mask = _mm512_mask_cmp_ps_mask(mask, vv, zero, _CMP_GE_OQ);
+        mask = _mm512_mask_cmp_ps_mask(mask, _mm512_add_ps(uu, vv), one, _CMP_LE_OQ);
+        const __m512 tt = _mm512_mul_ps(_mm512_fmadd_ps(e2z, qz, _mm512_fmadd_ps(e2y, qy, _mm512_mul_ps(e2x, qx))), inv_det);
+        mask = _mm512_mask_cmp_ps_mask(mask, tt, zero, _CMP_GT_OQ);
+        mask = _mm512_mask_cmp_ps_mask(mask, tt, _mm512_set1_ps(best_distance), _CMP_LT_OQ);
+        if(mask) {
+            _mm512_store_ps(t, tt);
+            _mm512_store_ps(u, uu);
+            _mm512_store_ps(v, vv);
+            const unsigned int lane_hit = selectClosestLane((unsigned int)mask, t, u, v, i, &best_distance, result);
+            hit = lane_hit ? lane_hit : hit;
+        }
+    }
+    return hit;
+}
+
+#endif
+
+IntersectTrianglesFunction intersectTriangles = intersectTrianglesScalar;
+SimdLevel active_simd_level = SIMD_SCALAR;
+
+SimdLevel detectSimdLevel() {
+#if SIMD_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx512f")) {
+        return SIMD_AVX512;
+    }
+    if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        return SIMD_AVX2;
+    }
+    if(__builtin_cpu_supports("sse2")) {
+        return SIMD_SSE;
+    }
+#endif
+    return SIMD_SCALAR;
+}
+
+const char* getSimdLevelName(SimdLevel level) {
+    switch(level) {
+        case SIMD_SSE: return "sse";
+        case SIMD_AVX2: return "avx2";
+        case SIMD_AVX512: return "avx512";
+        default: return "scalar";
+    }
+}
+
+// Number of triangles one call of the kernel tests at once
+unsigned int getSimdWidth(SimdLevel level) {
+    switch(level) {
+        case SIMD_SSE: return 4;
+        case SIMD_AVX2: return 8;
+        case SIMD_AVX512: return 16;
+        default: return 1;
+    }
+}
+
+IntersectTrianglesFunction getIntersectTrianglesFunction(SimdLevel level) {
+#if SIMD_X86
+    switch(level) {
+        case SIMD_SSE: return intersectTrianglesSse;
+        case SIMD_AVX2: return intersectTrianglesAvx2;
+        case SIMD_AVX512: return intersectTrianglesAvx512;
+        default: break;
+    }
+#endif
+    return intersectTrianglesScalar;
+}
+
+// Selects the intersection kernel, requested levels the CPU doesn't support fall back to the best supported one.
+// Has to be called before rendering starts.
+SimdLevel selectSimdLevel(SimdLevel requested) {
+    const SimdLevel supported = detectSimdLevel();
+    active_simd_level = requested == SIMD_AUTO || requested > supported ? supported : requested;
+    intersectTriangles = getIntersectTrianglesFunction(active_simd_level);
+    return active_simd_level;
+}
+
+// Compares the active kernel against the scalar one with random rays through random
+// batches of triangles, returns the number of disagreeing results
+unsigned int checkSimdKernel(const TrianglePrecomputed* triangles, unsigned int triangle_count, unsigned int ray_count) {
+    unsigned int mismatches = 0;
+    unsigned int state = 12345u;
+    #define SIMD_CHECK_RAND() ((state = state * 1664525u + 1013904223u) >> 8) * (1.0f / 16777216.0f)
+    for(unsigned int r = 0; r < ray_count && triangle_count > 0; r++) {
+        const unsigned int first = (unsigned int)(SIMD_CHECK_RAND() * (float)triangle_count) % triangle_count;
+        const unsigned int max_count = triangle_count - first < 2 * SIMD_MAX_WIDTH ? triangle_count - first : 2 * SIMD_MAX_WIDTH;
+        const unsigned int count = 1 + (unsigned int)(SIMD_CHECK_RAND() * (float)max_count) % max_count;
+        // aim at a random point of a random triangle of the batch so there are hits to compare
+        const unsigned int target = first + (unsigned int)(SIMD_CHECK_RAND() * (float)count) % count;
+        const float a = SIMD_CHECK_RAND() * 0.5f;
+        const float b = SIMD_CHECK_RAND() * 0.5f;
+        const Vec3 target_point = {
+            .x = triangles->v1.x[target] + triangles->edge12.x[target] * a + triangles->edge13.x[target] * b,
+            .y = triangles->v1.y[target] + triangles->edge12.y[target] * a + triangles->edge13.y[target] * b,
+            .z = triangles->v1.z[target] + triangles->edge12.z[target] * a + triangles->edge13.z[target] * b
+        };
+        const Vec3 offset = {
+            .x = SIMD_CHECK_RAND() * 2.0f - 1.0f,
+            .y = SIMD_CHECK_RAND() * 2.0f - 1.0f,
+            .z = SIMD_CHECK_RAND() * 2.0f - 1.0f
+        };
+        if(squaredLength(offset) == 0.0f) {
+            continue;
+        }
+        const Ray ray = {
+            .origin = addVec3(target_point, offset),
+            .dir = normalizeVec3(multVec3Scalar(offset, -1.0f))
+        };
+        TriangleIntersection scalar_result, simd_result;
+        const unsigned int scalar_hit = intersectTrianglesScalar(triangles, first, count, &ray, MAX_DISTANCE, &scalar_result);
+        const unsigned int simd_hit = intersectTriangles(triangles, first, count, &ray, MAX_DISTANCE, &simd_result);
+        if(!scalar_hit && !simd_hit) {
+            continue;
+        }
+        if(scalar_hit && simd_hit && fabsf(scalar_result.distance - simd_result.distance) <= SIMD_CHECK_DISTANCE_TOLERANCE * scalar_result.distance) {
+            // either of two triangles hit at almost the same distance may win
+            continue;
+        }
+        // FMA rounding may only make a kernel miss a triangle if the hit is right on its edge
+        // or the ray grazes the triangle
+        const int scalar_closer = !simd_hit || (scalar_hit && scalar_result.distance < simd_result.distance);
+        const TriangleIntersection* closer = scalar_closer ? &scalar_result : &simd_result;
+        const unsigned int closer_index = (scalar_closer ? scalar_hit : simd_hit) - 1;
+        const float edge_distance = fminf(fminf(closer->u, closer->v), 1.0f - closer->u - closer->v);
+        const float cos_angle = fabsf(dot(ray.dir, getVec3ArrayElement(&triangles->normal, closer_index)));
+        if(edge_distance > SIMD_CHECK_EDGE_TOLERANCE && cos_angle > SIMD_CHECK_GRAZING_COS) {
+            mismatches++;
+        }
+    }
+    #undef SIMD_CHECK_RAND
+    return mismatches;
+}
+
+#endif // SIMD_H
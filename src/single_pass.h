@@ -0,0 +1,72 @@
+#ifndef SINGLE_PASS_H
+#define SINGLE_PASS_H
+
+#include <assert.h>
+#include <stdlib.h>
+#include <omp.h>
+
+#include "accumulator.h"
+#include "camera.h"
+#include "options.h"
+#include "render.h"
+#include "scene.h"
+#include "tiles.h"
+#include "wavefront.h"
+
+// Renders without passes, checkpoints or workers, for the many small images of server jobs and frame sequences
+
+// Renders the crop window of the options into an empty accumulator in a single pass with the OpenMP threads
+void renderSinglePass(Scene* scene, const Options* options, Accumulator* accumulator) {
+    const RenderSettings settings = {
+        .width = options->width,
+        .height = options->height,
+        .camera = createCamera(options->camera_position, options->camera_target, options->camera_fov, options->width, options->height),
+        .seed = options->seed,
+        .max_depth = options->max_depth,
+        .roulette_depth = options->roulette_depth,
+        .sampler = options->sampler,
+        .sample_count = options->spp,
+        .next_event_estimation = options->next_event_estimation,
+        .primary_packets = options->primary_packets
+    };
+    TileSchedule schedule = createTileSchedule(options->crop_x, options->crop_y, options->crop_width, options->crop_height, options->tile_size, options->tile_order);
+    const unsigned int max_tile_pixels = getMaxTilePixels(&schedule);
+    #pragma omp parallel
+    {
+        PathStates paths;
+        if(options->wavefront) {
+            paths = createPathStates(WAVEFRONT_MAX_PATHS);
+        }
+        PixelSamples* tile_pixels = malloc(sizeof(PixelSamples) * max_tile_pixels);
+        SampleSum* tile_sums = malloc(sizeof(SampleSum) * max_tile_pixels);
+        assert(tile_pixels && tile_sums);
+        unsigned int tile_index;
+        while(acquireTile(&schedule, &tile_index)) {
+            const Tile tile = schedule.tiles[tile_index];
+            unsigned int tile_pixel_count = 0;
+            for(unsigned int y = tile.y; y < tile.y + tile.height; y++) {
+                for(unsigned int x = tile.x; x < tile.x + tile.width; x++) {
+                    tile_pixels[tile_pixel_count++] = (PixelSamples){x, y, 0, options->spp};
+                }
+            }
+            if(options->wavefront) {
+                samplePixelsWavefront(scene, &settings, &paths, tile_pixels, tile_pixel_count, tile_sums);
+            }
+            else {
+                samplePixels(scene, &settings, tile_pixels, tile_pixel_count, tile_sums);
+            }
+            for(unsigned int i = 0; i < tile_pixel_count; i++) {
+                AccumulatorPixel* pixel = getAccumulatorPixel(accumulator, tile_pixels[i].x - options->crop_x, tile_pixels[i].y - options->crop_y);
+                addAccumulatorSamples(pixel, tile_sums[i], tile_pixels[i].sample_count);
+            }
+        }
+        if(options->wavefront) {
+            freePathStates(&paths);
+        }
+        free(tile_pixels);
+        free(tile_sums);
+    }
+    freeTileSchedule(&schedule);
+}
+
+#endif // SINGLE_PASS_H
@@ -1,40 +1,163 @@
 #ifndef STATS_H
 #define STATS_H
 
+#include <assert.h>
+#include <inttypes.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+#include <omp.h>
+
+#include "platform.h"
+
+#define STATS_CACHE_LINE 64
+// paths with this many bounce rays or more share the last histogram bin
+#define STATS_PATH_DEPTH_BINS 17
 
 #if STATS
 typedef struct Stats {
-    unsigned int ray_count;
-    unsigned int ray_hits;
+    uint64_t ray_count;
+    uint64_t ray_hits;
     struct PrimaryRays {
-        unsigned int count;
-        unsigned int hits;
-        unsigned int hit_emissive;
+        uint64_t count;
+        uint64_t hits;
+        uint64_t hit_emissive;
     } primary_rays;
     struct BounceRays {
-        unsigned int reached_max_depth;
-        unsigned int hit_emissive;
+        uint64_t paths;
+        uint64_t reached_max_depth;
+        uint64_t roulette_terminated;
+        uint64_t hit_emissive;
+        // number of paths by their count of bounce rays
+        uint64_t path_depths[STATS_PATH_DEPTH_BINS];
     } bounce_rays;
+    struct ShadowRays {
+        uint64_t count;
+        uint64_t occluded;
+    } shadow_rays;
+    // camera rays traced for the denoiser features
+    struct FeatureRays {
+        uint64_t count;
+        uint64_t hits;
+    } feature_rays;
 } Stats;
+#endif
+
+// Counters of one thread, only ever written by that thread
+typedef struct ThreadStats {
+#if STATS
+    Stats stats;
+#endif
+    // read by the reporting thread while rendering
+    uint64_t pixel_samples_done;
+    // seconds spent rendering tiles
+    double busy_time;
+} ThreadStats;
+
+// Each thread gets its own cache lines, so counting doesn't cause false sharing
+typedef union PaddedThreadStats {
+    ThreadStats data;
+    char padding[(sizeof(ThreadStats) + STATS_CACHE_LINE - 1) / STATS_CACHE_LINE * STATS_CACHE_LINE];
+} PaddedThreadStats;
+
+PaddedThreadStats* thread_stats = NULL;
+unsigned int thread_stats_count = 0;
+
+void initThreadStats(unsigned int thread_count) {
+    thread_stats = alignedAlloc(sizeof(PaddedThreadStats) * thread_count, STATS_CACHE_LINE);
+    assert(thread_stats);
+    memset(thread_stats, 0, sizeof(PaddedThreadStats) * thread_count);
+    thread_stats_count = thread_count;
+}
+
+void freeThreadStats() {
+    alignedFree(thread_stats);
+    thread_stats = NULL;
+    thread_stats_count = 0;
+}
+
+ThreadStats* getThreadStats() {
+    const int thread = omp_get_thread_num();
+    assert((unsigned int)thread < thread_stats_count);
+    return &thread_stats[thread].data;
+}
+
+void addPixelSamplesDone(ThreadStats* stats, uint64_t samples) {
+    __atomic_store_n(&stats->pixel_samples_done, stats->pixel_samples_done + samples, __ATOMIC_RELAXED);
+}
+
+uint64_t sumPixelSamplesDone() {
+    uint64_t sum = 0;
+    for(unsigned int i = 0; i < thread_stats_count; i++) {
+        sum += __atomic_load_n(&thread_stats[i].data.pixel_samples_done, __ATOMIC_RELAXED);
+    }
+    return sum;
+}
+
+// Prints the share of pixel samples done and the estimated total time
+void printProgress(double time_used, uint64_t pixel_samples_total) {
+    const double work_done = (double)sumPixelSamplesDone() / (double)pixel_samples_total;
+    const double approx_total_time = time_used / work_done;
+    printf("Finished %4.1f%%, %02d:%02d / ~%02d:%02d\n", work_done * 100.0, (unsigned int)(time_used)/60, (unsigned int)(time_used)%60, (unsigned int)(approx_total_time)/60, (unsigned int)(approx_total_time)%60);
+}
+
+double getMaxBusyTime() {
+    double max_time = 0.0;
+    for(unsigned int i = 0; i < thread_stats_count; i++) {
+        max_time = max_time > thread_stats[i].data.busy_time ? max_time : thread_stats[i].data.busy_time;
+    }
+    return max_time;
+}
+
+// Busy time of the slowest thread relative to the average, 1.0 is a perfect balance
+double getBusyImbalance() {
+    double total_time = 0.0;
+    for(unsigned int i = 0; i < thread_stats_count; i++) {
+        total_time += thread_stats[i].data.busy_time;
+    }
+    return total_time > 0.0 ? getMaxBusyTime() / (total_time / (double)thread_stats_count) : 1.0;
+}
+
+#if STATS
+// Sums the counters of all threads, only valid after rendering finished
+Stats mergeThreadStats() {
+    Stats merged;
+    memset(&merged, 0, sizeof(merged));
+    uint64_t* merged_counters = (uint64_t*)&merged;
+    for(unsigned int i = 0; i < thread_stats_count; i++) {
+        const uint64_t* counters = (const uint64_t*)&thread_stats[i].data.stats;
+        for(unsigned int k = 0; k < sizeof(Stats) / sizeof(uint64_t); k++) {
+            merged_counters[k] += counters[k];
+        }
+    }
+    return merged;
+}
+
+// Where statistics are printed, NULL for stdout
+FILE* stats_stream = NULL;
+
+FILE* getStatsStream() {
+    return stats_stream ? stats_stream : stdout;
+}
 
-void printStatTotal(const char* text, unsigned int value) {
-    printf("  %-40s%16d\n", text, value);
+void printStatTotal(const char* text, uint64_t value) {
+    fprintf(getStatsStream(), "  %-40s%16" PRIu64 "\n", text, value);
 }
 
 void printStatFactor(const char* text, double value) {
-    printf("  %-40s%16.2f\n", text, value);
+    fprintf(getStatsStream(), "  %-40s%16.2f\n", text, value);
 }
 
-void printStatTime(const char* text, unsigned int seconds) {
-    printf("  %-40s%13d:%02d\n", text, seconds/60, seconds%60);
+void printStatTime(const char* text, double seconds) {
+    const unsigned int whole_seconds = (unsigned int)seconds;
+    fprintf(getStatsStream(), "  %-40s%10u:%02u.%03u\n", text, whole_seconds/60, whole_seconds%60, (unsigned int)((seconds - whole_seconds) * 1000.0));
 }
 
-void printStatTotalPercent(const char* text, unsigned int value, unsigned int percent_100) {
-    printf("  %-40s%16d    %4.1f%%\n", text, value, ((double)value / (double)percent_100) * 100.0);
+void printStatTotalPercent(const char* text, uint64_t value, uint64_t percent_100) {
+    fprintf(getStatsStream(), "  %-40s%16" PRIu64 "    %4.1f%%\n", text, value, ((double)value / (double)percent_100) * 100.0);
 }
 
 #endif
 
 
-#endif // STATS_H
\ No newline at end of file
+#endif // STATS_H
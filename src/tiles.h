@@ -0,0 +1,166 @@
+#ifndef TILES_H
+#define TILES_H
+
+#include <assert.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef enum TileOrder {
+    TILE_ORDER_SCANLINE,
+    TILE_ORDER_MORTON,
+    TILE_ORDER_SPIRAL
+} TileOrder;
+
+typedef struct Tile {
+    unsigned int x, y;
+    unsigned int width, height;
+} Tile;
+
+// Tiles in the order they are handed out. Threads take the next tile from a shared
+// counter, so fast threads keep pulling work until the image is done.
+typedef struct TileSchedule {
+    Tile* tiles;
+    unsigned int tile_count;
+    unsigned int next_tile;
+    // seconds spent on each tile over all passes and the thread which rendered it last
+    double* tile_times;
+    unsigned int* tile_threads;
+} TileSchedule;
+
+typedef struct TileSortKey {
+    double key;
+    Tile tile;
+} TileSortKey;
+
+int compareTileSortKeys(const void* a, const void* b) {
+    const double key_a = ((const TileSortKey*)a)->key;
+    const double key_b = ((const TileSortKey*)b)->key;
+    return key_a < key_b ? -1 : (key_a > key_b ? 1 : 0);
+}
+
+uint64_t getMortonCode(uint32_t x, uint32_t y) {
+    uint64_t code = 0;
+    for(unsigned int bit = 0; bit < 32; bit++) {
+        code |= (uint64_t)((x >> bit) & 1u) << (2 * bit);
+        code |= (uint64_t)((y >> bit) & 1u) << (2 * bit + 1);
+    }
+    return code;
+}
+
+// Sort key for the spiral order: ring around the center first, then the angle within the ring
+double getSpiralKey(unsigned int tile_x, unsigned int tile_y, unsigned int tiles_x, unsigned int tiles_y) {
+    const double dx = (double)tile_x - (double)(tiles_x - 1) * 0.5;
+    const double dy = (double)tile_y - (double)(tiles_y - 1) * 0.5;
+    const double ring = floor(fmax(fabs(dx), fabs(dy)) + 0.5);
+    const double angle = atan2(dy, dx) + M_PI;
+    return ring * 8.0 + angle;
+}
+
+TileSchedule createTileSchedule(unsigned int x, unsigned int y, unsigned int width, unsigned int height, unsigned int tile_size, TileOrder order) {
+    assert(tile_size > 0);
+    const unsigned int tiles_x = (width + tile_size - 1) / tile_size;
+    const unsigned int tiles_y = (height + tile_size - 1) / tile_size;
+    TileSchedule schedule = {
+        .tiles = malloc(sizeof(Tile) * tiles_x * tiles_y),
+        .tile_count = tiles_x * tiles_y,
+        .next_tile = 0,
+        .tile_times = calloc(tiles_x * tiles_y, sizeof(double)),
+        .tile_threads = calloc(tiles_x * tiles_y, sizeof(unsigned int))
+    };
+    TileSortKey* keys = malloc(sizeof(TileSortKey) * schedule.tile_count);
+    assert(schedule.tiles && schedule.tile_times && schedule.tile_threads && keys);
+
+    for(unsigned int ty = 0; ty < tiles_y; ty++) {
+        for(unsigned int tx = 0; tx < tiles_x; tx++) {
+            TileSortKey* key = &keys[tx + ty * tiles_x];
+            key->tile = (Tile) {
+                .x = x + tx * tile_size,
+                .y = y + ty * tile_size,
+                .width = (tx + 1) * tile_size > width ? width - tx * tile_size : tile_size,
+                .height = (ty + 1) * tile_size > height ? height - ty * tile_size : tile_size
+            };
+            switch(order) {
+                case TILE_ORDER_MORTON: key->key = (double)getMortonCode(tx, ty); break;
+                case TILE_ORDER_SPIRAL: key->key = getSpiralKey(tx, ty, tiles_x, tiles_y); break;
+                default: key->key = (double)(tx + ty * tiles_x); break;
+            }
+        }
+    }
+    qsort(keys, schedule.tile_count, sizeof(TileSortKey), compareTileSortKeys);
+    for(unsigned int i = 0; i < schedule.tile_count; i++) {
+        schedule.tiles[i] = keys[i].tile;
+    }
+    free(keys);
+    return schedule;
+}
+
+// Pixels of the largest tile, which per thread tile buffers have to hold
+unsigned int getMaxTilePixels(const TileSchedule* schedule) {
+    unsigned int max_pixels = 0;
+    for(unsigned int i = 0; i < schedule->tile_count; i++) {
+        const unsigned int pixels = schedule->tiles[i].width * schedule->tiles[i].height;
+        max_pixels = pixels > max_pixels ? pixels : max_pixels;
+    }
+    return max_pixels;
+}
+
+void freeTileSchedule(TileSchedule* schedule) {
+    free(schedule->tiles);
+    free(schedule->tile_times);
+    free(schedule->tile_threads);
+    schedule->tiles = NULL;
+    schedule->tile_count = 0;
+}
+
+// Starts handing out the tiles again for the next pass
+void resetTileSchedule(TileSchedule* schedule) {
+    schedule->next_tile = 0;
+}
+
+// Hands out the next tile, returns 0 once all tiles are taken
+int acquireTile(TileSchedule* schedule, unsigned int* tile_index) {
+    const unsigned int index = __atomic_fetch_add(&schedule->next_tile, 1, __ATOMIC_RELAXED);
+    *tile_index = index;
+    return index < schedule->tile_count;
+}
+
+typedef struct TileTimeStats {
+    double min_tile_time, avg_tile_time, max_tile_time;
+} TileTimeStats;
+
+// Only valid after all tiles are rendered
+TileTimeStats getTileTimeStats(const TileSchedule* schedule) {
+    TileTimeStats result = {0.0, 0.0, 0.0};
+    if(schedule->tile_count == 0) {
+        return result;
+    }
+    double total_time = 0.0;
+    result.min_tile_time = schedule->tile_times[0];
+    for(unsigned int i = 0; i < schedule->tile_count; i++) {
+        const double time = schedule->tile_times[i];
+        result.min_tile_time = fmin(result.min_tile_time, time);
+        result.max_tile_time = fmax(result.max_tile_time, time);
+        total_time += time;
+    }
+    result.avg_tile_time = total_time / (double)schedule->tile_count;
+    return result;
+}
+
+// Writes one line per tile: x, y, width, height, thread and seconds
+int writeTileTimes(const TileSchedule* schedule, const char* filename) {
+    FILE* fp = fopen(filename, "w");
+    if(!fp) {
+        return 0;
+    }
+    fprintf(fp, "x,y,width,height,thread,seconds\n");
+    for(unsigned int i = 0; i < schedule->tile_count; i++) {
+        const Tile* tile = &schedule->tiles[i];
+        fprintf(fp, "%u,%u,%u,%u,%u,%.6f\n", tile->x, tile->y, tile->width, tile->height, schedule->tile_threads[i], schedule->tile_times[i]);
+    }
+    fclose(fp);
+    return 1;
+}
+
+#endif // TILES_H
@@ -0,0 +1,111 @@
+#ifndef TRANSFORM_H
+#define TRANSFORM_H
+
+#include <math.h>
+
+#include "vec3.h"
+
+// Affine transform, the rows of a 3x4 matrix whose last column is the translation
+typedef struct Transform {
+    float m[3][4];
+} Transform;
+
+Transform identityTransform() {
+    return (Transform) {{
+        {1.0f, 0.0f, 0.0f, 0.0f},
+        {0.0f, 1.0f, 0.0f, 0.0f},
+        {0.0f, 0.0f, 1.0f, 0.0f}
+    }};
+}
+
+Transform translationTransform(Vec3 offset) {
+    Transform transform = identityTransform();
+    transform.m[0][3] = offset.x;
+    transform.m[1][3] = offset.y;
+    transform.m[2][3] = offset.z;
+    return transform;
+}
+
+Transform scaleTransform(float scale) {
+    Transform transform = identityTransform();
+    for(unsigned int i = 0; i < 3; i++) {
+        transform.m[i][i] = scale;
+    }
+    return transform;
+}
+
+// Counterclockwise around the y axis when looking down on it
+Transform rotationYTransform(float angle) {
+    const float c = cosf(angle);
+    const float s = sinf(angle);
+    return (Transform) {{
+        {   c, 0.0f,    s, 0.0f},
+        {0.0f, 1.0f, 0.0f, 0.0f},
+        {  -s, 0.0f,    c, 0.0f}
+    }};
+}
+
+// Applies b first and then a
+Transform multTransform(const Transform* a, const Transform* b) {
+    Transform result;
+    for(unsigned int i = 0; i < 3; i++) {
+        for(unsigned int j = 0; j < 4; j++) {
+            result.m[i][j] = a->m[i][0] * b->m[0][j] + a->m[i][1] * b->m[1][j] + a->m[i][2] * b->m[2][j] + (j == 3 ? a->m[i][3] : 0.0f);
+        }
+    }
+    return result;
+}
+
+// Inverse of a transform with non-zero determinant
+Transform invertTransform(const Transform* transform) {
+    const float (*m)[4] = transform->m;
+    const float cofactors[3][3] = {
+        {m[1][1] * m[2][2] - m[1][2] * m[2][1], m[1][2] * m[2][0] - m[1][0] * m[2][2], m[1][0] * m[2][1] - m[1][1] * m[2][0]},
+        {m[0][2] * m[2][1] - m[0][1] * m[2][2], m[0][0] * m[2][2] - m[0][2] * m[2][0], m[0][1] * m[2][0] - m[0][0] * m[2][1]},
+        {m[0][1] * m[1][2] - m[0][2] * m[1][1], m[0][2] * m[1][0] - m[0][0] * m[1][2], m[0][0] * m[1][1] - m[0][1] * m[1][0]}
+    };
+    const float inv_det = 1.0f / (m[0][0] * cofactors[0][0] + m[0][1] * cofactors[0][1] + m[0][2] * cofactors[0][2]);
+    Transform inverse;
+    // the inverse of the linear part is the transposed cofactor matrix divided by the determinant
+    for(unsigned int i = 0; i < 3; i++) {
+        for(unsigned int j = 0; j < 3; j++) {
+            inverse.m[i][j] = cofactors[j][i] * inv_det;
+        }
+    }
+    for(unsigned int i = 0; i < 3; i++) {
+        inverse.m[i][3] = -(inverse.m[i][0] * m[0][3] + inverse.m[i][1] * m[1][3] + inverse.m[i][2] * m[2][3]);
+    }
+    return inverse;
+}
+
+Vec3 transformPoint(const Transform* transform, Vec3 point) {
+    const float (*m)[4] = transform->m;
+    return (Vec3) {
+        .x = m[0][0] * point.x + m[0][1] * point.y + m[0][2] * point.z + m[0][3],
+        .y = m[1][0] * point.x + m[1][1] * point.y + m[1][2] * point.z + m[1][3],
+        .z = m[2][0] * point.x + m[2][1] * point.y + m[2][2] * point.z + m[2][3]
+    };
+}
+
+// Without the translation, the result isn't normalized
+Vec3 transformDir(const Transform* transform, Vec3 dir) {
+    const float (*m)[4] = transform->m;
+    return (Vec3) {
+        .x = m[0][0] * dir.x + m[0][1] * dir.y + m[0][2] * dir.z,
+        .y = m[1][0] * dir.x + m[1][1] * dir.y + m[1][2] * dir.z,
+        .z = m[2][0] * dir.x + m[2][1] * dir.y + m[2][2] * dir.z
+    };
+}
+
+// Normals transform with the transposed inverse, so this takes the inverse of the transform
+// which moves the surface. The result isn't normalized.
+Vec3 transformNormal(const Transform* inverse, Vec3 normal) {
+    const float (*m)[4] = inverse->m;
+    return (Vec3) {
+        .x = m[0][0] * normal.x + m[1][0] * normal.y + m[2][0] * normal.z,
+        .y = m[0][1] * normal.x + m[1][1] * normal.y + m[2][1] * normal.z,
+        .z = m[0][2] * normal.x + m[1][2] * normal.y + m[2][2] * normal.z
+    };
+}
+
+#endif // TRANSFORM_H
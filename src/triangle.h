@@ -14,4 +14,37 @@ typedef union TriangleVertices {
 
 typedef unsigned int TriangleHandle;
 
+// Structure-of-arrays storage of one Vec3 per triangle
+typedef struct Vec3Array {
+    float* x;
+    float* y;
+    float* z;
+} Vec3Array;
+
+// Data derived once from the TriangleVertices of a scene, so intersection
+// tests don't have to rebuild edges and normals for every ray
+typedef struct TrianglePrecomputed {
+    Vec3Array v1;
+    Vec3Array edge12;
+    Vec3Array edge13;
+    Vec3Array normal;
+    // shading frame around the normal, only read at hits
+    Vec3Array tangent;
+    Vec3Array bitangent;
+} TrianglePrecomputed;
+
+Vec3 getVec3ArrayElement(const Vec3Array* array, unsigned int index) {
+    return (Vec3) {
+        .x = array->x[index],
+        .y = array->y[index],
+        .z = array->z[index]
+    };
+}
+
+void setVec3ArrayElement(Vec3Array* array, unsigned int index, Vec3 value) {
+    array->x[index] = value.x;
+    array->y[index] = value.y;
+    array->z[index] = value.z;
+}
+
 #endif // TRIANGLE_H
\ No newline at end of file
@@ -7,8 +7,4 @@ inline float clamp(float value, float min, float max) {
     return value < min ? min : (value > max ? max : value); 
 }
 
-inline float randFloat() {
-    return (float)rand()/(float)(RAND_MAX);
-}
-
 #endif // UTIL_H
\ No newline at end of file
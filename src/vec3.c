@@ -69,4 +69,33 @@ Vec3 cross(Vec3 a, Vec3 b) {
 
 float dot(Vec3 a, Vec3 b) {
     return a.x * b.x + a.y * b.y + a.z * b.z;
-}
\ No newline at end of file
+}
+// Branch-free basis from Duff et al., "Building an Orthonormal Basis, Revisited"
+Frame createFrame(Norm3 normal) {
+    const float sign = copysignf(1.0f, normal.z);
+    const float a = -1.0f / (sign + normal.z);
+    const float b = normal.x * normal.y * a;
+    return (Frame) {
+        .tangent = {{1.0f + sign * normal.x * normal.x * a, sign * b, -sign * normal.x}},
+        .bitangent = {{b, sign + normal.y * normal.y * a, -normal.y}},
+        .normal = normal
+    };
+}
+
+Vec3 frameToLocal(const Frame* frame, Vec3 vec) {
+    Vec3 result = {
+        dot(vec, frame->tangent),
+        dot(vec, frame->bitangent),
+        dot(vec, frame->normal)
+    };
+    return result;
+}
+
+Vec3 frameToWorld(const Frame* frame, Vec3 vec) {
+    Vec3 result = {
+        frame->tangent.x * vec.x + frame->bitangent.x * vec.y + frame->normal.x * vec.z,
+        frame->tangent.y * vec.x + frame->bitangent.y * vec.y + frame->normal.y * vec.z,
+        frame->tangent.z * vec.x + frame->bitangent.z * vec.y + frame->normal.z * vec.z
+    };
+    return result;
+}
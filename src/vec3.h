@@ -44,4 +44,17 @@ Vec3 cross(Vec3 a, Vec3 b);
 
 float dot(Vec3 a, Vec3 b);
 
+// Orthonormal basis around a normal, directions in local space have the normal as z axis
+typedef struct Frame {
+    Norm3 tangent;
+    Norm3 bitangent;
+    Norm3 normal;
+} Frame;
+
+Frame createFrame(Norm3 normal);
+
+Vec3 frameToLocal(const Frame* frame, Vec3 vec);
+
+Vec3 frameToWorld(const Frame* frame, Vec3 vec);
+
 #endif // VEC_3_H
\ No newline at end of file
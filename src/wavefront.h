@@ -0,0 +1,398 @@
+#ifndef WAVEFRONT_H
+#define WAVEFRONT_H
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "vec3.h"
+#include "ray.h"
+#include "color.h"
+#include "triangle.h"
+#include "material.h"
+#include "scene.h"
+#include "sampler.h"
+#include "accumulator.h"
+#include "bsdf.h"
+#include "render.h"
+#include "stats.h"
+
+// Wavefront path tracing: instead of following one path to its end, a batch of paths advances
+// one bounce at a time through separate stages. Every stage is a tight loop over the paths
+// still alive, which keeps the code and data of intersection and shading in cache and lines
+// up the rays of a stage for SIMD. It samples exactly like samplePixelColor, so both give
+// identical images.
+//
+//   generate  trace the camera ray of each pixel, create a path for each sample
+//   shade     handle misses and lights, sample the light and the bsdf, Russian roulette
+//   shadow    trace the shadow rays queued by shade
+//   compact   finish the terminated paths and keep the others in the active list
+//   extend    trace the bounce rays of the active paths
+
+// Paths in flight per thread, the samples of a tile are split into batches of this size
+#define WAVEFRONT_MAX_PATHS 4096
+
+// Structure-of-arrays storage of one Color3f per path
+typedef struct Color3fArray {
+    float* r;
+    float* g;
+    float* b;
+} Color3fArray;
+
+Color3f getColor3fArrayElement(const Color3fArray* array, unsigned int index) {
+    return (Color3f) {
+        .r = array->r[index],
+        .g = array->g[index],
+        .b = array->b[index]
+    };
+}
+
+void setColor3fArrayElement(Color3fArray* array, unsigned int index, Color3f value) {
+    array->r[index] = value.r;
+    array->g[index] = value.g;
+    array->b[index] = value.b;
+}
+
+typedef struct PathStates {
+    unsigned int capacity;
+    // ray of the next extend stage and the hit it found
+    Vec3Array ray_origin;
+    Vec3Array ray_dir;
+    float* ray_pdf;
+    TriangleHandle* hit_handle;
+    unsigned int* hit_instance;
+    float* hit_distance;
+    // bounce rays traced so far, 0 while shading the camera ray hit
+    unsigned int* depth;
+    Color3fArray throughput;
+    // radiance arriving along the first bounce, weighted by the throughput after it
+    Color3fArray radiance;
+    // light sampled at the camera ray hit and the bsdf weight of the first bounce
+    Color3fArray direct;
+    Color3fArray primary_weight;
+    // shadow ray queued by shade, its radiance is added to the path if unoccluded
+    Vec3Array shadow_dir;
+    float* shadow_distance;
+    Color3fArray shadow_radiance;
+    Sampler* samplers;
+    // pixel of the batch the path samples
+    unsigned int* pixel;
+    unsigned char* terminated;
+    // path indices of the stages
+    unsigned int* active;
+    unsigned int* shadow_queue;
+    Color3f* results;
+} PathStates;
+
+float* allocPathArray(unsigned int capacity) {
+    float* array = alignedAlloc(sizeof(float) * capacity, 64);
+    assert(array);
+    return array;
+}
+
+Vec3Array allocPathVec3Array(unsigned int capacity) {
+    return (Vec3Array) { allocPathArray(capacity), allocPathArray(capacity), allocPathArray(capacity) };
+}
+
+Color3fArray allocPathColorArray(unsigned int capacity) {
+    return (Color3fArray) { allocPathArray(capacity), allocPathArray(capacity), allocPathArray(capacity) };
+}
+
+PathStates createPathStates(unsigned int capacity) {
+    PathStates paths = {
+        .capacity = capacity,
+        .ray_origin = allocPathVec3Array(capacity),
+        .ray_dir = allocPathVec3Array(capacity),
+        .ray_pdf = allocPathArray(capacity),
+        .hit_handle = malloc(sizeof(TriangleHandle) * capacity),
+        .hit_instance = malloc(sizeof(unsigned int) * capacity),
+        .hit_distance = allocPathArray(capacity),
+        .depth = malloc(sizeof(unsigned int) * capacity),
+        .throughput = allocPathColorArray(capacity),
+        .radiance = allocPathColorArray(capacity),
+        .direct = allocPathColorArray(capacity),
+        .primary_weight = allocPathColorArray(capacity),
+        .shadow_dir = allocPathVec3Array(capacity),
+        .shadow_distance = allocPathArray(capacity),
+        .shadow_radiance = allocPathColorArray(capacity),
+        .samplers = malloc(sizeof(Sampler) * capacity),
+        .pixel = malloc(sizeof(unsigned int) * capacity),
+        .terminated = malloc(capacity),
+        .active = malloc(sizeof(unsigned int) * capacity),
+        .shadow_queue = malloc(sizeof(unsigned int) * capacity),
+        .results = malloc(sizeof(Color3f) * capacity)
+    };
+    assert(paths.hit_handle && paths.hit_instance && paths.depth && paths.samplers && paths.pixel && paths.terminated && paths.active && paths.shadow_queue && paths.results);
+    return paths;
+}
+
+void freePathStates(PathStates* paths) {
+    float** arrays[] = {
+        &paths->ray_origin.x, &paths->ray_origin.y, &paths->ray_origin.z,
+        &paths->ray_dir.x, &paths->ray_dir.y, &paths->ray_dir.z,
+        &paths->ray_pdf, &paths->hit_distance,
+        &paths->throughput.r, &paths->throughput.g, &paths->throughput.b,
+        &paths->radiance.r, &paths->radiance.g, &paths->radiance.b,
+        &paths->direct.r, &paths->direct.g, &paths->direct.b,
+        &paths->primary_weight.r, &paths->primary_weight.g, &paths->primary_weight.b,
+        &paths->shadow_dir.x, &paths->shadow_dir.y, &paths->shadow_dir.z,
+        &paths->shadow_distance,
+        &paths->shadow_radiance.r, &paths->shadow_radiance.g, &paths->shadow_radiance.b
+    };
+    for(unsigned int i = 0; i < sizeof(arrays) / sizeof(arrays[0]); i++) {
+        alignedFree(*arrays[i]);
+        *arrays[i] = NULL;
+    }
+    free(paths->hit_handle);
+    free(paths->hit_instance);
+    free(paths->depth);
+    free(paths->samplers);
+    free(paths->pixel);
+    free(paths->terminated);
+    free(paths->active);
+    free(paths->shadow_queue);
+    free(paths->results);
+}
+
+// Ends a path that made it past the camera ray hit
+void terminatePath(PathStates* paths, const RenderSettings* settings, unsigned int path) {
+    paths->terminated[path] = 1;
+    #if STATS
+    const unsigned int depth = paths->depth[path];
+    Stats* stats = &getThreadStats()->stats;
+    stats->bounce_rays.paths++;
+    stats->bounce_rays.reached_max_depth += depth == settings->max_depth;
+    stats->bounce_rays.path_depths[depth < STATS_PATH_DEPTH_BINS ? depth : STATS_PATH_DEPTH_BINS - 1]++;
+    #else
+    (void)settings;
+    #endif
+}
+
+// Returns the number of paths queued for the shadow stage
+unsigned int shadePaths(Scene* scene, const RenderSettings* settings, PathStates* paths, unsigned int active_count) {
+    unsigned int shadow_count = 0;
+    for(unsigned int a = 0; a < active_count; a++) {
+        const unsigned int path = paths->active[a];
+        const unsigned int depth = paths->depth[path];
+        const TriangleHandle handle = paths->hit_handle[path];
+        const unsigned int instance = paths->hit_instance[path];
+        const Vec3 ray_origin = getVec3ArrayElement(&paths->ray_origin, path);
+        const Norm3 ray_dir = getVec3ArrayElement(&paths->ray_dir, path);
+        Color3f throughput = getColor3fArrayElement(&paths->throughput, path);
+        // the camera ray hit of a path is never a miss or a light, generate takes care of those
+        if(handle == 0) {
+            setColor3fArrayElement(&paths->radiance, path, addColor3f(getColor3fArrayElement(&paths->radiance, path), multColor3f(BACKGROUND_COLOR, throughput)));
+            terminatePath(paths, settings, path);
+            continue;
+        }
+        const Material* material = getMaterialPointer(scene, getHitMaterialHandle(scene, instance, handle));
+        const Frame frame = getHitFrame(scene, instance, handle, ray_dir);
+        if(depth > 0 && material->emission > 0.0f) {
+            #if STATS
+            getThreadStats()->stats.bounce_rays.hit_emissive++;
+            #endif
+            // with next event estimation the light was already sampled at the last surface
+            const TriangleHit hit = {
+                .intersection = { .distance = paths->hit_distance[path] },
+                .handle = handle,
+                .instance = instance,
+                .frame = frame
+            };
+            const float weight = settings->next_event_estimation ? getMisWeight(paths->ray_pdf[path], getLightPdf(scene, &hit, ray_dir)) : 1.0f;
+            setColor3fArrayElement(&paths->radiance, path, addColor3f(getColor3fArrayElement(&paths->radiance, path),
+                multColor3f(throughput, multColor3fScalar(material->diffuse, material->emission * weight))));
+            terminatePath(paths, settings, path);
+            continue;
+        }
+        const Vec3 world_pos = addVec3(ray_origin, multVec3Scalar(ray_dir, paths->hit_distance[path]));
+        const Norm3 out = multVec3Scalar(ray_dir, -1.0f);
+        const Vec3 origin = addVec3(world_pos, multVec3Scalar(frame.normal, 0.001f));
+        // shadow and bounce ray both start here
+        setVec3ArrayElement(&paths->ray_origin, path, origin);
+        Sampler* sampler = &paths->samplers[path];
+        if(settings->next_event_estimation) {
+            const LightConnection connection = connectLight(scene, origin, material, &frame, out, sampler);
+            if(connection.valid) {
+                setVec3ArrayElement(&paths->shadow_dir, path, connection.ray.dir);
+                paths->shadow_distance[path] = connection.distance;
+                // light at the camera ray hit isn't weighted by a throughput
+                setColor3fArrayElement(&paths->shadow_radiance, path, depth == 0 ? connection.radiance : multColor3f(throughput, connection.radiance));
+                paths->shadow_queue[shadow_count++] = path;
+            }
+        }
+        const BsdfSample bsdf = sampleBsdf(material, &frame, out, sampler);
+        if(bsdf.pdf <= 0.0f) {
+            if(depth == 0) {
+                // the path never got to its first bounce
+                paths->terminated[path] = 1;
+            }
+            else {
+                terminatePath(paths, settings, path);
+            }
+            continue;
+        }
+        setVec3ArrayElement(&paths->ray_dir, path, bsdf.dir);
+        paths->ray_pdf[path] = bsdf.pdf;
+        if(depth == 0) {
+            setColor3fArrayElement(&paths->primary_weight, path, bsdf.weight);
+        }
+        else {
+            throughput = multColor3f(throughput, bsdf.weight);
+            // Russian roulette as in sampleBounceRay
+            if(depth >= settings->roulette_depth) {
+                const float survival = fminf(fmaxf(throughput.r, fmaxf(throughput.g, throughput.b)), 0.95f);
+                if(getSample1D(sampler) >= survival) {
+                    #if STATS
+                    getThreadStats()->stats.bounce_rays.roulette_terminated++;
+                    #endif
+                    terminatePath(paths, settings, path);
+                    continue;
+                }
+                throughput = multColor3fScalar(throughput, 1.0f / survival);
+            }
+            setColor3fArrayElement(&paths->throughput, path, throughput);
+        }
+        if(depth >= settings->max_depth) {
+            terminatePath(paths, settings, path);
+        }
+    }
+    return shadow_count;
+}
+
+void traceShadowPaths(Scene* scene, PathStates* paths, unsigned int shadow_count) {
+    for(unsigned int s = 0; s < shadow_count; s++) {
+        const unsigned int path = paths->shadow_queue[s];
+        const Ray ray = {
+            .origin = getVec3ArrayElement(&paths->ray_origin, path),
+            .dir = getVec3ArrayElement(&paths->shadow_dir, path)
+        };
+        if(traceShadowRay(scene, ray, paths->shadow_distance[path])) {
+            continue;
+        }
+        const Color3f radiance = getColor3fArrayElement(&paths->shadow_radiance, path);
+        if(paths->depth[path] == 0) {
+            setColor3fArrayElement(&paths->direct, path, addColor3f(getColor3fArrayElement(&paths->direct, path), radiance));
+        }
+        else {
+            setColor3fArrayElement(&paths->radiance, path, addColor3f(getColor3fArrayElement(&paths->radiance, path), radiance));
+        }
+    }
+}
+
+// Stores the result of terminated paths and keeps the others, returns the new active count
+unsigned int compactPaths(PathStates* paths, unsigned int active_count) {
+    unsigned int kept = 0;
+    for(unsigned int a = 0; a < active_count; a++) {
+        const unsigned int path = paths->active[a];
+        if(!paths->terminated[path]) {
+            paths->active[kept++] = path;
+            continue;
+        }
+        const Color3f direct = getColor3fArrayElement(&paths->direct, path);
+        paths->results[path] = addColor3f(direct, multColor3f(getColor3fArrayElement(&paths->primary_weight, path), getColor3fArrayElement(&paths->radiance, path)));
+    }
+    return kept;
+}
+
+void extendPaths(Scene* scene, PathStates* paths, unsigned int active_count) {
+    for(unsigned int a = 0; a < active_count; a++) {
+        const unsigned int path = paths->active[a];
+        const Ray ray = {
+            .origin = getVec3ArrayElement(&paths->ray_origin, path),
+            .dir = getVec3ArrayElement(&paths->ray_dir, path)
+        };
+        const TriangleHit hit = intersectScene(scene, ray);
+        paths->hit_handle[path] = hit.handle;
+        paths->hit_instance[path] = hit.instance;
+        paths->hit_distance[path] = hit.intersection.distance;
+        paths->depth[path]++;
+    }
+}
+
+// Sums the samples of each pixel into sums like samplePixels, every pixel needs at least one sample
+void samplePixelsWavefront(Scene* scene, const RenderSettings* settings, PathStates* paths, const PixelSamples* pixels, unsigned int pixel_count, SampleSum* sums) {
+    const Color3f black = {0.0f, 0.0f, 0.0f};
+    // camera ray hits, reused by every sample of a pixel
+    TriangleHit* primary_hits = malloc(sizeof(TriangleHit) * pixel_count);
+    Ray* primary_rays = malloc(sizeof(Ray) * pixel_count);
+    unsigned int* next_samples = malloc(sizeof(unsigned int) * pixel_count);
+    assert(primary_hits && primary_rays && next_samples);
+    for(unsigned int start = 0; start < pixel_count; start += PACKET_MAX_RAYS) {
+        const unsigned int count = pixel_count - start < PACKET_MAX_RAYS ? pixel_count - start : PACKET_MAX_RAYS;
+        tracePrimaryRays(scene, settings, pixels + start, count, primary_rays + start, primary_hits + start);
+    }
+    uint64_t samples_left = 0;
+    for(unsigned int p = 0; p < pixel_count; p++) {
+        const PixelSamples* pixel = &pixels[p];
+        sums[p] = (SampleSum){{{0.0f, 0.0f, 0.0f}}, {{0.0f, 0.0f, 0.0f}}};
+        next_samples[p] = pixel->first_sample;
+        #if STATS
+        getThreadStats()->stats.primary_rays.count++;
+        #endif
+        const Material* material = primary_hits[p].handle != 0 ? getMaterialPointer(scene, getHitMaterialHandle(scene, primary_hits[p].instance, primary_hits[p].handle)) : NULL;
+        if(!material) {
+            sums[p] = (SampleSum){multColor3fScalar(BACKGROUND_COLOR, (float)pixel->sample_count), multColor3fScalar(multColor3f(BACKGROUND_COLOR, BACKGROUND_COLOR), (float)pixel->sample_count)};
+            next_samples[p] += pixel->sample_count;
+            continue;
+        }
+        #if STATS
+        getThreadStats()->stats.primary_rays.hits++;
+        #endif
+        if(material->emission > 0.0f) {
+            #if STATS
+            getThreadStats()->stats.primary_rays.hit_emissive++;
+            #endif
+            const Color3f emitted = multColor3fScalar(material->diffuse, material->emission);
+            sums[p] = (SampleSum){multColor3fScalar(emitted, (float)pixel->sample_count), multColor3fScalar(multColor3f(emitted, emitted), (float)pixel->sample_count)};
+            next_samples[p] += pixel->sample_count;
+            continue;
+        }
+        samples_left += pixel->sample_count;
+    }
+
+    // generate hands out one sample per pixel in turn, each pixel still sums its samples in order
+    unsigned int cursor = 0;
+    while(samples_left > 0) {
+        unsigned int path_count = 0;
+        while(path_count < paths->capacity && samples_left > 0) {
+            const unsigned int p = cursor;
+            cursor = cursor + 1 < pixel_count ? cursor + 1 : 0;
+            const PixelSamples* pixel = &pixels[p];
+            if(next_samples[p] >= pixel->first_sample + pixel->sample_count) {
+                continue;
+            }
+            const unsigned int path = path_count++;
+            samples_left--;
+            const unsigned int pixel_index = pixel->x + pixel->y * settings->width;
+            paths->samplers[path] = createSampler(settings->sampler, settings->seed, pixel->x, pixel->y, pixel_index, next_samples[p]++, settings->sample_count);
+            setVec3ArrayElement(&paths->ray_origin, path, primary_rays[p].origin);
+            setVec3ArrayElement(&paths->ray_dir, path, primary_rays[p].dir);
+            paths->hit_handle[path] = primary_hits[p].handle;
+            paths->hit_instance[path] = primary_hits[p].instance;
+            paths->hit_distance[path] = primary_hits[p].intersection.distance;
+            paths->depth[path] = 0;
+            setColor3fArrayElement(&paths->throughput, path, (Color3f){{1.0f, 1.0f, 1.0f}});
+            setColor3fArrayElement(&paths->radiance, path, black);
+            setColor3fArrayElement(&paths->direct, path, black);
+            setColor3fArrayElement(&paths->primary_weight, path, black);
+            paths->pixel[path] = p;
+            paths->terminated[path] = 0;
+            paths->active[path] = path;
+        }
+        unsigned int active_count = path_count;
+        while(active_count > 0) {
+            const unsigned int shadow_count = shadePaths(scene, settings, paths, active_count);
+            traceShadowPaths(scene, paths, shadow_count);
+            active_count = compactPaths(paths, active_count);
+            extendPaths(scene, paths, active_count);
+        }
+        for(unsigned int path = 0; path < path_count; path++) {
+            addSample(&sums[paths->pixel[path]], paths->results[path]);
+        }
+    }
+    free(primary_hits);
+    free(primary_rays);
+    free(next_samples);
+}
+
+#endif // WAVEFRONT_H